@@ -0,0 +1,38 @@
+#ifndef LFP_BUFFERED_H
+#define LFP_BUFFERED_H
+
+#include <stdint.h>
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** Buffered protocol
+ *
+ * A pass-through layer that reads the underlying handle in blocks of
+ * block_size bytes. Small reads, and seeks within the buffered block, are
+ * then served from memory, without going to the underlying handle. This is
+ * useful under protocols like tapeimage and rp66, which do many small reads
+ * of headers, over handles without buffering of their own, such as the fd
+ * protocol.
+ *
+ * Offsets, i.e. tell and seek, are the same as for the underlying handle.
+ * Reads larger than the block size bypass the buffer, and go straight to the
+ * underlying handle.
+ *
+ * The buffer is aligned to a page boundary.
+ *
+ * \param block_size the size of the buffer, in bytes. If zero, the default
+ *                   of 64 KiB is used.
+ *
+ * \retval NULL if f is NULL or block_size is negative
+ */
+lfp_protocol* lfp_buffered_open(lfp_protocol* f, int64_t block_size);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_BUFFERED_H
@@ -0,0 +1,75 @@
+#ifndef LFP_CACHE_H
+#define LFP_CACHE_H
+
+#include <stdint.h>
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** Cached protocol
+ *
+ * A pass-through layer that reads the underlying handle in fixed-size blocks,
+ * and keeps the blocks in a process-wide cache, shared by all cached handles.
+ * Handles that are opened with the same key share blocks, so when many handles
+ * read the same file, or the same regions are read over and over again, like
+ * the header areas of DLIS files, the reads are served from memory.
+ *
+ * The key identifies the file. Handles opened with the same key must read the
+ * same bytes at the same offsets, so the key should identify the contents too.
+ * Good keys are the path together with the modification time, or a content
+ * hash. Offsets are the offsets of the underlying handle, which must support
+ * tell and seek.
+ *
+ * The cache is thread safe, and handles can be used from different threads
+ * at the same time, but a single handle cannot.
+ *
+ * The cache holds at most lfp_cache_set_budget() bytes, and evicts blocks
+ * that have not been used recently (CLOCK). The default budget is 64 MiB.
+ *
+ * \retval NULL if f or key is NULL, or f does not support tell
+ */
+lfp_protocol* lfp_cache_open(lfp_protocol* f, const char* key);
+
+/** Set the size of the process-wide cache
+ *
+ * Set the maximum number of bytes held by the cache. If the cache is larger
+ * than the new budget, blocks are evicted straight away. A budget of zero
+ * disables caching.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The budget is negative
+ */
+int lfp_cache_set_budget(int64_t bytes);
+
+/** Drop blocks from the process-wide cache
+ *
+ * Drop all blocks read with the key, e.g. because the file has changed. If
+ * key is NULL, all blocks are dropped.
+ */
+void lfp_cache_drop(const char* key);
+
+/** Statistics of the process-wide cache */
+typedef struct lfp_cache_stats {
+    /** Block reads served from the cache */
+    int64_t hits;
+    /** Block reads that went to the underlying handle */
+    int64_t misses;
+    /** Blocks evicted to stay within the budget */
+    int64_t evictions;
+    /** Bytes currently held by the cache */
+    int64_t size;
+    /** The budget, in bytes */
+    int64_t budget;
+} lfp_cache_stats;
+
+/** Get the statistics of the process-wide cache */
+void lfp_cache_statistics(lfp_cache_stats* stats);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_CACHE_H
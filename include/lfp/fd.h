@@ -0,0 +1,35 @@
+#ifndef LFP_FD_H
+#define LFP_FD_H
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** File descriptor protocol
+ *
+ * This protocol provides an lfp interface to POSIX file descriptors, and is
+ * not available on Windows.
+ *
+ * Like the cfile protocol, the current offset of the descriptor is considered
+ * the start of the file by lfp. Unlike cfile, reads are not buffered. The
+ * protocol keeps track of the position itself, and reads with `pread()`,
+ * straight into the caller's buffer, which makes seeks free. This is a good
+ * fit under protocols like tapeimage and rp66, which seek at every record.
+ *
+ * The position of the descriptor itself is not changed by reads or seeks.
+ *
+ * Descriptors that cannot seek, such as pipes, are read with `read()`, and
+ * seek and tell will fail.
+ *
+ * This function takes *ownership* of the descriptor, and it will be
+ * `close()`d when `lfp_close()` is called on it.
+ */
+lfp_protocol* lfp_fd_open(int fd);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_FD_H
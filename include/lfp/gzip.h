@@ -0,0 +1,112 @@
+#ifndef LFP_GZIP_H
+#define LFP_GZIP_H
+
+#include <stdint.h>
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** gzip protocol
+ *
+ * Decompress a gzip or zlib stream, and provide `lfp_seek()` and `lfp_tell()`
+ * in the *uncompressed* offsets, so that e.g. the tapeimage and rp66 protocols
+ * can be opened directly on top of compressed files. Files with multiple gzip
+ * members, like those made by concatenating gzip files, are read as one
+ * stream. Anything after the last member that is not another gzip member is
+ * ignored.
+ *
+ * Deflate streams can only be decompressed from the start, so to seek
+ * quickly, the protocol records access points as it decompresses - every
+ * span uncompressed bytes, at the next deflate block boundary, it records the
+ * offsets and the 32 KiB of output before it, which is all that is needed to
+ * start decompressing there. A seek decompresses from the closest access
+ * point before the target, which is at most about span bytes away. The access
+ * points take 32 KiB each, so a smaller span makes seeks faster, at the cost
+ * of memory.
+ *
+ * Like the tapeimage record index, the access point index is built lazily,
+ * but can be built up front with `lfp_gzip_index_build()`, and stored with
+ * `lfp_gzip_index_dump()` and loaded with `lfp_gzip_index_load()`, so that
+ * files can be opened again without decompressing everything up to the
+ * interesting parts.
+ *
+ * Seeking backwards, or past access points, requires the underlying handle to
+ * support seek. Seeking past the end of the uncompressed stream is not an
+ * error, but reads will report EOF. The current position of the underlying
+ * handle is considered the start of the compressed stream.
+ *
+ * `lfp_readat()` decompresses from the closest access point, like a seek,
+ * but leaves the position of the handle alone. There is only one decoder, so
+ * reads from multiple threads are serialised. For parallel reads, use
+ * `lfp_dup()`, which gives every duplicate its own decoder and a copy of the
+ * access points.
+ *
+ * \param span the (uncompressed) distance between access points, in bytes.
+ *             If zero, the default of 1 MiB is used.
+ *
+ * \retval NULL if f is NULL, span is negative, or f does not start with a
+ *              gzip or zlib header
+ */
+lfp_protocol* lfp_gzip_open(lfp_protocol* f, int64_t span);
+
+/** Index all access points in the file
+ *
+ * Decompress the rest of the stream, and record the access points. Normally
+ * the index is built lazily, as the stream is read or seeked past. Building
+ * the full index makes the uncompressed size known, and is useful before
+ * `lfp_gzip_index_dump()`. The position of the handle is unchanged.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a gzip protocol
+ */
+int lfp_gzip_index_build(lfp_protocol*);
+
+/** Size of the serialized access point index
+ *
+ * Get the number of bytes needed to hold the serialized index, i.e. the
+ * minimum size of the buffer passed to `lfp_gzip_index_dump()`.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a gzip protocol
+ */
+int lfp_gzip_index_size(lfp_protocol*, int64_t* size);
+
+/** Serialize the access point index
+ *
+ * Write the access point index into dst. The serialized index can be stored,
+ * e.g. in a sidecar file, and given to `lfp_gzip_index_load()` when the same
+ * file is opened later.
+ *
+ * The index is only meaningful for the same file, opened at the same offset.
+ *
+ * \param dst buffer of at least `lfp_gzip_index_size()` bytes
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a gzip protocol, or len is too
+ *                          small
+ */
+int lfp_gzip_index_dump(lfp_protocol*, void* dst, int64_t len);
+
+/** Load a serialized access point index
+ *
+ * Replace the access point index with one previously obtained with
+ * `lfp_gzip_index_dump()`, if it covers more of the file than the index
+ * already built. The span of the loaded index is used from then on.
+ *
+ * The index is not checked against the compressed data, so loading an index
+ * made for another file gives garbage, or errors, when reading.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a gzip protocol, or the index is
+ *                          broken
+ */
+int lfp_gzip_index_load(lfp_protocol*, const void* src, int64_t len);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_GZIP_H
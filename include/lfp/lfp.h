@@ -201,6 +201,120 @@ int lfp_close(lfp_protocol*);
 LFP_API
 int lfp_readinto(lfp_protocol*, void* dst, int64_t len, int64_t* nread);
 
+/** Read len bytes at (absolute) byte offset into dst
+ *
+ * Like `lfp_readinto()`, but read from offset, rather than from the current
+ * position, which is left unchanged. This saves a seek when the offset is
+ * known, and since there is no shared position, several threads can read
+ * from the same handle at the same time, when the protocol supports it.
+ *
+ * Leaf protocols read with `pread()` (or a `memcpy()`), and are safe to use
+ * from multiple threads. Other protocols are not necessarily. Layers like
+ * tapeimage and rp66 translate the offset through their index, and read from
+ * the underlying handle with `lfp_readat()`, so they are only safe to use from
+ * multiple threads when the underlying handle is. Tapeimage indexes unindexed
+ * ranges under a lock, but rp66 is only safe once the range is indexed.
+ * Layers with a single decoder, like gzip, serialise the reads. Protocols
+ * that do not support readat, like pipes, or layers that can only be read
+ * front to back, report `LFP_NOTIMPLEMENTED` or `LFP_NOTSUPPORTED`.
+ *
+ * Reading past the end of the file is not an error, but returns `LFP_EOF`.
+ *
+ * \param offset byte offset to read from, must not be negative
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_OKINCOMPLETE Successful, but incomplete read
+ * \retval LFP_EOF Successful, but end of file was reached during the read
+ * \retval LFP_INVALID_ARGS Offset or len is negative
+ * \retval LFP_NOTIMPLEMENTED Layer does not support readat
+ */
+LFP_API
+int lfp_readat(
+    lfp_protocol*,
+    int64_t offset,
+    void* dst,
+    int64_t len,
+    int64_t* nread);
+
+/** A byte range to read with `lfp_readv_at()` */
+typedef struct lfp_range {
+    /** byte offset to read from */
+    int64_t offset;
+    /** number of bytes to read */
+    int64_t len;
+    /** buffer of (at least) len bytes */
+    void* dst;
+    /** number of bytes actually read, set by `lfp_readv_at()` */
+    int64_t nread;
+} lfp_range;
+
+/** Read many ranges at (absolute) byte offsets
+ *
+ * Like calling `lfp_readat()` for each of the n ranges, but the ranges are
+ * read as a batch. The ranges are sorted by offset, and ranges that overlap,
+ * or are close together, are read with a single read from the underlying
+ * handle. Layers like tapeimage and rp66 map all the ranges through their
+ * index in one pass, and read the records from the underlying handle as one
+ * batch, which again merges the reads. The ranges can be given in any order,
+ * and may overlap.
+ *
+ * The number of bytes read into each range is written to its nread. Like
+ * `lfp_readat()`, the position of the handle is unchanged, and reading past
+ * the end of the file is not an error. If an error is returned, the contents
+ * of the buffers and nread are unspecified.
+ *
+ * \param ranges array of n ranges
+ *
+ * \retval LFP_OK Success, all ranges were read completely
+ * \retval LFP_OKINCOMPLETE Successful, but some ranges were not read
+ *                          completely
+ * \retval LFP_EOF Successful, but end of file was reached in some range
+ * \retval LFP_INVALID_ARGS N, or the offset or len of a range, is negative
+ * \retval LFP_NOTIMPLEMENTED Layer does not support readat
+ */
+LFP_API
+int lfp_readv_at(lfp_protocol*, lfp_range* ranges, int64_t n);
+
+/** Borrow the next len bytes, without copying them
+ *
+ * Like `lfp_readinto()`, but rather than copying the bytes into a buffer,
+ * point ptr to them. The position is moved past the borrowed bytes, and the
+ * number of bytes borrowed is written to avail, which is usually only
+ * smaller than len at EOF.
+ *
+ * When the bytes are already in memory, and contiguous through every layer,
+ * ptr points straight into that memory. This is the case for the memfile and
+ * mmap protocols, and for tapeimage and rp66 on top of them, as long as the
+ * bytes are in a single record. Otherwise, the bytes are read into a buffer
+ * owned by the handle, which is as expensive as `lfp_readinto()`. Borrowing
+ * is mostly useful for peeking at small headers, where it often saves a
+ * copy.
+ *
+ * The borrowed bytes must not be modified, and are only valid until
+ * `lfp_release()`, which must be called before the handle is used again.
+ *
+ * \param len maximum number of bytes to borrow
+ * \param ptr set to point to the borrowed bytes
+ * \param avail number of bytes borrowed, can be `NULL`
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_OKINCOMPLETE Successful, but fewer than len bytes were borrowed
+ * \retval LFP_EOF Successful, but end of file was reached
+ * \retval LFP_INVALID_ARGS Len is negative
+ */
+LFP_API
+int lfp_borrow(lfp_protocol*, int64_t len, const void** ptr, int64_t* avail);
+
+/** Release the bytes borrowed with `lfp_borrow()`
+ *
+ * After this, the pointer from `lfp_borrow()` must not be used, and the
+ * handle can be used again.
+ *
+ * \retval LFP_OK Success
+ */
+LFP_API
+int lfp_release(lfp_protocol*);
+
 /** Set the file position to (absolute) byte offset n
  *
  * Protocols are not required to implement seek, e.g. file streams (pipes) are
@@ -223,6 +337,27 @@ int lfp_seek(lfp_protocol*, int64_t n);
 LFP_API
 int lfp_tell(lfp_protocol*, int64_t* n);
 
+/** Get the size of the file
+ *
+ * Obtain the number of bytes in the file, as seen through this protocol, i.e.
+ * the offset `lfp_seek()` would move to, to be at the end of the file. Like
+ * `lfp_tell()`, it is relative to where the file was when opened. The
+ * position of the handle does not change.
+ *
+ * The payload is not read. Leaf protocols ask the file system, and layers
+ * like tapeimage and rp66 index the rest of the file, which only reads the
+ * record headers. The gzip protocol must decompress the file to know its
+ * size, unless the index is already built or loaded.
+ *
+ * \param n size of the file
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_NOTIMPLEMENTED Some protocol in the stack does not support size
+ * \retval LFP_NOTSUPPORTED The size is not known, e.g. for a pipe
+ */
+LFP_API
+int lfp_size(lfp_protocol*, int64_t* n);
+
 /** Peels off the current protocol to expose the underlying one
  *
  * Conceptually this is similar to calling release() on a std::unique_ptr.
@@ -263,6 +398,33 @@ int lfp_peel(lfp_protocol* outer, lfp_protocol** inner);
 LFP_API
 int lfp_peek(lfp_protocol* outer, lfp_protocol** inner);
 
+/** Duplicate a handle
+ *
+ * Make a new, independent handle to the same file, through the same stack of
+ * protocols, positioned at the same offset. The handles can be read, seeked,
+ * and closed independently, e.g. from different threads. This is much cheaper
+ * than opening the file again - layers like tapeimage and rp66 share the
+ * record index with their duplicates, rather than indexing the file again,
+ * and leaf protocols re-use the file with its own position, e.g. with
+ * positional reads. The shared index keeps growing, so headers found by any
+ * of the handles are indexed for all of them, without locking on reads.
+ *
+ * Every protocol in the stack must support duplication. Protocols that read
+ * from streams (pipes), or that cannot give the duplicate its own position in
+ * the file, report `LFP_NOTSUPPORTED` or `LFP_NOTIMPLEMENTED`.
+ *
+ * The duplicate must be closed with `lfp_close()`, like any other handle.
+ *
+ * \param f Protocol to duplicate
+ * \param dup Reference to the new protocol
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_NOTIMPLEMENTED Some protocol in the stack does not support dup
+ * \retval LFP_NOTSUPPORTED The file cannot be duplicated, e.g. a pipe
+ */
+LFP_API
+int lfp_dup(lfp_protocol* f, lfp_protocol** dup);
+
 /** Checks if the end of file is reached
  *
  * This does not return a `lfp_status` code.
@@ -301,6 +463,11 @@ const char* lfp_errormsg(lfp_protocol*);
  * which means features may degrade when `FILE` is a stream (pipe) or similar.
  * Typically, this means seek and tell will fail.
  *
+ * The `FILE` is only read from. `lfp_readat()` reads the underlying
+ * descriptor directly, bypassing the `FILE` buffer, so anything written
+ * through the `FILE` must be flushed with `fflush()` before it is given to
+ * lfp, and it should not be written to afterwards.
+ *
  * This function takes *ownership* of the handle, and the `FILE` will be
  * `fclose()`d when `lfp_close()` is called on it.
  */
@@ -25,6 +25,17 @@ extern "C" {
 lfp_protocol* lfp_memfile_open();
 lfp_protocol* lfp_memfile_openwith(const unsigned char*, size_t);
 
+/*
+ * Open a memfile that reads straight from the caller's memory. The memory is
+ * not copied, and it must be kept alive and unchanged until the memfile is
+ * closed.
+ *
+ * This is useful when the data is already in a (possibly very large) buffer,
+ * e.g. a decompressed blob, where lfp_memfile_openwith would double the memory
+ * use and copy the whole buffer before the first read.
+ */
+lfp_protocol* lfp_memfile_borrow(const void*, size_t);
+
 #if (__cplusplus)
 } // extern "C"
 #endif
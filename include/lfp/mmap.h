@@ -0,0 +1,54 @@
+#ifndef LFP_MMAP_H
+#define LFP_MMAP_H
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** Access pattern hints for the mmap protocol
+ *
+ * The hints are passed on to `madvise()`, and can be combined with bitwise
+ * or. They are just hints - if the system does not support them, they are
+ * silently ignored.
+ */
+enum lfp_mmap_advice {
+    /** No particular access pattern */
+    LFP_MMAP_NORMAL     = 0,
+    /** Pages are read in order, and read-ahead should be aggressive */
+    LFP_MMAP_SEQUENTIAL = 1 << 0,
+    /** Pages are read in random order, and read-ahead is wasteful */
+    LFP_MMAP_RANDOM     = 1 << 1,
+    /** The whole file will be read soon, and should be paged in now */
+    LFP_MMAP_WILLNEED   = 1 << 2,
+    /** Back the mapping with huge pages, if possible */
+    LFP_MMAP_HUGEPAGE   = 1 << 3,
+};
+
+/** Memory mapped file protocol
+ *
+ * This protocol maps a POSIX file descriptor read-only into memory, and reads
+ * are copies straight out of the mapping, without system calls. For
+ * random-access reads of files that are already in the page cache, this is
+ * considerably cheaper than both cfile and fd. The protocol is not available
+ * on Windows.
+ *
+ * Like the cfile protocol, the current offset of the descriptor is considered
+ * the start of the file by lfp. The file is mapped as it is when opened, and
+ * later changes to its size are not seen. Seeking past the end is allowed, and
+ * the next read will report LFP_EOF.
+ *
+ * The advice is a combination of lfp_mmap_advice values.
+ *
+ * On success, this function takes *ownership* of the descriptor, which is
+ * closed straight away, as the mapping outlives it. On failure, e.g. if the
+ * descriptor is a pipe, NULL is returned and the descriptor is left open.
+ */
+lfp_protocol* lfp_mmap_open(int fd, int advice);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_MMAP_H
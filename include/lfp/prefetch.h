@@ -0,0 +1,45 @@
+#ifndef LFP_PREFETCH_H
+#define LFP_PREFETCH_H
+
+#include <stdint.h>
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** Prefetching protocol
+ *
+ * A pass-through layer that reads ahead of the current position in a
+ * background thread, so that reading from the underlying handle overlaps
+ * with whatever the caller does with the data, e.g. decoding records.
+ *
+ * The read-ahead window adapts to the access pattern. Every sequential read
+ * doubles the window, up to max_blocks blocks of block_size bytes. Every seek
+ * outside the window halves it. When the window shrinks to zero, reads go
+ * straight to the underlying handle, and nothing is read ahead.
+ *
+ * Offsets, i.e. tell and seek, are the same as for the underlying handle,
+ * which must support tell. The underlying handle is used from the background
+ * thread, so it must not be used by anyone else while the prefetch protocol
+ * is open. Errors from reading ahead are reported by the next read.
+ *
+ * \param block_size the size of the read-ahead blocks, in bytes. If zero, the
+ *                   default of 256 KiB is used.
+ * \param max_blocks the maximum number of blocks to read ahead. If zero, the
+ *                   default of 16 is used.
+ *
+ * \retval NULL if f is NULL, block_size or max_blocks are negative, or f does
+ *              not support tell
+ */
+lfp_protocol* lfp_prefetch_open(
+    lfp_protocol* f,
+    int64_t block_size,
+    int max_blocks);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_PREFETCH_H
@@ -6,7 +6,9 @@
 #include <cstdint>
 #include <exception>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <lfp/lfp.h>
 
@@ -55,6 +57,78 @@ public:
      */
     virtual int eof() const noexcept (false) = 0;
 
+    /** \copybrief lfp_readat
+     *
+     * The position of the handle must not change. If this is not implemented,
+     * `lfp_readat()` will always return `LFP_NOTIMPLEMENTED`.
+     *
+     * \param offset offset to read from, which is never negative
+     * \param dst buffer of size `len`
+     * \param len maximum length of data to be read
+     * \param bytes_read number of bytes actually read into the buffer
+     */
+    virtual lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false);
+
+    /** \copybrief lfp_readv_at
+     *
+     * The ranges are validated, and their nread set to zero, before this is
+     * called. The default implementation sorts the ranges, merges the ones
+     * that overlap or are close, and reads each merged range with `readat()`.
+     * Layers that map offsets, or have a better way of batching reads, should
+     * override it.
+     *
+     * \param ranges array of n ranges, which may be in any order
+     * \param n number of ranges
+     */
+    virtual lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false);
+
+    /** \copybrief lfp_borrow
+     *
+     * The default implementation reads the bytes with `readinto()` into a
+     * buffer owned by the handle, so all protocols support borrow. Protocols
+     * that have the bytes in memory should override it, and point to them
+     * instead. Layers can borrow from the underlying protocol when the bytes
+     * are contiguous in it, and must then forward `release()` too.
+     *
+     * \param len maximum number of bytes to borrow, which is never negative
+     * \param ptr set to point to the borrowed bytes
+     * \param avail number of bytes borrowed, which is never NULL
+     */
+    virtual lfp_status borrow(
+            std::int64_t len,
+            const void** ptr,
+            std::int64_t* avail)
+        noexcept (false);
+
+    /** \copybrief lfp_release
+     *
+     * The default implementation does nothing, as the buffer used by the
+     * default `borrow()` is re-used.
+     */
+    virtual void release() noexcept (false);
+
+    /**
+     * True if `borrow()` points into memory the protocol already has, at
+     * least for some ranges, rather than reading into a buffer. Layers use
+     * this to decide between borrowing from the underlying protocol, and
+     * reading through their own buffers. The default is false.
+     */
+    virtual bool lends() const noexcept (true);
+
+    /**
+     * True if `readat()` is safe to call from multiple threads at the same
+     * time. Callers that read at offsets from several threads, like the
+     * parallel tapeimage indexer, do the reads one at a time when it is not.
+     * The default is false.
+     */
+    virtual bool concurrent_readat() const noexcept (true);
+
     /** \copybrief lfp_seek
      *
      * If this is not implemented, `lfp_seek()` will always return
@@ -68,6 +142,16 @@ public:
      */
     virtual std::int64_t tell() const noexcept (false);
 
+    /** \copybrief lfp_size
+     *
+     * The size is in the same (logical) offsets as `tell()`, and the position
+     * of the handle must not change. Leaf protocols should get it from the
+     * file system, and layers from their index, or from the underlying
+     * protocol. If this is not implemented, `lfp_size()` will always return
+     * `LFP_NOTIMPLEMENTED`.
+     */
+    virtual std::int64_t size() noexcept (false);
+
     /** \copybrief lfp_peel
      *
      * If this is not implemented, `lfp_peel()` will throw
@@ -82,6 +166,15 @@ public:
      */
     virtual lfp_protocol* peek() const noexcept (false) = 0;
 
+    /** \copybrief lfp_dup
+     *
+     * The duplicate must be positioned at the same offset as this handle.
+     * Layers should duplicate the underlying protocol, and wrap it in a new
+     * instance of themselves. If this is not implemented, `lfp_dup()` will
+     * always return `LFP_NOTIMPLEMENTED`.
+     */
+    virtual lfp_protocol* dup() noexcept (false);
+
     /** \copybrief lfp_errormsg */
     const char* errmsg() noexcept (true);
 
@@ -92,6 +185,7 @@ public:
 
 private:
     std::string error_message;
+    std::vector< unsigned char > borrowed;
 };
 
 namespace lfp {
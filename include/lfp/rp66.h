@@ -44,6 +44,48 @@ extern "C" {
  */
 lfp_protocol* lfp_rp66_open(lfp_protocol*);
 
+/** Logical Record Segments
+ *
+ * The Logical Records (LR) of a dlis file are split into Logical Record
+ * Segments (LRS), each consisting of a header, an optional encryption packet,
+ * the segment body, and an optional trailer of padding, checksum and trailing
+ * length [1]. The header has the length of the segment, its attributes, which
+ * say what parts of the trailer are present, and the logical record type.
+ *
+ * The lrs protocol provides a view as if only the segment bodies were
+ * present, i.e. it strips the headers, encryption packets and trailers, and
+ * `lfp_seek()` and `lfp_tell()` consider offsets in the concatenated bodies.
+ * The segments are indexed as they are read, so seeking back is fast.
+ *
+ * \verbatim
+          --------------------------------------------------
+         | LRSH |  body  | pad | LRSH | enc |  body  | chk |
+          --------------------------------------------------
+  tell   0      4       104   110    114   120      200   202
+
+          -----------------
+         |  body  |  body  |
+          -----------------
+  tell   0       100      180
+  \endverbatim
+ *
+ * The underlying handle must be a stream of segments, typically an rp66
+ * handle, which strips the Visible Envelope. Checksums are not verified, and
+ * encrypted bodies are passed on as-is.
+ *
+ * The protocol can be opened at any segment, and tells will start at that
+ * position.
+ *
+ * When a segment is indexed its header, the size of the encryption packet
+ * and the trailer are read, and checked against the segment length. The
+ * bodies are read straight from the underlying handle, and `lfp_readat()`,
+ * `lfp_size()` and `lfp_dup()` are supported when the underlying handle
+ * supports them.
+ *
+ * [1] http://w3.energistics.org/RP66/V1/rp66v1_sec2.html#2_2
+ */
+lfp_protocol* lfp_rp66_lrs_open(lfp_protocol*);
+
 #if (__cplusplus)
 } // extern "C"
 #endif
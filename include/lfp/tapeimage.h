@@ -14,8 +14,10 @@ extern "C" {
  * The tape image is an encapsulation format developed for well logs. The file
  * is segmented into records, each preceeded by a record marker of three 4-byte
  * little-endian integers - a record type, offset of the previous record, and
- * offset of the next record. All offsets are absolute, so the file size is
- * limited to 4GB.
+ * offset of the next record. All offsets are absolute, and wrap around for
+ * files larger than 4GB. The protocol keeps track of the high bits as it
+ * walks the records, so large files are supported as long as every single
+ * record is smaller than 4GB.
  *
  * The tapeimage protocol provides a view of as if the record markers were not
  * present. `lfp_seek()` and `lfp_tell()` consider offsets as if the file had
@@ -28,6 +30,186 @@ extern "C" {
  */
 lfp_protocol* lfp_tapeimage_open(lfp_protocol*);
 
+/** Resynchronise on broken record markers
+ *
+ * By default, a broken record marker is a fatal error, unless it looks like
+ * a single, minor inconsistency, and the rest of the file is unreachable.
+ * With resynchronisation enabled, the handle instead searches forward from
+ * the broken marker for the next record marker that is consistent with the
+ * one following it, and continues from there. Everything from the broken
+ * marker up to the found marker, including the broken marker itself, is
+ * presented as the data of a single record.
+ *
+ * Once the handle has resynchronised, reads return
+ * `LFP_PROTOCOL_TRYRECOVERY`, as the data might be damaged. The search is
+ * only forward, so if the broken field is the offset of the next record, and
+ * it points past the end of the file, the handle cannot recover.
+ *
+ * \param enable non-zero to enable resynchronisation, zero to disable it
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage
+ */
+int lfp_tapeimage_set_resync(lfp_protocol*, int enable);
+
+/** Open the tape image at one of its last logical files
+ *
+ * A tape image can hold several logical files, each terminated by an
+ * end-of-file mark. To open at the start of a logical file towards the end,
+ * with `lfp_tapeimage_open()`, all record markers before it must be read.
+ * This function instead finds the end of the underlying file and walks the
+ * record markers backwards, following their offset of the previous record,
+ * until it reaches the start of the requested logical file. Only the record
+ * markers of the logical files that are passed are read.
+ *
+ * The handle is opened at the start of the logical file, like if
+ * `lfp_tapeimage_open()` was called with the underlying file positioned
+ * there, i.e. `lfp_tell()` is zero at the start of that logical file, and
+ * the handle reports EOF at its end-of-file mark. The record markers that
+ * were read are already in the record index.
+ *
+ * Logical files are counted from the end, so files = 1 opens the last
+ * logical file. Empty logical files, i.e. consecutive end-of-file marks such
+ * as the double mark that often ends a tape, are not counted.
+ *
+ * The underlying file must be seekable, and the end of the file is taken as
+ * the end of the tape image. The end is found with `lfp_size()`, or by
+ * probing if the underlying file does not know its size. The underlying
+ * file is searched from its current position, which is considered the start
+ * of the tape image.
+ *
+ * \param files which logical file to open, counted from the end
+ *
+ * \retval NULL if the file could not be opened, e.g. when the record markers
+ *              are broken, or there are fewer than files logical files. The
+ *              underlying file is not closed, but its position is undefined.
+ */
+lfp_protocol* lfp_tapeimage_open_tail(lfp_protocol*, int files);
+
+/** Index all records in the file
+ *
+ * Read all record markers in the file up to and including the end-of-file
+ * mark, and add them to the record index. Normally the index is built lazily,
+ * as records are read or seeked past. Building the full index up front makes
+ * every later seek immediate, and is useful before
+ * `lfp_tapeimage_index_dump()`.
+ *
+ * The underlying file is read in large blocks, and all the record markers in
+ * a block are decoded before the next read, which is a lot faster than
+ * visiting the records one by one when records are small. The position of
+ * the handle is unchanged.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage
+ */
+int lfp_tapeimage_index_build(lfp_protocol*);
+
+/** Index all records in the file, using multiple threads
+ *
+ * Build the same index as `lfp_tapeimage_index_build()`, but split the work
+ * between a number of threads. The file is divided into stripes, and every
+ * thread looks for record markers in its stripes on its own. Since a thread
+ * has to guess where the first record marker in its stripe is, the markers
+ * are then put together and checked in order from the last indexed record,
+ * and any marker not found by the threads is read from disk. The resulting
+ * index is always the same as the one built by `lfp_tapeimage_index_build()`.
+ *
+ * The threads share the underlying handle. When it supports `lfp_readat()`,
+ * and says that is safe to call from multiple threads, like the fd and mmap
+ * protocols do, the threads read in parallel. Otherwise the reads are done
+ * one at a time, with readat, or with seek and read, but decoding is still
+ * done in parallel. This pays off on large files on fast storage. The
+ * underlying handle must not be used by anyone else while the index is built.
+ *
+ * \param threads number of threads to use. If zero or negative, use the
+ *                number of hardware threads. With one thread, this is the
+ *                same as `lfp_tapeimage_index_build()`.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage
+ */
+int lfp_tapeimage_index_build_parallel(lfp_protocol*, int threads);
+
+/** Size of the serialized record index
+ *
+ * Get the number of bytes needed to hold the serialized record index, i.e.
+ * the minimum size of the buffer passed to `lfp_tapeimage_index_dump()`.
+ *
+ * The record index is built lazily, as records are read or seeked past, so
+ * the size grows as more of the file is visited.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage
+ */
+int lfp_tapeimage_index_size(lfp_protocol*, int64_t* size);
+
+/** Serialize the record index
+ *
+ * Write the record index, i.e. all record markers read so far, into dst. The
+ * serialized index can be stored, e.g. in a sidecar file, and given to
+ * `lfp_tapeimage_index_load()` when the same file is opened later, which
+ * removes the need to read the record markers from disk again.
+ *
+ * The index is only meaningful for the same file, opened at the same offset.
+ *
+ * \param dst buffer of at least `lfp_tapeimage_index_size()` bytes
+ * \param len size of dst
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage, or dst is too small
+ */
+int lfp_tapeimage_index_dump(lfp_protocol*, void* dst, int64_t len);
+
+/** Load a serialized record index
+ *
+ * Extend the record index with one previously obtained with
+ * `lfp_tapeimage_index_dump()`. Records covered by the loaded index are never
+ * read from disk, and seeks into them are immediate.
+ *
+ * The loaded index must agree with the records already indexed by the
+ * handle, and its base must match the offset the handle was opened at. The
+ * index records the size of the underlying file it was dumped from, and is
+ * rejected if the size of the underlying file is different now, e.g. because
+ * it has been rewritten. The position of the handle is unchanged.
+ *
+ * An index dumped from a handle that has recovered from broken record
+ * markers, see `lfp_tapeimage_set_resync()`, puts this handle in the same
+ * state, and reads return `LFP_PROTOCOL_TRYRECOVERY` like they did there.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage, or the index is
+ *                          malformed or does not match the file
+ */
+int lfp_tapeimage_index_load(lfp_protocol*, const void* src, int64_t len);
+
+/** Move to the next record
+ *
+ * Move the handle to the start of the record following the current one, and
+ * get its type, logical offset, and length. The current record is the one
+ * last read from or seeked into, and when the handle is freshly opened, the
+ * first call moves to the first record in the file. A seek to an offset that
+ * is exactly on a record boundary makes the record *starting* at that offset
+ * the current one.
+ *
+ * Only the record marker is read, so records can be skipped cheaply, and the
+ * length can be used to size the buffer for reading the full record with
+ * `lfp_readinto()`. The offset is the logical offset, i.e. the one reported
+ * by `lfp_tell()` after the move.
+ *
+ * The type is 0 for data records and 1 for the end-of-file mark. When the
+ * end-of-file mark is reached, `LFP_EOF` is returned and the handle stays at
+ * the mark. Any of type, offset and length can be NULL.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_EOF The next record is the end-of-file mark, or the handle is
+ *                 already at it
+ * \retval LFP_INVALID_ARGS The handle is not a tapeimage
+ */
+int lfp_tapeimage_next_record(lfp_protocol*,
+                              int* type,
+                              int64_t* offset,
+                              int64_t* length);
+
 #if (__cplusplus)
 } // extern "C"
 #endif
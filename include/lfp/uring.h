@@ -0,0 +1,63 @@
+#ifndef LFP_URING_H
+#define LFP_URING_H
+
+#include <stdint.h>
+
+#include <lfp/lfp.h>
+
+#if (__cplusplus)
+extern "C" {
+#endif
+
+/** io_uring file protocol
+ *
+ * This protocol reads a file descriptor through Linux' io_uring, and keeps up
+ * to depth block reads in flight at the same time. Sequential reads are read
+ * ahead, and lfp_uring_prefetch() can queue reads of regions that are known to
+ * be needed soon, which keeps the queue of fast devices, like NVMe drives,
+ * busy. The protocol is only available on Linux.
+ *
+ * Like the cfile and fd protocols, the current offset of the descriptor is
+ * considered the start of the file by lfp. The descriptor must be seekable.
+ *
+ * If io_uring is not available, e.g. because the kernel is too old or it is
+ * blocked by a seccomp policy, or depth is zero, the protocol falls back to
+ * reading with `pread()`, like the fd protocol.
+ *
+ * This function takes *ownership* of the descriptor, and it will be
+ * `close()`d when `lfp_close()` is called on it. Closing waits for the reads
+ * in flight, since the kernel writes into the blocks. If that wait fails, the
+ * kernel may still write to them, so the blocks of the reads in flight are
+ * leaked rather than freed.
+ *
+ * \param depth the maximum number of reads in flight, and the number of
+ *              blocks kept in memory
+ */
+lfp_protocol* lfp_uring_open(int fd, int depth);
+
+/** Queue reads of regions that will be needed soon
+ *
+ * The regions are given as n pairs of (logical) offsets and lengths, and the
+ * reads are submitted together, in a single batch, without waiting for them
+ * to complete. The regions are hints - if they are larger than the blocks that
+ * can be kept in memory, only the first blocks are read ahead.
+ *
+ * Without io_uring, the kernel is asked to read ahead with `posix_fadvise()`
+ * instead.
+ *
+ * \retval LFP_OK Success
+ * \retval LFP_INVALID_ARGS The handle is not an io_uring protocol, or a region
+ *                          has a negative offset or length
+ * \retval LFP_IOERROR The reads could not be submitted
+ */
+int lfp_uring_prefetch(
+    lfp_protocol*,
+    const int64_t* offsets,
+    const int64_t* lengths,
+    int n);
+
+#if (__cplusplus)
+} // extern "C"
+#endif
+
+#endif // LFP_URING_H
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cassert>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/buffered.h>
+
+namespace lfp { namespace {
+
+constexpr std::int64_t default_block_size = 64 * 1024;
+constexpr std::size_t alignment = 4096;
+
+/*
+ * A block buffer over another protocol.
+ *
+ * All positions are in the underlying protocol's offsets. The buffer holds
+ * the bytes [start, start + length), and the underlying handle is positioned
+ * at inner_pos, which is usually the end of the buffer. A read that is not
+ * covered by the buffer refills it from the current position, so sequential
+ * reads never seek the underlying handle, and seeks within the buffer are
+ * free.
+ *
+ * The underlying handle may not support tell and seek (e.g. a cfile over a
+ * pipe), in which case the buffered protocol does not either, but reads still
+ * work.
+ */
+class buffered : public lfp_protocol {
+public:
+    buffered(lfp_protocol*, std::int64_t block_size);
+
+    void close() noexcept (false) override;
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+    std::int64_t tell() const noexcept (false) override;
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    unique_lfp fp;
+    std::unique_ptr< unsigned char[] > storage;
+    unsigned char* buffer = nullptr;
+    std::int64_t block_size;
+
+    std::int64_t start  = 0;
+    std::int64_t length = 0;
+    std::int64_t pos    = 0;
+    mutable std::int64_t inner_pos = 0;
+    bool seekable = true;
+
+    /*
+     * The handle was seeked outside the buffer, so the next fill starts at
+     * the block boundary before the position. Seeks often go back and forth
+     * in the same region, e.g. to re-read headers.
+     */
+    bool align = false;
+
+    /*
+     * The underlying handle reported EOF when the buffer was last filled, so
+     * the file ends at start + length.
+     */
+    bool inner_eof = false;
+
+    lfp_status fill() noexcept (false);
+    void reposition() const noexcept (false);
+};
+
+buffered::buffered(lfp_protocol* f, std::int64_t bs) :
+    fp(f),
+    block_size(bs)
+{
+    try {
+        /* over-allocate so that the buffer can be page aligned */
+        auto space = std::size_t(bs) + alignment;
+        this->storage.reset(new unsigned char[space]);
+        void* p = this->storage.get();
+        this->buffer = static_cast< unsigned char* >(
+            std::align(alignment, std::size_t(bs), p, space)
+        );
+        assert(this->buffer);
+
+        this->pos = this->fp->tell();
+    } catch (const lfp::error& e) {
+        if (e.status() != LFP_NOTSUPPORTED) {
+            this->fp.release();
+            throw;
+        }
+        this->seekable = false;
+        this->pos = 0;
+    } catch (...) {
+        /*
+         * The caller still owns the underlying handle if the constructor
+         * fails, so don't close it
+         */
+        this->fp.release();
+        throw;
+    }
+
+    this->start = this->pos;
+    this->inner_pos = this->pos;
+}
+
+void buffered::close() noexcept (false) {
+    if (not this->fp) return;
+    this->fp.close();
+}
+
+void buffered::reposition() const noexcept (false) {
+    if (this->inner_pos == this->pos)
+        return;
+
+    this->fp.get()->seek(this->pos);
+    this->inner_pos = this->pos;
+}
+
+lfp_status buffered::fill() noexcept (false) {
+    auto from = this->pos;
+    if (this->align) {
+        from -= this->pos % this->block_size;
+        this->align = false;
+    }
+
+    if (from != this->inner_pos) {
+        this->fp->seek(from);
+        this->inner_pos = from;
+    }
+
+    std::int64_t n;
+    const auto err = this->fp->readinto(this->buffer, this->block_size, &n);
+    this->start = from;
+    this->length = n;
+    this->inner_pos = from + n;
+    this->inner_eof = err == LFP_EOF;
+    return err;
+}
+
+lfp_status buffered::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+
+    while (n < len) {
+        const auto end = this->start + this->length;
+        if (this->pos >= this->start and this->pos < end) {
+            const auto k = std::min(end - this->pos, len - n);
+            const auto* src = this->buffer + (this->pos - this->start);
+            std::memcpy(advance(dst, n), src, k);
+            this->pos += k;
+            n += k;
+            continue;
+        }
+
+        if (this->inner_eof and this->pos >= end) {
+            err = LFP_EOF;
+            break;
+        }
+
+        /*
+         * Large reads go straight to the caller's buffer - buffering them
+         * would only add a copy.
+         */
+        if (len - n >= this->block_size) {
+            this->reposition();
+            std::int64_t k;
+            err = this->fp->readinto(advance(dst, n), len - n, &k);
+            this->pos += k;
+            this->inner_pos += k;
+            n += k;
+            /* the buffer is no longer where the underlying handle is */
+            if (err == LFP_EOF) {
+                this->start = this->pos;
+                this->length = 0;
+                this->inner_eof = true;
+            }
+            break;
+        }
+
+        err = this->fill();
+        if (this->pos >= this->start + this->length)
+            break;
+    }
+
+    if (n == len)
+        err = LFP_OK;
+
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+/*
+ * Reads at an offset go straight to the underlying handle. The buffer belongs
+ * to the current position, and filling it from other threads is not safe.
+ */
+lfp_status buffered::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    if (not this->seekable)
+        throw not_supported("buffered: readat: underlying handle is not seekable");
+
+    return this->fp->readat(offset, dst, len, bytes_read);
+}
+
+lfp_status buffered::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    if (not this->seekable)
+        throw not_supported("buffered: readv_at: underlying handle is not seekable");
+
+    return this->fp->readv_at(ranges, n);
+}
+
+bool buffered::concurrent_readat() const noexcept (true) {
+    return this->fp->concurrent_readat();
+}
+
+int buffered::eof() const noexcept (true) {
+    return this->inner_eof and this->pos >= this->start + this->length;
+}
+
+std::int64_t buffered::tell() const noexcept (false) {
+    if (not this->seekable)
+        return this->fp->tell();
+    return this->pos;
+}
+
+void buffered::seek(std::int64_t n) noexcept (false) {
+    if (not this->seekable) {
+        this->fp->seek(n);
+        return;
+    }
+
+    if (n < 0) {
+        const auto msg = "buffered: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    /* within the buffer, or right after it, so no need to move */
+    if (n >= this->start and n <= this->start + this->length) {
+        this->pos = n;
+        return;
+    }
+
+    this->fp->seek(n);
+    this->pos = n;
+    this->inner_pos = n;
+    this->start = n;
+    this->length = 0;
+    this->inner_eof = false;
+    this->align = true;
+}
+
+std::int64_t buffered::size() noexcept (false) {
+    return this->fp->size();
+}
+
+/*
+ * The underlying handle is usually read ahead of the position, so move it
+ * back to the position before it is handed out
+ */
+lfp_protocol* buffered::peel() noexcept (false) {
+    assert(this->fp);
+    if (this->seekable)
+        this->reposition();
+    return this->fp.release();
+}
+
+lfp_protocol* buffered::peek() const noexcept (false) {
+    assert(this->fp);
+    if (this->seekable)
+        this->reposition();
+    return this->fp.get();
+}
+
+/*
+ * The duplicate starts with an empty buffer, at the same position
+ */
+lfp_protocol* buffered::dup() noexcept (false) {
+    assert(this->fp);
+    if (not this->seekable)
+        throw not_supported("buffered: dup: underlying handle is not seekable");
+
+    unique_lfp inner(this->fp->dup());
+    inner->seek(this->pos);
+    auto* copy = new buffered(inner.get(), this->block_size);
+    inner.release();
+    return copy;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_buffered_open(lfp_protocol* f, std::int64_t block_size) {
+    if (not f) return nullptr;
+    if (block_size < 0) return nullptr;
+    if (block_size == 0) block_size = lfp::default_block_size;
+
+    try {
+        return new lfp::buffered(f, block_size);
+    } catch (...) {
+        return nullptr;
+    }
+}
@@ -0,0 +1,565 @@
+#include <algorithm>
+#include <cassert>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/cache.h>
+
+namespace lfp { namespace {
+
+constexpr std::int64_t block_size = 64 * 1024;
+constexpr std::int64_t default_budget = 64 * 1024 * 1024;
+
+struct block {
+    std::vector< unsigned char > data;
+    /* the underlying handle reported EOF right after this block */
+    bool eof = false;
+};
+
+using block_ptr = std::shared_ptr< const block >;
+
+/*
+ * The process-wide block cache.
+ *
+ * Keys are interned to an integer file id when a handle is opened, so that
+ * lookups only hash (file, offset) pairs. Blocks are shared pointers, so a
+ * block that is evicted while a handle is reading from it stays alive until
+ * the handle is done with it, and the data is copied without holding the
+ * lock.
+ *
+ * Eviction is CLOCK - a hit sets the referenced bit, and the hand sweeps the
+ * slots, clearing the bit and evicting blocks that have not been referenced
+ * since the last sweep. The slots are a ring that never moves - an evicted
+ * block leaves its slot empty, and new blocks are put in the empty slots
+ * (the last one emptied first), so the hand sees blocks in the order they
+ * were put in the cache. The ring only grows when there are no empty slots.
+ */
+class block_cache {
+public:
+    static block_cache& instance() noexcept (false);
+
+    std::uint64_t intern(const std::string& key) noexcept (false);
+    block_ptr get(std::uint64_t file, std::int64_t offset) noexcept (false);
+    void put(std::uint64_t file, std::int64_t offset, block_ptr)
+        noexcept (false);
+
+    void set_budget(std::int64_t) noexcept (false);
+    void drop(const char* key) noexcept (false);
+    lfp_cache_stats statistics() noexcept (false);
+
+private:
+    using key = std::pair< std::uint64_t, std::int64_t >;
+
+    struct key_hash {
+        std::size_t operator () (const key& k) const noexcept (true) {
+            const auto h1 = std::hash< std::uint64_t >()(k.first);
+            const auto h2 = std::hash< std::int64_t >()(k.second);
+            return h1 ^ (h2 + 0x9e3779b97f4a7c15ULL + (h1 << 6) + (h1 >> 2));
+        }
+    };
+
+    /* empty slots have no data */
+    struct slot {
+        key id;
+        block_ptr data;
+        bool referenced;
+    };
+
+    void evict_until(std::int64_t limit) noexcept (true);
+    void remove(std::size_t i) noexcept (true);
+
+    std::mutex lock;
+    std::unordered_map< std::string, std::uint64_t > files;
+    std::unordered_map< key, std::size_t, key_hash > index;
+    std::vector< slot > slots;
+    std::vector< std::size_t > empty;
+    std::size_t hand = 0;
+
+    std::int64_t size      = 0;
+    std::int64_t budget    = default_budget;
+    std::int64_t hits      = 0;
+    std::int64_t misses    = 0;
+    std::int64_t evictions = 0;
+};
+
+block_cache& block_cache::instance() noexcept (false) {
+    static block_cache cache;
+    return cache;
+}
+
+std::uint64_t block_cache::intern(const std::string& k) noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->lock);
+    const auto next = std::uint64_t(this->files.size());
+    return this->files.emplace(k, next).first->second;
+}
+
+block_ptr block_cache::get(std::uint64_t file, std::int64_t offset)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->lock);
+    const auto itr = this->index.find(key(file, offset));
+    if (itr == this->index.end()) {
+        this->misses += 1;
+        return nullptr;
+    }
+
+    this->hits += 1;
+    auto& s = this->slots[itr->second];
+    s.referenced = true;
+    return s.data;
+}
+
+void block_cache::put(std::uint64_t file, std::int64_t offset, block_ptr b)
+noexcept (false) {
+    const auto bytes = std::int64_t(b->data.size());
+
+    std::lock_guard< std::mutex > guard(this->lock);
+    if (bytes > this->budget)
+        return;
+
+    /* another handle might have read the same block in the meantime */
+    const auto id = key(file, offset);
+    if (this->index.count(id))
+        return;
+
+    this->evict_until(this->budget - bytes);
+
+    /* make room first, so that nothing needs to be undone if it fails */
+    if (this->empty.empty())
+        this->slots.reserve(this->slots.size() + 1);
+    this->empty.reserve(this->slots.size() + 1);
+
+    std::size_t i = this->slots.size();
+    if (not this->empty.empty())
+        i = this->empty.back();
+
+    this->index.emplace(id, i);
+    if (i == this->slots.size())
+        this->slots.push_back(slot { id, std::move(b), false });
+    else {
+        this->empty.pop_back();
+        this->slots[i] = slot { id, std::move(b), false };
+    }
+    this->size += bytes;
+}
+
+void block_cache::remove(std::size_t i) noexcept (true) {
+    auto& s = this->slots[i];
+    this->index.erase(s.id);
+    this->size -= std::int64_t(s.data->data.size());
+    s.data.reset();
+    s.referenced = false;
+
+    /* there is room for every slot, so this never allocates */
+    this->empty.push_back(i);
+}
+
+void block_cache::evict_until(std::int64_t limit) noexcept (true) {
+    /* empty slots are skipped, so stop when there is nothing to evict */
+    while (this->size > limit and this->size > 0) {
+        if (this->hand >= this->slots.size())
+            this->hand = 0;
+
+        auto& s = this->slots[this->hand];
+        this->hand += 1;
+
+        if (not s.data)
+            continue;
+
+        if (s.referenced) {
+            s.referenced = false;
+            continue;
+        }
+
+        this->remove(this->hand - 1);
+        this->evictions += 1;
+    }
+}
+
+void block_cache::set_budget(std::int64_t bytes) noexcept (false) {
+    if (bytes < 0) {
+        const auto msg = "cache: expected budget (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, bytes));
+    }
+
+    std::lock_guard< std::mutex > guard(this->lock);
+    this->budget = bytes;
+    this->evict_until(bytes);
+}
+
+void block_cache::drop(const char* k) noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->lock);
+    if (not k) {
+        this->index.clear();
+        this->slots.clear();
+        this->empty.clear();
+        this->size = 0;
+        this->hand = 0;
+        return;
+    }
+
+    const auto itr = this->files.find(k);
+    if (itr == this->files.end())
+        return;
+
+    const auto file = itr->second;
+    for (std::size_t i = 0; i < this->slots.size(); ++i) {
+        const auto& s = this->slots[i];
+        if (s.data and s.id.first == file)
+            this->remove(i);
+    }
+}
+
+lfp_cache_stats block_cache::statistics() noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->lock);
+    lfp_cache_stats stats;
+    stats.hits      = this->hits;
+    stats.misses    = this->misses;
+    stats.evictions = this->evictions;
+    stats.size      = this->size;
+    stats.budget    = this->budget;
+    return stats;
+}
+
+/*
+ * The cached protocol reads the underlying handle in blocks through the
+ * process-wide cache. The block being read is kept, so that small, sequential
+ * reads don't go through the cache (and its lock) every time.
+ */
+class cached : public lfp_protocol {
+public:
+    cached(lfp_protocol*, const char* key);
+
+    void close() noexcept (false) override;
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+    std::int64_t tell() const noexcept (true) override;
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    /*
+     * Make a duplicate of other, that reads from f, the duplicate of its
+     * underlying file
+     */
+    cached(lfp_protocol* f, const cached& other);
+
+    unique_lfp fp;
+    std::uint64_t file = 0;
+    std::int64_t pos = 0;
+    mutable std::int64_t inner_pos = 0;
+
+    /* the end of the file, if it has been seen, or -1 */
+    std::int64_t eof_at = -1;
+
+    block_ptr current;
+    std::int64_t current_offset = -1;
+
+    void reposition() const noexcept (false);
+    block_ptr load(std::int64_t offset) noexcept (false);
+    block_ptr load_at(std::int64_t offset) noexcept (false);
+    static block_ptr share(std::uint64_t file, std::int64_t offset,
+                           std::shared_ptr< block > b, lfp_status err)
+        noexcept (false);
+};
+
+cached::cached(lfp_protocol* f, const char* key) : fp(f) {
+    try {
+        this->pos = this->fp->tell();
+        this->inner_pos = this->pos;
+        this->file = block_cache::instance().intern(key);
+    } catch (...) {
+        /*
+         * The caller still owns the underlying handle if the constructor
+         * fails, so don't close it
+         */
+        this->fp.release();
+        throw;
+    }
+}
+
+/*
+ * The duplicate reads through the same blocks in the cache, and shares the
+ * current block. The underlying file is seeked before it is read.
+ */
+cached::cached(lfp_protocol* f, const cached& other) :
+    fp(f),
+    file(other.file),
+    pos(other.pos),
+    inner_pos(-1),
+    eof_at(other.eof_at),
+    current(other.current),
+    current_offset(other.current_offset)
+{}
+
+void cached::close() noexcept (false) {
+    if (not this->fp) return;
+    this->fp.close();
+}
+
+block_ptr cached::load(std::int64_t offset) noexcept (false) {
+    auto& cache = block_cache::instance();
+    auto b = cache.get(this->file, offset);
+    if (b) return b;
+
+    if (this->inner_pos != offset) {
+        this->fp->seek(offset);
+        this->inner_pos = offset;
+    }
+
+    auto x = std::make_shared< block >();
+    x->data.resize(block_size);
+    std::int64_t n;
+    const auto err = this->fp->readinto(x->data.data(), block_size, &n);
+    this->inner_pos += n;
+    x->data.resize(n);
+    return share(this->file, offset, std::move(x), err);
+}
+
+/*
+ * Like load, but read the block with readat, which leaves the underlying
+ * handle where it is
+ */
+block_ptr cached::load_at(std::int64_t offset) noexcept (false) {
+    auto b = block_cache::instance().get(this->file, offset);
+    if (b) return b;
+
+    auto x = std::make_shared< block >();
+    x->data.resize(block_size);
+    std::int64_t n;
+    const auto err = this->fp->readat(offset, x->data.data(), block_size, &n);
+    x->data.resize(n);
+    return share(this->file, offset, std::move(x), err);
+}
+
+block_ptr cached::share(
+        std::uint64_t file,
+        std::int64_t offset,
+        std::shared_ptr< block > x,
+        lfp_status err)
+noexcept (false) {
+    x->eof = err == LFP_EOF;
+
+    /* an incomplete block is not the whole truth, so don't share it */
+    if (err != LFP_OKINCOMPLETE)
+        block_cache::instance().put(file, offset, x);
+
+    return x;
+}
+
+lfp_status cached::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+
+    while (n < len) {
+        const auto offset = this->pos - (this->pos % block_size);
+        if (not this->current or this->current_offset != offset) {
+            this->current = this->load(offset);
+            this->current_offset = offset;
+        }
+
+        const auto& data = this->current->data;
+        const auto within = this->pos - offset;
+        const auto avail = std::int64_t(data.size()) - within;
+        if (avail > 0) {
+            const auto k = std::min(avail, len - n);
+            std::memcpy(advance(dst, n), data.data() + within, k);
+            this->pos += k;
+            n += k;
+            continue;
+        }
+
+        if (this->current->eof) {
+            err = LFP_EOF;
+            break;
+        }
+
+        /* a short block without EOF - read it again next time */
+        this->current.reset();
+        err = LFP_OKINCOMPLETE;
+        break;
+    }
+
+    if (this->current and this->current->eof)
+        this->eof_at = this->current_offset
+                     + std::int64_t(this->current->data.size());
+
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+/*
+ * Reads at an offset go through the cache too, but not through the current
+ * block, which belongs to the current position. The cache is thread safe, so
+ * this is safe to call from multiple threads, if the underlying handle's
+ * readat is.
+ */
+lfp_status cached::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+
+    while (n < len) {
+        const auto at = offset + n;
+        const auto block_offset = at - (at % block_size);
+        const auto b = this->load_at(block_offset);
+
+        const auto within = at - block_offset;
+        const auto avail = std::int64_t(b->data.size()) - within;
+        if (avail > 0) {
+            const auto k = std::min(avail, len - n);
+            std::memcpy(advance(dst, n), b->data.data() + within, k);
+            n += k;
+            continue;
+        }
+
+        err = b->eof ? LFP_EOF : LFP_OKINCOMPLETE;
+        break;
+    }
+
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+bool cached::concurrent_readat() const noexcept (true) {
+    return this->fp->concurrent_readat();
+}
+
+int cached::eof() const noexcept (true) {
+    return this->eof_at >= 0 and this->pos >= this->eof_at;
+}
+
+std::int64_t cached::tell() const noexcept (true) {
+    return this->pos;
+}
+
+void cached::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "cache: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    /*
+     * Within the current block there is no need to involve the underlying
+     * handle. Otherwise, seek it, so that invalid seeks fail the same way as
+     * they would without the cache.
+     */
+    const auto offset = n - (n % block_size);
+    if (not this->current or this->current_offset != offset) {
+        this->fp->seek(n);
+        this->inner_pos = n;
+    }
+
+    this->pos = n;
+}
+
+std::int64_t cached::size() noexcept (false) {
+    return this->fp->size();
+}
+
+/*
+ * The underlying handle is left where the last block was read from, so move
+ * it to the position before it is handed out
+ */
+void cached::reposition() const noexcept (false) {
+    if (this->inner_pos == this->pos)
+        return;
+
+    this->fp.get()->seek(this->pos);
+    this->inner_pos = this->pos;
+}
+
+lfp_protocol* cached::peel() noexcept (false) {
+    assert(this->fp);
+    this->reposition();
+    return this->fp.release();
+}
+
+lfp_protocol* cached::peek() const noexcept (false) {
+    assert(this->fp);
+    this->reposition();
+    return this->fp.get();
+}
+
+lfp_protocol* cached::dup() noexcept (false) {
+    assert(this->fp);
+    unique_lfp inner(this->fp->dup());
+    auto* copy = new cached(inner.get(), *this);
+    inner.release();
+    return copy;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_cache_open(lfp_protocol* f, const char* key) {
+    if (not f) return nullptr;
+    if (not key) return nullptr;
+
+    try {
+        return new lfp::cached(f, key);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+int lfp_cache_set_budget(std::int64_t bytes) {
+    try {
+        lfp::block_cache::instance().set_budget(bytes);
+        return LFP_OK;
+    } catch (const lfp::error& e) {
+        return e.status();
+    } catch (...) {
+        return LFP_UNHANDLED_EXCEPTION;
+    }
+}
+
+void lfp_cache_drop(const char* key) {
+    try {
+        lfp::block_cache::instance().drop(key);
+    } catch (...) {
+        /* only fails if the key cannot be copied, so nothing to drop */
+    }
+}
+
+void lfp_cache_statistics(lfp_cache_stats* stats) {
+    assert(stats);
+    try {
+        *stats = lfp::block_cache::instance().statistics();
+    } catch (...) {
+        std::memset(stats, 0, sizeof(*stats));
+    }
+}
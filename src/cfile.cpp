@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <ciso646>
@@ -6,6 +7,15 @@
 #include <cstring>
 #include <limits>
 #include <memory>
+#include <string>
+
+#if !defined(_WIN32)
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <unistd.h>
+#endif
+
+#include <fmt/format.h>
 
 #include <lfp/protocol.hpp>
 #include <lfp/lfp.h>
@@ -29,14 +39,23 @@ public:
             std::int64_t len,
             std::int64_t* bytes_read)
         noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
 
+    bool concurrent_readat() const noexcept (true) override;
     int eof() const noexcept (false) override;
 
     void seek(std::int64_t) noexcept (false) override;
     std::int64_t tell() const noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
 
     lfp_protocol* peel() noexcept (false) override;
     lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
 
 private:
     struct del {
@@ -83,6 +102,72 @@ noexcept (false) {
         return LFP_OKINCOMPLETE;
 }
 
+/*
+ * Reading at an offset bypasses the FILE, and its buffer and lock, and reads
+ * the underlying descriptor directly with pread. The FILE is only ever read
+ * through this handle, so its buffer never holds bytes that are not in the
+ * file yet, as long as writes made before it was handed over are flushed,
+ * which is documented in lfp_cfile(). Like fd, a descriptor that would block
+ * gives an incomplete read, not an error.
+ */
+lfp_status cfile::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+#if defined(_WIN32)
+    (void)offset; (void)dst; (void)len; (void)bytes_read;
+    throw not_implemented("readat: not implemented for cfile on windows");
+#else
+    if (this->zero == -1)
+        throw not_supported(this->ftell_errmsg);
+
+    const auto fd = fileno(this->fp.get());
+    lfp_status status = LFP_OK;
+    std::int64_t n = 0;
+    while (n < len) {
+        const auto chunk = std::min(len - n, std::int64_t(1) << 30);
+        const auto res = ::pread(
+            fd,
+            advance(dst, n),
+            std::size_t(chunk),
+            off_t(this->zero + offset + n)
+        );
+
+        if (res > 0) {
+            n += res;
+            continue;
+        }
+
+        if (res == 0) {
+            status = LFP_EOF;
+            break;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN or errno == EWOULDBLOCK) {
+            status = LFP_OKINCOMPLETE;
+            break;
+        }
+
+        if (bytes_read)
+            *bytes_read = n;
+        throw io_error(std::strerror(errno));
+    }
+
+    if (bytes_read)
+        *bytes_read = n;
+    return status;
+#endif
+}
+
+bool cfile::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
 int cfile::eof() const noexcept (false) {
     return std::feof(this->fp.get());
 }
@@ -121,6 +206,28 @@ std::int64_t cfile::tell() const noexcept (false) {
     return off - this->zero;
 }
 
+/*
+ * Like readat, the size is taken from the underlying descriptor, which does
+ * not disturb the FILE.
+ */
+std::int64_t cfile::size() noexcept (false) {
+#if defined(_WIN32)
+    throw not_implemented("size: not implemented for cfile on windows");
+#else
+    if (this->zero == -1)
+        throw not_supported(this->ftell_errmsg);
+
+    struct stat st;
+    if (::fstat(fileno(this->fp.get()), &st) == -1)
+        throw io_error(std::strerror(errno));
+
+    if (not S_ISREG(st.st_mode))
+        throw not_supported("cfile: size: not a regular file");
+
+    return std::max(std::int64_t(st.st_size) - this->zero, std::int64_t(0));
+#endif
+}
+
 lfp_protocol* cfile::peel() noexcept (false) {
     throw lfp::leaf_protocol("peel: not supported for leaf protocol");
 }
@@ -129,6 +236,40 @@ lfp_protocol* cfile::peek() const noexcept (false) {
     throw lfp::leaf_protocol("peek: not supported for leaf protocol");
 }
 
+/*
+ * The duplicate needs a position of its own, so it cannot share the FILE, or
+ * a dup() of its descriptor, which shares the file offset. On linux, opening
+ * /proc/self/fd/N gives a new open file description for the same file, even
+ * if it has been renamed or unlinked since it was opened.
+ */
+lfp_protocol* cfile::dup() noexcept (false) {
+#if defined(__linux__)
+    if (this->zero == -1)
+        throw not_supported(this->ftell_errmsg);
+
+    const auto pos = std::ftell(this->fp.get());
+    if (pos == -1)
+        throw io_error(std::strerror(errno));
+
+    const auto path = fmt::format("/proc/self/fd/{}", fileno(this->fp.get()));
+    auto file = unique_file(std::fopen(path.c_str(), "rb"));
+    if (not file) {
+        const auto msg = "cfile: dup: unable to reopen file: {}";
+        throw not_supported(fmt::format(msg, std::strerror(errno)));
+    }
+
+    if (std::fseek(file.get(), pos, SEEK_SET))
+        throw io_error(std::strerror(errno));
+
+    auto* copy = new cfile(file.get());
+    file.release();
+    copy->zero = this->zero;
+    return copy;
+#else
+    throw not_implemented("dup: not implemented for cfile on this platform");
+#endif
+}
+
 }
 
 }
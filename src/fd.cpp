@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/fd.h>
+
+namespace lfp { namespace {
+
+/*
+ * A leaf protocol for POSIX file descriptors.
+ *
+ * Unlike cfile, there is no stdio buffer and no FILE lock - the position is
+ * kept by the protocol, and reads are pread()s straight into the caller's
+ * buffer. A seek is just an assignment, which matters as the layers above
+ * (tapeimage, rp66) seek on every record boundary.
+ *
+ * Descriptors that cannot seek (pipes, sockets) are read with read(), and
+ * seek and tell are not supported, like for cfile.
+ */
+class fd : public lfp_protocol {
+public:
+    explicit fd(int f);
+    ~fd() override;
+
+    void close() noexcept (false) override;
+    lfp_status readinto(
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t tell() const noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    int file = -1;
+    bool seekable;
+    bool end_of_file = false;
+
+    /*
+     * The absolute position in the file, and the position when opened, which
+     * is the start of the file as seen by lfp.
+     */
+    std::int64_t zero;
+    std::int64_t pos;
+    std::string lseek_errmsg;
+
+    /*
+     * Read len bytes from the absolute offset at, or just read() if the
+     * descriptor is not seekable. On errors, the number of bytes read before
+     * the error is written to nread before throwing.
+     */
+    lfp_status read_from(
+            std::int64_t at,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* nread)
+        const noexcept (false);
+};
+
+fd::fd(int f) : file(f) {
+    const auto off = ::lseek(f, 0, SEEK_CUR);
+    this->seekable = off != -1;
+    this->zero = this->seekable ? off : 0;
+    this->pos  = this->zero;
+
+    if (not this->seekable)
+        this->lseek_errmsg = std::strerror(errno);
+}
+
+fd::~fd() {
+    if (this->file != -1)
+        ::close(this->file);
+}
+
+void fd::close() noexcept (false) {
+    /*
+     * The descriptor will always be closed when the destructor is invoked,
+     * but when close is invoked directly, errors will be propagated
+     */
+    if (this->file == -1) return;
+    const auto err = ::close(this->file);
+    this->file = -1;
+
+    if (err)
+        throw runtime_error(std::strerror(errno));
+}
+
+lfp_status fd::read_from(
+        std::int64_t at,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* nread)
+const noexcept (false) {
+    assert(len >= 0);
+
+    /*
+     * A single read is capped at SSIZE_MAX bytes (and is sometimes shorter,
+     * e.g. on linux where reads are capped at ~2GB), so keep reading until the
+     * request is satisfied, the file is exhausted, or the descriptor would
+     * block.
+     */
+    constexpr auto max = std::int64_t(std::numeric_limits< ssize_t >::max());
+
+    lfp_status status = LFP_OK;
+    std::int64_t n = 0;
+    while (n < len) {
+        const auto chunk = std::size_t(std::min(len - n, max));
+        auto* p = advance(dst, n);
+        const auto res = this->seekable
+                       ? ::pread(this->file, p, chunk, off_t(at + n))
+                       : ::read(this->file, p, chunk);
+
+        if (res > 0) {
+            n += res;
+            continue;
+        }
+
+        if (res == 0) {
+            status = LFP_EOF;
+            break;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN or errno == EWOULDBLOCK) {
+            status = LFP_OKINCOMPLETE;
+            break;
+        }
+
+        *nread = n;
+        throw io_error(std::strerror(errno));
+    }
+
+    *nread = n;
+    return status;
+}
+
+lfp_status fd::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::int64_t n = 0;
+    lfp_status status;
+    try {
+        status = this->read_from(this->pos, dst, len, &n);
+    } catch (...) {
+        this->pos += n;
+        if (bytes_read)
+            *bytes_read = n;
+        throw;
+    }
+
+    this->pos += n;
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (status == LFP_EOF)
+        this->end_of_file = true;
+
+    return status;
+}
+
+lfp_status fd::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    if (not this->seekable)
+        throw not_supported(this->lseek_errmsg);
+
+    std::int64_t n = 0;
+    const auto status = this->read_from(this->zero + offset, dst, len, &n);
+    if (bytes_read)
+        *bytes_read = n;
+    return status;
+}
+
+bool fd::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
+int fd::eof() const noexcept (true) {
+    return this->end_of_file;
+}
+
+void fd::seek(std::int64_t n) noexcept (false) {
+    if (not this->seekable)
+        throw not_supported(this->lseek_errmsg);
+
+    if (n < 0) {
+        const auto msg = "fd: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    this->pos = this->zero + n;
+    this->end_of_file = false;
+}
+
+std::int64_t fd::tell() const noexcept (false) {
+    if (not this->seekable)
+        throw not_supported(this->lseek_errmsg);
+
+    return this->pos - this->zero;
+}
+
+/*
+ * The size is only known for regular files, and only from the file system.
+ * Where the descriptor was when opened is the start of the file.
+ */
+std::int64_t fd::size() noexcept (false) {
+    if (not this->seekable)
+        throw not_supported(this->lseek_errmsg);
+
+    struct stat st;
+    if (::fstat(this->file, &st) == -1)
+        throw io_error(std::strerror(errno));
+
+    if (not S_ISREG(st.st_mode)) {
+        const auto msg = "fd: size: descriptor (= {}) is not a regular file";
+        throw not_supported(fmt::format(msg, this->file));
+    }
+
+    return std::max(std::int64_t(st.st_size) - this->zero, std::int64_t(0));
+}
+
+lfp_protocol* fd::peel() noexcept (false) {
+    throw lfp::leaf_protocol("peel: not supported for leaf protocol");
+}
+
+lfp_protocol* fd::peek() const noexcept (false) {
+    throw lfp::leaf_protocol("peek: not supported for leaf protocol");
+}
+
+/*
+ * A dup()ed descriptor shares the file offset with the original, but since
+ * the position is kept by the protocol, and reads are preads, the duplicate
+ * is still independent. Streams can only be read with read(), so the
+ * duplicate would steal bytes from the original.
+ */
+lfp_protocol* fd::dup() noexcept (false) {
+    if (not this->seekable)
+        throw not_supported(this->lseek_errmsg);
+
+    const auto f = ::dup(this->file);
+    if (f == -1)
+        throw io_error(std::strerror(errno));
+
+    fd* copy;
+    try {
+        copy = new fd(f);
+    } catch (...) {
+        ::close(f);
+        throw;
+    }
+
+    copy->zero = this->zero;
+    copy->pos = this->pos;
+    copy->end_of_file = this->end_of_file;
+    return copy;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_fd_open(int f) {
+    if (f < 0) return nullptr;
+
+    try {
+        return new lfp::fd(f);
+    } catch (...) {
+        return nullptr;
+    }
+}
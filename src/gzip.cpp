@@ -0,0 +1,855 @@
+#include <algorithm>
+#include <cassert>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include <fmt/format.h>
+#include <zlib.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/gzip.h>
+
+namespace lfp { namespace {
+
+constexpr std::int64_t default_span = 1024 * 1024;
+constexpr std::size_t input_size = 64 * 1024;
+constexpr std::size_t window_size = 32 * 1024;
+
+/* zlib's window bits for raw deflate, and for automatic gzip/zlib detection */
+constexpr int raw_deflate = -15;
+constexpr int wrapped = 15 + 32;
+
+/* the sizes of the gzip (crc32, isize) and zlib (adler32) trailers */
+constexpr int gzip_trailer = 8;
+constexpr int zlib_trailer = 4;
+
+/*
+ * An access point is a place in the compressed stream, at a deflate block
+ * boundary, where decompression can start. The block might start in the
+ * middle of a byte, in which case the high bits of the byte before in belong
+ * to it. A block can refer to up to 32 KiB of output before it, so that is
+ * kept too.
+ */
+struct access_point {
+    std::int64_t out;
+    std::int64_t in;
+    int bits;
+    std::vector< unsigned char > window;
+};
+
+struct inflater {
+    z_stream strm;
+    bool initialised = false;
+
+    inflater() noexcept (true) {
+        std::memset(&this->strm, 0, sizeof(this->strm));
+    }
+
+    ~inflater() {
+        if (this->initialised)
+            inflateEnd(&this->strm);
+    }
+
+    void init() noexcept (false) {
+        if (inflateInit2(&this->strm, wrapped) != Z_OK)
+            throw runtime_error("gzip: unable to initialise zlib");
+        this->initialised = true;
+    }
+};
+
+/*
+ * Decompress a gzip or zlib stream, recording access points along the way,
+ * like zlib's zran example.
+ *
+ * The decoder produces the uncompressed bytes from out, and is always
+ * decompressing contiguously from an access point, or from the start. The
+ * index is complete up to the frontier, the furthest offset that has been
+ * decompressed. Decompressing past the frontier adds access points, and
+ * decompressing below it never does, since the block boundaries are the same
+ * every time.
+ *
+ * Decompressing from an access point is raw deflate, so the trailers, and the
+ * headers of the following gzip members, are handled here.
+ */
+class gzip : public lfp_protocol {
+public:
+    gzip(lfp_protocol*, std::int64_t span);
+
+    /*
+     * Make a duplicate of other on top of f, which is a duplicate of the
+     * underlying handle of other. The access points are copied, and the
+     * decoder starts from scratch.
+     */
+    gzip(lfp_protocol* f, const gzip& other);
+
+    void close() noexcept (false) override;
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+    std::int64_t tell() const noexcept (true) override;
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+    void build_index() noexcept (false);
+    std::int64_t index_size() const noexcept (false);
+    void dump_index(void* dst, std::int64_t len) const noexcept (false);
+    void load_index(const void* src, std::int64_t len) noexcept (false);
+
+private:
+    unique_lfp fp;
+    inflater z;
+    std::int64_t span;
+
+    /* the offset of the compressed stream in the underlying handle */
+    std::int64_t base = 0;
+    /* the (compressed) offset the underlying handle is at */
+    std::int64_t in_pos = 0;
+    bool in_eof = false;
+    bool zlib_wrapped = false;
+    std::vector< unsigned char > input;
+    std::vector< unsigned char > scratch;
+
+    /* the decoder was started from an access point, i.e. is raw deflate */
+    bool raw = false;
+    bool finished = false;
+    std::int64_t out = 0;
+
+    std::vector< access_point > points;
+    std::int64_t frontier = 0;
+    /* the uncompressed size, if the end has been seen, or -1 */
+    std::int64_t total = -1;
+
+    std::int64_t pos = 0;
+
+    /*
+     * Guards the decoder, the underlying handle, and the access points, which
+     * are all moved by a read, so that readat can be called from multiple
+     * threads. The reads are serialised, and still restart the decoder when
+     * the threads read far apart - dup is better for parallel reads. The
+     * index functions take it too, as the access points may grow under them.
+     */
+    mutable std::mutex decoder;
+
+    lfp_status refill() noexcept (false);
+    void fill_at_least(std::size_t n) noexcept (false);
+    void consume(std::size_t n) noexcept (false);
+    void start() noexcept (false);
+    void restore(const access_point&) noexcept (false);
+    void add_point() noexcept (false);
+    void end_of_member() noexcept (false);
+    lfp_status decompress(void* dst, std::int64_t len, std::int64_t* n)
+        noexcept (false);
+    lfp_status position(std::int64_t n) noexcept (false);
+    lfp_status read_from(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* n)
+        noexcept (false);
+};
+
+gzip::gzip(lfp_protocol* f, std::int64_t s) :
+    fp(f),
+    span(s)
+{
+    try {
+        try {
+            this->base = this->fp->tell();
+        } catch (const lfp::error& e) {
+            /* pipes are fine, as long as there are no backwards seeks */
+            if (e.status() != LFP_NOTSUPPORTED)
+                throw;
+        }
+
+        this->input.resize(input_size);
+        this->scratch.resize(input_size);
+        this->z.init();
+
+        this->fill_at_least(2);
+        const auto* b = this->z.strm.next_in;
+        const auto is_gzip = this->z.strm.avail_in >= 2
+                         and b[0] == 0x1F
+                         and b[1] == 0x8B;
+        const auto is_zlib = this->z.strm.avail_in >= 2
+                         and (b[0] & 0x0F) == Z_DEFLATED
+                         and (b[0] * 256 + b[1]) % 31 == 0;
+
+        if (not is_gzip and not is_zlib)
+            throw protocol_fatal("gzip: not a gzip or zlib stream");
+        this->zlib_wrapped = is_zlib;
+    } catch (...) {
+        /*
+         * The caller still owns the underlying handle if the constructor
+         * fails, so don't close it
+         */
+        this->fp.release();
+        throw;
+    }
+}
+
+gzip::gzip(lfp_protocol* f, const gzip& other) :
+    fp(f),
+    span(other.span),
+    base(other.base),
+    zlib_wrapped(other.zlib_wrapped),
+    points(other.points),
+    frontier(other.frontier),
+    total(other.total),
+    pos(other.pos)
+{
+    try {
+        this->input.resize(input_size);
+        this->scratch.resize(input_size);
+        this->z.init();
+        this->start();
+    } catch (...) {
+        this->fp.release();
+        throw;
+    }
+}
+
+void gzip::close() noexcept (false) {
+    if (not this->fp) return;
+    this->fp.close();
+}
+
+/*
+ * Read more compressed input into the input buffer, after what is not yet
+ * consumed.
+ */
+lfp_status gzip::refill() noexcept (false) {
+    if (this->in_eof)
+        return LFP_EOF;
+
+    auto& strm = this->z.strm;
+    const auto left = std::size_t(strm.avail_in);
+    if (left > 0 and strm.next_in != this->input.data())
+        std::memmove(this->input.data(), strm.next_in, left);
+
+    std::int64_t n;
+    const auto err = this->fp->readinto(
+        this->input.data() + left,
+        std::int64_t(this->input.size() - left),
+        &n
+    );
+    this->in_pos += n;
+    strm.next_in = this->input.data();
+    strm.avail_in = uInt(left + n);
+    this->in_eof = err == LFP_EOF;
+    return err;
+}
+
+void gzip::fill_at_least(std::size_t n) noexcept (false) {
+    while (this->z.strm.avail_in < n and not this->in_eof)
+        this->refill();
+}
+
+void gzip::consume(std::size_t n) noexcept (false) {
+    this->fill_at_least(n);
+    if (this->z.strm.avail_in < n)
+        throw unexpected_eof("gzip: compressed stream is truncated");
+
+    this->z.strm.next_in += n;
+    this->z.strm.avail_in -= uInt(n);
+}
+
+void gzip::start() noexcept (false) {
+    /* the input buffer might still hold the start, e.g. right after open */
+    const auto buffered = this->z.strm.avail_in;
+    const auto at_start = this->in_pos == std::int64_t(buffered)
+                      and this->z.strm.next_in == this->input.data();
+
+    if (not at_start) {
+        this->fp->seek(this->base);
+        this->in_pos = 0;
+        this->in_eof = false;
+        this->z.strm.next_in = this->input.data();
+        this->z.strm.avail_in = 0;
+    }
+
+    if (inflateReset2(&this->z.strm, wrapped) != Z_OK)
+        throw runtime_error("gzip: unable to reset zlib");
+
+    this->raw = false;
+    this->finished = false;
+    this->out = 0;
+}
+
+void gzip::restore(const access_point& point) noexcept (false) {
+    auto& strm = this->z.strm;
+    if (inflateReset2(&strm, raw_deflate) != Z_OK)
+        throw runtime_error("gzip: unable to reset zlib");
+
+    const auto from = point.in - (point.bits ? 1 : 0);
+    this->fp->seek(this->base + from);
+    this->in_pos = from;
+    this->in_eof = false;
+    strm.next_in = this->input.data();
+    strm.avail_in = 0;
+
+    if (point.bits) {
+        this->fill_at_least(1);
+        if (strm.avail_in < 1)
+            throw unexpected_eof("gzip: compressed stream is truncated");
+        const auto byte = int(strm.next_in[0]);
+        this->consume(1);
+        inflatePrime(&strm, point.bits, byte >> (8 - point.bits));
+    }
+
+    if (not point.window.empty()) {
+        const auto err = inflateSetDictionary(
+            &strm,
+            point.window.data(),
+            uInt(point.window.size())
+        );
+        if (err != Z_OK)
+            throw runtime_error("gzip: unable to restore access point");
+    }
+
+    this->raw = true;
+    this->finished = false;
+    this->out = point.out;
+}
+
+void gzip::add_point() noexcept (false) {
+    auto& strm = this->z.strm;
+    access_point point;
+    point.out  = this->out;
+    point.in   = this->in_pos - std::int64_t(strm.avail_in);
+    point.bits = strm.data_type & 7;
+
+    point.window.resize(window_size);
+    uInt len = uInt(window_size);
+    if (inflateGetDictionary(&strm, point.window.data(), &len) != Z_OK)
+        throw runtime_error("gzip: unable to get the decompression window");
+    point.window.resize(len);
+    point.window.shrink_to_fit();
+
+    this->points.push_back(std::move(point));
+}
+
+void gzip::end_of_member() noexcept (false) {
+    /*
+     * zlib checks and consumes the trailer when it has seen the header, but
+     * when decompressing from an access point, it is raw deflate.
+     */
+    if (this->raw)
+        this->consume(this->zlib_wrapped ? zlib_trailer : gzip_trailer);
+
+    this->fill_at_least(2);
+    const auto& strm = this->z.strm;
+    const auto another = not this->zlib_wrapped
+                     and strm.avail_in >= 2
+                     and strm.next_in[0] == 0x1F
+                     and strm.next_in[1] == 0x8B;
+
+    if (another) {
+        if (inflateReset2(&this->z.strm, wrapped) != Z_OK)
+            throw runtime_error("gzip: unable to reset zlib");
+        this->raw = false;
+        return;
+    }
+
+    this->finished = true;
+    this->total = this->out;
+}
+
+lfp_status gzip::decompress(void* dst, std::int64_t len, std::int64_t* n)
+noexcept (false) {
+    constexpr auto max_chunk = std::int64_t(1) << 30;
+    auto& strm = this->z.strm;
+
+    *n = 0;
+    while (*n < len) {
+        if (this->finished)
+            return LFP_EOF;
+
+        if (strm.avail_in == 0) {
+            if (this->in_eof)
+                throw unexpected_eof("gzip: compressed stream is truncated");
+
+            const auto err = this->refill();
+            if (strm.avail_in == 0 and err == LFP_OKINCOMPLETE)
+                return LFP_OKINCOMPLETE;
+            continue;
+        }
+
+        const auto want = std::min(len - *n, max_chunk);
+        strm.next_out = static_cast< Bytef* >(advance(dst, *n));
+        strm.avail_out = uInt(want);
+
+        const auto ret = inflate(&strm, Z_BLOCK);
+        const auto k = want - std::int64_t(strm.avail_out);
+        *n += k;
+        this->out += k;
+
+        switch (ret) {
+            case Z_OK:
+            case Z_BUF_ERROR:
+                break;
+
+            case Z_STREAM_END:
+                this->end_of_member();
+                break;
+
+            case Z_MEM_ERROR:
+                throw runtime_error("gzip: out of memory");
+
+            default: {
+                const auto msg = "gzip: corrupt compressed stream at "
+                                 "(uncompressed) offset {}: {}";
+                const auto* what = strm.msg ? strm.msg : "unknown error";
+                throw protocol_fatal(fmt::format(msg, this->out, what));
+            }
+        }
+
+        /*
+         * At a block boundary, that is not the end of the stream. A point
+         * is always recorded at the start, so that decompression can start
+         * there after a seek, without re-reading the header.
+         */
+        const auto boundary = ret == Z_OK
+                          and (strm.data_type & 128)
+                          and not (strm.data_type & 64);
+        const auto far_enough = this->points.empty()
+                             or this->out - this->points.back().out >= this->span;
+        if (boundary and far_enough and this->out >= this->frontier)
+            this->add_point();
+
+        this->frontier = std::max(this->frontier, this->out);
+    }
+
+    return LFP_OK;
+}
+
+/*
+ * Move the decoder to the uncompressed offset n, from the closest access
+ * point before it, unless the decoder is already between it and n.
+ */
+lfp_status gzip::position(std::int64_t n) noexcept (false) {
+    if (this->out == n)
+        return LFP_OK;
+
+    const auto after = std::upper_bound(
+        this->points.begin(),
+        this->points.end(),
+        n,
+        [](std::int64_t x, const access_point& p) { return x < p.out; }
+    );
+
+    const auto closest = after == this->points.begin()
+                       ? this->points.end()
+                       : std::prev(after);
+
+    const auto behind = n < this->out;
+    const auto skippable = closest != this->points.end()
+                       and closest->out > this->out;
+
+    if (behind or skippable) {
+        if (closest == this->points.end())
+            this->start();
+        else
+            this->restore(*closest);
+    }
+
+    while (this->out < n) {
+        const auto len = std::min(
+            n - this->out,
+            std::int64_t(this->scratch.size())
+        );
+        std::int64_t k;
+        const auto err = this->decompress(this->scratch.data(), len, &k);
+        if (err != LFP_OK)
+            return err;
+    }
+
+    return LFP_OK;
+}
+
+lfp_status gzip::read_from(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* n)
+noexcept (false) {
+    *n = 0;
+    const auto err = this->position(offset);
+    if (err != LFP_OK)
+        return err;
+    return this->decompress(dst, len, n);
+}
+
+lfp_status gzip::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->decoder);
+    std::int64_t n = 0;
+    const auto err = this->read_from(this->pos, dst, len, &n);
+
+    this->pos += n;
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+/*
+ * The decoder is moved to offset like for a read, but the read position is
+ * left alone. The decoder is left where the read ended, which is fine, since
+ * it is moved to the read position before every read anyway.
+ */
+lfp_status gzip::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->decoder);
+    std::int64_t n = 0;
+    const auto err = this->read_from(offset, dst, len, &n);
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+/* the reads are serialised on the decoder lock */
+bool gzip::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
+int gzip::eof() const noexcept (true) {
+    return this->total >= 0 and this->pos >= this->total;
+}
+
+std::int64_t gzip::tell() const noexcept (true) {
+    return this->pos;
+}
+
+void gzip::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "gzip: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    /*
+     * Seeks are lazy, since nothing but decompressing up to n tells if it is
+     * in the file, and reads past the end report EOF anyway.
+     */
+    this->pos = n;
+}
+
+/*
+ * The size in the gzip trailer is modulo 4 GiB, and only covers the last
+ * member, so the only way to know is to decompress to the end. That builds
+ * the index too, so it is only done once, and never when the index is loaded.
+ */
+std::int64_t gzip::size() noexcept (false) {
+    this->build_index();
+    return this->total;
+}
+
+lfp_protocol* gzip::peel() noexcept (false) {
+    assert(this->fp);
+    return this->fp.release();
+}
+
+lfp_protocol* gzip::peek() const noexcept (false) {
+    assert(this->fp);
+    return this->fp.get();
+}
+
+lfp_protocol* gzip::dup() noexcept (false) {
+    assert(this->fp);
+    std::lock_guard< std::mutex > guard(this->decoder);
+    unique_lfp inner(this->fp->dup());
+    auto* copy = new gzip(inner.get(), *this);
+    inner.release();
+    return copy;
+}
+
+void gzip::build_index() noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->decoder);
+    const auto end = std::numeric_limits< std::int64_t >::max();
+    while (this->total < 0)
+        this->position(end);
+}
+
+namespace index_format {
+
+constexpr const unsigned char magic[] = { 'L', 'G', 'Z', 'X' };
+constexpr const std::uint32_t version = 1;
+constexpr const std::int64_t preamble = 4 + 4 + 4 + 8 + 8 + 8 + 8 + 8;
+constexpr const std::int64_t entry = 8 + 8 + 4 + 4;
+
+template < typename T >
+unsigned char* put(unsigned char* dst, T x) noexcept (true) {
+    std::memcpy(dst, &x, sizeof(x));
+    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        std::reverse(dst, dst + sizeof(x));
+    #endif
+    return dst + sizeof(x);
+}
+
+template < typename T >
+const unsigned char* get(const unsigned char* src, T& x) noexcept (true) {
+    unsigned char b[sizeof(x)];
+    std::memcpy(b, src, sizeof(x));
+    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        std::reverse(b, b + sizeof(x));
+    #endif
+    std::memcpy(&x, b, sizeof(x));
+    return src + sizeof(x);
+}
+
+std::int64_t size(const std::vector< access_point >& points)
+noexcept (true) {
+    auto size = preamble;
+    for (const auto& point : points)
+        size += entry + std::int64_t(point.window.size());
+    return size;
+}
+
+}
+
+std::int64_t gzip::index_size() const noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->decoder);
+    return index_format::size(this->points);
+}
+
+void gzip::dump_index(void* dst, std::int64_t len) const noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->decoder);
+    const auto size = index_format::size(this->points);
+    if (len < size) {
+        const auto msg = "gzip: index_dump: len (= {}) < index size (= {})";
+        throw invalid_args(fmt::format(msg, len, size));
+    }
+
+    auto* p = static_cast< unsigned char* >(dst);
+    std::memcpy(p, index_format::magic, sizeof(index_format::magic));
+    p += sizeof(index_format::magic);
+    p = index_format::put(p, index_format::version);
+    p = index_format::put(p, std::uint32_t(this->zlib_wrapped));
+    p = index_format::put(p, this->base);
+    p = index_format::put(p, this->span);
+    p = index_format::put(p, this->frontier);
+    p = index_format::put(p, this->total);
+    p = index_format::put(p, std::int64_t(this->points.size()));
+
+    for (const auto& point : this->points) {
+        p = index_format::put(p, point.out);
+        p = index_format::put(p, point.in);
+        p = index_format::put(p, std::uint32_t(point.bits));
+        p = index_format::put(p, std::uint32_t(point.window.size()));
+        if (not point.window.empty())
+            std::memcpy(p, point.window.data(), point.window.size());
+        p += point.window.size();
+    }
+}
+
+void gzip::load_index(const void* src, std::int64_t len) noexcept (false) {
+    const auto* p = static_cast< const unsigned char* >(src);
+    const auto* end = p + len;
+
+    if (len < index_format::preamble) {
+        const auto msg = "gzip: index_load: len (= {}) too small for "
+                         "index preamble";
+        throw invalid_args(fmt::format(msg, len));
+    }
+
+    if (not std::equal(p, p + 4, index_format::magic))
+        throw invalid_args("gzip: index_load: not a gzip index");
+    p += sizeof(index_format::magic);
+
+    std::uint32_t version;
+    std::uint32_t zlib;
+    std::int64_t base;
+    std::int64_t span;
+    std::int64_t frontier;
+    std::int64_t size;
+    std::int64_t count;
+    p = index_format::get(p, version);
+    p = index_format::get(p, zlib);
+    p = index_format::get(p, base);
+    p = index_format::get(p, span);
+    p = index_format::get(p, frontier);
+    p = index_format::get(p, size);
+    p = index_format::get(p, count);
+
+    if (version != index_format::version) {
+        const auto msg = "gzip: index_load: unsupported version {}";
+        throw invalid_args(fmt::format(msg, version));
+    }
+
+    if (base != this->base) {
+        const auto msg = "gzip: index_load: index base (= {}) does not "
+                         "match handle base (= {})";
+        throw invalid_args(fmt::format(msg, base, this->base));
+    }
+
+    const auto consistent = (zlib != 0) == this->zlib_wrapped
+                        and span > 0
+                        and frontier >= 0
+                        and (size == -1 or size == frontier)
+                        and count >= 0
+                        and count <= (end - p) / index_format::entry;
+    if (not consistent)
+        throw invalid_args("gzip: index_load: index preamble is corrupt");
+
+    /*
+     * Decode and sanity check all access points before touching the index,
+     * so that a broken index leaves the handle untouched
+     */
+    std::vector< access_point > loaded;
+    loaded.reserve(count);
+    for (std::int64_t i = 0; i < count; ++i) {
+        if (end - p < index_format::entry) {
+            const auto msg = "gzip: index_load: access point {} is truncated";
+            throw invalid_args(fmt::format(msg, i));
+        }
+
+        access_point point;
+        std::uint32_t bits;
+        std::uint32_t window;
+        p = index_format::get(p, point.out);
+        p = index_format::get(p, point.in);
+        p = index_format::get(p, bits);
+        p = index_format::get(p, window);
+        point.bits = int(bits);
+
+        const auto ordered = loaded.empty()
+                          or (point.out > loaded.back().out
+                              and point.in > loaded.back().in);
+
+        if (not ordered
+                or point.out > frontier
+                or point.in < 0
+                or bits > 7
+                or window > window_size
+                or std::int64_t(window) > point.out
+                or std::int64_t(window) > end - p) {
+            const auto msg = "gzip: index_load: access point {} is corrupt";
+            throw invalid_args(fmt::format(msg, i));
+        }
+
+        point.window.assign(p, p + window);
+        p += window;
+        loaded.push_back(std::move(point));
+    }
+
+    std::lock_guard< std::mutex > guard(this->decoder);
+    if (frontier <= this->frontier)
+        return;
+
+    this->points.swap(loaded);
+    this->span = span;
+    this->frontier = frontier;
+    this->total = size;
+}
+
+gzip& as_gzip(lfp_protocol* f) noexcept (false) {
+    auto* gz = dynamic_cast< gzip* >(f);
+    if (not gz)
+        throw invalid_args("handle is not a gzip protocol");
+    return *gz;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_gzip_open(lfp_protocol* f, std::int64_t span) {
+    if (not f) return nullptr;
+    if (span < 0) return nullptr;
+    if (span == 0) span = lfp::default_span;
+
+    try {
+        return new lfp::gzip(f, span);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+int lfp_gzip_index_build(lfp_protocol* f) try {
+    assert(f);
+    lfp::as_gzip(f).build_index();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_gzip_index_size(lfp_protocol* f, std::int64_t* size) try {
+    assert(f);
+    assert(size);
+    *size = lfp::as_gzip(f).index_size();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_gzip_index_dump(lfp_protocol* f, void* dst, std::int64_t len) try {
+    assert(f);
+    assert(dst);
+    lfp::as_gzip(f).dump_index(dst, len);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_gzip_index_load(lfp_protocol* f, const void* src, std::int64_t len)
+try {
+    assert(f);
+    assert(src);
+    lfp::as_gzip(f).load_index(src, len);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cassert>
 #include <ciso646>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
 #include <fmt/format.h>
 
@@ -45,6 +48,125 @@ int lfp_readinto(lfp_protocol* f,
     return LFP_UNHANDLED_EXCEPTION;
 }
 
+int lfp_readat(lfp_protocol* f,
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* nread) try {
+    assert(dst);
+    assert(f);
+
+    if (offset < 0) {
+        const auto msg = "expected offset (which is {}) >= 0";
+        f->errmsg(fmt::format(msg, offset));
+        return LFP_INVALID_ARGS;
+    }
+
+    if (len < 0) {
+        f->errmsg(fmt::format("expected len (which is {}) >= 0", len));
+        return LFP_INVALID_ARGS;
+    }
+
+    return f->readat(offset, dst, len, nread);
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_readv_at(lfp_protocol* f, lfp_range* ranges, std::int64_t n) try {
+    assert(f);
+
+    if (n < 0) {
+        f->errmsg(fmt::format("expected n (which is {}) >= 0", n));
+        return LFP_INVALID_ARGS;
+    }
+
+    assert(ranges or n == 0);
+    for (std::int64_t i = 0; i < n; ++i) {
+        const auto& r = ranges[i];
+        if (r.offset < 0) {
+            const auto msg = "expected ranges[{}].offset (which is {}) >= 0";
+            f->errmsg(fmt::format(msg, i, r.offset));
+            return LFP_INVALID_ARGS;
+        }
+
+        if (r.len < 0) {
+            const auto msg = "expected ranges[{}].len (which is {}) >= 0";
+            f->errmsg(fmt::format(msg, i, r.len));
+            return LFP_INVALID_ARGS;
+        }
+
+        assert(r.dst or r.len == 0);
+    }
+
+    for (std::int64_t i = 0; i < n; ++i)
+        ranges[i].nread = 0;
+
+    return f->readv_at(ranges, n);
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_borrow(lfp_protocol* f,
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail) try {
+    assert(ptr);
+    assert(f);
+
+    if (len < 0) {
+        f->errmsg(fmt::format("expected len (which is {}) >= 0", len));
+        return LFP_INVALID_ARGS;
+    }
+
+    std::int64_t n;
+    const auto err = f->borrow(len, ptr, &n);
+    if (avail)
+        *avail = n;
+    return err;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_release(lfp_protocol* f) try {
+    assert(f);
+    f->release();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
 int lfp_seek(lfp_protocol* f, std::int64_t n) try {
     assert(f);
 
@@ -84,6 +206,23 @@ int lfp_tell(lfp_protocol* f, std::int64_t* n) try {
     return LFP_UNHANDLED_EXCEPTION;
 }
 
+int lfp_size(lfp_protocol* f, std::int64_t* n) try {
+    assert(n);
+    assert(f);
+    *n = f->size();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
 int lfp_peel(lfp_protocol* outer, lfp_protocol** inner) try {
     assert(outer);
     assert(inner);
@@ -118,6 +257,24 @@ int lfp_peek(lfp_protocol* outer, lfp_protocol** inner) try {
     return e.status();
 }
 
+int lfp_dup(lfp_protocol* f, lfp_protocol** dup) try {
+    assert(f);
+    assert(dup);
+
+    *dup = f->dup();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
 int lfp_eof(lfp_protocol* f) {
     assert(f);
     return f->eof();
@@ -130,6 +287,98 @@ const char* lfp_errormsg(lfp_protocol* f) try {
     return nullptr;
 }
 
+lfp_status lfp_protocol::readat(std::int64_t, void*, std::int64_t, std::int64_t*)
+noexcept (false) {
+    throw lfp::not_implemented("readat: not implemented for layer");
+}
+
+namespace {
+
+/*
+ * Ranges that are less than max_gap bytes apart are read with a single read,
+ * and the bytes between them are thrown away. For most files, reading a few
+ * extra bytes is a lot cheaper than another read, e.g. skipping the record
+ * headers between the record bodies in tapeimage files.
+ *
+ * Merged ranges are read into a buffer, and copied out, so don't merge more
+ * than max_span bytes.
+ */
+constexpr std::int64_t readv_max_gap = 4096;
+constexpr std::int64_t readv_max_span = 1024 * 1024;
+
+}
+
+lfp_status lfp_protocol::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    auto order = std::vector< lfp_range* >();
+    for (std::int64_t i = 0; i < n; ++i) {
+        if (ranges[i].len > 0)
+            order.push_back(ranges + i);
+    }
+
+    const auto by_offset = [](const lfp_range* a, const lfp_range* b) {
+        return a->offset < b->offset;
+    };
+    std::sort(order.begin(), order.end(), by_offset);
+
+    auto eof = false;
+    auto incomplete = false;
+    const auto update = [&](const lfp_range& r, lfp_status err) {
+        if (r.nread == r.len)
+            return;
+
+        if (err == LFP_EOF)
+            eof = true;
+        else
+            incomplete = true;
+    };
+
+    auto buffer = std::vector< unsigned char >();
+    std::size_t i = 0;
+    while (i < order.size()) {
+        const auto begin = order[i]->offset;
+        auto end = begin + order[i]->len;
+        auto j = i + 1;
+        for (; j < order.size(); ++j) {
+            const auto& next = *order[j];
+            const auto merged = std::max(end, next.offset + next.len);
+            if (next.offset - end > readv_max_gap)
+                break;
+            if (merged - begin > readv_max_span)
+                break;
+            end = merged;
+        }
+
+        if (j == i + 1) {
+            auto& r = *order[i];
+            const auto err = this->readat(r.offset, r.dst, r.len, &r.nread);
+            update(r, err);
+            i = j;
+            continue;
+        }
+
+        buffer.resize(end - begin);
+        std::int64_t m;
+        const auto err = this->readat(begin, buffer.data(), end - begin, &m);
+        for (; i < j; ++i) {
+            auto& r = *order[i];
+            const auto avail = begin + m - r.offset;
+            r.nread = std::max(std::int64_t(0), std::min(r.len, avail));
+            const auto src = buffer.data() + (r.offset - begin);
+            std::memcpy(r.dst, src, r.nread);
+            update(r, err);
+        }
+    }
+
+    if (eof)
+        return LFP_EOF;
+
+    if (incomplete)
+        return LFP_OKINCOMPLETE;
+
+    return LFP_OK;
+}
+
 void lfp_protocol::seek(std::int64_t) noexcept (false) {
     throw lfp::not_implemented("seek: not implemented for layer");
 }
@@ -138,6 +387,37 @@ std::int64_t lfp_protocol::tell() const noexcept (false) {
     throw lfp::not_implemented("tell: not implemented for layer");
 }
 
+std::int64_t lfp_protocol::size() noexcept (false) {
+    throw lfp::not_implemented("size: not implemented for layer");
+}
+
+lfp_status lfp_protocol::borrow(
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail)
+noexcept (false) {
+    if (std::int64_t(this->borrowed.size()) < len)
+        this->borrowed.resize(len);
+
+    const auto err = this->readinto(this->borrowed.data(), len, avail);
+    *ptr = this->borrowed.data();
+    return err;
+}
+
+void lfp_protocol::release() noexcept (false) {}
+
+bool lfp_protocol::lends() const noexcept (true) {
+    return false;
+}
+
+bool lfp_protocol::concurrent_readat() const noexcept (true) {
+    return false;
+}
+
+lfp_protocol* lfp_protocol::dup() noexcept (false) {
+    throw lfp::not_implemented("dup: not implemented for layer");
+}
+
 const char* lfp_protocol::errmsg() noexcept (true) {
     if (this->error_message.empty())
         return nullptr;
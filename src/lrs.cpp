@@ -0,0 +1,669 @@
+#include <algorithm>
+#include <cassert>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/rp66.h>
+
+namespace lfp { namespace {
+
+/*
+ * A Logical Record Segment (LRS), as found in the index. Segments are fully
+ * described by the header, except the size of the padding and the encryption
+ * packet, which are stored in the segment, so the extent of the body is
+ * resolved when the segment is indexed.
+ */
+struct segment {
+    /*
+     * Offset of the segment header in the underlying file
+     */
+    std::int64_t offset;
+
+    std::uint16_t length;
+    std::uint8_t  attributes;
+    std::uint8_t  type;
+
+    /*
+     * The body, relative to the start of the segment
+     */
+    std::int64_t body_begin;
+    std::int64_t body_end;
+
+    static constexpr const int size = 4;
+
+    /*
+     * Segment attribute bits, as defined by rp66v1. The remaining bits
+     * (logical record structure, predecessor, successor, encryption) do not
+     * affect the layout of the segment.
+     */
+    static constexpr const std::uint8_t encryption_packet = 1 << 3;
+    static constexpr const std::uint8_t checksum          = 1 << 2;
+    static constexpr const std::uint8_t trailing_length   = 1 << 1;
+    static constexpr const std::uint8_t padding           = 1 << 0;
+};
+
+/*
+ * The Logical Record Segment protocol strips segment headers, encryption
+ * packets, padding, checksums and trailing lengths, and presents the segment
+ * bodies as one contiguous stream. It is usually stacked on top of rp66, which
+ * removes the Visible Envelope.
+ *
+ * Segments are short (at most 64k), and the size of the padding is only known
+ * after reading the end of the segment, so whole segments are read into a
+ * buffer, and reads are served from it. The header of the next segment is
+ * read together with the segment, so that reading front to back costs a
+ * single read per segment, and no seeks. Segments are indexed as they are
+ * read, the same way rp66 indexes Visible Records, and seeks into the index
+ * are immediate. Only readat reads bodies straight from the underlying file.
+ */
+class lrs : public lfp_protocol {
+public:
+    lrs(lfp_protocol*);
+    lrs(lfp_protocol*, const lrs&);
+
+    void close() noexcept (false) override;
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+
+    int eof() const noexcept (true) override;
+    std::int64_t tell() const noexcept (true) override;
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    unique_lfp fp;
+    std::int64_t base;
+
+    /*
+     * The segments read so far, and the logical end offset of every segment
+     * body, for looking up logical offsets with a binary search.
+     */
+    std::vector< segment > index;
+    std::vector< std::int64_t > ends;
+
+    /*
+     * The read head - the current segment, and the number of bytes left of
+     * its body. Before the first segment is read, current is -1.
+     */
+    std::int64_t current = -1;
+    std::int64_t remaining = 0;
+    bool end_of_file = false;
+
+    /*
+     * The contents of the segment loaded, without the header, and the
+     * physical position of the underlying file.
+     */
+    std::vector< unsigned char > buffer;
+    std::int64_t loaded = -1;
+    mutable std::int64_t inner_pos;
+
+    /*
+     * The header of the segment at ahead_offset, which was read together with
+     * the segment before it. If the file ended before the header did, then
+     * ahead_n < segment::size, and ahead_eof is set.
+     */
+    unsigned char ahead[segment::size];
+    std::int64_t ahead_offset = -1;
+    std::int64_t ahead_n = 0;
+    bool ahead_eof = false;
+
+    std::int64_t readinto(void* dst, std::int64_t) noexcept (false);
+
+    /*
+     * Read and index the segment following the last one indexed. Sets
+     * end_of_file, and does not add to the index, if there are no more
+     * segments.
+     */
+    void read_segment_from_disk() noexcept (false);
+
+    /*
+     * Index segments until the logical offset n is covered, or the file
+     * ends.
+     */
+    void index_to(std::int64_t n) noexcept (false);
+
+    /*
+     * Read the already-indexed segment i into the buffer, unless it is
+     * already loaded.
+     */
+    void load(std::int64_t i) noexcept (false);
+
+    /*
+     * Read at least len, and at most len + extra, bytes from the physical
+     * offset pos. Throws if fewer than len bytes could be read.
+     */
+    lfp_status read_at(
+            std::int64_t pos,
+            void* dst,
+            std::int64_t len,
+            std::int64_t extra,
+            std::int64_t* nread)
+        noexcept (false);
+
+    /*
+     * Move the underlying file to the byte following the last byte read
+     * through the protocol.
+     */
+    void reposition() const noexcept (false);
+
+    std::int64_t body_size(std::int64_t i) const noexcept (true);
+};
+
+std::int64_t baseaddr(lfp_protocol* f) noexcept (true) {
+    try {
+        return f->tell();
+    } catch (const lfp::error&) {
+        return 0;
+    }
+}
+
+lrs::lrs(lfp_protocol* f) :
+    fp(f),
+    base(baseaddr(f)),
+    inner_pos(base)
+{}
+
+/*
+ * The duplicate gets a copy of the index, and its read head is moved to the
+ * same position as the read head of other. f is a duplicate of other's
+ * underlying file, and so is at the same physical position.
+ */
+lrs::lrs(lfp_protocol* f, const lrs& other) :
+    fp(f),
+    base(other.base),
+    index(other.index),
+    ends(other.ends),
+    current(other.current),
+    remaining(other.remaining),
+    end_of_file(other.end_of_file),
+    inner_pos(other.inner_pos)
+{}
+
+void lrs::close() noexcept (false) {
+    if (!this->fp) return;
+    this->fp.close();
+}
+
+/*
+ * The underlying file is usually ahead of the protocol, as full segments are
+ * read, and segments are indexed before they are read. Before it is exposed,
+ * it is moved to the byte following the last byte read through the protocol,
+ * or to the start, if nothing has been read yet.
+ */
+void lrs::reposition() const noexcept (false) {
+    auto pos = this->base;
+    if (this->current >= 0) {
+        const auto& seg = this->index[this->current];
+        pos = seg.offset + seg.body_end - this->remaining;
+    }
+
+    if (pos == this->inner_pos)
+        return;
+
+    this->fp.get()->seek(pos);
+    this->inner_pos = pos;
+}
+
+lfp_protocol* lrs::peel() noexcept (false) {
+    assert(this->fp);
+    this->reposition();
+    return this->fp.release();
+}
+
+lfp_protocol* lrs::peek() const noexcept (false) {
+    assert(this->fp);
+    this->reposition();
+    return this->fp.get();
+}
+
+lfp_protocol* lrs::dup() noexcept (false) {
+    assert(this->fp);
+    unique_lfp inner(this->fp->dup());
+    auto* copy = new lrs(inner.get(), *this);
+    inner.release();
+    return copy;
+}
+
+lfp_status lrs::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    const auto n = this->readinto(dst, len);
+    assert(n <= len);
+
+    if (bytes_read) *bytes_read = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    if (this->eof())
+        return LFP_EOF;
+
+    return LFP_OKINCOMPLETE;
+}
+
+std::int64_t lrs::readinto(void* dst, std::int64_t len) noexcept (false) {
+    std::int64_t bytes_read = 0;
+
+    while (len > 0) {
+        if (this->remaining == 0) {
+            const auto next = this->current + 1;
+            if (next == std::int64_t(this->index.size())) {
+                if (this->end_of_file)
+                    return bytes_read;
+
+                this->read_segment_from_disk();
+                if (this->end_of_file)
+                    return bytes_read;
+            }
+
+            this->current = next;
+            this->remaining = this->body_size(next);
+
+            /* might be an empty segment, so re-start */
+            continue;
+        }
+
+        this->load(this->current);
+        const auto& seg = this->index[this->current];
+        const auto pos = seg.body_end - this->remaining - segment::size;
+        const auto n = std::min(len, this->remaining);
+        std::memcpy(dst, this->buffer.data() + pos, n);
+
+        this->remaining -= n;
+        bytes_read += n;
+        len -= n;
+        dst = advance(dst, n);
+    }
+
+    return bytes_read;
+}
+
+int lrs::eof() const noexcept (true) {
+    return this->end_of_file
+       and this->remaining == 0
+       and this->current + 1 == std::int64_t(this->index.size());
+}
+
+std::int64_t lrs::tell() const noexcept (true) {
+    if (this->current < 0)
+        return 0;
+
+    return this->ends[this->current] - this->remaining;
+}
+
+void lrs::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "lrs: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    this->index_to(n);
+
+    if (this->ends.empty()) {
+        this->current = -1;
+        this->remaining = 0;
+        return;
+    }
+
+    if (n >= this->ends.back()) {
+        /* seek to, or past, the end - position at the end of the last body */
+        this->current = std::int64_t(this->ends.size()) - 1;
+        this->remaining = 0;
+        return;
+    }
+
+    const auto end = std::upper_bound(this->ends.begin(), this->ends.end(), n);
+    const auto i = std::distance(this->ends.begin(), end);
+    this->current = i;
+    this->remaining = this->ends[i] - n;
+}
+
+/*
+ * Index the rest of the file, and the file ends where the body of the last
+ * segment does
+ */
+std::int64_t lrs::size() noexcept (false) {
+    this->index_to(std::numeric_limits< std::int64_t >::max());
+    if (this->ends.empty())
+        return 0;
+    return this->ends.back();
+}
+
+/*
+ * Translate the logical offsets through the index, and read the segments'
+ * bodies with readat on the underlying file, without touching the read head
+ * or going through the buffer. Unindexed ranges are indexed first, like on
+ * seek, which moves the underlying file.
+ */
+lfp_status lrs::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(offset >= 0);
+    assert(len >= 0);
+
+    if (len > 0)
+        this->index_to(offset + len - 1);
+
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+    auto hint = this->ends.begin();
+    while (n < len) {
+        const auto logical = offset + n;
+        hint = std::upper_bound(hint, this->ends.end(), logical);
+        if (hint == this->ends.end()) {
+            err = LFP_EOF;
+            break;
+        }
+
+        const auto i = std::distance(this->ends.begin(), hint);
+        const auto& seg = this->index[i];
+        const auto physical = seg.offset + seg.body_end - (*hint - logical);
+        const auto to_read = std::min(len - n, *hint - logical);
+
+        std::int64_t m;
+        err = this->fp->readat(physical, advance(dst, n), to_read, &m);
+        n += m;
+
+        if (m == to_read)
+            continue;
+
+        if (err == LFP_EOF) {
+            const auto msg = "lrs: unexpected EOF when reading segment "
+                             "- got {} bytes, expected {}";
+            throw unexpected_eof(fmt::format(msg, m, to_read));
+        }
+
+        break;
+    }
+
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return err;
+}
+
+void lrs::index_to(std::int64_t n) noexcept (false) {
+    while (this->ends.empty() or n >= this->ends.back()) {
+        if (this->end_of_file)
+            break;
+        this->read_segment_from_disk();
+    }
+}
+
+void lrs::load(std::int64_t i) noexcept (false) {
+    if (this->loaded == i)
+        return;
+
+    const auto& seg = this->index[i];
+    const auto len = std::int64_t(seg.length) - segment::size;
+    if (std::int64_t(this->buffer.size()) < len)
+        this->buffer.resize(len);
+
+    this->loaded = -1;
+    std::int64_t n;
+    this->read_at(seg.offset + segment::size, this->buffer.data(), len, 0, &n);
+    this->loaded = i;
+}
+
+lfp_status lrs::read_at(
+        std::int64_t pos,
+        void* dst,
+        std::int64_t len,
+        std::int64_t extra,
+        std::int64_t* nread)
+noexcept (false) {
+    if (pos != this->inner_pos) {
+        /*
+         * Like in read_segment_from_disk(), an invalid seek is taken as the
+         * end of the file, which makes the segment truncated
+         */
+        try {
+            this->fp->seek(pos);
+        } catch (const lfp::error& e) {
+            if (e.status() != LFP_INVALID_ARGS)
+                throw;
+            const auto msg = "lrs: unexpected EOF when reading segment "
+                             "- offset {} is past the end of the file";
+            throw unexpected_eof(fmt::format(msg, pos));
+        }
+        this->inner_pos = pos;
+    }
+
+    std::int64_t n;
+    const auto err = this->fp->readinto(dst, len + extra, &n);
+    this->inner_pos += n;
+    *nread = n;
+
+    if (n >= len)
+        return err;
+
+    switch (err) {
+        case LFP_OKINCOMPLETE:
+            throw protocol_failed_recovery(
+                "lrs: incomplete read of Logical Record Segment, "
+                "recovery not implemented"
+            );
+
+        case LFP_EOF:
+        {
+            const auto msg = "lrs: unexpected EOF when reading segment "
+                             "- got {} bytes, expected {}";
+            throw unexpected_eof(fmt::format(msg, n, len));
+        }
+
+        default:
+            throw not_implemented(
+                "lrs: unhandled error code in read_at"
+            );
+    }
+}
+
+void lrs::read_segment_from_disk() noexcept (false) {
+    assert(not this->end_of_file);
+
+    const auto offset = this->index.empty()
+                      ? this->base
+                      : this->index.back().offset + this->index.back().length;
+
+    unsigned char b[segment::size];
+    std::int64_t n;
+    lfp_status err;
+
+    if (offset == this->ahead_offset
+            and (this->ahead_n == segment::size or this->ahead_eof)) {
+        std::memcpy(b, this->ahead, sizeof(b));
+        n = this->ahead_n;
+        err = this->ahead_eof ? LFP_EOF : LFP_OK;
+    } else {
+        if (offset != this->inner_pos) {
+            /*
+             * Some protocols, like memfile, do not allow seeking to the end
+             * of the file, so an invalid seek to the start of the next
+             * segment is taken as the end of the file.
+             */
+            try {
+                this->fp->seek(offset);
+            } catch (const lfp::error& e) {
+                if (e.status() != LFP_INVALID_ARGS)
+                    throw;
+                this->end_of_file = true;
+                return;
+            }
+            this->inner_pos = offset;
+        }
+
+        err = this->fp->readinto(b, sizeof(b), &n);
+        this->inner_pos += n;
+    }
+
+    switch (err) {
+        case LFP_OK: break;
+
+        case LFP_OKINCOMPLETE:
+            throw protocol_failed_recovery(
+                "lrs: incomplete read of Logical Record Segment Header, "
+                "recovery not implemented"
+            );
+
+        case LFP_EOF:
+            /*
+             * Like with Visible Records, the last segment ends exactly at
+             * EOF, which is not recorded before trying to read past it.
+             */
+            if (n == 0) {
+                this->end_of_file = true;
+                return;
+            } else if (n < segment::size) {
+                const auto msg = "lrs: unexpected EOF when reading header "
+                                 "- got {} bytes";
+                throw protocol_fatal(fmt::format(msg, n));
+            }
+            break;
+
+        default:
+            throw not_implemented(
+                "lrs: unhandled error code in read_segment_from_disk"
+            );
+    }
+
+    segment seg;
+    seg.offset = offset;
+    seg.length = (std::uint16_t(b[0]) << 8) | b[1];
+    seg.attributes = b[2];
+    seg.type = b[3];
+
+    /*
+     * The trailer is stored back-to-front: trailing length, checksum, and
+     * then padding, where the last pad byte is the size of the padding,
+     * including itself. The segment must at least fit the header, the size
+     * of the encryption packet, and the trailer.
+     */
+    const auto has_padding = bool(seg.attributes & segment::padding);
+    const auto has_packet = bool(seg.attributes & segment::encryption_packet);
+    std::int64_t trailer = 0;
+    if (seg.attributes & segment::trailing_length) trailer += 2;
+    if (seg.attributes & segment::checksum)        trailer += 2;
+
+    const auto pad_size = has_padding ? 1 : 0;
+    const auto packet_size = has_packet ? 2 : 0;
+    const auto minimum = segment::size + packet_size + trailer + pad_size;
+
+    const auto segno = this->index.size() + 1;
+    if (seg.length < minimum) {
+        const auto msg = "lrs: Logical Record Segment {} has length (= {}) "
+                         "shorter than its header and trailer (= {})";
+        throw protocol_fatal(fmt::format(msg, segno, seg.length, minimum));
+    }
+
+    /*
+     * Read the rest of the segment, and the header of the next one, which
+     * might not be there if this is the last segment
+     */
+    const auto len = std::int64_t(seg.length) - segment::size;
+    if (std::int64_t(this->buffer.size()) < len + segment::size)
+        this->buffer.resize(len + segment::size);
+
+    this->loaded = -1;
+    this->ahead_offset = -1;
+    const auto ahead_err = this->read_at(
+        offset + segment::size,
+        this->buffer.data(),
+        len,
+        segment::size,
+        &n
+    );
+
+    this->ahead_offset = offset + seg.length;
+    this->ahead_n = n - len;
+    this->ahead_eof = ahead_err == LFP_EOF;
+    std::memcpy(this->ahead, this->buffer.data() + len, this->ahead_n);
+
+    const auto* content = this->buffer.data();
+    seg.body_begin = segment::size;
+    seg.body_end = seg.length - trailer;
+
+    if (has_packet) {
+        const auto packet = (std::uint16_t(content[0]) << 8) | content[1];
+        const auto avail = seg.body_end - pad_size - seg.body_begin;
+        if (packet < 2 or packet > avail) {
+            const auto msg = "lrs: Logical Record Segment {} has encryption "
+                             "packet size (= {}) outside [2, {}]";
+            throw protocol_fatal(fmt::format(msg, segno, packet, avail));
+        }
+        seg.body_begin += packet;
+    }
+
+    if (seg.attributes & segment::trailing_length) {
+        const auto* p = content + len - 2;
+        const auto copy = (std::uint16_t(p[0]) << 8) | p[1];
+        if (copy != seg.length) {
+            const auto msg = "lrs: Logical Record Segment {} has trailing "
+                             "length (= {}) != length (= {})";
+            throw protocol_fatal(fmt::format(msg, segno, copy, seg.length));
+        }
+    }
+
+    if (has_padding) {
+        const auto last = seg.body_end - segment::size - 1;
+        const auto pad = std::int64_t(content[last]);
+        const auto avail = seg.body_end - seg.body_begin;
+        if (pad < 1 or pad > avail) {
+            const auto msg = "lrs: Logical Record Segment {} has pad count "
+                             "(= {}) outside [1, {}]";
+            throw protocol_fatal(fmt::format(msg, segno, pad, avail));
+        }
+        seg.body_end -= pad;
+    }
+
+    const auto prev_end = this->ends.empty() ? 0 : this->ends.back();
+    try {
+        this->index.push_back(seg);
+        this->ends.push_back(prev_end + seg.body_end - seg.body_begin);
+    } catch (...) {
+        this->index.resize(this->ends.size());
+        throw runtime_error("lrs: unable to store header");
+    }
+    this->loaded = std::int64_t(this->index.size()) - 1;
+}
+
+std::int64_t lrs::body_size(std::int64_t i) const noexcept (true) {
+    const auto& seg = this->index[i];
+    return seg.body_end - seg.body_begin;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_rp66_lrs_open(lfp_protocol* f) {
+    if (not f) return nullptr;
+
+    try {
+        return new lfp::lrs(f);
+    } catch (...) {
+        return nullptr;
+    }
+}
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <cstdint>
 #include <cassert>
+#include <memory>
 #include <vector>
 
 #include <fmt/format.h>
@@ -11,18 +12,28 @@
 namespace lfp { namespace {
 
 /*
- * A fixed-size file in memory - is right now a vector, but could just as well
- * be a memory mapped file.
+ * A fixed-size file in memory, either copied into a vector, or borrowed from
+ * the caller, who must keep it alive until the memfile is closed.
  *
  * It is largely intended for testing, but it can surely be used for other
- * things too.
+ * things too. For files on disk, the mmap protocol maps the file instead.
  *
- * TODO: proper mmap implementation
+ * The contents are never modified, so duplicates share the copied vector.
  */
 class memfile : public lfp_protocol {
 public:
     memfile() = default;
-    memfile(const unsigned char* p, std::size_t len) : mem(p, p + len) {}
+    memfile(const unsigned char* p, std::size_t len) :
+        owned(std::make_shared< std::vector< unsigned char > >(p, p + len)),
+        mem(this->owned->data()),
+        length(len)
+    {}
+
+    struct borrowed {};
+    memfile(const void* p, std::size_t len, borrowed) :
+        mem(static_cast< const unsigned char* >(p)),
+        length(len)
+    {}
 
     void close() noexcept (true) override;
     lfp_status readinto(
@@ -30,17 +41,36 @@ public:
             std::int64_t len,
             std::int64_t* bytes_read)
         noexcept (true) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (true) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (true) override;
+    lfp_status borrow(
+            std::int64_t len,
+            const void** ptr,
+            std::int64_t* avail)
+        noexcept (true) override;
+    bool lends() const noexcept (true) override;
+    bool concurrent_readat() const noexcept (true) override;
 
     int eof() const noexcept (true) override;
 
     void seek(std::int64_t) noexcept (false) override;
     std::int64_t tell() const noexcept (true) override;
+    std::int64_t size() noexcept (true) override;
 
     lfp_protocol* peel() noexcept (false) override;
     lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
 
 private:
-    std::vector< unsigned char > mem;
+    std::shared_ptr< const std::vector< unsigned char > > owned;
+    const unsigned char* mem = nullptr;
+    std::size_t length = 0;
     std::int64_t pos = 0;
 };
 
@@ -48,12 +78,12 @@ void memfile::close() noexcept (true) {}
 
 lfp_status memfile::readinto(void* p, std::int64_t len, std::int64_t* nread)
 noexcept (true) {
-    const auto remaining = std::int64_t(this->mem.size() - this->pos);
+    const auto remaining = std::int64_t(this->length - this->pos);
     const auto n = std::min(len, remaining);
     assert(n >= 0);
     assert(this->pos >= 0);
-    assert(std::size_t(this->pos + n) <= this->mem.size());
-    std::memcpy(p, this->mem.data() + this->pos, n);
+    assert(std::size_t(this->pos + n) <= this->length);
+    std::memcpy(p, this->mem + this->pos, n);
     this->pos += n;
 
     if (nread)
@@ -68,15 +98,80 @@ noexcept (true) {
         return LFP_OKINCOMPLETE;
 }
 
+lfp_status memfile::readat(
+        std::int64_t offset,
+        void* p,
+        std::int64_t len,
+        std::int64_t* nread)
+noexcept (true) {
+    assert(offset >= 0);
+    const auto size = std::int64_t(this->length);
+    const auto remaining = std::max(size - offset, std::int64_t(0));
+    const auto n = std::min(len, remaining);
+    if (n > 0)
+        std::memcpy(p, this->mem + offset, n);
+
+    if (nread)
+        *nread = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return LFP_EOF;
+}
+
+/*
+ * There is nothing to gain from merging reads from memory, so just copy the
+ * ranges one by one
+ */
+lfp_status memfile::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (true) {
+    auto err = LFP_OK;
+    for (std::int64_t i = 0; i < n; ++i) {
+        auto& r = ranges[i];
+        if (this->readat(r.offset, r.dst, r.len, &r.nread) != LFP_OK)
+            err = LFP_EOF;
+    }
+    return err;
+}
+
+/*
+ * The file is already in memory, so just point to it
+ */
+lfp_status memfile::borrow(
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail)
+noexcept (true) {
+    const auto remaining = std::int64_t(this->length - this->pos);
+    const auto n = std::min(len, remaining);
+    *ptr = this->mem + this->pos;
+    *avail = n;
+    this->pos += n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return LFP_EOF;
+}
+
+bool memfile::lends() const noexcept (true) {
+    return true;
+}
+
+bool memfile::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
 int memfile::eof() const noexcept (true) {
-    return std::size_t(this->pos) == this->mem.size();
+    return std::size_t(this->pos) == this->length;
 }
 
 void memfile::seek(std::int64_t n) noexcept (false) {
     assert(n >= 0);
-    if (std::size_t(n) >= this->mem.size()) {
+    if (std::size_t(n) >= this->length) {
         const auto msg = "memfile: seek: offset (= {}) >= file size (= {})";
-        throw invalid_args(fmt::format(msg, n, this->mem.size()));
+        throw invalid_args(fmt::format(msg, n, this->length));
     }
 
     this->pos = n;
@@ -86,6 +181,10 @@ std::int64_t memfile::tell() const noexcept (true) {
     return this->pos;
 }
 
+std::int64_t memfile::size() noexcept (true) {
+    return std::int64_t(this->length);
+}
+
 lfp_protocol* memfile::peel() noexcept (false) {
     throw lfp::leaf_protocol("peel: not supported for leaf protocol");
 }
@@ -94,6 +193,10 @@ lfp_protocol* memfile::peek() const noexcept (false) {
     throw lfp::leaf_protocol("peek: not supported for leaf protocol");
 }
 
+lfp_protocol* memfile::dup() noexcept (false) {
+    return new memfile(*this);
+}
+
 }
 
 }
@@ -113,3 +216,11 @@ lfp_protocol* lfp_memfile_openwith(const unsigned char* p, std::size_t len) {
         return nullptr;
     }
 }
+
+lfp_protocol* lfp_memfile_borrow(const void* p, std::size_t len) {
+    try {
+        return new lfp::memfile(p, len, lfp::memfile::borrowed {});
+    } catch (...) {
+        return nullptr;
+    }
+}
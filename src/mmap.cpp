@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/mmap.h>
+
+namespace lfp { namespace {
+
+/*
+ * A read-only memory mapped file. This is the memfile, but without copying
+ * the file into a vector first - the page cache *is* the buffer, and a read is
+ * a memcpy out of the mapping.
+ *
+ * The mapping always starts at file offset 0, since mmap offsets must be page
+ * aligned, and the offset of the descriptor when opened is kept as zero.
+ *
+ * The mapping is shared with duplicates, and unmapped when the last of them
+ * is closed.
+ */
+class mmapfile : public lfp_protocol {
+public:
+    mmapfile(int fd, int advice);
+
+    void close() noexcept (false) override;
+    lfp_status readinto(
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false) override;
+    lfp_status borrow(
+            std::int64_t len,
+            const void** ptr,
+            std::int64_t* avail)
+        noexcept (false) override;
+    bool lends() const noexcept (true) override;
+    bool concurrent_readat() const noexcept (true) override;
+
+    int eof() const noexcept (true) override;
+
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t tell() const noexcept (true) override;
+    std::int64_t size() noexcept (true) override;
+
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    void advise(int advice) noexcept (true);
+
+    struct mapping {
+        void* addr;
+        std::size_t len;
+
+        ~mapping() {
+            if (this->addr)
+                ::munmap(this->addr, this->len);
+        }
+    };
+
+    std::shared_ptr< mapping > map;
+    unsigned char* base = nullptr;
+    std::int64_t length = 0;
+    std::int64_t zero = 0;
+    std::int64_t pos  = 0;
+};
+
+mmapfile::mmapfile(int fd, int advice) {
+    struct stat st;
+    if (::fstat(fd, &st) == -1)
+        throw io_error(std::strerror(errno));
+
+    if (not S_ISREG(st.st_mode)) {
+        const auto msg = "mmap: descriptor (= {}) is not a regular file";
+        throw not_supported(fmt::format(msg, fd));
+    }
+
+    const auto off = ::lseek(fd, 0, SEEK_CUR);
+    if (off == -1)
+        throw io_error(std::strerror(errno));
+
+    this->length = st.st_size;
+    this->zero = std::min(std::int64_t(off), this->length);
+    this->pos  = this->zero;
+
+    /* mapping an empty file is an error, so just leave it unmapped */
+    if (this->length == 0)
+        return;
+
+    auto* p = ::mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        throw io_error(std::strerror(errno));
+
+    try {
+        this->map.reset(new mapping { p, std::size_t(this->length) });
+    } catch (...) {
+        ::munmap(p, this->length);
+        throw;
+    }
+
+    this->base = static_cast< unsigned char* >(p);
+    this->advise(advice);
+}
+
+void mmapfile::advise(int advice) noexcept (true) {
+    /*
+     * madvise is only a hint, so failures (e.g. huge pages for file mappings
+     * on a kernel without CONFIG_READ_ONLY_THP_FOR_FS) are ignored.
+     */
+    if (advice & LFP_MMAP_SEQUENTIAL)
+        ::madvise(this->base, this->length, MADV_SEQUENTIAL);
+
+    if (advice & LFP_MMAP_RANDOM)
+        ::madvise(this->base, this->length, MADV_RANDOM);
+
+    if (advice & LFP_MMAP_WILLNEED)
+        ::madvise(this->base, this->length, MADV_WILLNEED);
+
+#ifdef MADV_HUGEPAGE
+    if (advice & LFP_MMAP_HUGEPAGE)
+        ::madvise(this->base, this->length, MADV_HUGEPAGE);
+#endif
+}
+
+void mmapfile::close() noexcept (false) {
+    if (not this->map) return;
+
+    /*
+     * Unmap right away if this is the last handle to the mapping, so that
+     * errors are reported. Otherwise the last duplicate to close unmaps it.
+     */
+    auto err = 0;
+    if (this->map.use_count() == 1) {
+        err = ::munmap(this->map->addr, this->map->len);
+        this->map->addr = nullptr;
+    }
+
+    this->map.reset();
+    this->base = nullptr;
+    this->length = 0;
+
+    if (err)
+        throw runtime_error(std::strerror(errno));
+}
+
+lfp_status mmapfile::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(len >= 0);
+
+    const auto remaining = std::max(this->length - this->pos, std::int64_t(0));
+    const auto n = std::min(len, remaining);
+    if (n > 0)
+        std::memcpy(dst, this->base + this->pos, n);
+    this->pos += n;
+
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return LFP_EOF;
+}
+
+lfp_status mmapfile::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(offset >= 0);
+    assert(len >= 0);
+
+    const auto from = this->zero + offset;
+    const auto remaining = std::max(this->length - from, std::int64_t(0));
+    const auto n = std::min(len, remaining);
+    if (n > 0)
+        std::memcpy(dst, this->base + from, n);
+
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return LFP_EOF;
+}
+
+/*
+ * There is nothing to gain from merging reads from memory, so just copy the
+ * ranges one by one
+ */
+lfp_status mmapfile::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    auto err = LFP_OK;
+    for (std::int64_t i = 0; i < n; ++i) {
+        auto& r = ranges[i];
+        if (this->readat(r.offset, r.dst, r.len, &r.nread) != LFP_OK)
+            err = LFP_EOF;
+    }
+    return err;
+}
+
+/*
+ * The bytes are in the mapping already, so point to them rather than copy
+ */
+lfp_status mmapfile::borrow(
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail)
+noexcept (false) {
+    const auto from = std::min(this->pos, this->length);
+    const auto n = std::min(len, this->length - from);
+    *ptr = this->base + from;
+    *avail = n;
+    this->pos += n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return LFP_EOF;
+}
+
+bool mmapfile::lends() const noexcept (true) {
+    return true;
+}
+
+bool mmapfile::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
+int mmapfile::eof() const noexcept (true) {
+    return this->pos >= this->length;
+}
+
+void mmapfile::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "mmap: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    this->pos = this->zero + n;
+}
+
+std::int64_t mmapfile::tell() const noexcept (true) {
+    return this->pos - this->zero;
+}
+
+std::int64_t mmapfile::size() noexcept (true) {
+    return this->length - this->zero;
+}
+
+lfp_protocol* mmapfile::peel() noexcept (false) {
+    throw lfp::leaf_protocol("peel: not supported for leaf protocol");
+}
+
+lfp_protocol* mmapfile::peek() const noexcept (false) {
+    throw lfp::leaf_protocol("peek: not supported for leaf protocol");
+}
+
+lfp_protocol* mmapfile::dup() noexcept (false) {
+    return new mmapfile(*this);
+}
+
+}
+
+}
+
+lfp_protocol* lfp_mmap_open(int fd, int advice) {
+    if (fd < 0) return nullptr;
+
+    try {
+        auto* f = new lfp::mmapfile(fd, advice);
+        ::close(fd);
+        return f;
+    } catch (...) {
+        return nullptr;
+    }
+}
@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <ciso646>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/prefetch.h>
+
+namespace lfp { namespace {
+
+constexpr std::int64_t default_block_size = 256 * 1024;
+constexpr int default_max_blocks = 16;
+
+/*
+ * Block on cv until done() is true, like cv.wait(guard, done).
+ *
+ * condition_variable::wait(unique_lock&) got a new symbol version in GCC 12,
+ * and when the build finds that it can not be loaded, because the libstdc++
+ * at runtime is older than the compiler, LFP_CONDVAR_WAIT_FOR is defined.
+ * wait_for is inlined, so then wait in (long) timed slices instead. Every
+ * change to what done() looks at is followed by a notify, so the timeout is
+ * only an upper bound, and never adds latency.
+ */
+template < typename Predicate >
+void wait(
+        std::condition_variable& cv,
+        std::unique_lock< std::mutex >& guard,
+        Predicate done) {
+#if defined(LFP_CONDVAR_WAIT_FOR)
+    while (not done())
+        cv.wait_for(guard, std::chrono::seconds(1));
+#else
+    cv.wait(guard, done);
+#endif
+}
+
+struct chunk {
+    std::int64_t offset;
+    std::vector< unsigned char > data;
+    /* the underlying handle reported EOF right after this chunk */
+    bool eof;
+
+    std::int64_t end() const noexcept (true) {
+        return this->offset + std::int64_t(this->data.size());
+    }
+};
+
+/*
+ * A background thread reads blocks ahead of the current position into a
+ * ring of chunks, which the reader consumes.
+ *
+ * Two locks are used. The io lock guards the underlying handle, and is held
+ * for the duration of every read or seek on it. The state lock guards
+ * everything else - the worker does not hold it while reading, so the reader
+ * can consume chunks while the next one is read. The reader may take the io
+ * lock while holding the state lock, but never the other way around.
+ *
+ * The ring is always contiguous, and starts at or before the current
+ * position. When it is empty, next is the current position. A seek outside
+ * the ring clears it, and bumps the generation, so that a read in flight for
+ * the old position is discarded when it lands.
+ *
+ * The window is the number of chunks to read ahead. It doubles on every
+ * sequential read, and halves on every seek outside the ring. At zero, reads
+ * go straight to the underlying handle, in the reader's thread.
+ */
+class prefetch : public lfp_protocol {
+public:
+    prefetch(lfp_protocol*, std::int64_t block_size, int max_blocks);
+    ~prefetch() override;
+
+    void close() noexcept (false) override;
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+    std::int64_t tell() const noexcept (true) override;
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+private:
+    unique_lfp fp;
+    std::int64_t block_size;
+    int max_window;
+
+    std::mutex io;
+    std::int64_t inner_pos = 0;
+
+    std::mutex lock;
+    std::condition_variable wake_worker;
+    std::condition_variable wake_reader;
+    std::deque< chunk > ring;
+    std::int64_t next = 0;
+    std::uint64_t generation = 0;
+    int window = 1;
+    bool stopped = false;
+    bool ahead_eof = false;
+    std::exception_ptr failure;
+
+    std::int64_t pos = 0;
+    /* where the previous read ended, or -1 after a seek outside the ring */
+    std::int64_t last_end = 0;
+    bool end_of_file = false;
+
+    std::thread worker;
+
+    void run() noexcept (true);
+    void stop() noexcept (true);
+    void clear(std::int64_t n) noexcept (true);
+    lfp_status read_direct(void* dst, std::int64_t len, std::int64_t* n)
+        noexcept (false);
+};
+
+prefetch::prefetch(lfp_protocol* f, std::int64_t bs, int max_blocks) :
+    fp(f),
+    block_size(bs),
+    max_window(max_blocks)
+{
+    try {
+        this->pos = this->fp->tell();
+        this->inner_pos = this->pos;
+        this->next = this->pos;
+        this->last_end = this->pos;
+        this->worker = std::thread(&prefetch::run, this);
+    } catch (...) {
+        /*
+         * The caller still owns the underlying handle if the constructor
+         * fails, so don't close it
+         */
+        this->fp.release();
+        throw;
+    }
+}
+
+prefetch::~prefetch() {
+    this->stop();
+}
+
+void prefetch::stop() noexcept (true) {
+    {
+        std::lock_guard< std::mutex > guard(this->lock);
+        this->stopped = true;
+    }
+    this->wake_worker.notify_all();
+    if (this->worker.joinable())
+        this->worker.join();
+}
+
+void prefetch::close() noexcept (false) {
+    this->stop();
+    if (not this->fp) return;
+    this->fp.close();
+}
+
+void prefetch::run() noexcept (true) {
+    std::unique_lock< std::mutex > guard(this->lock);
+    while (true) {
+        wait(this->wake_worker, guard, [this] {
+            return this->stopped
+                or (not this->failure
+                    and not this->ahead_eof
+                    and int(this->ring.size()) < this->window);
+        });
+
+        if (this->stopped)
+            return;
+
+        const auto offset = this->next;
+        const auto gen = this->generation;
+        guard.unlock();
+
+        auto buffer = std::vector< unsigned char >();
+        auto err = LFP_OK;
+        std::exception_ptr ex;
+        try {
+            buffer.resize(this->block_size);
+            std::lock_guard< std::mutex > io_guard(this->io);
+            if (this->inner_pos != offset) {
+                this->fp->seek(offset);
+                this->inner_pos = offset;
+            }
+
+            std::int64_t n;
+            err = this->fp->readinto(buffer.data(), this->block_size, &n);
+            this->inner_pos += n;
+            buffer.resize(n);
+        } catch (...) {
+            ex = std::current_exception();
+        }
+
+        guard.lock();
+        /* the reader has moved on while this was read */
+        if (gen != this->generation)
+            continue;
+
+        if (ex) {
+            this->failure = ex;
+        } else {
+            const auto eof = err == LFP_EOF;
+            this->ring.push_back(chunk { offset, std::move(buffer), eof });
+            this->next = this->ring.back().end();
+            this->ahead_eof = eof;
+        }
+        this->wake_reader.notify_all();
+    }
+}
+
+void prefetch::clear(std::int64_t n) noexcept (true) {
+    this->generation += 1;
+    this->ring.clear();
+    this->next = n;
+    this->ahead_eof = false;
+    this->failure = nullptr;
+}
+
+lfp_status prefetch::read_direct(void* dst, std::int64_t len, std::int64_t* n)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->io);
+    if (this->inner_pos != this->pos) {
+        this->fp->seek(this->pos);
+        this->inner_pos = this->pos;
+    }
+
+    const auto err = this->fp->readinto(dst, len, n);
+    this->inner_pos += *n;
+    return err;
+}
+
+lfp_status prefetch::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::unique_lock< std::mutex > guard(this->lock);
+
+    if (this->pos == this->last_end) {
+        const auto prev = this->window;
+        this->window = std::min(std::max(2 * prev, 1), this->max_window);
+        /* read-ahead starts again, from here */
+        if (prev == 0 and this->ring.empty())
+            this->clear(this->pos);
+        this->wake_worker.notify_one();
+    }
+
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+    while (n < len) {
+        if (this->ring.empty()) {
+            if (this->failure) {
+                /* report the error once, and retry on the next read */
+                auto ex = this->failure;
+                this->clear(this->pos);
+                this->wake_worker.notify_one();
+                std::rethrow_exception(ex);
+            }
+
+            if (this->ahead_eof) {
+                err = LFP_EOF;
+                break;
+            }
+
+            if (this->window == 0) {
+                std::int64_t k;
+                err = this->read_direct(advance(dst, n), len - n, &k);
+                this->pos += k;
+                n += k;
+                break;
+            }
+
+            /* the worker notifies when it delivers a chunk, or fails */
+            wait(this->wake_reader, guard, [this] {
+                return not this->ring.empty()
+                    or this->failure
+                    or this->ahead_eof;
+            });
+            continue;
+        }
+
+        auto& front = this->ring.front();
+        assert(front.offset <= this->pos);
+        const auto avail = front.end() - this->pos;
+        if (avail > 0) {
+            const auto within = this->pos - front.offset;
+            const auto k = std::min(avail, len - n);
+            std::memcpy(advance(dst, n), front.data.data() + within, k);
+            this->pos += k;
+            n += k;
+            continue;
+        }
+
+        if (front.eof) {
+            err = LFP_EOF;
+            break;
+        }
+
+        /* an empty chunk means the underlying handle had nothing yet */
+        const auto incomplete = front.data.empty();
+        this->ring.pop_front();
+        this->wake_worker.notify_one();
+        if (incomplete) {
+            err = LFP_OKINCOMPLETE;
+            break;
+        }
+    }
+
+    if (n == len)
+        err = LFP_OK;
+
+    this->end_of_file = err == LFP_EOF
+        or (not this->ring.empty()
+            and this->ring.front().eof
+            and this->pos >= this->ring.front().end());
+
+    this->last_end = this->pos;
+    if (bytes_read)
+        *bytes_read = n;
+    return err;
+}
+
+/*
+ * Reads at an offset go straight to the underlying handle, without
+ * disturbing the read-ahead
+ */
+lfp_status prefetch::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->io);
+    return this->fp->readat(offset, dst, len, bytes_read);
+}
+
+lfp_status prefetch::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->io);
+    return this->fp->readv_at(ranges, n);
+}
+
+/* the reads are serialised on the io lock */
+bool prefetch::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
+int prefetch::eof() const noexcept (true) {
+    return this->end_of_file;
+}
+
+std::int64_t prefetch::tell() const noexcept (true) {
+    return this->pos;
+}
+
+void prefetch::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "prefetch: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    std::lock_guard< std::mutex > guard(this->lock);
+
+    /*
+     * Seeking within the read-ahead window, e.g. skipping a record, is still
+     * sequential access. Chunks before the target are dropped. When n is the
+     * end of the ring, all of them are, and the ring is empty at next (= n).
+     */
+    const auto in_ring = not this->ring.empty()
+        and this->ring.front().offset <= n
+        and n <= this->ring.back().end();
+
+    if (in_ring) {
+        while (not this->ring.empty() and this->ring.front().end() <= n)
+            this->ring.pop_front();
+
+        this->wake_worker.notify_one();
+        this->pos = n;
+        this->last_end = n;
+        this->end_of_file = false;
+        return;
+    }
+
+    this->window /= 2;
+    this->clear(n);
+    {
+        /*
+         * Seek the underlying handle right away, so that invalid seeks fail
+         * here, like they would without prefetching
+         */
+        std::lock_guard< std::mutex > io_guard(this->io);
+        this->fp->seek(n);
+        this->inner_pos = n;
+    }
+
+    this->pos = n;
+    this->last_end = -1;
+    this->end_of_file = false;
+    this->wake_worker.notify_one();
+}
+
+/*
+ * Asking for the size may read the underlying handle, e.g. to index a
+ * tapeimage, so it must not race with the worker
+ */
+std::int64_t prefetch::size() noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->io);
+    return this->fp->size();
+}
+
+/*
+ * The worker is stopped first, since it reads ahead, and would keep moving
+ * the underlying handle. Then the handle is moved back to the position.
+ */
+lfp_protocol* prefetch::peel() noexcept (false) {
+    assert(this->fp);
+    this->stop();
+    if (this->inner_pos != this->pos) {
+        this->fp->seek(this->pos);
+        this->inner_pos = this->pos;
+    }
+    return this->fp.release();
+}
+
+lfp_protocol* prefetch::peek() const noexcept (false) {
+    assert(this->fp);
+    return this->fp.get();
+}
+
+/*
+ * The duplicate has its own worker and read-ahead, which starts at the
+ * current position
+ */
+lfp_protocol* prefetch::dup() noexcept (false) {
+    assert(this->fp);
+    std::unique_lock< std::mutex > io_guard(this->io);
+    unique_lfp inner(this->fp->dup());
+    io_guard.unlock();
+
+    inner->seek(this->pos);
+    auto* copy = new prefetch(inner.get(), this->block_size, this->max_window);
+    inner.release();
+    return copy;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_prefetch_open(
+        lfp_protocol* f,
+        std::int64_t block_size,
+        int max_blocks) {
+    if (not f) return nullptr;
+    if (block_size < 0 or max_blocks < 0) return nullptr;
+    if (block_size == 0) block_size = lfp::default_block_size;
+    if (max_blocks == 0) max_blocks = lfp::default_max_blocks;
+
+    try {
+        return new lfp::prefetch(f, block_size, max_blocks);
+    } catch (...) {
+        return nullptr;
+    }
+}
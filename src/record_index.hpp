@@ -0,0 +1,97 @@
+#ifndef LFP_RECORD_INDEX_HPP
+#define LFP_RECORD_INDEX_HPP
+
+#include <atomic>
+#include <ciso646>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+/** \file record_index.hpp
+ *
+ * Internal storage for the record indices of the tapeimage and rp66
+ * protocols. It is not installed.
+ */
+
+namespace lfp {
+
+/*
+ * The position of the highest set bit in x, i.e. floor(log2(x))
+ */
+inline int highest_bit(std::uint64_t x) noexcept (true) {
+    assert(x > 0);
+    #if defined(__GNUC__)
+        return 63 - __builtin_clzll(x);
+    #else
+        int n = 0;
+        while (x >>= 1) ++n;
+        return n;
+    #endif
+}
+
+/*
+ * Append-only storage for index entries, shared by duplicated handles that
+ * may be used from other threads. The entries are stored in segments that
+ * double in size and never move, so references to them stay valid when the
+ * storage grows. Appends are serialised with the lock, and published by
+ * storing the new size. Readers never lock - they only see the entries that
+ * were complete when they loaded the size.
+ */
+template< typename T >
+struct segmented_storage {
+    /*
+     * The first segment holds 2^first_segment entries, and every segment
+     * after that twice as many as the one before it
+     */
+    static constexpr const int first_segment = 8;
+    static constexpr const int max_segments = 48;
+
+    std::unique_ptr< T[] > segments[max_segments];
+    std::atomic< std::int64_t > size { 0 };
+    std::mutex lock;
+
+    const T& at(std::int64_t i) const noexcept (true);
+    void push(const T&) noexcept (false);
+};
+
+/*
+ * The segments before segment s hold 2^first + ... + 2^(first+s-1) entries,
+ * so offsetting i by 2^first makes its highest bit first+s, and the rest of
+ * the bits the position within the segment.
+ */
+template< typename T >
+const T& segmented_storage< T >::at(std::int64_t i) const noexcept (true) {
+    assert(i >= 0);
+    const auto k = std::uint64_t(i) + (std::uint64_t(1) << first_segment);
+    const auto bit = highest_bit(k);
+    return this->segments[bit - first_segment][k - (std::uint64_t(1) << bit)];
+}
+
+/*
+ * Only called with the lock held, or before the storage is shared. The entry
+ * is written before the size is stored, so it is complete by the time readers
+ * can see it.
+ */
+template< typename T >
+void segmented_storage< T >::push(const T& x) noexcept (false) {
+    const auto i = this->size.load(std::memory_order_relaxed);
+    const auto k = std::uint64_t(i) + (std::uint64_t(1) << first_segment);
+    const auto bit = highest_bit(k);
+    const auto segment = bit - first_segment;
+    if (segment >= max_segments)
+        throw std::length_error("record_index: too many records");
+
+    auto& entries = this->segments[segment];
+    if (not entries)
+        entries.reset(new T[std::size_t(1) << bit]);
+
+    entries[k - (std::uint64_t(1) << bit)] = x;
+    this->size.store(i + 1, std::memory_order_release);
+}
+
+}
+
+#endif // LFP_RECORD_INDEX_HPP
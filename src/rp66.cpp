@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 
 #include <fmt/format.h>
@@ -8,6 +16,8 @@
 #include <lfp/protocol.hpp>
 #include <lfp/rp66.h>
 
+#include "record_index.hpp"
+
 namespace lfp { namespace {
 
 struct header {
@@ -69,14 +79,54 @@ private:
 /*
  * The record headers already read by rp66, stored in an order
  * (lower-address first fashion).
+ *
+ * The logical end offset of every (non-ghost) record is stored alongside its
+ * header, so that a logical offset can be looked up with a single binary
+ * search.
+ *
+ * Like in tapeimage, the index is shared with duplicated handles, which may
+ * be used from other threads. It is append-only, and stored in segments that
+ * double in size and never move, so iterators stay valid when it grows.
+ * Appends are serialised with a lock and published by storing the new size,
+ * and readers never lock.
  */
-class record_index : private std::vector< header > {
-    using base = std::vector< header >;
+class record_index {
+    struct entry {
+        header head;
+        std::int64_t end;
+    };
+
+    using storage = segmented_storage< entry >;
 
 public:
-    using iterator = base::const_iterator;
+    class iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type        = header;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const header*;
+        using reference         = const header&;
+
+        iterator() = default;
+
+        pointer operator -> () const noexcept (true);
+
+        iterator& operator ++ () noexcept (true);
+        iterator& operator -- () noexcept (true);
+        difference_type operator - (const iterator&) const noexcept (true);
+
+        bool operator == (const iterator&) const noexcept (true);
+
+    private:
+        friend class record_index;
+        iterator(const storage* s, difference_type i) : data(s), pos(i) {}
+
+        const storage* data = nullptr;
+        difference_type pos = 0;
+    };
 
     explicit record_index(address_map m);
+
     /*
      * Check if the logical address offset n is already indexed. If it is, then
      * find() will be defined, and return the correct record.
@@ -86,20 +136,27 @@ public:
     /*
      * Find the record header that contains the logical offset n. Behaviour is
      * undefined if contains(n) is false.
+     *
+     * The hint will always be checked before the index is scanned.
      */
-    iterator find(std::int64_t n) const noexcept (false);
+    iterator find(std::int64_t n, iterator hint) const noexcept (false);
 
-    void append(const header& head) noexcept (false);
+    /*
+     * Append the header that follows after, and get an iterator to it. If the
+     * index already has a header after it, the index is unchanged, and that
+     * header is returned instead.
+     */
+    iterator append(const header& head, const iterator& after)
+        noexcept (false);
 
     iterator last() const noexcept (true);
-    std::size_t size() const noexcept (true);
-    bool empty() const noexcept (true);
     iterator begin() const noexcept (true);
 
     iterator::difference_type index_of(const iterator&) const noexcept (true);
 
 private:
     address_map addr;
+    std::shared_ptr< storage > data;
 };
 
 /**
@@ -174,21 +231,80 @@ public:
     void close() noexcept (false) override;
     lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
         noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false) override;
+    lfp_status borrow(
+            std::int64_t len,
+            const void** ptr,
+            std::int64_t* avail)
+        noexcept (false) override;
+    void release() noexcept (false) override;
+    bool lends() const noexcept (true) override;
 
     int eof() const noexcept (true) override;
     std::int64_t tell() const noexcept (true) override;
     void seek(std::int64_t) noexcept (false) override;
+    std::int64_t size() noexcept (false) override;
     lfp_protocol* peel() noexcept (false) override;
     lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
 
 private:
+    /*
+     * Make a duplicate of other, that reads from f, the duplicate of its
+     * underlying file
+     */
+    rp66(lfp_protocol* f, rp66& other);
+
     unique_lfp fp;
     address_map addr;
     record_index index;
     read_head current;
 
+    /*
+     * The borrowed bytes were borrowed from the underlying file, which must
+     * be released with them
+     */
+    bool lent = false;
+
     std::int64_t readinto(void*, std::int64_t) noexcept (false);
-    void read_header_from_disk() noexcept (false);
+
+    /*
+     * Read and index the header that follows after, and get the header from
+     * the index, which may already have it if a duplicate got there first.
+     * read_header_from_disk() reads from the current position of the
+     * underlying file, and returns after if it is at EOF.
+     */
+    using iterator = record_index::iterator;
+    iterator read_header_from_disk(const iterator& after) noexcept (false);
+    iterator append_header(unsigned char* b, const iterator& after)
+        noexcept (false);
+
+    /*
+     * Read and index headers with read_header_at(), until the logical
+     * offset n is covered by the index, or the underlying file ends. The
+     * read head is kept where it is.
+     */
+    void index_to(std::int64_t n) noexcept (false);
+
+    /*
+     * Read the header at the physical offset pos with readat. If the
+     * underlying file does not support readat, seek there and read, and put
+     * the underlying file back where it was, which is not safe to do from
+     * multiple threads. A seek past the end is taken as EOF.
+     */
+    lfp_status read_header_at(
+            std::int64_t pos,
+            unsigned char* dst,
+            std::int64_t* nread)
+        noexcept (false);
+    bool positional = true;
 };
 
 std::int64_t
@@ -207,7 +323,37 @@ std::int64_t address_map::base() const noexcept (true) {
     return this->zero;
 }
 
-record_index::record_index(address_map m) : addr(m) {
+record_index::iterator::pointer
+record_index::iterator::operator -> () const noexcept (true) {
+    return &this->data->at(this->pos).head;
+}
+
+record_index::iterator& record_index::iterator::operator ++ () noexcept (true) {
+    this->pos += 1;
+    return *this;
+}
+
+record_index::iterator& record_index::iterator::operator -- () noexcept (true) {
+    this->pos -= 1;
+    return *this;
+}
+
+record_index::iterator::difference_type
+record_index::iterator::operator - (const iterator& other)
+const noexcept (true) {
+    assert(this->data == other.data);
+    return this->pos - other.pos;
+}
+
+bool record_index::iterator::operator == (const iterator& other)
+const noexcept (true) {
+    return this->data == other.data and this->pos == other.pos;
+}
+
+record_index::record_index(address_map m) :
+    addr(m),
+    data(std::make_shared< storage >())
+{
     header ghost;
 
     /**
@@ -224,33 +370,85 @@ record_index::record_index(address_map m) : addr(m) {
     ghost.offset = this->addr.base() - ghost.length;
     ghost.format = 0x00;
     ghost.major = 255;
-    this->append(ghost);
+
+    /* the ghost node has no logical extent */
+    this->data->push(entry { ghost, 0 });
 }
 
 bool record_index::contains(std::int64_t n) const noexcept (true) {
+    /*
+     * The logical end of the last record is computed with the index of the
+     * last record, not the number of records, or the last header::size bytes
+     * would be considered unindexed, and seek would look for them in the last
+     * record even when they are in the one before. For the ghost node, the
+     * end is zero.
+     */
     const auto last = this->last();
-    return n < this->addr.logical(last->offset + last->length, this->size());
+    const auto end = last->offset + last->length;
+    return n < this->addr.logical(end, this->index_of(last));
 }
 
 record_index::iterator
-record_index::find(std::int64_t n) const noexcept (false) {
+record_index::find(std::int64_t n, iterator hint) const noexcept (false) {
     assert(this->contains(n));
 
-    auto cur = this->begin();
-    while (true) {
-        const auto pos = this->index_of(cur);
-        const auto off = cur->offset + cur->length;
+    /*
+     * Seeks are often small, and within the current record, in which case
+     * there is no need to search the index. The hint can be the ghost node,
+     * which has no extent.
+     */
+    const auto& s = *this->data;
+    const auto pos = this->index_of(hint);
+    if (pos >= 0) {
+        const auto prev = std::prev(hint);
+        const auto off = prev->offset + prev->length;
+        const auto begin = this->addr.logical(off, pos - 1);
+        const auto end   = s.at(hint.pos).end;
+        if (n >= begin and n < end)
+            return hint;
+    }
 
-        if (n < this->addr.logical(off, pos))
-            return cur;
+    /*
+     * The logical end offsets are increasing, so the record is the first one
+     * whose end is past n. A 2GB file has about 250k records, so a linear
+     * search is noticeably slow.
+     */
+    const auto size = s.size.load(std::memory_order_acquire);
+    auto lo = this->begin().pos;
+    auto hi = size;
+    while (lo < hi) {
+        const auto mid = lo + (hi - lo) / 2;
+        if (s.at(mid).end <= n)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-        cur++;
+    if (lo == size) {
+        const auto msg = "rp66: seek: n = {} not found in index";
+        throw std::logic_error(fmt::format(msg, n));
     }
+
+    return iterator(&s, lo);
 }
 
-void record_index::append(const header& head) noexcept (false) {
+record_index::iterator
+record_index::append(const header& head, const iterator& after)
+noexcept (false) {
+    auto& s = *this->data;
+    assert(after.data == &s);
+
+    std::lock_guard< std::mutex > guard(s.lock);
+    const auto pos = after.pos + 1;
+    if (pos < s.size.load(std::memory_order_relaxed))
+        return iterator(&s, pos);
+
     try {
-        this->push_back(head);
+        const auto itr = iterator(&s, pos);
+        const auto end = head.offset + head.length;
+        const auto logical = this->addr.logical(end, this->index_of(itr));
+        s.push(entry { head, logical });
+        return itr;
     } catch (...) {
         throw runtime_error("rp66: unable to store header");
     }
@@ -258,24 +456,17 @@ void record_index::append(const header& head) noexcept (false) {
 
 record_index::iterator
 record_index::last() const noexcept (true) {
-    return std::prev(this->end());
-}
-
-std::size_t record_index::size() const noexcept (true) {
-    return this->base::size() - 1;
-}
-
-bool record_index::empty() const noexcept (true) {
-    return this->size() == 0;
+    const auto size = this->data->size.load(std::memory_order_acquire);
+    return iterator(this->data.get(), size - 1);
 }
 
 record_index::iterator record_index::begin() const noexcept (true) {
-    return this->base::begin() + 1;
+    return iterator(this->data.get(), 1);
 }
 
 record_index::iterator::difference_type
 record_index::index_of(const iterator& itr) const noexcept (true) {
-    return std::distance(this->begin(), itr);
+    return itr - this->begin();
 }
 
 read_head read_head::ghost(const base_type& b) noexcept (true) {
@@ -348,11 +539,33 @@ rp66::rp66(lfp_protocol* f) :
     this->current = read_head::ghost(this->index.last());
 }
 
+/*
+ * The duplicate shares the index, and its read head is moved to the same
+ * position as the read head of other
+ */
+rp66::rp66(lfp_protocol* f, rp66& other) :
+    fp(f),
+    addr(other.addr),
+    index(other.index),
+    current(other.current)
+{}
+
 void rp66::close() noexcept (false) {
     if(!this->fp) return;
     this->fp.close();
 }
 
+/*
+ * Index the rest of the file, reading only the headers, and the file ends
+ * where the last Visible Record does
+ */
+std::int64_t rp66::size() noexcept (false) {
+    this->index_to(std::numeric_limits< std::int64_t >::max());
+    const auto last = this->index.last();
+    const auto end = last->offset + last->length;
+    return this->addr.logical(end, this->index.index_of(last));
+}
+
 lfp_protocol* rp66::peel() noexcept (false) {
     assert(this->fp);
     return this->fp.release();
@@ -363,6 +576,14 @@ lfp_protocol* rp66::peek() const noexcept (false) {
     return this->fp.get();
 }
 
+lfp_protocol* rp66::dup() noexcept (false) {
+    assert(this->fp);
+    unique_lfp inner(this->fp->dup());
+    auto* copy = new rp66(inner.get(), *this);
+    inner.release();
+    return copy;
+}
+
 lfp_status rp66::readinto(
         void* dst,
         std::int64_t len,
@@ -403,7 +624,7 @@ void rp66::seek(std::int64_t n) noexcept (false) {
      */
 
     if (this->index.contains(n)) {
-        const auto next = this->index.find(n);
+        const auto next = this->index.find(n, this->current);
         const auto pos  = this->index.index_of(next);
         const auto real_offset = this->addr.physical(n, pos);
 
@@ -416,9 +637,9 @@ void rp66::seek(std::int64_t n) noexcept (false) {
      * target is past the already-index'd records, so follow the headers, and
      * index them as we go
      */
-    this->current.move(this->index.last());
+    auto last = this->index.last();
+    this->current.move(last);
     while (true) {
-        const auto last = this->index.last();
         const auto pos  = this->index.index_of(last);
         const auto real_offset = this->addr.physical(n, pos);
         const auto end = last->offset + last->length;
@@ -437,10 +658,288 @@ void rp66::seek(std::int64_t n) noexcept (false) {
 
         this->current.skip();
         this->fp->seek(end);
-        this->read_header_from_disk();
+        last = this->read_header_from_disk(last);
         if (this->eof()) return;
-        this->current.move(this->index.last());
+        this->current.move(last);
+    }
+}
+
+void rp66::index_to(std::int64_t n) noexcept (false) {
+    while (not this->index.contains(n)) {
+        /* the ghost node ends at the base address */
+        const auto last = this->index.last();
+        const auto end = last->offset + last->length;
+
+        std::int64_t m;
+        unsigned char b[header::size];
+        const auto err = this->read_header_at(end, b, &m);
+        if (m == 0 and err == LFP_EOF)
+            break;
+
+        if (m != sizeof(b)) {
+            const auto msg = "rp66: unexpected EOF when reading header "
+                             "- got {} bytes";
+            throw protocol_fatal(fmt::format(msg, m));
+        }
+
+        this->append_header(b, last);
+    }
+}
+
+lfp_status rp66::read_header_at(
+        std::int64_t pos,
+        unsigned char* dst,
+        std::int64_t* nread)
+noexcept (false) {
+    if (this->positional) {
+        try {
+            return this->fp->readat(pos, dst, header::size, nread);
+        } catch (const lfp::error& e) {
+            const auto status = e.status();
+            if (status != LFP_NOTIMPLEMENTED and status != LFP_NOTSUPPORTED)
+                throw;
+            this->positional = false;
+        }
+    }
+
+    const auto here = this->fp->tell();
+    try {
+        this->fp->seek(pos);
+    } catch (const lfp::error& e) {
+        if (e.status() != LFP_INVALID_ARGS)
+            throw;
+        *nread = 0;
+        return LFP_EOF;
+    }
+
+    const auto err = this->fp->readinto(dst, header::size, nread);
+    if (pos + *nread != here)
+        this->fp->seek(here);
+    return err;
+}
+
+/*
+ * Translate the logical offsets through the index, and read the records'
+ * bodies with readat on the underlying file, without touching the read head.
+ * Once the range is indexed, this only reads the index, and is safe to call
+ * from multiple threads.
+ */
+lfp_status rp66::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(offset >= 0);
+    assert(len >= 0);
+
+    if (len > 0 and not this->index.contains(offset + len - 1))
+        this->index_to(offset + len - 1);
+
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+    auto hint = this->index.begin();
+    while (n < len) {
+        const auto logical = offset + n;
+        if (not this->index.contains(logical)) {
+            err = LFP_EOF;
+            break;
+        }
+
+        hint = this->index.find(logical, hint);
+        const auto pos = this->index.index_of(hint);
+        const auto physical = this->addr.physical(logical, pos);
+        const auto end = hint->offset + hint->length;
+        const auto to_read = std::min(len - n, end - physical);
+
+        std::int64_t m;
+        err = this->fp->readat(physical, advance(dst, n), to_read, &m);
+        n += m;
+
+        if (m == to_read)
+            continue;
+
+        if (err == LFP_EOF) {
+            const auto msg = "rp66: unexpected EOF when reading record "
+                             "- got {} bytes, expected {}";
+            throw unexpected_eof(fmt::format(msg, m, to_read));
+        }
+
+        break;
+    }
+
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (n == len)
+        return LFP_OK;
+
+    return err;
+}
+
+/*
+ * Map all the ranges through the index in a single pass, in offset order, and
+ * read the records' bodies from the underlying handle as one batch, so that
+ * it can merge the reads of consecutive records.
+ */
+lfp_status rp66::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    auto order = std::vector< lfp_range* >();
+    std::int64_t end = 0;
+    for (std::int64_t i = 0; i < n; ++i) {
+        if (ranges[i].len == 0)
+            continue;
+
+        order.push_back(ranges + i);
+        end = std::max(end, ranges[i].offset + ranges[i].len);
+    }
+
+    if (order.empty())
+        return LFP_OK;
+
+    const auto by_offset = [](const lfp_range* a, const lfp_range* b) {
+        return a->offset < b->offset;
+    };
+    std::sort(order.begin(), order.end(), by_offset);
+
+    if (not this->index.contains(end - 1))
+        this->index_to(end - 1);
+
+    /*
+     * The physical ranges of all the logical ranges, in order, and how many
+     * there are for each logical range
+     */
+    auto physical = std::vector< lfp_range >();
+    auto pieces = std::vector< std::size_t >();
+    auto eof = false;
+    auto hint = this->index.begin();
+    for (const auto* r : order) {
+        const auto first = physical.size();
+        std::int64_t mapped = 0;
+        if (this->index.contains(r->offset))
+            hint = this->index.find(r->offset, hint);
+
+        while (mapped < r->len) {
+            const auto logical = r->offset + mapped;
+            if (not this->index.contains(logical)) {
+                eof = true;
+                break;
+            }
+
+            /*
+             * Past the first record, the range continues in the next one,
+             * so there is no need to search the index
+             */
+            if (mapped > 0)
+                ++hint;
+
+            const auto pos = this->index.index_of(hint);
+            const auto at = this->addr.physical(logical, pos);
+            const auto body_end = hint->offset + hint->length;
+            const auto to_read = std::min(r->len - mapped, body_end - at);
+            if (to_read > 0) {
+                const auto dst = advance(r->dst, mapped);
+                physical.push_back(lfp_range { at, to_read, dst, 0 });
+                mapped += to_read;
+            }
+        }
+
+        pieces.push_back(physical.size() - first);
+    }
+
+    auto err = LFP_OK;
+    if (not physical.empty()) {
+        const auto size = std::int64_t(physical.size());
+        err = this->fp->readv_at(physical.data(), size);
     }
+
+    auto incomplete = false;
+    auto piece = physical.begin();
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        auto* r = order[i];
+        const auto last = piece + pieces[i];
+        for (; piece != last; ++piece) {
+            r->nread += piece->nread;
+            if (piece->nread == piece->len)
+                continue;
+
+            if (err == LFP_EOF) {
+                const auto msg = "rp66: unexpected EOF when reading record "
+                                 "- got {} bytes, expected {}";
+                throw unexpected_eof(fmt::format(msg, piece->nread, piece->len));
+            }
+
+            incomplete = true;
+            piece = last;
+            break;
+        }
+    }
+
+    if (eof)
+        return LFP_EOF;
+
+    if (incomplete)
+        return LFP_OKINCOMPLETE;
+
+    return LFP_OK;
+}
+
+/*
+ * Bytes in a single record are contiguous in the underlying file, so they are
+ * borrowed from it when it lends. Otherwise they are read into a buffer.
+ */
+lfp_status rp66::borrow(
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail)
+noexcept (false) {
+    assert(not this->lent);
+
+    while (len > 0 and this->current.exhausted() and not this->eof()) {
+        if (this->current == this->index.last()) {
+            const auto next = this->read_header_from_disk(this->current);
+            if (this->eof()) break;
+            this->current.move(next);
+        } else {
+            const auto next = this->current.next_record();
+            this->fp->seek(next.tell());
+            this->current.move(next);
+        }
+    }
+
+    const auto direct = len > 0
+                    and len <= this->current.bytes_left()
+                    and this->fp->lends();
+
+    if (not direct)
+        return lfp_protocol::borrow(len, ptr, avail);
+
+    std::int64_t n;
+    const auto err = this->fp->borrow(len, ptr, &n);
+    this->lent = true;
+
+    if (n < len and err == LFP_EOF) {
+        this->release();
+        const auto msg = "rp66: unexpected EOF when reading record "
+                         "- got {} bytes, expected there to be {} more";
+        throw unexpected_eof(fmt::format(msg, n, len - n));
+    }
+
+    this->current.move(n);
+    *avail = n;
+    return err;
+}
+
+void rp66::release() noexcept (false) {
+    if (not this->lent)
+        return;
+
+    this->lent = false;
+    this->fp->release();
+}
+
+bool rp66::lends() const noexcept (true) {
+    return this->fp->lends();
 }
 
 std::int64_t rp66::readinto(void* dst, std::int64_t len) noexcept (false) {
@@ -452,9 +951,9 @@ std::int64_t rp66::readinto(void* dst, std::int64_t len) noexcept (false) {
             return bytes_read;
         if (this->current.exhausted()) {
             if (this->current == this->index.last()) {
-                this->read_header_from_disk();
+                const auto next = this->read_header_from_disk(this->current);
                 if (this->eof()) return bytes_read;
-                this->current.move(this->index.last());
+                this->current.move(next);
             } else {
                 const auto next = this->current.next_record();
                 this->fp->seek(next.tell());
@@ -500,8 +999,8 @@ std::int64_t rp66::readinto(void* dst, std::int64_t len) noexcept (false) {
     }
 }
 
-void rp66::read_header_from_disk() noexcept (false) {
-    assert(this->current == this->index.last() and this->current.exhausted());
+rp66::iterator rp66::read_header_from_disk(const iterator& after)
+noexcept (false) {
 
     std::int64_t n;
     unsigned char b[header::size];
@@ -522,7 +1021,7 @@ void rp66::read_header_from_disk() noexcept (false) {
              * perfectly fine to exhaust the last VR without EOF being set.
              */
             if (n == 0)
-                return;
+                return after;
             else {
                 const auto msg = "rp66: unexpected EOF when reading header "
                                  "- got {} bytes";
@@ -536,6 +1035,11 @@ void rp66::read_header_from_disk() noexcept (false) {
             );
     }
 
+    return this->append_header(b, after);
+}
+
+rp66::iterator rp66::append_header(unsigned char* b, const iterator& after)
+noexcept (false) {
     // Check the makefile-provided IS_LITTLE_ENDIAN, or the one set by gcc
     #if (defined(IS_LITTLE_ENDIAN) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
         std::reverse(b + 0, b + 2);
@@ -556,16 +1060,14 @@ void rp66::read_header_from_disk() noexcept (false) {
      */
     if (head.format != 0xFF or head.major != 1) {
         const auto msg = "rp66: Incorrect format version in Visible Record {}";
-        throw protocol_fatal( fmt::format(msg, this->index.size() + 1) );
+        const auto record = this->index.index_of(after) + 2;
+        throw protocol_fatal( fmt::format(msg, record) );
     }
 
-    std::int64_t base = this->addr.base();
-    if ( !this->index.empty() ) {
-        base = this->index.last()->offset + this->index.last()->length;
-    }
-    head.offset = base;
+    /* the ghost node ends at the base address */
+    head.offset = after->offset + after->length;
 
-    this->index.append(head);
+    return this->index.append(head, after);
 }
 
 }
@@ -1,26 +1,80 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <ciso646>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
 #include <fmt/format.h>
 
 #include <lfp/protocol.hpp>
 #include <lfp/tapeimage.h>
 
+#include "record_index.hpp"
+
 namespace lfp { namespace {
 
+/*
+ * The prev and next offsets are 32-bit on disk, and wrap around in files
+ * larger than 4GB. In memory they are stored as full 64-bit physical offsets,
+ * reconstructed when the header is read.
+ */
 struct header {
     std::uint32_t type;
-    std::uint32_t prev;
-    std::uint32_t next;
+    std::int64_t  prev;
+    std::int64_t  next;
 
     static constexpr const int size = 12;
 };
 
+/*
+ * Reconstruct the full offsets from the low 32 bits on disk, and the position
+ * of the header they are read from. prev is the closest matching offset
+ * before the header, and next the closest matching offset after it. Records
+ * are assumed to be smaller than 4GB.
+ *
+ * A prev after the header, or a next before it, is only taken to have
+ * wrapped if the file is large enough for it to wrap. Otherwise the offsets
+ * are taken as-is, so that broken headers are still detected. end is the
+ * physical end of the file, or max if it is not known.
+ */
+std::int64_t full_prev(std::uint32_t prev, std::int64_t pos) noexcept (true) {
+    const auto wrap = std::int64_t(1) << 32;
+    const auto high = pos & ~(wrap - 1);
+    const auto full = high | prev;
+    if (full > pos and high > 0)
+        return full - wrap;
+    return full;
+}
+
+std::int64_t full_next(std::uint32_t next, std::int64_t pos, std::int64_t end)
+noexcept (true) {
+    const auto wrap = std::int64_t(1) << 32;
+    const auto high = pos & ~(wrap - 1);
+    const auto full = high | next;
+    if (full <= pos and full <= end - wrap)
+        return full + wrap;
+    return full;
+}
+
+/*
+ * A header as it is stored on disk.
+ */
+using raw_header = std::array< unsigned char, header::size >;
+
 /**
  * Address translator between physical offsets (provided by the underlying
  * file) and logical offsets (presented to the user).
@@ -34,7 +88,8 @@ public:
      * Get the logical address from the physical address, i.e. the one reported
      * by tapeimage::tell(), in the bytestream with no interleaved headers.
      */
-    std::int64_t logical(std::int64_t addr, int record) const noexcept (true);
+    std::int64_t logical(std::int64_t addr, std::int64_t record)
+    const noexcept (true);
     /**
      * Get the physical address from the logical address, i.e. the address with
      * headers accounted for.
@@ -43,7 +98,8 @@ public:
      * -------
      *  This function assumes the physical address within record.
      */
-    std::int64_t physical(std::int64_t addr, int record) const noexcept (true);
+    std::int64_t physical(std::int64_t addr, std::int64_t record)
+    const noexcept (true);
 
     /**
      * Base address of the map, i.e. the first possible address. This is
@@ -72,12 +128,55 @@ private:
  *  Two ghosts are needed to not invoke undefined behaviour when adding the
  *  first header from the file, as prev(last) where last = ghost would then be
  *  outside the index.
+ *
+ *  The logical end offset of every (non-ghost) record is stored alongside its
+ *  header, so that a logical offset can be looked up with a single binary
+ *  search.
+ *
+ *  The index is shared between a handle and its duplicates (lfp_dup), which
+ *  may be used from other threads, so that a header read by any of them is
+ *  available to all. The index is append-only, and the entries are stored in
+ *  segments that double in size and never move, so iterators stay valid when
+ *  the index grows. Appends are serialised with a lock, and published by
+ *  storing the new size. Readers never lock - they only see the entries that
+ *  were complete when they loaded the size.
  */
-class record_index : private std::vector< header > {
-    using base = std::vector< header >;
+class record_index {
+    struct entry {
+        header head;
+        std::int64_t end;
+    };
+
+    using storage = segmented_storage< entry >;
 
 public:
-    using iterator = base::const_iterator;
+    class iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type        = header;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const header*;
+        using reference         = const header&;
+
+        iterator() = default;
+
+        reference operator * () const noexcept (true);
+        pointer   operator -> () const noexcept (true);
+
+        iterator& operator ++ () noexcept (true);
+        iterator& operator -- () noexcept (true);
+        difference_type operator - (const iterator&) const noexcept (true);
+
+        bool operator == (const iterator&) const noexcept (true);
+        bool operator != (const iterator&) const noexcept (true);
+
+    private:
+        friend class record_index;
+        iterator(const storage* s, difference_type i) : data(s), pos(i) {}
+
+        const storage* data = nullptr;
+        difference_type pos = 0;
+    };
 
     explicit record_index(address_map m);
 
@@ -95,17 +194,23 @@ public:
      */
     iterator find(std::int64_t n, iterator hint) const noexcept (false);
 
-    void append(const header&) noexcept (false);
+    /*
+     * Append the header that follows after, and get an iterator to it. If the
+     * index already has a header after it, e.g. because a duplicate got there
+     * first, the index is unchanged, and that header is returned instead.
+     */
+    iterator append(const header&, const iterator& after) noexcept (false);
 
     iterator last() const noexcept (true);
     std::size_t size() const noexcept (true);
-    bool empty() const noexcept (true);
     iterator begin() const noexcept (true);
+    iterator end() const noexcept (true);
 
     iterator::difference_type index_of(const iterator&) const noexcept (true);
 
 private:
     address_map addr;
+    std::shared_ptr< storage > data;
 };
 
 /**
@@ -180,37 +285,179 @@ public:
     void close() noexcept (false) override;
     lfp_status readinto(void* dst, std::int64_t len, std::int64_t* bytes_read)
         noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readv_at(lfp_range* ranges, std::int64_t n)
+        noexcept (false) override;
+    lfp_status borrow(
+            std::int64_t len,
+            const void** ptr,
+            std::int64_t* avail)
+        noexcept (false) override;
+    void release() noexcept (false) override;
+    bool lends() const noexcept (true) override;
+    bool concurrent_readat() const noexcept (true) override;
 
     int eof() const noexcept (true) override;
 
     void seek(std::int64_t)   noexcept (false) override;
     std::int64_t tell() const noexcept (false) override;
+    std::int64_t size()       noexcept (false) override;
     lfp_protocol* peel() noexcept (false) override;
     lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+    std::int64_t index_size() const noexcept (true);
+    void dump_index(void* dst, std::int64_t len) const noexcept (false);
+    void load_index(const void* src, std::int64_t len) noexcept (false);
+    void build_index() noexcept (false);
+    void build_index(int threads) noexcept (false);
+    void append_headers(const std::vector< raw_header >&) noexcept (false);
+    void set_resync(bool enable) noexcept (true);
+    lfp_status next_record(int* type, std::int64_t* offset, std::int64_t* len)
+        noexcept (false);
 
-private:
     static constexpr const std::uint32_t record = 0;
     static constexpr const std::uint32_t file   = 1;
 
+private:
+    /*
+     * Make a duplicate of other, that reads from f, the duplicate of its
+     * underlying file
+     */
+    tapeimage(lfp_protocol* f, tapeimage& other);
+
     address_map addr;
     unique_lfp fp;
     record_index index;
     read_head current;
 
     std::int64_t readinto(void* dst, std::int64_t) noexcept (false);
-    void read_header_from_disk() noexcept (false);
 
-    lfp_status recovery = LFP_OK;
+    /*
+     * Read, check, and index the header that follows after, and get the
+     * header from the index. The index may have grown past after, e.g. by a
+     * duplicate in another thread, in which case the header is already
+     * indexed, and the one in the index is returned.
+     */
+    using iterator = record_index::iterator;
+    iterator read_header_from_disk(const iterator& after) noexcept (false);
+    iterator append_header(
+            const unsigned char* b,
+            const iterator& after,
+            bool positional = false)
+        noexcept (false);
+    iterator append_header_strict(const unsigned char* b, const iterator& after)
+        noexcept (false);
+
+    /*
+     * Recover from a broken header by searching forward for the next header
+     * that is consistent with its neighbour, and append a header that covers
+     * the broken area as a single record. The record is reported with
+     * LFP_PROTOCOL_TRYRECOVERY. Throws if no header can be found. If
+     * positional is set, the file is searched with readat, and the read
+     * buffer is not touched.
+     */
+    iterator resynchronise(const iterator& broken, bool positional = false)
+        noexcept (false);
+    bool resync = false;
+    std::int64_t resync_target = -1;
+
+    /*
+     * Read len bytes from the physical offset pos, using the read buffer.
+     *
+     * Reads are served from the buffer when possible. Otherwise, small reads
+     * refill the buffer with a single large read from the underlying file,
+     * which usually covers many (small) records and their headers. Large
+     * reads go straight into dst. The underlying file is only seeked when it
+     * is not already at pos.
+     *
+     * The return value and nread have the same meaning as for readinto().
+     */
+    lfp_status read_at(
+            std::int64_t pos,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* nread)
+        noexcept (false);
+
+    /*
+     * Seek the underlying file to pos, unless it is already there.
+     */
+    void seek_underlying(std::int64_t pos) const noexcept (false);
+
+    /*
+     * The physical end of the underlying file, or max if it does not know
+     * its size. It is asked every time, since the file may grow.
+     */
+    std::int64_t physical_end() noexcept (false);
+
+    /*
+     * The size of the underlying file, which ties a dumped index to it, or
+     * -1 if it does not know its size
+     */
+    std::int64_t underlying_size() const noexcept (false);
+
+    static constexpr const std::int64_t buffer_size = 64 * 1024;
+    std::vector< unsigned char > buffer;
+    std::int64_t buffer_begin = 0;
+    std::int64_t buffer_end = 0;
+
+    /*
+     * The physical position of the underlying file, which is usually ahead of
+     * the read head because of the read buffer.
+     */
+    mutable std::int64_t inner_pos;
+
+    /*
+     * The borrowed bytes were borrowed from the underlying file, which must
+     * be released with them
+     */
+    bool lent = false;
+
+    /*
+     * Read and index headers until the logical offset n is covered by the
+     * index, or the end-of-file mark is found.
+     *
+     * Rather than reading every header on its own, the underlying file is
+     * read in blocks, and all headers in a block are decoded before the next
+     * read is issued. The block size starts small and grows with every read,
+     * so that short scans do not read far ahead. Records that are larger than
+     * the block are skipped over by only reading the next header.
+     *
+     * The underlying file position is left undefined, unless positional is
+     * set. Then the blocks are read with readat into a buffer of their own,
+     * and neither the underlying file position, the read buffer, nor the
+     * scan buffer is touched, so positional scans can run in several threads.
+     */
+    void scan_headers(std::int64_t n, bool positional = false)
+        noexcept (false);
+    std::vector< unsigned char > scanbuf;
+
+    /*
+     * Serialises append_header, since readat and readv_at index from
+     * multiple threads, at the same time as readinto. Checking and appending
+     * headers reads and changes resync_target and recovery, so only one
+     * thread at a time may append. Recovery is atomic, so that it can be
+     * checked on every read without the lock.
+     */
+    std::mutex indexing;
+
+    std::atomic< lfp_status > recovery { LFP_OK };
 };
 
 std::int64_t
-address_map::logical(std::int64_t addr, int record)
+address_map::logical(std::int64_t addr, std::int64_t record)
 const noexcept (true) {
     return addr - (header::size * (1 + record)) - this->zero;
 }
 
 std::int64_t
-address_map::physical(std::int64_t addr, int record)
+address_map::physical(std::int64_t addr, std::int64_t record)
 const noexcept (true) {
     return addr + (header::size * (1 + record)) + this->zero;
 }
@@ -219,13 +466,55 @@ std::int64_t address_map::base() const noexcept (true) {
     return this->zero;
 }
 
-record_index::record_index(address_map m) : addr(m) {
+record_index::iterator::reference
+record_index::iterator::operator * () const noexcept (true) {
+    return this->data->at(this->pos).head;
+}
+
+record_index::iterator::pointer
+record_index::iterator::operator -> () const noexcept (true) {
+    return &this->data->at(this->pos).head;
+}
+
+record_index::iterator& record_index::iterator::operator ++ () noexcept (true) {
+    this->pos += 1;
+    return *this;
+}
+
+record_index::iterator& record_index::iterator::operator -- () noexcept (true) {
+    this->pos -= 1;
+    return *this;
+}
+
+record_index::iterator::difference_type
+record_index::iterator::operator - (const iterator& other)
+const noexcept (true) {
+    assert(this->data == other.data);
+    return this->pos - other.pos;
+}
+
+bool record_index::iterator::operator == (const iterator& other)
+const noexcept (true) {
+    return this->data == other.data and this->pos == other.pos;
+}
+
+bool record_index::iterator::operator != (const iterator& other)
+const noexcept (true) {
+    return not (*this == other);
+}
+
+record_index::record_index(address_map m) :
+    addr(m),
+    data(std::make_shared< storage >())
+{
     header ghost;
     ghost.type = -1;
     ghost.prev = m.base();
     ghost.next = m.base();
-    this->append(ghost);
-    this->append(ghost);
+
+    /* the ghost nodes have no logical extent */
+    this->data->push(entry { ghost, 0 });
+    this->data->push(entry { ghost, 0 });
 }
 
 bool record_index::contains(std::int64_t n) const noexcept (true) {
@@ -262,69 +551,53 @@ record_index::find(std::int64_t n, iterator hint) const noexcept (false) {
         return hint;
     }
 
-    const auto begin = this->begin();
-    const auto end   = this->end();
-
     /**
      * Look up the record containing the logical offset n in the index.
      *
      * seek() is a pretty common operation, and experience from dlisio [1]
      * shows that a poor algorithm here significantly slows down programs.
      *
-     * The algorithm actually makes two searches:
-     *
-     * Phase 1 is an approximating binary search that pretends the logical and
-     * phyiscal offset are the same. Since phyiscal offset >= logical offset,
-     * we know that the result is always correct or before the correct one in
-     * the ordered index.
-     *
-     * Phase 2 is a linear search from [cur, end) that is aware of the
-     * logical/physical offset distinction. Because of the approximation, it
-     * should do fairly few hops.
-     *
-     * The main reason for the two-phase search is that an elements' index is
-     * required to compare logical addresses to physical ones, and upper_bound
-     * is oblivious to the current item's position.
+     * The logical end offsets are increasing, so the record is the first one
+     * whose end is past n. The ends are computed when the header is appended,
+     * as the header contribution depends on the position in the index.
      *
      * [1] https://github.com/equinor/dlisio
      */
+    const auto& s = *this->data;
+    const auto size = s.size.load(std::memory_order_acquire);
+    auto lo = this->begin().pos;
+    auto hi = size;
+    while (lo < hi) {
+        const auto mid = lo + (hi - lo) / 2;
+        if (s.at(mid).end <= n)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    // phase 1
-    const auto addr = this->addr;
-    auto less = [addr] (std::int64_t n, const header& h) noexcept (true) {
-        return n < addr.logical(h.next, 0);
-    };
-    const auto lower = std::upper_bound(begin, end, n, less);
-
-    // phase 2
-    /*
-     * We found the right record when record->next > n. All hits after will
-     * also be a match, but this is ok since the search is in an ordered list.
-     *
-     * Using a mutable lambda to carry the header contribution is a pretty
-     * convoluted approach, but both the element *and* the header sizes need to
-     * be accounted for, and the latter is only available through the
-     * *position* in the index, which doesn't play so well with the std
-     * algorithms. The use of lambda + find-if is still valuable though, as it
-     * gives a clean error check if the offset n is somehow *not* in the index.
-     */
-    auto pos = this->index_of(lower);
-    auto next_larger = [addr, n, pos] (const header& rec) mutable {
-        return n < addr.logical(rec.next, pos++);
-    };
-
-    const auto cur = std::find_if(lower, end, next_larger);
-    if (cur >= this->end()) {
+    if (lo == size) {
         const auto msg = "seek: n = {} not found in index, end->next = {}";
-        throw std::logic_error(fmt::format(msg, n, this->back().next));
+        throw std::logic_error(fmt::format(msg, n, this->last()->next));
     }
 
-    return cur;
+    return iterator(&s, lo);
 }
 
-void record_index::append(const header& h) noexcept (false) {
+record_index::iterator
+record_index::append(const header& h, const iterator& after) noexcept (false) {
+    auto& s = *this->data;
+    assert(after.data == &s);
+
+    std::lock_guard< std::mutex > guard(s.lock);
+    const auto pos = after.pos + 1;
+    if (pos < s.size.load(std::memory_order_relaxed))
+        return iterator(&s, pos);
+
     try {
-        this->push_back(h);
+        const auto itr = iterator(&s, pos);
+        const auto end = this->addr.logical(h.next, this->index_of(itr));
+        s.push(entry { h, end });
+        return itr;
     } catch (...) {
         throw runtime_error("tapeimage: unable to store header");
     }
@@ -335,21 +608,22 @@ record_index::iterator record_index::last() const noexcept (true) {
 }
 
 std::size_t record_index::size() const noexcept (true) {
-    return this->base::size() - 2;
-}
-
-bool record_index::empty() const noexcept (true) {
-    return this->size() == 0;
+    return std::size_t(this->index_of(this->end()));
 }
 
 record_index::iterator record_index::begin() const noexcept (true) {
     /* don't even consider the ghost nodes in [begin, end) */
-    return this->base::begin() + 2;
+    return iterator(this->data.get(), 2);
+}
+
+record_index::iterator record_index::end() const noexcept (true) {
+    const auto size = this->data->size.load(std::memory_order_acquire);
+    return iterator(this->data.get(), size);
 }
 
 record_index::iterator::difference_type
 record_index::index_of(const iterator& itr) const noexcept (true) {
-    return std::distance(this->begin(), itr);
+    return itr - this->begin();
 }
 
 read_head read_head::ghost(const base_type& b) noexcept (true) {
@@ -379,11 +653,6 @@ void read_head::move(std::int64_t n) noexcept (false) {
 
 void read_head::move(const base_type& itr) noexcept (true) {
     assert(this->remaining >= 0);
-    /*
-     * This is carefully implemented not to reference any this-> members, as
-     * the underlying iterator may have been invalidated by an index append.
-     * move() is the correct way to position the read_head in a new record.
-     */
     const auto base_offset = std::prev(itr)->next + header::size;
     read_head copy(itr);
     copy.remaining = copy->next - base_offset;
@@ -421,26 +690,60 @@ std::int64_t baseaddr(lfp_protocol* f) noexcept (false) {
 tapeimage::tapeimage(lfp_protocol* f) :
     addr(baseaddr(f)),
     fp(f),
-    index(this->addr)
+    index(this->addr),
+    inner_pos(this->addr.base())
 {
     this->current = read_head::ghost(this->index.last());
 }
 
+/*
+ * The duplicate shares the index, and starts with an empty read buffer. Its
+ * underlying file is seeked before the first read, as it may not be where
+ * the underlying file of other is.
+ */
+tapeimage::tapeimage(lfp_protocol* f, tapeimage& other) :
+    addr(other.addr),
+    fp(f),
+    index(other.index),
+    current(other.current),
+    inner_pos(-1)
+{
+    std::lock_guard< std::mutex > guard(other.indexing);
+    this->resync = other.resync;
+    this->resync_target = other.resync_target;
+    this->recovery = other.recovery.load();
+}
+
 void tapeimage::close() noexcept (false) {
     if(!this->fp) return;
     this->fp.close();
 }
 
+/*
+ * Because of the read buffer, the underlying file is usually ahead of the
+ * tapeimage. Before it is exposed, it is moved to the byte following the
+ * last byte read through the tapeimage, as if there was no buffering.
+ */
 lfp_protocol* tapeimage::peel() noexcept (false) {
     assert(this->fp);
+    this->seek_underlying(this->current.tell());
     return this->fp.release();
 }
 
 lfp_protocol* tapeimage::peek() const noexcept (false) {
     assert(this->fp);
+    this->seek_underlying(this->current.tell());
     return this->fp.get();
 }
 
+lfp_protocol* tapeimage::dup() noexcept (false) {
+    assert(this->fp);
+    unique_lfp inner(this->fp->dup());
+    auto* copy = new tapeimage(inner.get(), *this);
+    inner.release();
+    return copy;
+}
+
 lfp_status tapeimage::readinto(
         void* dst,
         std::int64_t len,
@@ -475,14 +778,10 @@ std::int64_t tapeimage::readinto(void* dst, std::int64_t len) noexcept (false) {
             return bytes_read;
 
         if (this->current.exhausted()) {
-            if (this->current == this->index.last()) {
-                this->read_header_from_disk();
-                this->current.move(this->index.last());
-            } else {
-                const auto next = this->current.next_record();
-                this->fp->seek(next.tell());
-                this->current.move(next);
-            }
+            if (this->current == this->index.last())
+                this->current.move(this->read_header_from_disk(this->current));
+            else
+                this->current.move(this->current.next_record());
 
             /* might be EOF, or even empty records, so re-start  */
             continue;
@@ -491,7 +790,7 @@ std::int64_t tapeimage::readinto(void* dst, std::int64_t len) noexcept (false) {
         assert(not this->current.exhausted());
         std::int64_t n;
         const auto to_read = std::min(len, this->current.bytes_left());
-        const auto err = this->fp->readinto(dst, to_read, &n);
+        const auto err = this->read_at(this->current.tell(), dst, to_read, &n);
         assert(err == LFP_OKINCOMPLETE ? (n < to_read) : true);
         assert(err == LFP_EOF ? (n < to_read) : true);
 
@@ -526,6 +825,303 @@ std::int64_t tapeimage::readinto(void* dst, std::int64_t len) noexcept (false) {
     }
 }
 
+/*
+ * Bytes in a single record are contiguous, so they are lent straight from the
+ * read buffer when it has them, or from the underlying file when it lends.
+ * Otherwise, e.g. for bytes across a record boundary, they are read into a
+ * buffer like any other read, which also refills the read buffer.
+ */
+lfp_status tapeimage::borrow(
+        std::int64_t len,
+        const void** ptr,
+        std::int64_t* avail)
+noexcept (false) {
+    assert(not this->lent);
+
+    while (len > 0 and this->current.exhausted() and not this->eof()) {
+        if (this->current == this->index.last())
+            this->current.move(this->read_header_from_disk(this->current));
+        else
+            this->current.move(this->current.next_record());
+    }
+
+    if (len == 0 or len > this->current.bytes_left())
+        return lfp_protocol::borrow(len, ptr, avail);
+
+    const auto pos = this->current.tell();
+    const auto buffered = pos >= this->buffer_begin
+                      and pos + len <= this->buffer_end;
+
+    if (buffered) {
+        *ptr = this->buffer.data() + (pos - this->buffer_begin);
+        *avail = len;
+        this->current.move(len);
+        return this->recovery ? this->recovery.load() : LFP_OK;
+    }
+
+    if (not this->fp->lends())
+        return lfp_protocol::borrow(len, ptr, avail);
+
+    std::int64_t n;
+    this->seek_underlying(pos);
+    const auto err = this->fp->borrow(len, ptr, &n);
+    this->inner_pos = pos + n;
+    this->lent = true;
+
+    if (n < len and err == LFP_EOF) {
+        this->release();
+        const auto msg = "tapeimage: unexpected EOF when reading record "
+                         "- got {} bytes, expected {}";
+        throw unexpected_eof(fmt::format(msg, n, len));
+    }
+
+    this->current.move(n);
+    *avail = n;
+
+    if (n < len)
+        return err;
+
+    return this->recovery ? this->recovery.load() : LFP_OK;
+}
+
+void tapeimage::release() noexcept (false) {
+    if (not this->lent)
+        return;
+
+    this->lent = false;
+    this->fp->release();
+}
+
+/*
+ * Borrowing is never more expensive than reading, since bytes are lent from
+ * the read buffer even when the underlying file does not lend
+ */
+bool tapeimage::lends() const noexcept (true) {
+    return true;
+}
+
+/*
+ * Unindexed ranges are indexed under a lock, so readat is as safe as the
+ * underlying file's readat
+ */
+bool tapeimage::concurrent_readat() const noexcept (true) {
+    return this->fp->concurrent_readat();
+}
+
+/*
+ * Translate the logical offsets through the index, and read the records'
+ * bodies with readat on the underlying file. Unindexed ranges are indexed
+ * first, with readat too, and the headers are appended under the indexing
+ * lock. Neither the read head nor the read buffer is touched, so this is safe
+ * to call from multiple threads. Like readinto, this reports
+ * LFP_PROTOCOL_TRYRECOVERY once a broken header has been resynchronised.
+ */
+lfp_status tapeimage::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(offset >= 0);
+    assert(len >= 0);
+
+    if (len > 0 and not this->index.contains(offset + len - 1))
+        this->scan_headers(offset + len, true);
+
+    std::int64_t n = 0;
+    lfp_status err = LFP_OK;
+    auto hint = this->index.begin();
+    while (n < len) {
+        const auto logical = offset + n;
+        if (not this->index.contains(logical)) {
+            err = LFP_EOF;
+            break;
+        }
+
+        hint = this->index.find(logical, hint);
+        if (hint->type == tapeimage::file) {
+            err = LFP_EOF;
+            break;
+        }
+
+        const auto pos = this->index.index_of(hint);
+        const auto physical = this->addr.physical(logical, pos);
+        const auto to_read = std::min(len - n, hint->next - physical);
+
+        std::int64_t m;
+        err = this->fp->readat(physical, advance(dst, n), to_read, &m);
+        n += m;
+
+        if (m == to_read)
+            continue;
+
+        if (err == LFP_EOF) {
+            const auto msg = "tapeimage: unexpected EOF when reading record "
+                             "- got {} bytes, expected {}";
+            throw unexpected_eof(fmt::format(msg, m, to_read));
+        }
+
+        break;
+    }
+
+    if (bytes_read)
+        *bytes_read = n;
+
+    if (this->recovery)
+        return this->recovery;
+
+    if (n == len)
+        return LFP_OK;
+
+    return err;
+}
+
+/*
+ * Map all the ranges through the index in a single pass, in offset order, and
+ * read the records' bodies from the underlying handle as one batch. The
+ * bodies of consecutive records are only separated by a header, so the
+ * underlying handle can usually read them together.
+ */
+lfp_status tapeimage::readv_at(lfp_range* ranges, std::int64_t n)
+noexcept (false) {
+    auto order = std::vector< lfp_range* >();
+    std::int64_t end = 0;
+    for (std::int64_t i = 0; i < n; ++i) {
+        if (ranges[i].len == 0)
+            continue;
+
+        order.push_back(ranges + i);
+        end = std::max(end, ranges[i].offset + ranges[i].len);
+    }
+
+    if (order.empty())
+        return LFP_OK;
+
+    const auto by_offset = [](const lfp_range* a, const lfp_range* b) {
+        return a->offset < b->offset;
+    };
+    std::sort(order.begin(), order.end(), by_offset);
+
+    if (not this->index.contains(end - 1))
+        this->scan_headers(end, true);
+
+    /*
+     * The physical ranges of all the logical ranges, in order, and how many
+     * there are for each logical range
+     */
+    auto physical = std::vector< lfp_range >();
+    auto pieces = std::vector< std::size_t >();
+    auto eof = false;
+    auto hint = this->index.begin();
+    for (const auto* r : order) {
+        const auto first = physical.size();
+        std::int64_t mapped = 0;
+        if (this->index.contains(r->offset))
+            hint = this->index.find(r->offset, hint);
+
+        while (mapped < r->len) {
+            const auto logical = r->offset + mapped;
+            if (not this->index.contains(logical)) {
+                eof = true;
+                break;
+            }
+
+            /*
+             * Past the first record, the range continues in the next one,
+             * so there is no need to search the index
+             */
+            if (mapped > 0)
+                ++hint;
+
+            if (hint->type == tapeimage::file) {
+                eof = true;
+                break;
+            }
+
+            const auto pos = this->index.index_of(hint);
+            const auto at = this->addr.physical(logical, pos);
+            const auto to_read = std::min(r->len - mapped, hint->next - at);
+            if (to_read > 0) {
+                const auto dst = advance(r->dst, mapped);
+                physical.push_back(lfp_range { at, to_read, dst, 0 });
+                mapped += to_read;
+            }
+        }
+
+        pieces.push_back(physical.size() - first);
+    }
+
+    auto err = LFP_OK;
+    if (not physical.empty()) {
+        const auto size = std::int64_t(physical.size());
+        err = this->fp->readv_at(physical.data(), size);
+    }
+
+    auto incomplete = false;
+    auto piece = physical.begin();
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        auto* r = order[i];
+        const auto last = piece + pieces[i];
+        for (; piece != last; ++piece) {
+            r->nread += piece->nread;
+            if (piece->nread == piece->len)
+                continue;
+
+            if (err == LFP_EOF) {
+                const auto msg = "tapeimage: unexpected EOF when reading "
+                                 "record - got {} bytes, expected {}";
+                throw unexpected_eof(fmt::format(msg, piece->nread, piece->len));
+            }
+
+            incomplete = true;
+            piece = last;
+            break;
+        }
+    }
+
+    if (this->recovery)
+        return this->recovery;
+
+    if (eof)
+        return LFP_EOF;
+
+    if (incomplete)
+        return LFP_OKINCOMPLETE;
+
+    return LFP_OK;
+}
+
+lfp_status tapeimage::next_record(
+        int* type,
+        std::int64_t* offset,
+        std::int64_t* len)
+noexcept (false) {
+    if (this->eof())
+        return LFP_EOF;
+
+    /*
+     * Only the header is read, and only if the next record is not indexed
+     * already - the body is never touched, so skipping records is cheap.
+     */
+    if (this->current == this->index.last())
+        this->current.move(this->read_header_from_disk(this->current));
+    else
+        this->current.move(this->current.next_record());
+
+    const auto pos = this->index.index_of(this->current);
+    if (type)   *type   = this->current->type;
+    if (offset) *offset = this->addr.logical(this->current.tell(), pos);
+    if (len)    *len    = this->current.bytes_left();
+
+    if (this->recovery)
+        return this->recovery;
+
+    if (this->eof())
+        return LFP_EOF;
+
+    return LFP_OK;
+}
+
 // TODO: status instead of boolean?
 int tapeimage::eof() const noexcept (true) {
     // TODO: consider when this says record, but physical file is EOF
@@ -533,19 +1129,12 @@ int tapeimage::eof() const noexcept (true) {
     return this->current->type == tapeimage::file;
 }
 
-void tapeimage::read_header_from_disk() noexcept (false) {
-    try {
-        /*
-         * This method should only be called when the underlying file pointer
-         * is exactly at the start of a header
-         */
-        assert(this->index.last()->next == this->fp->tell());
-    } catch (const lfp::error&) {
-    }
-
+tapeimage::iterator
+tapeimage::read_header_from_disk(const iterator& after) noexcept (false) {
     std::int64_t n;
-    unsigned char b[sizeof(std::uint32_t) * 3];
-    const auto err = this->fp->readinto(b, sizeof(b), &n);
+    unsigned char b[header::size];
+    const auto head = after->next;
+    const auto err = this->read_at(head, b, sizeof(b), &n);
 
     /* TODO: should also check INCOMPLETE */
     switch (err) {
@@ -573,16 +1162,71 @@ void tapeimage::read_header_from_disk() noexcept (false) {
             );
     }
 
-    // Check the makefile-provided IS_BIG_ENDIAN, or the one set by gcc
-    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return this->append_header(b, after);
+}
+
+tapeimage::iterator
+tapeimage::append_header(
+        const unsigned char* src,
+        const iterator& after,
+        bool positional)
+noexcept (false) {
+    std::lock_guard< std::mutex > guard(this->indexing);
+
+    /* another thread got here first */
+    if (after != this->index.last())
+        return std::next(after);
+
+    if (not this->resync)
+        return this->append_header_strict(src, after);
+
+    try {
+        return this->append_header_strict(src, after);
+    } catch (const lfp::error&) {
+        return this->resynchronise(after, positional);
+    }
+}
+
+tapeimage::iterator
+tapeimage::append_header_strict(const unsigned char* src, const iterator& after)
+noexcept (false) {
+    unsigned char b[header::size];
+    std::memcpy(b, src, sizeof(b));
+
+    // Check the makefile-provided IS_BIG_ENDIAN, or the one set by gcc
+    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
         std::reverse(b + 0, b + 4);
         std::reverse(b + 4, b + 8);
         std::reverse(b + 8, b + 12);
     #endif
+    std::uint32_t prev;
+    std::uint32_t next;
     header head;
     std::memcpy(&head.type, b + 0 * 4, 4);
-    std::memcpy(&head.prev, b + 1 * 4, 4);
-    std::memcpy(&head.next, b + 2 * 4, 4);
+    std::memcpy(&prev,      b + 1 * 4, 4);
+    std::memcpy(&next,      b + 2 * 4, 4);
+
+    /*
+     * The offsets wrap around at 4GB, so only the low 32 bits are stored on
+     * disk. The position of this header is known though, so the high bits are
+     * reconstructed from it. The size of the file is only needed when next
+     * looks like it wrapped, which is rare.
+     */
+    const auto position = after->next;
+    const auto wrap = std::int64_t(1) << 32;
+    const auto high = position & ~(wrap - 1);
+    const auto end = (high | next) <= position
+                   ? this->physical_end()
+                   : std::numeric_limits< std::int64_t >::max();
+    head.prev = full_prev(prev, position);
+    head.next = full_next(next, position, end);
+
+    /*
+     * The header found by resynchronise() follows the header that covers the
+     * broken area, which it does not know about, so its prev is patched.
+     */
+    if (position == this->resync_target)
+        head.prev = std::prev(after)->next;
 
     const auto header_type_consistent = head.type == tapeimage::record or
                                         head.type == tapeimage::file;
@@ -611,10 +1255,6 @@ void tapeimage::read_header_from_disk() noexcept (false) {
          * likely either the previous pointer which is broken, or this entire
          * header.
          *
-         * This will happen for over 4GB files. As we do not support them at
-         * the moment, this check should detect them and prevent further
-         * invalid state.
-         *
          * At least for now, consider it a non-recoverable error.
          */
         if (!header_type_consistent) {
@@ -624,12 +1264,23 @@ void tapeimage::read_header_from_disk() noexcept (false) {
             throw protocol_fatal(fmt::format(msg, head.next, head.prev));
         } else {
             const auto msg = "file corrupt: head.next (= {}) <= head.prev "
-                             "(= {}). File size might be > 4GB";
+                             "(= {})";
             throw protocol_fatal(fmt::format(msg, head.next, head.prev));
         }
     }
 
-    if (this->index.size() >= 2) {
+    if (head.next < position + header::size) {
+        /*
+         * The record would end before its header does. A next that wrapped
+         * around at 4GB is already accounted for, so this is broken too.
+         */
+        const auto msg = "file corrupt: head.next (= {}) is before the end "
+                         "of the header (= {})";
+        throw protocol_fatal(
+              fmt::format(msg, head.next, position + header::size));
+    }
+
+    if (this->index.index_of(after) >= 1) {
         /*
          * backpointer is not consistent with this header's previous - this is
          * recoverable, under the assumption it's the *back pointer* that is
@@ -641,7 +1292,7 @@ void tapeimage::read_header_from_disk() noexcept (false) {
          *
          * TODO: should taint the handle, unless explicitly cleared
          */
-        const auto& back2 = *std::prev(this->index.last());
+        const auto& back2 = *std::prev(after);
         if (head.prev != back2.next) {
             if (this->recovery) {
                 const auto msg = "file corrupt: head.prev (= {}) != "
@@ -654,7 +1305,7 @@ void tapeimage::read_header_from_disk() noexcept (false) {
             this->recovery = LFP_PROTOCOL_TRYRECOVERY;
             head.prev = back2.next;
         }
-    } else if (this->recovery and not this->index.empty()) {
+    } else if (this->recovery and this->index.index_of(after) == 0) {
         /*
          * In this case we have just two headers (A and B)
          * ------------------------
@@ -672,70 +1323,240 @@ void tapeimage::read_header_from_disk() noexcept (false) {
         }
     }
 
-    this->index.append(head);
+    return this->index.append(head, after);
 }
 
 void tapeimage::seek(std::int64_t n) noexcept (false) {
     assert(n >= 0);
 
-    if (std::numeric_limits<std::uint32_t>::max() < n)
-        throw invalid_args("Too big seek offset. TIF protocol does not "
-                           "support files larger than 4GB");
+    /*
+     * The target is beyond what we have indexed, so chase the headers and add
+     * them to the index
+     */
+    if (not this->index.contains(n))
+        this->scan_headers(n);
 
-    if (this->index.contains(n)) {
+    /*
+     * Duplicates may add to the index at any time, so the last header is only
+     * looked up once, and the rest of the seek is relative to it.
+     */
+    const auto last = this->index.last();
+    const auto pos  = this->index.index_of(last);
+    const auto real_offset = this->addr.physical(n, pos);
+
+    if (real_offset < last->next) {
         const auto next = this->index.find(n, this->current);
-        const auto pos  = this->index.index_of(next);
-        const auto real_offset = this->addr.physical(n, pos);
+        const auto at = this->addr.physical(n, this->index.index_of(next));
 
-        this->fp->seek(real_offset);
         this->current.move(next);
-        assert(real_offset >= this->current.tell());
-        this->current.move(real_offset - this->current.tell());
+        assert(at >= this->current.tell());
+        this->current.move(at - this->current.tell());
         return;
     }
 
+    this->current.move(last);
+
     /*
-     * The target is beyond what we have indexed, so chase the headers and add
-     * them to the index as we go
+     * When doing a cold seek(n), and n happens to be at the start of a
+     * record, stop before reading the last header. This supports the case
+     * where the header is broken, and makes cold seek() consistent with
+     * readinto() to the same byte. If the header is broken, the next read
+     * would fail anyway, but it might be that this address is seek()'d to,
+     * and a following readinto() never happens.
+     */
+    if (real_offset == last->next) {
+        this->current.skip();
+        return;
+    }
+
+    /*
+     * Seeking past eof will is allowed (as in C FILE), but tell is left
+     * undefined. Trying to read after a seek-past-eof will immediately report
+     * eof.
      */
-    this->current.move(this->index.last());
+    assert(last->type == tapeimage::file);
+}
+
+void tapeimage::scan_headers(std::int64_t n, bool positional)
+noexcept (false) {
+    constexpr std::int64_t min_block = 4 * 1024;
+    constexpr std::int64_t max_block = 1024 * 1024;
+
+    auto own = std::vector< unsigned char >();
+    auto& scanbuf = positional ? own : this->scanbuf;
+
+    std::int64_t block_size = min_block;
+    std::int64_t block_begin = 0;
+    std::int64_t block_end = 0;
+
     while (true) {
         const auto last = this->index.last();
-        const auto pos  = this->index.index_of(last);
-        const auto real_offset = this->addr.physical(n, pos);
-
-        /*
-         * When doing a cold seek(n), and n happens to be at the start of a
-         * record, stop before reading the last header. This supports the case
-         * where the header is broken, and makes cold seek() consistent with
-         * readinto() to the same byte. If the header is broken, the next read
-         * would fail anyway, but it might be that this address is seek()'d to,
-         * and a following readinto() never happens.
-         */
-        if (real_offset == last->next) {
-            this->fp->seek(last->next);
-            this->current.skip();
-            break;
-        }
+        const auto end = this->addr.logical(
+            last->next,
+            this->index.index_of(last)
+        );
 
-        if (real_offset < last->next) {
-            this->fp->seek(real_offset);
-            this->current.move(real_offset - this->current.tell());
+        if (last->type == tapeimage::file or n <= end)
             break;
-        }
 
-        if (last->type == tapeimage::file) {
+        const auto head = last->next;
+        if (head < block_begin or head + header::size > block_end) {
             /*
-             * Seeking past eof will is allowed (as in C FILE), but tell is
-             * left undefined. Trying to read after a seek-past-eof will
-             * immediately report eof.
+             * If the previous record did not fit in a block, the next
+             * one probably won't either, so there is nothing to gain
+             * from reading past the header.
              */
-            break;
+            const auto record_size = head - std::prev(last)->next;
+            const auto to_read = record_size >= block_size
+                               ? std::int64_t(header::size)
+                               : block_size;
+
+            if (std::int64_t(scanbuf.size()) < to_read)
+                scanbuf.resize(to_read);
+
+            std::int64_t nread;
+            lfp_status err;
+            if (positional) {
+                err = this->fp->readat(head, scanbuf.data(), to_read, &nread);
+            } else {
+                this->seek_underlying(head);
+                err = this->fp->readinto(scanbuf.data(), to_read, &nread);
+                this->inner_pos = head + nread;
+            }
+
+            block_begin = head;
+            block_end = head + nread;
+            block_size = std::min(block_size * 2, max_block);
+
+            if (nread < header::size) switch (err) {
+                case LFP_OK:
+                case LFP_OKINCOMPLETE:
+                    throw protocol_failed_recovery(
+                        "tapeimage: incomplete read of tapeimage header, "
+                        "recovery not implemented"
+                    );
+
+                case LFP_EOF:
+                {
+                    const auto msg = "tapeimage: unexpected EOF when "
+                                     "reading header - got {} bytes";
+                    throw unexpected_eof(fmt::format(msg, nread));
+                }
+
+                default:
+                    throw not_implemented(
+                        "tapeimage: unhandled error code in scan_headers"
+                    );
+            }
         }
 
-        this->fp->seek(last->next);
-        this->read_header_from_disk();
-        this->current.move(this->index.last());
+        const auto* b = scanbuf.data() + (head - block_begin);
+        this->append_header(b, last, positional);
+    }
+}
+
+void tapeimage::build_index() noexcept (false) {
+    this->scan_headers(std::numeric_limits< std::int64_t >::max());
+}
+
+/*
+ * The file ends where the last record before the tape mark ends, so the size
+ * is known once the whole file is indexed. Only the headers are read, and the
+ * read head is kept where it is.
+ */
+std::int64_t tapeimage::size() noexcept (false) {
+    this->build_index();
+    const auto last = this->index.last();
+    return this->addr.logical(last->next, this->index.index_of(last));
+}
+
+lfp_status tapeimage::read_at(
+        std::int64_t pos,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* nread)
+noexcept (false) {
+    std::int64_t n = 0;
+
+    if (pos >= this->buffer_begin and pos < this->buffer_end) {
+        const auto available = this->buffer_end - pos;
+        const auto from_buffer = std::min(len, available);
+        std::memcpy(
+            dst,
+            this->buffer.data() + (pos - this->buffer_begin),
+            from_buffer
+        );
+
+        n += from_buffer;
+        pos += from_buffer;
+        len -= from_buffer;
+        dst = advance(dst, from_buffer);
+    }
+
+    *nread = n;
+    if (len == 0)
+        return LFP_OK;
+
+    /*
+     * EOF from the underlying file is not remembered, since the file may
+     * still be growing, so reads past it are always tried again. Files that
+     * refuse to seek past their end, like memfile, are at EOF there.
+     */
+    try {
+        this->seek_underlying(pos);
+    } catch (const lfp::error& e) {
+        if (e.status() != LFP_INVALID_ARGS)
+            throw;
+        return LFP_EOF;
+    }
+
+    if (len >= buffer_size) {
+        std::int64_t m;
+        const auto err = this->fp->readinto(dst, len, &m);
+        this->inner_pos = pos + m;
+        *nread = n + m;
+        return err;
+    }
+
+    if (this->buffer.empty())
+        this->buffer.resize(buffer_size);
+
+    std::int64_t m;
+    const auto err = this->fp->readinto(this->buffer.data(), buffer_size, &m);
+    this->inner_pos = pos + m;
+    this->buffer_begin = pos;
+    this->buffer_end = pos + m;
+
+    const auto from_buffer = std::min(len, m);
+    std::memcpy(dst, this->buffer.data(), from_buffer);
+    *nread = n + from_buffer;
+
+    if (from_buffer == len)
+        return LFP_OK;
+
+    switch (err) {
+        case LFP_OK:
+        case LFP_OKINCOMPLETE:
+            return LFP_OKINCOMPLETE;
+
+        default:
+            return err;
+    }
+}
+
+void tapeimage::seek_underlying(std::int64_t pos) const noexcept (false) {
+    if (this->inner_pos == pos)
+        return;
+
+    this->fp.get()->seek(pos);
+    this->inner_pos = pos;
+}
+
+std::int64_t tapeimage::physical_end() noexcept (false) {
+    try {
+        return this->fp->size();
+    } catch (const lfp::error&) {
+        return std::numeric_limits< std::int64_t >::max();
     }
 }
 
@@ -744,6 +1565,949 @@ std::int64_t tapeimage::tell() const noexcept (false) {
     return this->addr.logical(this->current.tell(), pos);
 }
 
+/*
+ * The serialized index is a small fixed-size preamble, followed by the record
+ * headers in the same little-endian layout they have on disk:
+ *
+ *  magic   : 4 bytes, "LTIX"
+ *  version : uint32
+ *  base    : int64, the address the tapeimage was opened at
+ *  size    : int64, the size of the underlying file, or -1 if unknown
+ *  count   : int64, number of headers
+ *  headers : count * { type: uint32, prev: int64, next: int64 }
+ *
+ * Unlike on disk, prev and next are stored as 64-bit offsets, so that files
+ * larger than 4GB can be indexed. The size ties the index to the file it was
+ * made from, so that an index of a file that has since been rewritten is not
+ * loaded.
+ */
+namespace index_format {
+
+constexpr const unsigned char magic[] = { 'L', 'T', 'I', 'X' };
+constexpr const std::uint32_t version = 4;
+constexpr const std::int64_t preamble = 4 + 4 + 4 + 8 + 8 + 8;
+constexpr const std::int64_t entry = 4 + 8 + 8;
+
+template < typename T >
+unsigned char* put(unsigned char* dst, T x) noexcept (true) {
+    std::memcpy(dst, &x, sizeof(x));
+    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        std::reverse(dst, dst + sizeof(x));
+    #endif
+    return dst + sizeof(x);
+}
+
+template < typename T >
+const unsigned char* get(const unsigned char* src, T& x) noexcept (true) {
+    unsigned char b[sizeof(x)];
+    std::memcpy(b, src, sizeof(x));
+    #if (defined(IS_BIG_ENDIAN) || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        std::reverse(b, b + sizeof(x));
+    #endif
+    std::memcpy(&x, b, sizeof(x));
+    return src + sizeof(x);
+}
+
+}
+
+std::int64_t tapeimage::underlying_size() const noexcept (false) {
+    try {
+        return this->fp.get()->size();
+    } catch (const lfp::error&) {
+        return -1;
+    }
+}
+
+std::int64_t tapeimage::index_size() const noexcept (true) {
+    return index_format::preamble
+         + std::int64_t(this->index.size()) * index_format::entry;
+}
+
+void tapeimage::dump_index(void* dst, std::int64_t len) const noexcept (false) {
+    /*
+     * The index may grow while it is written, so stop at the end it had when
+     * the size was checked. Recovery is set before a patched header is
+     * appended, so it is checked after, and a recovered index is always
+     * marked as such.
+     */
+    const auto end = this->index.end();
+    const auto count = std::int64_t(this->index.index_of(end));
+    const auto recovered = std::uint32_t(this->recovery != LFP_OK);
+    const auto size = index_format::preamble + count * index_format::entry;
+    if (len < size) {
+        const auto msg = "tapeimage: index_dump: len (= {}) < index size (= {})";
+        throw invalid_args(fmt::format(msg, len, size));
+    }
+
+    auto* p = static_cast< unsigned char* >(dst);
+    std::memcpy(p, index_format::magic, sizeof(index_format::magic));
+    p += sizeof(index_format::magic);
+    p = index_format::put(p, index_format::version);
+    p = index_format::put(p, recovered);
+    p = index_format::put(p, this->addr.base());
+    p = index_format::put(p, this->underlying_size());
+    p = index_format::put(p, count);
+
+    for (auto itr = this->index.begin(); itr != end; ++itr) {
+        p = index_format::put(p, itr->type);
+        p = index_format::put(p, itr->prev);
+        p = index_format::put(p, itr->next);
+    }
+}
+
+void tapeimage::load_index(const void* src, std::int64_t len)
+noexcept (false) {
+    const auto* p = static_cast< const unsigned char* >(src);
+
+    if (len < index_format::preamble) {
+        const auto msg = "tapeimage: index_load: len (= {}) too small for "
+                         "index preamble";
+        throw invalid_args(fmt::format(msg, len));
+    }
+
+    if (not std::equal(p, p + 4, index_format::magic))
+        throw invalid_args("tapeimage: index_load: not a tapeimage index");
+    p += sizeof(index_format::magic);
+
+    std::uint32_t version;
+    std::uint32_t recovered;
+    std::int64_t base;
+    std::int64_t size;
+    std::int64_t count;
+    p = index_format::get(p, version);
+    p = index_format::get(p, recovered);
+    p = index_format::get(p, base);
+    p = index_format::get(p, size);
+    p = index_format::get(p, count);
+
+    if (version != index_format::version) {
+        const auto msg = "tapeimage: index_load: unsupported version {}";
+        throw invalid_args(fmt::format(msg, version));
+    }
+
+    if (base != this->addr.base()) {
+        const auto msg = "tapeimage: index_load: index base (= {}) does not "
+                         "match handle base (= {})";
+        throw invalid_args(fmt::format(msg, base, this->addr.base()));
+    }
+
+    if (recovered > 1)
+        throw invalid_args("tapeimage: index_load: index preamble is corrupt");
+
+    const auto file_size = this->underlying_size();
+    if (size >= 0 and file_size >= 0 and size != file_size) {
+        const auto msg = "tapeimage: index_load: index file size (= {}) does "
+                         "not match the underlying file size (= {})";
+        throw invalid_args(fmt::format(msg, size, file_size));
+    }
+
+    const auto entries = (len - index_format::preamble) / index_format::entry;
+    if (count < 0 or count > entries) {
+        const auto msg = "tapeimage: index_load: header count (= {}) "
+                         "inconsistent with len (= {})";
+        throw invalid_args(fmt::format(msg, count, len));
+    }
+
+    /*
+     * Decode and sanity check all headers before touching the index, so that
+     * a broken index leaves the handle untouched. The checks are not as
+     * thorough as when reading headers from disk, but they make sure the
+     * records are in order, that every prev points to the header before it,
+     * like in append_header_strict(), and that nothing follows the
+     * end-of-file mark. The headers of a recovered index were patched before
+     * they were indexed, so they are checked the same way.
+     */
+    std::vector< header > headers;
+    headers.reserve(count);
+    std::int64_t position = base;
+    for (std::int64_t i = 0; i < count; ++i) {
+        header head;
+        p = index_format::get(p, head.type);
+        p = index_format::get(p, head.prev);
+        p = index_format::get(p, head.next);
+
+        const auto type_consistent = head.type == tapeimage::record or
+                                     head.type == tapeimage::file;
+        const auto after_eof = not headers.empty()
+                           and headers.back().type == tapeimage::file;
+        const auto prev_expected = i < 2 ? base : headers[i - 2].next;
+        const auto prev_consistent = i == 0 or head.prev == prev_expected;
+
+        if (not type_consistent
+                or after_eof
+                or not prev_consistent
+                or head.next < position + header::size) {
+            const auto msg = "tapeimage: index_load: header {} is corrupt";
+            throw invalid_args(fmt::format(msg, i));
+        }
+
+        position = head.next;
+        headers.push_back(head);
+    }
+
+    std::lock_guard< std::mutex > guard(this->indexing);
+    auto itr = this->index.begin();
+    const auto common = std::min(this->index.size(), headers.size());
+    for (std::size_t i = 0; i < common; ++i, ++itr) {
+        const auto& head = headers[i];
+        if (itr->type != head.type
+                or itr->prev != head.prev
+                or itr->next != head.next) {
+            const auto msg = "tapeimage: index_load: header {} does not match "
+                             "the already indexed header";
+            throw invalid_args(fmt::format(msg, i));
+        }
+    }
+
+    /*
+     * The index was dumped from a handle that recovered from broken headers,
+     * so reads must report it like they did on that handle
+     */
+    if (recovered)
+        this->recovery = LFP_PROTOCOL_TRYRECOVERY;
+
+    auto after = std::prev(itr);
+    for (auto i = common; i < headers.size(); ++i)
+        after = this->index.append(headers[i], after);
+}
+
+struct decoded {
+    std::uint32_t type;
+    std::int64_t  prev;
+    std::int64_t  next;
+};
+
+/*
+ * Decode the header at the physical offset pos, and check if it could be a
+ * real header. The high bits of prev and next are reconstructed like in
+ * tapeimage::append_header(), where end is the physical end of the file.
+ */
+bool plausible(
+        const unsigned char* b,
+        std::int64_t pos,
+        std::int64_t end,
+        decoded& h)
+noexcept (true) {
+    std::uint32_t prev;
+    std::uint32_t next;
+    index_format::get(b + 0, h.type);
+    index_format::get(b + 4, prev);
+    index_format::get(b + 8, next);
+
+    if (h.type != 0 and h.type != 1)
+        return false;
+
+    h.prev = full_prev(prev, pos);
+    h.next = full_next(next, pos, end);
+    return h.prev <= pos and h.next >= pos + header::size;
+}
+
+/*
+ * Find the first offset p in [begin, end) that could be the start of a
+ * header, judging only by the type field, i.e. that [p, p + 4) is a
+ * little-endian 0 or 1. This is the filter in front of plausible() when
+ * searching for headers in arbitrary data, which can be large, so it is
+ * vectorised where possible.
+ *
+ * Returns end if there is no such offset.
+ */
+const unsigned char* find_type(
+        const unsigned char* begin,
+        const unsigned char* end)
+noexcept (true) {
+    if (end - begin < 4)
+        return end;
+
+    /* the type field of a header at p covers [p, p + 4) */
+    const auto last = end - 3;
+    auto p = begin;
+
+#if defined(__SSE2__)
+    const auto one  = _mm_set1_epi8(1);
+    const auto zero = _mm_setzero_si128();
+
+    /*
+     * Check 16 offsets at a time. The first byte must be <= 1, and the 3
+     * bytes after it must be zero, which is checked by comparing the 16-byte
+     * block at p, p + 1, p + 2 and p + 3.
+     */
+    const auto load = [] (const unsigned char* x) noexcept (true) {
+        return _mm_loadu_si128(reinterpret_cast< const __m128i* >(x));
+    };
+
+    while (last - p >= 16) {
+        const auto b0 = load(p + 0);
+        const auto b1 = load(p + 1);
+        const auto b2 = load(p + 2);
+        const auto b3 = load(p + 3);
+
+        const auto low = _mm_cmpeq_epi8(_mm_max_epu8(b0, one), one);
+        const auto high = _mm_and_si128(
+            _mm_cmpeq_epi8(b1, zero),
+            _mm_and_si128(_mm_cmpeq_epi8(b2, zero), _mm_cmpeq_epi8(b3, zero))
+        );
+
+        const auto mask = _mm_movemask_epi8(_mm_and_si128(low, high));
+        if (mask)
+            return p + __builtin_ctz(mask);
+
+        p += 16;
+    }
+#endif
+
+    for (; p < last; ++p) {
+        if (p[0] <= 1 and p[1] == 0 and p[2] == 0 and p[3] == 0)
+            return p;
+    }
+
+    return end;
+}
+
+tapeimage::iterator
+tapeimage::resynchronise(const iterator& after, bool positional)
+noexcept (false) {
+    constexpr std::int64_t block_size = 1024 * 1024;
+    const auto broken = after->next;
+
+    /*
+     * Resynchronising can happen in the middle of scan_headers(), so the scan
+     * buffer cannot be used.
+     */
+    auto buf = std::vector< unsigned char >(block_size);
+    const auto file_end = this->physical_end();
+
+    const auto read = [this, positional] (
+            std::int64_t at,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* nread) {
+        if (positional)
+            return this->fp->readat(at, dst, len, nread);
+        return this->read_at(at, dst, len, nread);
+    };
+
+    /*
+     * A plausible header is only accepted if the header it points to is
+     * plausible too, and points back. The exception is the end-of-file mark,
+     * which is also accepted if it is the last header in the file.
+     *
+     * Garbage tends to repeat, e.g. long runs of zeros, which all point to
+     * the same next, so the last next that did not check out is remembered.
+     */
+    std::int64_t failed_next = -1;
+    const auto consistent = [&] (std::int64_t at, const decoded& h) {
+        if (h.next == failed_next)
+            return false;
+
+        unsigned char b[header::size];
+        std::int64_t nread;
+        read(h.next, b, sizeof(b), &nread);
+
+        decoded after;
+        const auto ok = nread == 0
+                      ? h.type == tapeimage::file
+                      : nread == header::size
+                        and plausible(b, h.next, file_end, after)
+                        and after.prev == at;
+
+        if (not ok)
+            failed_next = h.next;
+        return ok;
+    };
+
+    auto pos = broken + 1;
+    std::int64_t found = -1;
+    while (found < 0) {
+        std::int64_t nread;
+        const auto err = read(pos, buf.data(), block_size, &nread);
+
+        if (nread < header::size) {
+            const auto msg = "tapeimage: no header found after broken header "
+                             "at {}, unable to resynchronise";
+            throw protocol_failed_recovery(fmt::format(msg, broken));
+        }
+
+        const auto* begin = buf.data();
+        const auto* end   = begin + nread;
+        const auto* last  = end - header::size + 1;
+        auto p = find_type(begin, end);
+        for (; p < last; p = find_type(p + 1, end)) {
+            const auto at = pos + (p - begin);
+            decoded h;
+            if (plausible(p, at, file_end, h) and consistent(at, h)) {
+                found = at;
+                break;
+            }
+        }
+
+        if (found < 0 and err != LFP_OK) {
+            const auto msg = "tapeimage: no header found after broken header "
+                             "at {}, unable to resynchronise";
+            throw protocol_failed_recovery(fmt::format(msg, broken));
+        }
+
+        /* a header may straddle the block boundary */
+        pos += nread - header::size + 1;
+    }
+
+    /*
+     * The broken header and everything up until the found header is
+     * presented as a single record.
+     */
+    header head;
+    head.type = tapeimage::record;
+    head.prev = std::prev(after)->next;
+    head.next = found;
+    const auto itr = this->index.append(head, after);
+
+    this->resync_target = found;
+    this->recovery = LFP_PROTOCOL_TRYRECOVERY;
+    return itr;
+}
+
+void tapeimage::set_resync(bool enable) noexcept (true) {
+    this->resync = enable;
+}
+
+/*
+ * Speculative, parallel header scanning for build_index(threads).
+ *
+ * The headers form a chain, where every header points to the next, so the
+ * index can only be built one header at a time. Instead, the underlying file
+ * is split into stripes which are scanned by worker threads. A worker does not
+ * know where the first header in its stripe is, so it guesses - it searches
+ * for a plausible header (type 0 or 1, prev before it and next after it)
+ * whose next header points back to it. From there it follows the chain to the
+ * end of the stripe, and keeps the raw bytes of every header it visits.
+ *
+ * The candidates are only guesses, but they are always the real bytes at
+ * their offset in the file. The index is then built in order from the last
+ * indexed header, and a header is taken from the candidates when there is
+ * one at the right offset, and read from disk when there is not. The index is
+ * the same as the one built sequentially, and bad guesses only cost time.
+ *
+ * The workers read the underlying file with readat, so the reads run in
+ * parallel too, when the underlying file says its readat is safe to call from
+ * multiple threads. Otherwise the reads are done one at a time under a lock,
+ * and when the underlying file does not support readat, the workers share its
+ * single position, and a seek and its read are done under the lock. Then
+ * only searching and decoding run in parallel.
+ */
+namespace speculative {
+
+constexpr const std::int64_t stripe_size = 8 * 1024 * 1024;
+constexpr const std::int64_t block_size = 1024 * 1024;
+
+struct candidate {
+    std::int64_t offset;
+    raw_header bytes;
+};
+
+struct shared {
+    shared(lfp_protocol* f, std::int64_t start, std::int64_t file_end) :
+        fp(f),
+        start(start),
+        file_end(file_end),
+        concurrent(f->concurrent_readat())
+    {}
+
+    lfp_protocol* fp;
+    std::int64_t start;
+    /* the physical end of the file, for plausible() */
+    std::int64_t file_end;
+
+    /* readat can be called without holding the io lock */
+    bool concurrent;
+
+    /*
+     * The io lock guards next_stripe, and the underlying file when its readat
+     * is not safe to call from multiple threads, or it does not support
+     * readat. The stripes are handed out in order, and end is the lowest
+     * known offset past which there are no more headers, i.e. the end of the
+     * file or (likely) the end-of-file mark.
+     */
+    std::mutex io;
+    std::int64_t next_stripe = 0;
+    std::atomic< std::int64_t > end {
+        std::numeric_limits< std::int64_t >::max()
+    };
+    std::atomic< bool > positional { true };
+
+    std::int64_t read(std::int64_t pos, unsigned char* dst, std::int64_t len)
+        noexcept (false);
+    void stop_at(std::int64_t pos) noexcept (true);
+};
+
+std::int64_t shared::read(
+        std::int64_t pos,
+        unsigned char* dst,
+        std::int64_t len)
+noexcept (false) {
+    std::int64_t nread;
+    lfp_status err;
+
+    if (this->positional) {
+        try {
+            if (this->concurrent) {
+                err = this->fp->readat(pos, dst, len, &nread);
+            } else {
+                std::lock_guard< std::mutex > lock(this->io);
+                err = this->fp->readat(pos, dst, len, &nread);
+            }
+            if (err == LFP_EOF)
+                this->stop_at(pos + nread);
+            return nread;
+        } catch (const lfp::error& e) {
+            const auto status = e.status();
+            if (status != LFP_NOTIMPLEMENTED and status != LFP_NOTSUPPORTED)
+                throw;
+            this->positional = false;
+        }
+    }
+
+    std::lock_guard< std::mutex > lock(this->io);
+    this->fp->seek(pos);
+    err = this->fp->readinto(dst, len, &nread);
+    if (err == LFP_EOF)
+        this->stop_at(pos + nread);
+    return nread;
+}
+
+void shared::stop_at(std::int64_t pos) noexcept (true) {
+    auto cur = this->end.load();
+    while (pos < cur and not this->end.compare_exchange_weak(cur, pos))
+        ;
+}
+
+void scan(
+        shared& s,
+        std::int64_t begin,
+        std::int64_t end,
+        std::vector< unsigned char >& buf,
+        std::vector< candidate >& out)
+noexcept (false) {
+    std::int64_t buf_begin = 0;
+    std::int64_t buf_end = 0;
+
+    /*
+     * Make [pos, pos + header::size) available in buf. Returns a pointer to
+     * the header, or nullptr if the file ends before it.
+     */
+    const auto fetch = [&] (std::int64_t pos, std::int64_t len) {
+        if (pos >= buf_begin and pos + header::size <= buf_end)
+            return buf.data() + (pos - buf_begin);
+
+        const auto nread = s.read(pos, buf.data(), len);
+        buf_begin = pos;
+        buf_end = pos + nread;
+        if (nread < header::size)
+            return static_cast< unsigned char* >(nullptr);
+        return buf.data();
+    };
+
+    /* the offset where the last search started, and the chain state */
+    std::int64_t search = begin;
+    std::int64_t expect = -1;
+    std::int64_t expect_prev = 0;
+    std::int64_t last = -1;
+    std::int64_t failed_next = -1;
+
+    while (true) {
+        const auto pos = expect >= 0 ? expect : search;
+        if (pos >= end or pos >= s.end)
+            return;
+
+        decoded h;
+        if (expect >= 0) {
+            /*
+             * Following the chain. Like in tapeimage::scan_headers(), don't
+             * read past the header if the previous record was larger than a
+             * block.
+             */
+            const auto len = pos - last >= block_size
+                           ? std::int64_t(header::size)
+                           : block_size + header::size;
+            const auto* b = fetch(pos, len);
+            if (not b)
+                return;
+
+            if (plausible(b, pos, s.file_end, h) and h.prev == expect_prev) {
+                candidate c;
+                c.offset = pos;
+                std::copy(b, b + header::size, c.bytes.begin());
+                out.push_back(c);
+
+                if (h.type == tapeimage::file) {
+                    s.stop_at(h.next);
+                    return;
+                }
+
+                last = pos;
+                expect = h.next;
+                expect_prev = pos;
+                continue;
+            }
+
+            /*
+             * The chain is broken, either because the guess was wrong or the
+             * file is. Search on from the broken header, as everything before
+             * it is already covered by the chain.
+             */
+            search = std::max(search, pos + 1);
+            expect = -1;
+            continue;
+        }
+
+        const auto* b = fetch(pos, block_size + header::size);
+        if (not b)
+            return;
+
+        /*
+         * Skip to the next offset with a plausible type field, like
+         * resynchronise(). The last 3 bytes in the buffer could start a type
+         * field that is not all in the buffer, so the search is picked up
+         * from there.
+         */
+        const auto* filled = buf.data() + (buf_end - buf_begin);
+        const auto* p = find_type(b, filled);
+        if (p == filled) {
+            search = buf_end - 3;
+            continue;
+        }
+
+        const auto at = buf_begin + (p - buf.data());
+        if (at != pos) {
+            search = at;
+            continue;
+        }
+
+        search = pos + 1;
+        if (not plausible(b, pos, s.file_end, h) or h.next == failed_next)
+            continue;
+
+        /*
+         * The header is plausible on its own, so check that the next one
+         * points back to it. Garbage tends to repeat, e.g. long runs of
+         * zeros, so the last next that did not check out is remembered.
+         */
+        decoded after;
+        unsigned char far[header::size];
+        const unsigned char* a = far;
+        if (h.next + header::size <= buf_end)
+            a = buf.data() + (h.next - buf_begin);
+        else if (s.read(h.next, far, header::size) < header::size)
+            a = nullptr;
+
+        const auto ok = a
+                    and plausible(a, h.next, s.file_end, after)
+                    and after.prev == pos;
+
+        if (not ok) {
+            failed_next = h.next;
+            continue;
+        }
+
+        expect = pos;
+        expect_prev = h.prev;
+        last = pos;
+    }
+}
+
+void work(shared& s, std::vector< candidate >& out) noexcept (true) {
+    /*
+     * Any error, including running past the end of the file, just ends this
+     * worker. Every header is either found by a worker or read from disk
+     * when the index is put together, so errors in the file are still
+     * reported, in the right order, from the sequential part.
+     */
+    try {
+        auto buf = std::vector< unsigned char >(block_size + header::size);
+        while (true) {
+            std::int64_t begin;
+            {
+                std::lock_guard< std::mutex > lock(s.io);
+                begin = s.start + s.next_stripe * stripe_size;
+                s.next_stripe += 1;
+            }
+
+            if (begin >= s.end)
+                return;
+
+            scan(s, begin, begin + stripe_size, buf, out);
+        }
+    } catch (...) {
+        return;
+    }
+}
+
+}
+
+void tapeimage::build_index(int threads) noexcept (false) {
+    if (threads <= 0)
+        threads = int(std::thread::hardware_concurrency());
+
+    if (threads <= 1)
+        return this->build_index();
+
+    if (this->index.last()->type == tapeimage::file)
+        return;
+
+    speculative::shared s(
+        this->fp.get(),
+        this->index.last()->next,
+        this->physical_end()
+    );
+    std::vector< std::vector< speculative::candidate > > found(threads);
+    std::vector< std::thread > workers;
+
+    try {
+        for (int i = 0; i < threads; ++i)
+            workers.emplace_back(
+                speculative::work,
+                std::ref(s),
+                std::ref(found[i])
+            );
+    } catch (const std::system_error&) {
+        /* run with the threads that could be started */
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    /* the workers may have moved the underlying file */
+    this->inner_pos = -1;
+
+    std::vector< speculative::candidate > candidates;
+    for (const auto& xs : found)
+        candidates.insert(candidates.end(), xs.begin(), xs.end());
+
+    using speculative::candidate;
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [] (const candidate& lhs, const candidate& rhs) noexcept (true) {
+            return lhs.offset < rhs.offset;
+        }
+    );
+
+    auto cur = candidates.begin();
+    auto last = this->index.last();
+    while (last->type != tapeimage::file) {
+        const auto head = last->next;
+        cur = std::lower_bound(
+            cur,
+            candidates.end(),
+            head,
+            [] (const candidate& c, std::int64_t n) noexcept (true) {
+                return c.offset < n;
+            }
+        );
+
+        if (cur != candidates.end() and cur->offset == head)
+            last = this->append_header(cur->bytes.data(), last);
+        else
+            last = this->read_header_from_disk(last);
+    }
+}
+
+/*
+ * Find the end of f, i.e. the offset after the last byte. It is asked for the
+ * size, and if it does not know it, the end is found by probing for bytes at
+ * increasing offsets, and then bisecting. Seeking past the end is an error
+ * for some protocols and not for others, so when probing, a position is only
+ * considered part of the file if a byte can actually be read from it.
+ */
+bool has_byte(lfp_protocol* f, std::int64_t n) noexcept (false) {
+    try {
+        f->seek(n);
+    } catch (const lfp::error&) {
+        return false;
+    }
+
+    unsigned char x;
+    std::int64_t nread;
+    f->readinto(&x, 1, &nread);
+    return nread == 1;
+}
+
+std::int64_t find_end(lfp_protocol* f, std::int64_t start) noexcept (false) {
+    try {
+        return std::max(start, f->size());
+    } catch (const lfp::error& e) {
+        const auto status = e.status();
+        if (status != LFP_NOTIMPLEMENTED and status != LFP_NOTSUPPORTED)
+            throw;
+    }
+
+    if (not has_byte(f, start))
+        return start;
+
+    /* invariant: has_byte(lo) and not has_byte(hi) */
+    std::int64_t lo = start;
+    std::int64_t hi = start + 1;
+    while (has_byte(f, hi)) {
+        lo = hi;
+        hi = start + 2 * (hi - start);
+    }
+
+    while (hi - lo > 1) {
+        const auto mid = lo + (hi - lo) / 2;
+        if (has_byte(f, mid)) lo = mid;
+        else                  hi = mid;
+    }
+
+    return hi;
+}
+
+struct tail {
+    std::int64_t begin;
+    std::vector< raw_header > headers;
+};
+
+/*
+ * Find the start of the n-th last logical file in f by walking the prev
+ * pointers backwards from the end-of-file mark at the end of the file. Every
+ * step is checked, by requiring that the previous header's next points back.
+ *
+ * Logical files are terminated by a file mark, and empty logical files
+ * (consecutive file marks) are not counted. The headers from the start of the
+ * logical file up to and including its file mark are returned in file order.
+ */
+tail find_tail(lfp_protocol* f, int files) noexcept (false) {
+    if (files < 1) {
+        const auto msg = "tapeimage: expected files (= {}) >= 1";
+        throw invalid_args(fmt::format(msg, files));
+    }
+
+    constexpr std::int64_t block_size = 64 * 1024;
+
+    const auto start = f->tell();
+    const auto end = find_end(f, start);
+    if (end - start < header::size)
+        throw invalid_args("tapeimage: file is too small to be a tape image");
+
+    std::vector< unsigned char > buf;
+    std::int64_t buf_begin = 0;
+    std::int64_t buf_end = 0;
+
+    /*
+     * The walk goes backwards, so read the block that *ends* with the header
+     * at pos, which is likely to contain the headers before it too.
+     */
+    const auto fetch = [&] (std::int64_t pos) {
+        if (pos >= buf_begin and pos + header::size <= buf_end)
+            return buf.data() + (pos - buf_begin);
+
+        const auto begin = std::max(start, pos + header::size - block_size);
+        const auto len = pos + header::size - begin;
+        buf.resize(len);
+
+        std::int64_t nread;
+        f->seek(begin);
+        f->readinto(buf.data(), len, &nread);
+        if (nread != len) {
+            const auto msg = "tapeimage: unexpected EOF when reading header "
+                             "- got {} bytes";
+            throw unexpected_eof(fmt::format(msg, nread));
+        }
+
+        buf_begin = begin;
+        buf_end = begin + len;
+        return buf.data() + (pos - buf_begin);
+    };
+
+    tail t;
+    auto pos = end - header::size;
+    auto after = end;
+    auto counted = 0;
+    auto in_file = false;
+
+    while (true) {
+        const auto* b = fetch(pos);
+
+        decoded h;
+        if (not plausible(b, pos, end, h) or h.next != after) {
+            const auto msg = "tapeimage: broken header at {} when walking "
+                             "backwards from the end of the file";
+            throw protocol_fatal(fmt::format(msg, pos));
+        }
+
+        if (h.type == tapeimage::file) {
+            if (in_file)
+                counted += 1;
+
+            in_file = false;
+            if (counted == files) {
+                t.begin = after;
+                break;
+            }
+        } else {
+            in_file = true;
+        }
+
+        raw_header raw;
+        std::copy(b, b + header::size, raw.begin());
+        t.headers.push_back(raw);
+
+        if (pos == start) {
+            if (in_file)
+                counted += 1;
+
+            if (counted == files) {
+                t.begin = start;
+                break;
+            }
+
+            const auto msg = "tapeimage: expected {} logical files, "
+                             "but the file only has {}";
+            throw invalid_args(fmt::format(msg, files, counted));
+        }
+
+        if (h.prev < start or h.prev + header::size > pos) {
+            const auto msg = "tapeimage: header at {} has prev (= {}) "
+                             "outside the file";
+            throw protocol_fatal(fmt::format(msg, pos, h.prev));
+        }
+
+        after = pos;
+        pos = h.prev;
+    }
+
+    /*
+     * The protocol stops at the first file mark, so any trailing (empty)
+     * logical files are not included in the index.
+     */
+    std::reverse(t.headers.begin(), t.headers.end());
+    const auto is_mark = [] (const raw_header& raw) noexcept (true) {
+        std::uint32_t type;
+        index_format::get(raw.data(), type);
+        return type == tapeimage::file;
+    };
+    const auto mark = std::find_if(t.headers.begin(), t.headers.end(), is_mark);
+    if (mark != t.headers.end())
+        t.headers.erase(std::next(mark), t.headers.end());
+
+    return t;
+}
+
+void tapeimage::append_headers(const std::vector< raw_header >& headers)
+noexcept (false) {
+    auto last = this->index.last();
+    for (const auto& head : headers)
+        last = this->append_header(head.data(), last);
+}
+
+/*
+ * Get the tapeimage of a handle, or throw if the handle is some other
+ * protocol.
+ */
+tapeimage& as_tapeimage(lfp_protocol* f) noexcept (false) {
+    auto* tif = dynamic_cast< tapeimage* >(f);
+    if (not tif)
+        throw invalid_args("handle is not a tapeimage");
+    return *tif;
+}
+
 }
 
 }
@@ -757,3 +2521,152 @@ lfp_protocol* lfp_tapeimage_open(lfp_protocol* f) {
         return nullptr;
     }
 }
+
+int lfp_tapeimage_set_resync(lfp_protocol* f, int enable) try {
+    assert(f);
+    lfp::as_tapeimage(f).set_resync(enable != 0);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+lfp_protocol* lfp_tapeimage_open_tail(lfp_protocol* f, int files) {
+    if (not f) return nullptr;
+
+    lfp::tail tail;
+    try {
+        tail = lfp::find_tail(f, files);
+        f->seek(tail.begin);
+    } catch (...) {
+        return nullptr;
+    }
+
+    lfp::tapeimage* tif;
+    try {
+        tif = new lfp::tapeimage(f);
+    } catch (...) {
+        return nullptr;
+    }
+
+    try {
+        tif->append_headers(tail.headers);
+    } catch (...) {
+        tif->peel();
+        delete tif;
+        return nullptr;
+    }
+
+    return tif;
+}
+
+int lfp_tapeimage_index_size(lfp_protocol* f, std::int64_t* size) try {
+    assert(f);
+    assert(size);
+    *size = lfp::as_tapeimage(f).index_size();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_tapeimage_index_build(lfp_protocol* f) try {
+    assert(f);
+    lfp::as_tapeimage(f).build_index();
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_tapeimage_index_build_parallel(lfp_protocol* f, int threads) try {
+    assert(f);
+    lfp::as_tapeimage(f).build_index(threads);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_tapeimage_index_dump(lfp_protocol* f, void* dst, std::int64_t len) try {
+    assert(f);
+    assert(dst);
+    lfp::as_tapeimage(f).dump_index(dst, len);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_tapeimage_index_load(lfp_protocol* f, const void* src, std::int64_t len)
+try {
+    assert(f);
+    assert(src);
+    lfp::as_tapeimage(f).load_index(src, len);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
+
+int lfp_tapeimage_next_record(
+        lfp_protocol* f,
+        int* type,
+        std::int64_t* offset,
+        std::int64_t* len)
+try {
+    assert(f);
+    return lfp::as_tapeimage(f).next_record(type, offset, len);
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
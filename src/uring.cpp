@@ -0,0 +1,823 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <lfp/protocol.hpp>
+#include <lfp/uring.h>
+
+namespace lfp { namespace {
+
+constexpr std::int64_t block_size = 128 * 1024;
+constexpr int max_depth = 256;
+
+/*
+ * A minimal io_uring, driven through the raw system calls. liburing would do
+ * the same, but it is not available everywhere, and only reads are needed.
+ *
+ * The ring is only ever used from a single thread, and the caller makes sure
+ * there are never more reads in flight than there are entries, so neither the
+ * submission nor the completion queue can overflow.
+ */
+class ring {
+public:
+    explicit ring(unsigned entries) noexcept (false);
+    ~ring();
+
+    ring(const ring&) = delete;
+    ring& operator = (const ring&) = delete;
+
+    /*
+     * Queue a read. It is not submitted to the kernel until submit() is
+     * called, so that many reads can be submitted with a single system call.
+     */
+    void prepare_read(
+            int file,
+            void* dst,
+            unsigned len,
+            std::int64_t offset,
+            std::uint64_t tag)
+        noexcept (true);
+
+    /*
+     * Submit all queued reads, and if wait is true, block until at least one
+     * read has completed.
+     */
+    void submit(bool wait) noexcept (false);
+
+    /*
+     * Call f(tag, result) for every completed read.
+     */
+    template < typename F >
+    void reap(F f) noexcept (true);
+
+private:
+    void release() noexcept (true);
+
+    int fd = -1;
+    unsigned queued = 0;
+
+    void*       sq_ptr   = MAP_FAILED;
+    std::size_t sq_size  = 0;
+    void*       cq_ptr   = MAP_FAILED;
+    std::size_t cq_size  = 0;
+    void*       sqe_ptr  = MAP_FAILED;
+    std::size_t sqe_size = 0;
+
+    unsigned* sq_tail  = nullptr;
+    unsigned* sq_mask  = nullptr;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = nullptr;
+
+    unsigned* cq_head  = nullptr;
+    unsigned* cq_tail  = nullptr;
+    unsigned* cq_mask  = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
+
+template < typename T >
+T* at(void* base, std::uint32_t offset) noexcept (true) {
+    return reinterpret_cast< T* >(static_cast< char* >(base) + offset);
+}
+
+ring::ring(unsigned entries) noexcept (false) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+
+    const auto ringfd = ::syscall(__NR_io_uring_setup, entries, &p);
+    if (ringfd < 0)
+        throw not_supported(std::strerror(errno));
+    this->fd = int(ringfd);
+
+    /*
+     * IORING_OP_READ was added in linux 5.6, together with the probe, so if
+     * the probe fails the kernel is too old.
+     */
+    {
+        constexpr auto nops = 256;
+        const auto size = sizeof(io_uring_probe)
+                        + nops * sizeof(io_uring_probe_op);
+        auto probe = std::vector< unsigned char >(size, 0);
+        auto* pr = reinterpret_cast< io_uring_probe* >(probe.data());
+
+        const auto err = ::syscall(
+            __NR_io_uring_register,
+            this->fd,
+            IORING_REGISTER_PROBE,
+            pr,
+            nops
+        );
+
+        const auto supported = err == 0
+            and pr->last_op >= IORING_OP_READ
+            and (pr->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+
+        if (not supported) {
+            this->release();
+            throw not_supported("io_uring: IORING_OP_READ not supported");
+        }
+    }
+
+    this->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        this->sq_size = this->cq_size = std::max(this->sq_size, this->cq_size);
+
+    const auto prot  = PROT_READ | PROT_WRITE;
+    const auto flags = MAP_SHARED | MAP_POPULATE;
+
+    this->sq_ptr = ::mmap(
+        nullptr, this->sq_size, prot, flags, this->fd, IORING_OFF_SQ_RING
+    );
+
+    if (single)
+        this->cq_ptr = this->sq_ptr;
+    else if (this->sq_ptr != MAP_FAILED)
+        this->cq_ptr = ::mmap(
+            nullptr, this->cq_size, prot, flags, this->fd, IORING_OFF_CQ_RING
+        );
+
+    this->sqe_size = p.sq_entries * sizeof(io_uring_sqe);
+    if (this->cq_ptr != MAP_FAILED)
+        this->sqe_ptr = ::mmap(
+            nullptr, this->sqe_size, prot, flags, this->fd, IORING_OFF_SQES
+        );
+
+    if (this->sqe_ptr == MAP_FAILED) {
+        const auto msg = std::string(std::strerror(errno));
+        this->release();
+        throw io_error("io_uring: mmap: " + msg);
+    }
+
+    this->sq_tail  = at< unsigned >(this->sq_ptr, p.sq_off.tail);
+    this->sq_mask  = at< unsigned >(this->sq_ptr, p.sq_off.ring_mask);
+    this->sq_array = at< unsigned >(this->sq_ptr, p.sq_off.array);
+    this->sqes     = static_cast< io_uring_sqe* >(this->sqe_ptr);
+
+    this->cq_head  = at< unsigned >(this->cq_ptr, p.cq_off.head);
+    this->cq_tail  = at< unsigned >(this->cq_ptr, p.cq_off.tail);
+    this->cq_mask  = at< unsigned >(this->cq_ptr, p.cq_off.ring_mask);
+    this->cqes     = at< io_uring_cqe >(this->cq_ptr, p.cq_off.cqes);
+}
+
+ring::~ring() {
+    this->release();
+}
+
+void ring::release() noexcept (true) {
+    if (this->sqe_ptr != MAP_FAILED)
+        ::munmap(this->sqe_ptr, this->sqe_size);
+    if (this->cq_ptr != MAP_FAILED and this->cq_ptr != this->sq_ptr)
+        ::munmap(this->cq_ptr, this->cq_size);
+    if (this->sq_ptr != MAP_FAILED)
+        ::munmap(this->sq_ptr, this->sq_size);
+    if (this->fd != -1)
+        ::close(this->fd);
+
+    this->sqe_ptr = this->cq_ptr = this->sq_ptr = MAP_FAILED;
+    this->fd = -1;
+}
+
+void ring::prepare_read(
+        int file,
+        void* dst,
+        unsigned len,
+        std::int64_t offset,
+        std::uint64_t tag)
+noexcept (true) {
+    /* only this thread writes the tail, so a plain load is fine */
+    const auto tail = *this->sq_tail;
+    const auto index = tail & *this->sq_mask;
+
+    auto* sqe = this->sqes + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = file;
+    sqe->off       = std::uint64_t(offset);
+    sqe->addr      = std::uint64_t(reinterpret_cast< std::uintptr_t >(dst));
+    sqe->len       = len;
+    sqe->user_data = tag;
+
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    this->queued += 1;
+}
+
+void ring::submit(bool wait) noexcept (false) {
+    auto flags = wait ? IORING_ENTER_GETEVENTS : 0u;
+    auto min_complete = wait ? 1u : 0u;
+
+    while (this->queued > 0 or min_complete > 0) {
+        const auto n = ::syscall(
+            __NR_io_uring_enter,
+            this->fd,
+            this->queued,
+            min_complete,
+            flags,
+            nullptr,
+            0
+        );
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw io_error(fmt::format("io_uring: enter: {}",
+                                       std::strerror(errno)));
+        }
+
+        /*
+         * The kernel consumed none of the queued reads. Retrying would just
+         * spin, so give up, and leave the reads in the queue.
+         */
+        if (n == 0 and this->queued > 0)
+            throw io_error("io_uring: enter: no reads submitted");
+
+        /* the wait, if any, is done */
+        this->queued -= unsigned(n);
+        flags = 0;
+        min_complete = 0;
+    }
+}
+
+template < typename F >
+void ring::reap(F f) noexcept (true) {
+    auto head = *this->cq_head;
+    const auto tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        const auto& cqe = this->cqes[head & *this->cq_mask];
+        f(cqe.user_data, cqe.res);
+        ++head;
+    }
+
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * A leaf protocol that reads through io_uring.
+ *
+ * The file is read in fixed-size blocks, and a small set of block buffers are
+ * kept. When reads are sequential, the next blocks are read ahead, so that up
+ * to depth reads are in flight, and prefetch() can explicitly queue blocks in
+ * a single batch. Blocks stay around after they've been read, and are evicted
+ * least-recently-used first, so seeking back and forth in a small region,
+ * like when tapeimage and rp66 read headers, is served from memory.
+ *
+ * Large, block-aligned reads that are not already in flight are read straight
+ * into the caller's buffer.
+ *
+ * Without a ring, the protocol is the same as the fd protocol.
+ */
+class uring : public lfp_protocol {
+public:
+    uring(int fd, int depth) noexcept (false);
+    ~uring() override;
+
+    void close() noexcept (false) override;
+    lfp_status readinto(
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* bytes_read)
+        noexcept (false) override;
+
+    bool concurrent_readat() const noexcept (true) override;
+    int eof() const noexcept (true) override;
+
+    void seek(std::int64_t) noexcept (false) override;
+    std::int64_t tell() const noexcept (true) override;
+    std::int64_t size() noexcept (false) override;
+
+    lfp_protocol* peel() noexcept (false) override;
+    lfp_protocol* peek() const noexcept (false) override;
+    lfp_protocol* dup() noexcept (false) override;
+
+    void prefetch(
+            const std::int64_t* offsets,
+            const std::int64_t* lengths,
+            int n)
+        noexcept (false);
+
+private:
+    enum class state { empty, inflight, ready };
+
+    struct block {
+        std::unique_ptr< unsigned char[] > buffer;
+        std::int64_t offset = -1;
+        std::int64_t size = 0;
+        state status = state::empty;
+        /* errno of a failed read, or 0 */
+        int error = 0;
+        /* short reads are completed with pread, once */
+        bool complete = false;
+        std::uint64_t used = 0;
+    };
+
+    int file = -1;
+    std::int64_t zero = 0;
+    std::int64_t pos = 0;
+    /* the position after the previous read, to detect sequential reads */
+    std::int64_t sequential_pos = 0;
+    bool end_of_file = false;
+
+    std::vector< block > blocks;
+    std::unique_ptr< ring > io;
+    int inflight = 0;
+    std::uint64_t clock = 0;
+
+    /* pread len bytes from the absolute offset at, bypassing the blocks */
+    lfp_status read_direct(
+            std::int64_t at,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* n)
+        const noexcept (false);
+
+    block* lookup(std::int64_t offset) noexcept (true);
+    block& acquire(const block* keep) noexcept (false);
+    block& request(std::int64_t offset, const block* keep) noexcept (false);
+    void wait(block&) noexcept (false);
+    void finish(block&) noexcept (false);
+    void wait_any() noexcept (false);
+    void drain() noexcept (true);
+};
+
+uring::uring(int fd, int depth) noexcept (false) : file(fd) {
+    const auto off = ::lseek(fd, 0, SEEK_CUR);
+    if (off == -1)
+        throw not_supported(std::strerror(errno));
+
+    this->zero = off;
+    this->pos = off;
+    this->sequential_pos = off;
+
+    if (depth == 0)
+        return;
+
+    try {
+        this->io.reset(new ring(unsigned(depth)));
+    } catch (const lfp::error&) {
+        /* no io_uring, so fall back to pread */
+        return;
+    }
+
+    this->blocks.resize(depth);
+    for (auto& b : this->blocks)
+        b.buffer.reset(new unsigned char[block_size]);
+}
+
+uring::~uring() {
+    /*
+     * The kernel writes into the block buffers, so all reads must complete
+     * before they're freed
+     */
+    this->drain();
+    if (this->file != -1)
+        ::close(this->file);
+}
+
+void uring::close() noexcept (false) {
+    if (this->file == -1) return;
+
+    this->drain();
+    this->io.reset();
+    this->blocks.clear();
+
+    const auto err = ::close(this->file);
+    this->file = -1;
+
+    if (err)
+        throw runtime_error(std::strerror(errno));
+}
+
+void uring::drain() noexcept (true) {
+    while (this->inflight > 0) {
+        try {
+            this->wait_any();
+        } catch (...) {
+            /*
+             * If waiting fails the kernel may still write to the buffers of
+             * the reads in flight, so they cannot be freed. Leak them.
+             */
+            for (auto& b : this->blocks)
+                if (b.status == state::inflight)
+                    b.buffer.release();
+            this->inflight = 0;
+        }
+    }
+}
+
+lfp_status uring::read_direct(
+        std::int64_t at,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* nread)
+const noexcept (false) {
+    std::int64_t n = 0;
+    lfp_status status = LFP_OK;
+    while (n < len) {
+        const auto res = ::pread(
+            this->file,
+            advance(dst, n),
+            std::size_t(std::min(len - n, std::int64_t(1) << 30)),
+            off_t(at + n)
+        );
+
+        if (res > 0) {
+            n += res;
+            continue;
+        }
+
+        if (res == 0) {
+            status = LFP_EOF;
+            break;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        *nread = n;
+        throw io_error(std::strerror(errno));
+    }
+
+    *nread = n;
+    return status;
+}
+
+uring::block* uring::lookup(std::int64_t offset) noexcept (true) {
+    for (auto& b : this->blocks) {
+        if (b.status != state::empty and b.offset == offset)
+            return &b;
+    }
+    return nullptr;
+}
+
+uring::block& uring::acquire(const block* keep) noexcept (false) {
+    while (true) {
+        block* victim = nullptr;
+        for (auto& b : this->blocks) {
+            if (&b == keep or b.status == state::inflight)
+                continue;
+
+            if (b.status == state::empty)
+                return b;
+
+            if (not victim or b.used < victim->used)
+                victim = &b;
+        }
+
+        if (victim) {
+            victim->status = state::empty;
+            return *victim;
+        }
+
+        /* every block is in flight, so wait for one to land */
+        this->wait_any();
+    }
+}
+
+uring::block& uring::request(std::int64_t offset, const block* keep)
+noexcept (false) {
+    auto* b = this->lookup(offset);
+    if (b) return *b;
+
+    auto& x = this->acquire(keep);
+    x.offset = offset;
+    x.size = 0;
+    x.error = 0;
+    x.complete = false;
+    x.status = state::inflight;
+    x.used = ++this->clock;
+    this->io->prepare_read(
+        this->file,
+        x.buffer.get(),
+        unsigned(block_size),
+        offset,
+        std::uint64_t(&x - this->blocks.data())
+    );
+    this->inflight += 1;
+    return x;
+}
+
+void uring::wait_any() noexcept (false) {
+    this->io->submit(true);
+    this->io->reap([this](std::uint64_t tag, std::int32_t res) {
+        auto& b = this->blocks[tag];
+        assert(b.status == state::inflight);
+        b.status = state::ready;
+        b.size  = std::max(res, 0);
+        b.error = res < 0 ? -res : 0;
+        this->inflight -= 1;
+    });
+}
+
+void uring::wait(block& b) noexcept (false) {
+    while (b.status == state::inflight)
+        this->wait_any();
+}
+
+void uring::finish(block& b) noexcept (false) {
+    if (b.complete) return;
+
+    if (b.error) {
+        const auto err = b.error;
+        b.status = state::empty;
+        throw io_error(fmt::format("io_uring: read: {}", std::strerror(err)));
+    }
+
+    /*
+     * Reads can be short without being at the end of the file, so read the
+     * rest of the block with pread. This happens at most once per block.
+     */
+    while (b.size < block_size) {
+        const auto res = ::pread(
+            this->file,
+            b.buffer.get() + b.size,
+            std::size_t(block_size - b.size),
+            off_t(b.offset + b.size)
+        );
+
+        if (res > 0) {
+            b.size += res;
+            continue;
+        }
+
+        if (res == 0)
+            break;
+
+        if (errno == EINTR)
+            continue;
+
+        b.status = state::empty;
+        throw io_error(std::strerror(errno));
+    }
+
+    b.complete = true;
+}
+
+lfp_status uring::readinto(
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    assert(len >= 0);
+
+    std::int64_t n = 0;
+    if (not this->io) {
+        const auto status = this->read_direct(this->pos, dst, len, &n);
+        this->pos += n;
+        if (bytes_read)
+            *bytes_read = n;
+        if (status == LFP_EOF)
+            this->end_of_file = true;
+        return status;
+    }
+
+    const auto sequential = this->pos == this->sequential_pos;
+    const auto readahead = std::int64_t(this->blocks.size()) - 1;
+
+    lfp_status status = LFP_OK;
+    while (n < len) {
+        const auto offset = this->pos - (this->pos % block_size);
+        auto* b = this->lookup(offset);
+
+        if (not b and this->pos == offset and len - n >= block_size) {
+            const auto m = ((len - n) / block_size) * block_size;
+            std::int64_t k;
+            status = this->read_direct(this->pos, advance(dst, n), m, &k);
+            this->pos += k;
+            n += k;
+            if (status == LFP_EOF) break;
+            continue;
+        }
+
+        if (not b)
+            b = &this->request(offset, nullptr);
+        b->used = ++this->clock;
+
+        if (sequential) {
+            for (std::int64_t i = 1; i <= readahead; ++i)
+                this->request(offset + i * block_size, b);
+        }
+
+        this->wait(*b);
+        this->finish(*b);
+
+        const auto within = this->pos - b->offset;
+        const auto k = std::min(b->size - within, len - n);
+        if (k > 0) {
+            std::memcpy(advance(dst, n), b->buffer.get() + within, k);
+            n += k;
+            this->pos += k;
+        }
+
+        if (b->size < block_size and this->pos >= b->offset + b->size) {
+            if (n < len) status = LFP_EOF;
+            break;
+        }
+    }
+
+    /* submit outstanding read-aheads, if any, without waiting for them */
+    this->io->submit(false);
+
+    if (status == LFP_EOF)
+        this->end_of_file = true;
+
+    this->sequential_pos = this->pos;
+    if (bytes_read)
+        *bytes_read = n;
+    return status;
+}
+
+/*
+ * Reads at an offset go straight to pread, and never touch the blocks, so
+ * that they are safe to call from multiple threads
+ */
+lfp_status uring::readat(
+        std::int64_t offset,
+        void* dst,
+        std::int64_t len,
+        std::int64_t* bytes_read)
+noexcept (false) {
+    std::int64_t n = 0;
+    const auto status = this->read_direct(this->zero + offset, dst, len, &n);
+    if (bytes_read)
+        *bytes_read = n;
+    return status;
+}
+
+bool uring::concurrent_readat() const noexcept (true) {
+    return true;
+}
+
+int uring::eof() const noexcept (true) {
+    return this->end_of_file;
+}
+
+void uring::seek(std::int64_t n) noexcept (false) {
+    if (n < 0) {
+        const auto msg = "uring: seek: expected n (= {}) >= 0";
+        throw invalid_args(fmt::format(msg, n));
+    }
+
+    this->pos = this->zero + n;
+    this->end_of_file = false;
+}
+
+std::int64_t uring::tell() const noexcept (true) {
+    return this->pos - this->zero;
+}
+
+std::int64_t uring::size() noexcept (false) {
+    struct stat st;
+    if (::fstat(this->file, &st) == -1)
+        throw io_error(std::strerror(errno));
+
+    if (not S_ISREG(st.st_mode)) {
+        const auto msg = "uring: size: descriptor (= {}) is not "
+                         "a regular file";
+        throw not_supported(fmt::format(msg, this->file));
+    }
+
+    return std::max(std::int64_t(st.st_size) - this->zero, std::int64_t(0));
+}
+
+lfp_protocol* uring::peel() noexcept (false) {
+    throw lfp::leaf_protocol("peel: not supported for leaf protocol");
+}
+
+lfp_protocol* uring::peek() const noexcept (false) {
+    throw lfp::leaf_protocol("peek: not supported for leaf protocol");
+}
+
+/*
+ * The duplicate gets its own ring and blocks, over a dup() of the
+ * descriptor. The descriptors share the file offset, but it is never used,
+ * as all reads are positional.
+ */
+lfp_protocol* uring::dup() noexcept (false) {
+    const auto f = ::dup(this->file);
+    if (f == -1)
+        throw io_error(std::strerror(errno));
+
+    uring* copy;
+    try {
+        copy = new uring(f, int(this->blocks.size()));
+    } catch (...) {
+        ::close(f);
+        throw;
+    }
+
+    copy->zero = this->zero;
+    copy->pos = this->pos;
+    copy->sequential_pos = this->pos;
+    copy->end_of_file = this->end_of_file;
+    return copy;
+}
+
+void uring::prefetch(
+        const std::int64_t* offsets,
+        const std::int64_t* lengths,
+        int n)
+noexcept (false) {
+    for (int i = 0; i < n; ++i) {
+        if (offsets[i] < 0 or lengths[i] < 0) {
+            const auto msg = "uring: prefetch: expected offset (= {}) >= 0 "
+                             "and length (= {}) >= 0";
+            throw invalid_args(fmt::format(msg, offsets[i], lengths[i]));
+        }
+    }
+
+    if (not this->io) {
+        for (int i = 0; i < n; ++i) {
+            ::posix_fadvise(
+                this->file,
+                off_t(this->zero + offsets[i]),
+                off_t(lengths[i]),
+                POSIX_FADV_WILLNEED
+            );
+        }
+        return;
+    }
+
+    /*
+     * Requesting more blocks than there are buffers would evict the blocks
+     * just requested, so stop when the buffers are used up
+     */
+    auto budget = std::int64_t(this->blocks.size());
+    for (int i = 0; i < n and budget > 0; ++i) {
+        if (lengths[i] == 0) continue;
+
+        const auto begin = this->zero + offsets[i];
+        const auto end   = begin + lengths[i];
+        auto offset = begin - (begin % block_size);
+        for (; offset < end and budget > 0; offset += block_size, --budget)
+            this->request(offset, nullptr);
+    }
+
+    this->io->submit(false);
+}
+
+uring& as_uring(lfp_protocol* f) noexcept (false) {
+    auto* u = dynamic_cast< uring* >(f);
+    if (not u)
+        throw invalid_args("handle is not an io_uring protocol");
+    return *u;
+}
+
+}
+
+}
+
+lfp_protocol* lfp_uring_open(int fd, int depth) {
+    if (fd < 0) return nullptr;
+    if (depth < 0 or depth > lfp::max_depth) return nullptr;
+
+    try {
+        return new lfp::uring(fd, depth);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+int lfp_uring_prefetch(
+        lfp_protocol* f,
+        const std::int64_t* offsets,
+        const std::int64_t* lengths,
+        int n)
+try {
+    assert(f);
+    assert(n == 0 or (offsets and lengths));
+    lfp::as_uring(f).prefetch(offsets, lengths, n);
+    return LFP_OK;
+} catch (const lfp::error& e) {
+    f->errmsg(e.what());
+    return e.status();
+} catch (const std::exception& e) {
+    f->errmsg(e.what());
+    return LFP_UNHANDLED_EXCEPTION;
+} catch (...) {
+    assert(false);
+    f->errmsg("Unhandled error that does not derive from std::exception");
+    return LFP_UNHANDLED_EXCEPTION;
+}
@@ -0,0 +1,302 @@
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/buffered.h>
+#include <lfp/lfp.h>
+#include <lfp/memfile.h>
+#include <lfp/protocol.hpp>
+#include <lfp/rp66.h>
+
+#include "utils.hpp"
+
+using namespace Catch::Matchers;
+
+namespace {
+
+struct random_buffered : random_memfile {
+    random_buffered() {
+        const auto block_size = GENERATE(1, 7, 64, 0);
+        f = lfp_buffered_open(f, block_size);
+        REQUIRE(f);
+    }
+};
+
+}
+
+TEST_CASE(
+    "Buffered open fails on null and negative block size",
+    "[buffered][open]") {
+    CHECK(not lfp_buffered_open(nullptr, 0));
+
+    auto* mem = lfp_memfile_open();
+    CHECK(not lfp_buffered_open(mem, -1));
+    lfp_close(mem);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be read",
+    "[buffered][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be seeked",
+    "[buffered][seek]") {
+    test_random_seek(this);
+}
+
+TEST_CASE(
+    "Buffered reads and seeks within the block are served from memory",
+    "[buffered]") {
+    auto file = std::vector< unsigned char >(1000);
+    for (std::size_t i = 0; i < file.size(); ++i)
+        file[i] = static_cast< unsigned char >(i);
+
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* f = lfp_buffered_open(counter, 100);
+    REQUIRE(f);
+
+    /* read 10 bytes at a time, seeking back and forth within a block */
+    for (int i = 0; i < 10; ++i) {
+        unsigned char buf[10];
+        std::int64_t nread;
+        auto err = lfp_seek(f, 90 - i * 10);
+        REQUIRE(err == LFP_OK);
+        err = lfp_readinto(f, buf, sizeof(buf), &nread);
+        REQUIRE(err == LFP_OK);
+        CHECK(buf[0] == 90 - i * 10);
+
+        std::int64_t tell;
+        lfp_tell(f, &tell);
+        CHECK(tell == 100 - i * 10);
+    }
+
+    CHECK(counter->reads == 1);
+
+    /* sequential reads past the block refill without seeking */
+    auto out = std::vector< unsigned char >(250);
+    std::int64_t nread;
+    auto err = lfp_seek(f, 100);
+    REQUIRE(err == LFP_OK);
+    for (int i = 0; i < 25; ++i) {
+        err = lfp_readinto(f, out.data() + i * 10, 10, &nread);
+        REQUIRE(err == LFP_OK);
+    }
+    CHECK(out[0] == 100);
+    CHECK(out[249] == static_cast< unsigned char >(349));
+    CHECK(counter->reads == 1 + 3);
+
+    /* large reads bypass the buffer */
+    out.resize(500);
+    err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(out[0] == static_cast< unsigned char >(350));
+    CHECK(counter->reads == 1 + 3 + 1);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Buffered duplicates start at the position, with an empty buffer",
+    "[buffered][dup]") {
+    auto file = std::vector< unsigned char >(1000);
+    for (std::size_t i = 0; i < file.size(); ++i)
+        file[i] = static_cast< unsigned char >(i);
+
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_buffered_open(mem, 100);
+    REQUIRE(f);
+
+    /* the underlying file is ahead of the buffered handle */
+    unsigned char buf[10];
+    std::int64_t nread;
+    auto err = lfp_readinto(f, buf, sizeof(buf), &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* dup = nullptr;
+    err = lfp_dup(f, &dup);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t tell = -1;
+    err = lfp_tell(dup, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 10);
+
+    err = lfp_readinto(dup, buf, sizeof(buf), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(buf[0] == 10);
+
+    /* the original reads on from its own buffer */
+    err = lfp_readinto(f, buf, sizeof(buf), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(buf[0] == 10);
+
+    lfp_close(dup);
+    lfp_close(f);
+
+    /* the underlying handle must support dup */
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    f = lfp_buffered_open(counter, 100);
+    REQUIRE(f);
+    err = lfp_dup(f, &dup);
+    CHECK(err == LFP_NOTIMPLEMENTED);
+
+    err = lfp_readinto(f, buf, sizeof(buf), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(buf[0] == 0);
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "rp66 can be layered on a buffered file",
+    "[buffered][rp66]") {
+    const auto file = std::vector< unsigned char > {
+        0x00, 0x08, 0xFF, 0x01,
+        0x01, 0x02, 0x03, 0x04,
+
+        0x00, 0x06, 0xFF, 0x01,
+        0x05, 0x06,
+    };
+
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_rp66_open(lfp_buffered_open(mem, 5));
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(7);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 6);
+    out.resize(nread);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >{ 1, 2, 3, 4, 5, 6 }));
+
+    err = lfp_seek(f, 3);
+    CHECK(err == LFP_OK);
+    unsigned char x;
+    err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(x == 4);
+
+    lfp_protocol* inner;
+    err = lfp_peek(f, &inner);
+    CHECK(err == LFP_OK);
+
+    lfp_protocol* leaf;
+    err = lfp_peek(inner, &leaf);
+    CHECK(err == LFP_OK);
+    CHECK(leaf == mem);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be read at an offset",
+    "[buffered][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be read at many offsets",
+    "[buffered][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be duplicated",
+    "[buffered][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file can be borrowed from",
+    "[buffered][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_buffered,
+    "Buffered file reports its size",
+    "[buffered][size]") {
+    test_random_size(this);
+}
+
+TEST_CASE(
+    "Buffered file leaves the underlying file at its position on peel",
+    "[buffered][peel]") {
+    const auto file = make_file(100000);
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_buffered_open(mem, 0);
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(10);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* inner;
+    std::int64_t tell;
+    SECTION( "peek" ) {
+        err = lfp_peek(f, &inner);
+        CHECK(err == LFP_OK);
+        err = lfp_tell(inner, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 10);
+
+        /* the buffer is still valid */
+        unsigned char x;
+        err = lfp_readinto(f, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(x == file[10]);
+        lfp_close(f);
+    }
+
+    SECTION( "peel" ) {
+        err = lfp_peel(f, &inner);
+        CHECK(err == LFP_OK);
+        err = lfp_tell(inner, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 10);
+
+        unsigned char x;
+        err = lfp_readinto(inner, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(x == file[10]);
+        lfp_close(inner);
+        lfp_close(f);
+    }
+}
@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <ciso646>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/cache.h>
+#include <lfp/lfp.h>
+#include <lfp/memfile.h>
+#include <lfp/protocol.hpp>
+
+#include "utils.hpp"
+
+using namespace Catch::Matchers;
+
+namespace {
+
+constexpr std::int64_t default_budget = 64 * 1024 * 1024;
+
+struct random_cached : random_memfile {
+    random_cached() {
+        /* the contents are random, so make sure nothing is left over */
+        lfp_cache_drop("random");
+        f = lfp_cache_open(f, "random");
+        REQUIRE(f);
+    }
+};
+
+lfp_cache_stats statistics() {
+    lfp_cache_stats stats;
+    lfp_cache_statistics(&stats);
+    return stats;
+}
+
+}
+
+TEST_CASE(
+    "Cache open fails on null handle or key",
+    "[cache][open]") {
+    CHECK(not lfp_cache_open(nullptr, "key"));
+
+    auto* mem = lfp_memfile_open();
+    CHECK(not lfp_cache_open(mem, nullptr));
+    lfp_close(mem);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be read",
+    "[cache][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be seeked",
+    "[cache][seek]") {
+    test_random_seek(this);
+}
+
+TEST_CASE(
+    "Cached file is read at offsets through the shared blocks",
+    "[cache][readat]") {
+    lfp_cache_drop("readat");
+    const auto file = make_file(300 * 1000);
+
+    auto* f = lfp_cache_open(
+        lfp_memfile_openwith(file.data(), file.size()),
+        "readat"
+    );
+    REQUIRE(f);
+
+    /* a range across a block boundary, and then the same range again */
+    const auto offset = 64 * 1024 - 100;
+    auto out = std::vector< unsigned char >(200);
+    std::int64_t nread;
+
+    const auto before = statistics();
+    auto err = lfp_readat(f, offset, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::equal(out.begin(), out.end(), file.begin() + offset));
+
+    const auto first = statistics();
+    CHECK(first.misses == before.misses + 2);
+
+    err = lfp_readat(f, offset, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::equal(out.begin(), out.end(), file.begin() + offset));
+
+    const auto second = statistics();
+    CHECK(second.misses == first.misses);
+    CHECK(second.hits == first.hits + 2);
+
+    /* past the end of the file */
+    err = lfp_readat(f, file.size() - 10, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 10);
+
+    std::int64_t tell = -1;
+    lfp_tell(f, &tell);
+    CHECK(tell == 0);
+
+    lfp_close(f);
+    lfp_cache_drop("readat");
+}
+
+TEST_CASE(
+    "Cached file duplicates share the blocks of the original",
+    "[cache][dup]") {
+    lfp_cache_drop("dup");
+    const auto file = make_file(300 * 1000);
+
+    auto* f = lfp_cache_open(
+        lfp_memfile_openwith(file.data(), file.size()),
+        "dup"
+    );
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(file.size());
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), 1000, &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* dup = nullptr;
+    err = lfp_dup(f, &dup);
+    REQUIRE(err == LFP_OK);
+    err = lfp_readinto(f, out.data() + 1000, out.size() - 1000, &nread);
+    REQUIRE(err == LFP_OK);
+    CHECK_THAT(out, Equals(file));
+    lfp_close(f);
+
+    /* every block was read by the original, so the duplicate only hits */
+    const auto before = statistics();
+    std::int64_t tell = -1;
+    lfp_tell(dup, &tell);
+    CHECK(tell == 1000);
+
+    out.assign(file.size(), 0);
+    err = lfp_readinto(dup, out.data() + 1000, out.size() - 1000, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::equal(out.begin() + 1000, out.end(), file.begin() + 1000));
+
+    const auto after = statistics();
+    CHECK(after.misses == before.misses);
+    CHECK(after.hits > before.hits);
+
+    lfp_close(dup);
+    lfp_cache_drop("dup");
+}
+
+TEST_CASE(
+    "Handles with the same key share blocks",
+    "[cache]") {
+    lfp_cache_drop("shared");
+    const auto file = make_file(300 * 1000);
+
+    auto* c1 = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* c2 = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* f1 = lfp_cache_open(c1, "shared");
+    auto* f2 = lfp_cache_open(c2, "shared");
+    REQUIRE(f1);
+    REQUIRE(f2);
+
+    const auto before = statistics();
+
+    auto out1 = std::vector< unsigned char >(file.size());
+    auto out2 = std::vector< unsigned char >(file.size());
+    std::int64_t nread;
+    auto err = lfp_readinto(f1, out1.data(), out1.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK_THAT(out1, Equals(file));
+    CHECK(c1->reads > 0);
+
+    /* the second handle reads it all from the cache, in scrambled order */
+    const std::int64_t chunk = 1000;
+    for (std::int64_t i = 0; i < 300; ++i) {
+        const auto n = ((i * 7919) % 300) * chunk;
+        err = lfp_seek(f2, n);
+        REQUIRE(err == LFP_OK);
+        err = lfp_readinto(f2, out2.data() + n, chunk, &nread);
+        REQUIRE(err == LFP_OK);
+    }
+    CHECK_THAT(out2, Equals(file));
+    CHECK(c2->reads == 0);
+
+    const auto after = statistics();
+    CHECK(after.misses - before.misses == c1->reads);
+    CHECK(after.hits > before.hits);
+
+    SECTION( "dropped blocks are read again" ) {
+        lfp_cache_drop("shared");
+        err = lfp_seek(f2, 0);
+        REQUIRE(err == LFP_OK);
+        err = lfp_readinto(f2, out2.data(), 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(c2->reads == 1);
+    }
+
+    lfp_close(f1);
+    lfp_close(f2);
+}
+
+TEST_CASE(
+    "Cache stays within the budget",
+    "[cache][budget]") {
+    lfp_cache_drop(nullptr);
+    const auto file = make_file(1000 * 1000);
+
+    CHECK(lfp_cache_set_budget(-1) == LFP_INVALID_ARGS);
+
+    const auto budget = GENERATE(0, 100 * 1000, 300 * 1000);
+    REQUIRE(lfp_cache_set_budget(budget) == LFP_OK);
+
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* f = lfp_cache_open(counter, "budget");
+    REQUIRE(f);
+
+    const auto before = statistics();
+
+    auto out = std::vector< unsigned char >(file.size());
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK_THAT(out, Equals(file));
+
+    const auto after = statistics();
+    CHECK(after.budget == budget);
+    CHECK(after.size <= budget);
+
+    if (budget == 0) {
+        CHECK(after.size == 0);
+        CHECK(after.evictions == before.evictions);
+    } else {
+        CHECK(after.size > 0);
+        CHECK(after.evictions > before.evictions);
+    }
+
+    SECTION( "shrinking the budget evicts" ) {
+        REQUIRE(lfp_cache_set_budget(0) == LFP_OK);
+        CHECK(statistics().size == 0);
+    }
+
+    lfp_close(f);
+    lfp_cache_drop(nullptr);
+    lfp_cache_set_budget(default_budget);
+}
+
+TEST_CASE(
+    "Cache evicts the blocks that have not been used in the longest time",
+    "[cache][budget][clock]") {
+    constexpr std::int64_t block = 64 * 1024;
+    lfp_cache_drop(nullptr);
+    REQUIRE(lfp_cache_set_budget(3 * block) == LFP_OK);
+    const auto file = make_file(6 * block);
+
+    /* read one byte at the start of blocks, through the cache */
+    auto read_blocks = [&file](std::vector< int > blocks) {
+        auto* counter = new read_counter(
+            lfp_memfile_openwith(file.data(), file.size())
+        );
+        auto* f = lfp_cache_open(counter, "clock");
+        REQUIRE(f);
+
+        unsigned char out;
+        std::int64_t nread;
+        for (const auto n : blocks) {
+            REQUIRE(lfp_seek(f, n * block) == LFP_OK);
+            const auto err = lfp_readinto(f, &out, 1, &nread);
+            CHECK(err == LFP_OK);
+            CHECK(out == file[n * block]);
+        }
+
+        const auto reads = counter->reads.load();
+        lfp_close(f);
+        return reads;
+    };
+
+    SECTION( "the oldest blocks are evicted first" ) {
+        CHECK(read_blocks({ 0, 1, 2, 3, 4, 5 }) == 6);
+        CHECK(statistics().size == 3 * block);
+
+        CHECK(read_blocks({ 3 }) == 0);
+        CHECK(read_blocks({ 4 }) == 0);
+        CHECK(read_blocks({ 5 }) == 0);
+        CHECK(read_blocks({ 0 }) == 1);
+        CHECK(read_blocks({ 1 }) == 1);
+        CHECK(read_blocks({ 2 }) == 1);
+    }
+
+    SECTION( "blocks used since the last sweep get a second chance" ) {
+        CHECK(read_blocks({ 0, 1, 2 }) == 3);
+        CHECK(read_blocks({ 0 }) == 0);
+        CHECK(read_blocks({ 3 }) == 1);
+
+        CHECK(read_blocks({ 0 }) == 0);
+        CHECK(read_blocks({ 2 }) == 0);
+        CHECK(read_blocks({ 3 }) == 0);
+        CHECK(read_blocks({ 1 }) == 1);
+    }
+
+    lfp_cache_drop(nullptr);
+    lfp_cache_set_budget(default_budget);
+}
+
+TEST_CASE(
+    "Cache can be shared between threads",
+    "[cache][thread]") {
+    lfp_cache_drop("threads");
+    REQUIRE(lfp_cache_set_budget(200 * 1000) == LFP_OK);
+    const auto file = make_file(1000 * 1000);
+
+    auto ok = std::vector< int >(4, 0);
+    auto threads = std::vector< std::thread >();
+    for (std::size_t t = 0; t < ok.size(); ++t) {
+        threads.emplace_back([&file, &ok, t] {
+            auto* mem = lfp_memfile_openwith(file.data(), file.size());
+            auto* f = lfp_cache_open(mem, "threads");
+            if (not f) return;
+
+            int good = 1;
+            auto out = std::vector< unsigned char >(997);
+            for (std::int64_t i = 0; i < 500; ++i) {
+                const auto n = ((i + t * 131) * 7919 * 13) % (1000 * 999);
+                std::int64_t nread;
+                lfp_seek(f, n);
+                lfp_readinto(f, out.data(), out.size(), &nread);
+                const auto begin = file.begin() + n;
+                good &= std::equal(out.begin(), out.end(), begin);
+            }
+
+            lfp_close(f);
+            ok[t] = good;
+        });
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    CHECK_THAT(ok, Equals(std::vector< int >(4, 1)));
+    CHECK(statistics().size <= 200 * 1000);
+
+    lfp_cache_drop(nullptr);
+    lfp_cache_set_budget(default_budget);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be read at an offset",
+    "[cache][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be read at many offsets",
+    "[cache][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be duplicated",
+    "[cache][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file can be borrowed from",
+    "[cache][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_cached,
+    "Cached file reports its size",
+    "[cache][size]") {
+    test_random_size(this);
+}
+
+TEST_CASE(
+    "Cached file leaves the underlying file at its position on peel",
+    "[cache][peel]") {
+    lfp_cache_drop("peel");
+    const auto file = make_file(300 * 1000);
+    auto* f = lfp_cache_open(
+        lfp_memfile_openwith(file.data(), file.size()),
+        "peel"
+    );
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(10);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* inner;
+    std::int64_t tell;
+    SECTION( "peek" ) {
+        err = lfp_peek(f, &inner);
+        CHECK(err == LFP_OK);
+        err = lfp_tell(inner, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 10);
+
+        unsigned char x;
+        err = lfp_readinto(f, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(x == file[10]);
+        lfp_close(f);
+    }
+
+    SECTION( "peel" ) {
+        err = lfp_peel(f, &inner);
+        CHECK(err == LFP_OK);
+        err = lfp_tell(inner, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 10);
+
+        unsigned char x;
+        err = lfp_readinto(inner, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(x == file[10]);
+        lfp_close(inner);
+        lfp_close(f);
+    }
+
+    lfp_cache_drop("peel");
+}
@@ -199,3 +199,68 @@ TEST_CASE_METHOD(
         CHECK_THAT(msg, Contains(">= 0"));
     }
 }
+
+TEST_CASE_METHOD(
+    random_cfile,
+    "Cfile can be read at an offset",
+    "[cfile][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_cfile,
+    "Cfile can be read at many offsets",
+    "[cfile][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_cfile,
+    "Cfile can be duplicated",
+    "[cfile][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_cfile,
+    "Cfile can be borrowed from",
+    "[cfile][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE(
+    "Cfile size starts where the file was opened",
+    "[cfile][size]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file", fp);
+    std::fflush(fp);
+    std::fseek(fp, 5, SEEK_SET);
+
+    auto* cfile = lfp_cfile(fp);
+    REQUIRE(cfile);
+
+    std::int64_t size = -1;
+    auto err = lfp_size(cfile, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 11);
+
+    /* reading to the end does not change the size */
+    auto buffer = std::vector< char >(12);
+    std::int64_t nread;
+    err = lfp_readinto(cfile, buffer.data(), 12, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == size);
+
+    err = lfp_size(cfile, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 11);
+
+    lfp_close(cfile);
+}
+
+TEST_CASE_METHOD(
+    random_cfile,
+    "Cfile reports its size",
+    "[cfile][size]") {
+    test_random_size(this);
+}
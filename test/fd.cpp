@@ -0,0 +1,387 @@
+#include <ciso646>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/fd.h>
+#include <lfp/lfp.h>
+
+#include "utils.hpp"
+
+
+using namespace Catch::Matchers;
+
+namespace {
+
+struct random_fd : random_memfile {
+    random_fd() {
+        REQUIRE(not expected.empty());
+
+        lfp_close(f);
+        f = nullptr;
+
+        f = lfp_fd_open(tmpfd(expected.data(), expected.size()));
+        REQUIRE(f);
+    }
+};
+
+}
+
+TEST_CASE(
+    "Opening a negative descriptor fails",
+    "[fd][open]") {
+    CHECK(not lfp_fd_open(-1));
+}
+
+TEST_CASE(
+    "Unsupported peel and peek leave the fd intact",
+    "[fd][peel][peek]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file" , fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 0, SEEK_SET);
+
+    auto* f = lfp_fd_open(fd);
+    REQUIRE(f);
+
+    lfp_protocol* protocol;
+    auto err = lfp_peel(f, &protocol);
+    CHECK(err == LFP_LEAF_PROTOCOL);
+    err = lfp_peek(f, &protocol);
+    CHECK(err == LFP_LEAF_PROTOCOL);
+
+    auto buffer = std::vector< unsigned char >(17, 0xFF);
+    std::int64_t nread;
+    err = lfp_readinto(f, buffer.data(), 17, &nread);
+
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 16);
+    CHECK(lfp_eof(f));
+
+    err = lfp_close(f);
+    CHECK(err == LFP_OK);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be read",
+    "[fd][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+
+    SECTION( "negative read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), -1, &nread);
+
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(f));
+        CHECK_THAT(msg, Contains(">= 0"));
+    }
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be seeked",
+    "[fd][seek]") {
+
+    SECTION( "correct seek" ) {
+        test_random_seek(this);
+    }
+
+    SECTION( "seek beyond file end" ) {
+        auto err = lfp_seek(f, expected.size() + 10);
+        CHECK(err == LFP_OK);
+
+        std::int64_t nread = -1;
+        err = lfp_readinto(f, out.data(), 1, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 0);
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "negative seek" ) {
+        const auto err = lfp_seek(f, -1);
+
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(f));
+        CHECK_THAT(msg, Contains(">= 0"));
+    }
+}
+
+TEST_CASE(
+    "fd opened at an offset considers it the start",
+    "[fd][seek]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file" , fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_fd_open(fd);
+    REQUIRE(f);
+
+    std::int64_t tell = -1;
+    auto err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+
+    auto buffer = std::vector< char >(6);
+    std::int64_t nread;
+    err = lfp_readinto(f, buffer.data(), 6, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::string(buffer.begin(), buffer.end()) == "simple");
+
+    err = lfp_seek(f, 7);
+    CHECK(err == LFP_OK);
+    err = lfp_readinto(f, buffer.data(), 4, &nread);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 4) == "file");
+
+    std::int64_t size = -1;
+    err = lfp_size(f, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 11);
+
+    /* the position of the descriptor itself is left alone */
+    CHECK(::lseek(fd, 0, SEEK_CUR) == 5);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Pipes can be read, but not seeked",
+    "[fd][pipe]") {
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    REQUIRE(::write(fds[1], "pipe", 4) == 4);
+    ::close(fds[1]);
+
+    auto* f = lfp_fd_open(fds[0]);
+    REQUIRE(f);
+
+    auto buffer = std::vector< char >(5);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, buffer.data(), 5, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 4);
+
+    err = lfp_seek(f, 0);
+    CHECK(err == LFP_NOTSUPPORTED);
+
+    std::int64_t tell;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_NOTSUPPORTED);
+
+    lfp_protocol* dup;
+    err = lfp_dup(f, &dup);
+    CHECK(err == LFP_NOTSUPPORTED);
+
+    std::int64_t size;
+    err = lfp_size(f, &size);
+    CHECK(err == LFP_NOTSUPPORTED);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "fd reads at offsets from where it was opened, but not from pipes",
+    "[fd][readat]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file" , fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_fd_open(fd);
+    REQUIRE(f);
+
+    auto buffer = std::vector< char >(8);
+    std::int64_t nread;
+    auto err = lfp_readat(f, 7, buffer.data(), 8, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 4);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 4) == "file");
+
+    err = lfp_readat(f, 20, buffer.data(), 8, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+
+    /* neither the handle nor the descriptor is moved */
+    std::int64_t tell = -1;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+    CHECK(::lseek(fd, 0, SEEK_CUR) == 5);
+    lfp_close(f);
+
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    REQUIRE(::write(fds[1], "pipe", 4) == 4);
+    ::close(fds[1]);
+
+    auto* pipe = lfp_fd_open(fds[0]);
+    REQUIRE(pipe);
+    err = lfp_readat(pipe, 0, buffer.data(), 4, &nread);
+    CHECK(err == LFP_NOTSUPPORTED);
+
+    /* the failed readat did not steal from the stream */
+    err = lfp_readinto(pipe, buffer.data(), 4, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 4) == "pipe");
+    lfp_close(pipe);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be read at an offset",
+    "[fd][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE(
+    "fd reads many ranges from where it was opened, but not from pipes",
+    "[fd][readv]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file" , fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_fd_open(fd);
+    REQUIRE(f);
+
+    auto file = std::vector< char >(4);
+    auto simple = std::vector< char >(6);
+    auto past = std::vector< char >(4);
+    lfp_range ranges[] = {
+        { 7, 4, file.data(), -1 },
+        { 0, 6, simple.data(), -1 },
+        { 9, 4, past.data(), -1 },
+    };
+
+    auto err = lfp_readv_at(f, ranges, 3);
+    CHECK(err == LFP_EOF);
+    CHECK(ranges[0].nread == 4);
+    CHECK(ranges[1].nread == 6);
+    CHECK(ranges[2].nread == 2);
+    CHECK(std::string(file.begin(), file.end()) == "file");
+    CHECK(std::string(simple.begin(), simple.end()) == "simple");
+    CHECK(std::string(past.begin(), past.begin() + 2) == "le");
+
+    std::int64_t tell = -1;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+    lfp_close(f);
+
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    ::close(fds[1]);
+
+    auto* pipe = lfp_fd_open(fds[0]);
+    REQUIRE(pipe);
+    err = lfp_readv_at(pipe, ranges, 3);
+    CHECK(err == LFP_NOTSUPPORTED);
+    lfp_close(pipe);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be read at many offsets",
+    "[fd][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE(
+    "fd duplicates keep where the descriptor was opened, and own a descriptor",
+    "[fd][dup]") {
+    std::FILE* fp = std::tmpfile();
+    std::fputs("Very simple file" , fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_fd_open(fd);
+    REQUIRE(f);
+
+    auto buffer = std::vector< char >(6);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, buffer.data(), 6, &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* dup = nullptr;
+    err = lfp_dup(f, &dup);
+    REQUIRE(err == LFP_OK);
+
+    /* closing the original closes its descriptor, but not the duplicate's */
+    err = lfp_close(f);
+    CHECK(err == LFP_OK);
+    CHECK(::fcntl(fd, F_GETFD) == -1);
+
+    std::int64_t tell = -1;
+    err = lfp_tell(dup, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 6);
+
+    err = lfp_seek(dup, 7);
+    CHECK(err == LFP_OK);
+    err = lfp_readinto(dup, buffer.data(), 4, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 4) == "file");
+
+    std::int64_t size = -1;
+    err = lfp_size(dup, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 11);
+
+    lfp_close(dup);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be duplicated",
+    "[fd][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd can be borrowed from",
+    "[fd][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_fd,
+    "fd reports its size",
+    "[fd][size]") {
+    test_random_size(this);
+}
@@ -0,0 +1,602 @@
+#include <algorithm>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <zlib.h>
+
+#include <lfp/gzip.h>
+#include <lfp/lfp.h>
+#include <lfp/memfile.h>
+#include <lfp/protocol.hpp>
+#include <lfp/rp66.h>
+
+#include "utils.hpp"
+
+using namespace Catch::Matchers;
+
+namespace {
+
+constexpr int gzip_format = 15 + 16;
+constexpr int zlib_format = 15;
+
+/*
+ * Compress src, ending a deflate block every block bytes. The blocks are not
+ * byte aligned, so that access points in the middle of bytes are exercised.
+ */
+std::vector< unsigned char > compress(
+        const std::vector< unsigned char >& src,
+        int format,
+        std::size_t block) {
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    auto err = deflateInit2(
+        &strm,
+        Z_DEFAULT_COMPRESSION,
+        Z_DEFLATED,
+        format,
+        8,
+        Z_DEFAULT_STRATEGY
+    );
+    REQUIRE(err == Z_OK);
+
+    auto dst = std::vector< unsigned char >(
+        deflateBound(&strm, uLong(src.size())) + 5 * (src.size() / block + 1)
+    );
+    strm.next_out = dst.data();
+    strm.avail_out = uInt(dst.size());
+
+    std::size_t pos = 0;
+    do {
+        const auto n = std::min(block, src.size() - pos);
+        strm.next_in = const_cast< Bytef* >(src.data() + pos);
+        strm.avail_in = uInt(n);
+        pos += n;
+        const auto flush = pos == src.size() ? Z_FINISH : Z_BLOCK;
+        err = deflate(&strm, flush);
+        REQUIRE(err != Z_STREAM_ERROR);
+        REQUIRE(strm.avail_in == 0);
+    } while (pos < src.size());
+
+    REQUIRE(err == Z_STREAM_END);
+    dst.resize(strm.total_out);
+    deflateEnd(&strm);
+    return dst;
+}
+
+/*
+ * Random, but compressible, data - there are only 16 different bytes
+ */
+std::vector< unsigned char > make_compressible(std::size_t size) {
+    auto data = make_tempfile(size);
+    for (auto& x : data)
+        x &= 0x0F;
+    return data;
+}
+
+class byte_counter : public lfp_protocol {
+public:
+    explicit byte_counter(lfp_protocol* f) : inner(f) {}
+
+    void close() noexcept (false) override {
+        if (this->inner) this->inner.close();
+    }
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* nread)
+    noexcept (false) override {
+        std::int64_t n;
+        const auto err = this->inner->readinto(dst, len, &n);
+        this->bytes += n;
+        if (nread) *nread = n;
+        return err;
+    }
+
+    int eof() const noexcept (false) override { return this->inner->eof(); }
+    void seek(std::int64_t n) noexcept (false) override {
+        this->inner->seek(n);
+    }
+    std::int64_t tell() const noexcept (false) override {
+        return this->inner->tell();
+    }
+
+    lfp_protocol* peel() noexcept (false) override { return nullptr; }
+    lfp_protocol* peek() const noexcept (false) override { return nullptr; }
+
+    std::int64_t bytes = 0;
+
+private:
+    lfp::unique_lfp inner;
+};
+
+struct random_gzip : random_memfile {
+    random_gzip() {
+        const auto format = GENERATE(values({ gzip_format, zlib_format }));
+        const auto span = GENERATE(1, 0);
+        compressed = compress(expected, format, 64);
+
+        lfp_close(f);
+        f = lfp_gzip_open(memopen(compressed).release(), span);
+        REQUIRE(f);
+    }
+
+    std::vector< unsigned char > compressed;
+};
+
+}
+
+TEST_CASE(
+    "gzip open fails on null, negative span, and uncompressed data",
+    "[gzip][open]") {
+    CHECK(not lfp_gzip_open(nullptr, 0));
+
+    const auto text = std::string("not compressed");
+    auto* mem = lfp_memfile_openwith(
+        reinterpret_cast< const unsigned char* >(text.data()),
+        text.size()
+    );
+    CHECK(not lfp_gzip_open(mem, -1));
+    CHECK(not lfp_gzip_open(mem, 0));
+
+    /* the caller still owns the handle, and it is intact */
+    std::int64_t tell;
+    const auto err = lfp_tell(mem, &tell);
+    CHECK(err == LFP_OK);
+    lfp_close(mem);
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file can be read",
+    "[gzip][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file can be seeked",
+    "[gzip][seek]") {
+    test_random_seek(this);
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file reports its size",
+    "[gzip][size]") {
+    test_random_size(this);
+}
+
+TEST_CASE(
+    "gzip seeks back and forth in a large file",
+    "[gzip][seek]") {
+    const auto format = GENERATE(values({ gzip_format, zlib_format }));
+    const auto expected = make_compressible(1 << 20);
+    const auto compressed = compress(expected, format, 1000);
+
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 4096);
+    REQUIRE(f);
+
+    const auto offsets = GENERATE_COPY(
+        take(1, chunk(50, random(0, int(expected.size()) - 100)))
+    );
+
+    auto out = std::vector< unsigned char >(100);
+    for (const auto offset : offsets) {
+        auto err = lfp_seek(f, offset);
+        REQUIRE(err == LFP_OK);
+
+        std::int64_t nread;
+        err = lfp_readinto(f, out.data(), out.size(), &nread);
+        REQUIRE(err == LFP_OK);
+        REQUIRE(nread == out.size());
+
+        const auto* first = expected.data() + offset;
+        const auto slice = std::vector< unsigned char >(first, first + 100);
+        CHECK_THAT(out, Equals(slice));
+    }
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "gzip reads concatenated members as one stream",
+    "[gzip][read]") {
+    const auto first  = make_compressible(5000);
+    const auto second = make_compressible(7000);
+
+    auto compressed = compress(first, gzip_format, 500);
+    const auto tail = compress(second, gzip_format, 500);
+    compressed.insert(compressed.end(), tail.begin(), tail.end());
+    /* trailing garbage after the last member is ignored */
+    compressed.insert(compressed.end(), 16, 0);
+
+    auto expected = first;
+    expected.insert(expected.end(), second.begin(), second.end());
+
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 1);
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(expected.size() + 10);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == expected.size());
+    out.resize(nread);
+    CHECK_THAT(out, Equals(expected));
+
+    /* seek back into the second member, through its access points */
+    err = lfp_seek(f, 6000);
+    REQUIRE(err == LFP_OK);
+    out.resize(expected.size() - 6000);
+    err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >(
+        expected.begin() + 6000,
+        expected.end()
+    )));
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "gzip reads past the end report EOF",
+    "[gzip][seek]") {
+    const auto expected = make_compressible(100);
+    const auto compressed = compress(expected, gzip_format, 100);
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 0);
+    REQUIRE(f);
+
+    auto err = lfp_seek(f, 200);
+    CHECK(err == LFP_OK);
+    CHECK(not lfp_eof(f));
+
+    unsigned char x;
+    std::int64_t nread = -1;
+    err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+    CHECK(lfp_eof(f));
+
+    std::int64_t tell;
+    lfp_tell(f, &tell);
+    CHECK(tell == 200);
+
+    err = lfp_seek(f, -1);
+    CHECK(err == LFP_INVALID_ARGS);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "gzip reports truncated and corrupt streams",
+    "[gzip][read]") {
+    const auto expected = make_compressible(10000);
+    auto compressed = compress(expected, gzip_format, 1000);
+
+    auto out = std::vector< unsigned char >(expected.size());
+    std::int64_t nread;
+
+    SECTION( "truncated" ) {
+        compressed.resize(compressed.size() / 2);
+        auto* f = lfp_gzip_open(memopen(compressed).release(), 0);
+        REQUIRE(f);
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_UNEXPECTED_EOF);
+        lfp_close(f);
+    }
+
+    SECTION( "corrupt" ) {
+        for (std::size_t i = 20; i < compressed.size(); i += 7)
+            compressed[i] ^= 0x5A;
+        auto* f = lfp_gzip_open(memopen(compressed).release(), 0);
+        REQUIRE(f);
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        lfp_close(f);
+    }
+}
+
+TEST_CASE(
+    "gzip index can be dumped and loaded",
+    "[gzip][index]") {
+    const auto expected = make_compressible(1 << 20);
+    const auto compressed = compress(expected, gzip_format, 4000);
+
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 16 * 1024);
+    REQUIRE(f);
+
+    auto err = lfp_gzip_index_build(f);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t tell;
+    lfp_tell(f, &tell);
+    CHECK(tell == 0);
+
+    std::int64_t size;
+    err = lfp_gzip_index_size(f, &size);
+    REQUIRE(err == LFP_OK);
+
+    auto index = std::vector< unsigned char >(size);
+    err = lfp_gzip_index_dump(f, index.data(), size - 1);
+    CHECK(err == LFP_INVALID_ARGS);
+    err = lfp_gzip_index_dump(f, index.data(), size);
+    REQUIRE(err == LFP_OK);
+    lfp_close(f);
+
+    /*
+     * With the index loaded, reading near the end only decompresses from
+     * the closest access point, rather than from the start
+     */
+    auto* counter = new byte_counter(memopen(compressed).release());
+    f = lfp_gzip_open(counter, 0);
+    REQUIRE(f);
+    err = lfp_gzip_index_load(f, index.data(), size);
+    REQUIRE(err == LFP_OK);
+    const auto before = counter->bytes;
+
+    /* the index knows the size, so nothing is decompressed to find it */
+    std::int64_t total;
+    err = lfp_size(f, &total);
+    CHECK(err == LFP_OK);
+    CHECK(total == std::int64_t(expected.size()));
+    CHECK(counter->bytes == before);
+
+    const auto offset = std::int64_t(expected.size()) - 1000;
+    err = lfp_seek(f, offset);
+    REQUIRE(err == LFP_OK);
+
+    auto out = std::vector< unsigned char >(2000);
+    std::int64_t nread;
+    err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 1000);
+    CHECK(lfp_eof(f));
+    out.resize(nread);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >(
+        expected.begin() + offset,
+        expected.end()
+    )));
+
+    CHECK(counter->bytes - before < std::int64_t(compressed.size()) / 4);
+
+    SECTION( "broken indices are rejected" ) {
+        err = lfp_gzip_index_load(f, index.data(), 10);
+        CHECK(err == LFP_INVALID_ARGS);
+
+        auto broken = index;
+        broken[0] = 'X';
+        err = lfp_gzip_index_load(f, broken.data(), broken.size());
+        CHECK(err == LFP_INVALID_ARGS);
+
+        err = lfp_gzip_index_load(f, index.data(), size - 1);
+        CHECK(err == LFP_INVALID_ARGS);
+    }
+
+    SECTION( "only gzip handles have an index" ) {
+        auto* mem = lfp_memfile_open();
+        err = lfp_gzip_index_size(mem, &size);
+        CHECK(err == LFP_INVALID_ARGS);
+        lfp_close(mem);
+    }
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "rp66 can be layered on a gzip file",
+    "[gzip][rp66]") {
+    const auto file = std::vector< unsigned char > {
+        0x00, 0x08, 0xFF, 0x01,
+        0x01, 0x02, 0x03, 0x04,
+
+        0x00, 0x06, 0xFF, 0x01,
+        0x05, 0x06,
+    };
+    const auto compressed = compress(file, gzip_format, 5);
+
+    auto* f = lfp_rp66_open(
+        lfp_gzip_open(memopen(compressed).release(), 1)
+    );
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(7);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 6);
+    out.resize(nread);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >{ 1, 2, 3, 4, 5, 6 }));
+
+    err = lfp_seek(f, 3);
+    CHECK(err == LFP_OK);
+    unsigned char x;
+    err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(x == 4);
+
+    std::int64_t size;
+    err = lfp_size(f, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 6);
+
+    /* the size is found without moving the handle */
+    err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(x == 5);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "rp66 on a gzip file without readat reports its size",
+    "[gzip][rp66][size]") {
+    const auto file = std::vector< unsigned char > {
+        0x00, 0x08, 0xFF, 0x01,
+        0x01, 0x02, 0x03, 0x04,
+
+        0x00, 0x06, 0xFF, 0x01,
+        0x05, 0x06,
+    };
+    const auto compressed = compress(file, gzip_format, 5);
+
+    /*
+     * Between gzip and rp66, read_counter hides readat, so that rp66 must
+     * seek to the headers
+     */
+    auto* counter = new read_counter(
+        lfp_gzip_open(memopen(compressed).release(), 1)
+    );
+    counter->sized = true;
+    auto* f = lfp_rp66_open(counter);
+    REQUIRE(f);
+
+    unsigned char x;
+    std::int64_t nread;
+    auto err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(x == 1);
+
+    std::int64_t size;
+    err = lfp_size(f, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 6);
+
+    err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(x == 2);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file can be read at offsets",
+    "[gzip][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file can read many ranges",
+    "[gzip][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_gzip,
+    "gzip file can be duplicated",
+    "[gzip][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE(
+    "gzip duplicates keep the access points of the original",
+    "[gzip][dup]") {
+    const auto expected = make_compressible(1 << 16);
+    const auto compressed = compress(expected, gzip_format, 1000);
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 4096);
+    REQUIRE(f);
+
+    auto err = lfp_gzip_index_build(f);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t size;
+    err = lfp_gzip_index_size(f, &size);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* dup;
+    err = lfp_dup(f, &dup);
+    REQUIRE(err == LFP_OK);
+    lfp_close(f);
+
+    std::int64_t dup_size;
+    err = lfp_gzip_index_size(dup, &dup_size);
+    CHECK(err == LFP_OK);
+    CHECK(dup_size == size);
+
+    auto out = std::vector< unsigned char >(100);
+    std::int64_t nread;
+    err = lfp_readat(dup, 50000, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == 100);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >(
+        expected.begin() + 50000,
+        expected.begin() + 50100
+    )));
+
+    lfp_close(dup);
+}
+
+TEST_CASE(
+    "gzip file can be read at offsets from multiple threads",
+    "[gzip][readat]") {
+    const auto expected = make_compressible(1 << 18);
+    const auto compressed = compress(expected, gzip_format, 1000);
+    auto* f = lfp_gzip_open(memopen(compressed).release(), 4096);
+    REQUIRE(f);
+
+    auto ok = std::vector< int >(4, 1);
+    auto threads = std::vector< std::thread >();
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([f, t, &ok, &expected] {
+            auto out = std::vector< unsigned char >(100);
+            const auto last = std::int64_t(expected.size()) - 100;
+            for (std::int64_t i = last - 1000 * t; i >= 0; i -= 9973) {
+                std::int64_t nread;
+                const auto err = lfp_readat(
+                    f, i, out.data(), out.size(), &nread
+                );
+                ok[t] = ok[t]
+                    and err == LFP_OK
+                    and nread == 100
+                    and std::equal(out.begin(), out.end(), &expected[i]);
+            }
+        });
+    }
+
+    /*
+     * The index is dumped while the readers add access points, so it may
+     * outgrow the buffer between size and dump
+     */
+    auto dumped = true;
+    threads.emplace_back([f, &dumped] {
+        for (int i = 0; i < 20; ++i) {
+            std::int64_t size;
+            auto err = lfp_gzip_index_size(f, &size);
+            auto index = std::vector< unsigned char >(size);
+            if (err == LFP_OK)
+                err = lfp_gzip_index_dump(f, index.data(), index.size());
+            dumped = dumped and (err == LFP_OK or err == LFP_INVALID_ARGS);
+        }
+    });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_THAT(ok, Equals(std::vector< int >(4, 1)));
+    CHECK(dumped);
+    lfp_close(f);
+}
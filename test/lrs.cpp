@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <ciso646>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/lfp.h>
+#include <lfp/memfile.h>
+#include <lfp/rp66.h>
+
+#include "utils.hpp"
+
+using namespace Catch::Matchers;
+
+namespace {
+
+constexpr const unsigned char encryption_packet = 1 << 3;
+constexpr const unsigned char checksum          = 1 << 2;
+constexpr const unsigned char trailing_length   = 1 << 1;
+constexpr const unsigned char padding           = 1 << 0;
+
+void put_u16(std::vector< unsigned char >& out, int x) {
+    out.push_back((x >> 8) & 0xFF);
+    out.push_back((x >> 0) & 0xFF);
+}
+
+/*
+ * Make a Logical Record Segment with the body, and the trailer described by
+ * the attributes. The padding, if any, is pad bytes, and the encryption
+ * packet, if any, is 4 bytes.
+ */
+std::vector< unsigned char > make_segment(
+        const std::vector< unsigned char >& body,
+        unsigned char attributes,
+        int pad = 0) {
+    std::vector< unsigned char > seg;
+    const auto enc = (attributes & encryption_packet) ? 4 : 0;
+    const auto chk = (attributes & checksum) ? 2 : 0;
+    const auto tl  = (attributes & trailing_length) ? 2 : 0;
+    const auto pd  = (attributes & padding) ? pad : 0;
+    const auto length = 4 + enc + int(body.size()) + pd + chk + tl;
+
+    put_u16(seg, length);
+    seg.push_back(attributes);
+    seg.push_back(0);
+
+    if (enc) {
+        put_u16(seg, enc);
+        put_u16(seg, 0xEEEE);
+    }
+
+    seg.insert(seg.end(), body.begin(), body.end());
+
+    if (pd) {
+        seg.insert(seg.end(), pd - 1, 0xAA);
+        seg.push_back(pd);
+    }
+
+    if (chk) put_u16(seg, 0xCCCC);
+    if (tl)  put_u16(seg, length);
+
+    return seg;
+}
+
+struct lrs_file {
+    lrs_file() {
+        const unsigned char attributes[] = {
+            0,
+            padding,
+            checksum,
+            trailing_length,
+            encryption_packet,
+            padding | checksum | trailing_length,
+            encryption_packet | padding | checksum | trailing_length,
+            0,
+        };
+
+        unsigned char x = 0;
+        for (int i = 0; i < 8; ++i) {
+            auto body = std::vector< unsigned char >(10 + i * 7);
+            for (auto& b : body) b = x++;
+
+            /* an empty body in the middle */
+            if (i == 3) body.clear();
+
+            const auto seg = make_segment(body, attributes[i], 1 + i % 4);
+            file.insert(file.end(), seg.begin(), seg.end());
+            expected.insert(expected.end(), body.begin(), body.end());
+        }
+    }
+
+    std::vector< unsigned char > file;
+    std::vector< unsigned char > expected;
+};
+
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: headers and trailers are stripped",
+    "[rp66][lrs]") {
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_rp66_lrs_open(mem);
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(expected.size() + 10);
+    std::int64_t nread;
+
+    SECTION( "in a single read" ) {
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == std::int64_t(expected.size()));
+    }
+
+    SECTION( "in many small reads" ) {
+        std::int64_t total = 0;
+        while (true) {
+            const auto err = lfp_readinto(f, out.data() + total, 3, &nread);
+            total += nread;
+            if (err == LFP_EOF) break;
+            REQUIRE(err == LFP_OK);
+        }
+        CHECK(total == std::int64_t(expected.size()));
+        nread = total;
+    }
+
+    out.resize(nread);
+    CHECK_THAT(out, Equals(expected));
+
+    std::int64_t tell;
+    lfp_tell(f, &tell);
+    CHECK(tell == std::int64_t(expected.size()));
+    CHECK(lfp_eof(f));
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: seek and tell",
+    "[rp66][lrs]") {
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_rp66_lrs_open(mem);
+    REQUIRE(f);
+
+    const auto size = std::int64_t(expected.size());
+
+    /* visit every offset once, in a scrambled order */
+    for (std::int64_t i = 0; i < size; ++i) {
+        const auto n = (i * 97) % size;
+        auto err = lfp_seek(f, n);
+        REQUIRE(err == LFP_OK);
+
+        std::int64_t tell;
+        lfp_tell(f, &tell);
+        CHECK(tell == n);
+
+        unsigned char x;
+        std::int64_t nread;
+        err = lfp_readinto(f, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(x == expected[n]);
+    }
+
+    SECTION( "seek past the end" ) {
+        auto err = lfp_seek(f, size + 10);
+        CHECK(err == LFP_OK);
+        CHECK(lfp_eof(f));
+
+        unsigned char x;
+        std::int64_t nread;
+        err = lfp_readinto(f, &x, 1, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 0);
+    }
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: stacked on the Visible Envelope",
+    "[rp66][lrs][visible envelope]") {
+    /* split the segments over two Visible Records */
+    const auto split = 16;
+    std::vector< unsigned char > ve;
+
+    put_u16(ve, 4 + split);
+    ve.push_back(0xFF);
+    ve.push_back(0x01);
+    ve.insert(ve.end(), file.begin(), file.begin() + split);
+
+    put_u16(ve, 4 + file.size() - split);
+    ve.push_back(0xFF);
+    ve.push_back(0x01);
+    ve.insert(ve.end(), file.begin() + split, file.end());
+
+    auto* mem = lfp_memfile_openwith(ve.data(), ve.size());
+    auto* f = lfp_rp66_lrs_open(lfp_rp66_open(mem));
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(expected.size());
+    std::int64_t nread;
+    const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK_THAT(out, Equals(expected));
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Logical Record Segment: broken segments are reported",
+    "[rp66][lrs]") {
+    const auto body = std::vector< unsigned char >(20, 0x01);
+    auto seg = make_segment(body, padding | checksum, 4);
+
+    SECTION( "truncated segment" ) {
+        seg.resize(seg.size() - 5);
+        auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+        auto* f = lfp_rp66_lrs_open(mem);
+
+        auto out = std::vector< unsigned char >(body.size());
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_UNEXPECTED_EOF);
+        lfp_close(f);
+    }
+
+    SECTION( "padding larger than the segment" ) {
+        seg[seg.size() - 3] = 0xFF;
+        auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+        auto* f = lfp_rp66_lrs_open(mem);
+
+        auto out = std::vector< unsigned char >(body.size());
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        lfp_close(f);
+    }
+
+    SECTION( "pad count is zero" ) {
+        seg[seg.size() - 3] = 0;
+        auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+        auto* f = lfp_rp66_lrs_open(mem);
+
+        auto out = std::vector< unsigned char >(body.size());
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        CHECK_THAT(lfp_errormsg(f), Contains("pad count"));
+        lfp_close(f);
+    }
+
+    SECTION( "length shorter than the trailer" ) {
+        /* header, pad count and checksum need 7 bytes */
+        seg[0] = 0;
+        seg[1] = 6;
+        auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+        auto* f = lfp_rp66_lrs_open(mem);
+
+        auto out = std::vector< unsigned char >(body.size());
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        CHECK_THAT(lfp_errormsg(f), Contains("shorter than"));
+        lfp_close(f);
+    }
+
+    SECTION( "length shorter than the header" ) {
+        seg[0] = 0;
+        seg[1] = 2;
+        auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+        auto* f = lfp_rp66_lrs_open(mem);
+
+        auto out = std::vector< unsigned char >(body.size());
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        lfp_close(f);
+    }
+}
+
+TEST_CASE(
+    "Logical Record Segment: trailer is checked against the length",
+    "[rp66][lrs]") {
+    const auto body = std::vector< unsigned char >(20, 0x01);
+    std::vector< unsigned char > seg;
+    std::string message;
+
+    SECTION( "trailing length differs from the length" ) {
+        seg = make_segment(body, trailing_length);
+        seg.back() += 1;
+        message = "trailing length";
+    }
+
+    SECTION( "encryption packet larger than the segment" ) {
+        seg = make_segment(body, encryption_packet | checksum);
+        seg[4] = 0;
+        seg[5] = 27;
+        message = "encryption packet";
+    }
+
+    SECTION( "encryption packet smaller than its size" ) {
+        seg = make_segment(body, encryption_packet);
+        seg[4] = 0;
+        seg[5] = 1;
+        message = "encryption packet";
+    }
+
+    auto* mem = lfp_memfile_openwith(seg.data(), seg.size());
+    auto* f = lfp_rp66_lrs_open(mem);
+
+    auto out = std::vector< unsigned char >(body.size());
+    std::int64_t nread;
+    const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+    CHECK_THAT(lfp_errormsg(f), Contains(message));
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: readat, size and dup",
+    "[rp66][lrs][readat][size][dup]") {
+    std::vector< unsigned char > ve;
+    lfp_protocol* f = nullptr;
+
+    SECTION( "directly on the segments" ) {
+        auto* mem = lfp_memfile_openwith(file.data(), file.size());
+        f = lfp_rp66_lrs_open(mem);
+    }
+
+    SECTION( "stacked on the Visible Envelope" ) {
+        put_u16(ve, 4 + file.size());
+        ve.push_back(0xFF);
+        ve.push_back(0x01);
+        ve.insert(ve.end(), file.begin(), file.end());
+
+        auto* mem = lfp_memfile_openwith(ve.data(), ve.size());
+        f = lfp_rp66_lrs_open(lfp_rp66_open(mem));
+    }
+    REQUIRE(f);
+
+    const auto size = std::int64_t(expected.size());
+    unsigned char x;
+    auto err = lfp_readinto(f, &x, 1, nullptr);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t n;
+    err = lfp_size(f, &n);
+    CHECK(err == LFP_OK);
+    CHECK(n == size);
+
+    /* every range that ends in the file, from every offset */
+    for (std::int64_t offset = 0; offset < size; ++offset) {
+        const auto len = size - offset;
+        auto out = std::vector< unsigned char >(len + 5);
+        std::int64_t nread;
+        err = lfp_readat(f, offset, out.data(), out.size(), &nread);
+        CHECK(err == LFP_EOF);
+        REQUIRE(nread == len);
+
+        out.resize(len);
+        const auto begin = expected.begin() + offset;
+        CHECK(std::equal(out.begin(), out.end(), begin));
+    }
+
+    std::int64_t tell;
+    lfp_tell(f, &tell);
+    CHECK(tell == 1);
+
+    lfp_protocol* copy = nullptr;
+    err = lfp_dup(f, &copy);
+    REQUIRE(err == LFP_OK);
+
+    lfp_tell(copy, &tell);
+    CHECK(tell == 1);
+
+    auto out = std::vector< unsigned char >(size - 1);
+    std::int64_t nread;
+    err = lfp_readinto(copy, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::equal(out.begin(), out.end(), expected.begin() + 1));
+    lfp_close(copy);
+
+    err = lfp_readinto(f, &x, 1, nullptr);
+    CHECK(err == LFP_OK);
+    CHECK(x == expected[1]);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: one read per segment, and no seeks",
+    "[rp66][lrs]") {
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* f = lfp_rp66_lrs_open(counter);
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(expected.size());
+    std::int64_t total = 0;
+    while (true) {
+        std::int64_t nread;
+        const auto err = lfp_readinto(f, out.data() + total, 3, &nread);
+        total += nread;
+        if (err == LFP_EOF) break;
+        REQUIRE(err == LFP_OK);
+    }
+    CHECK_THAT(out, Equals(expected));
+
+    /*
+     * The first header is read on its own, and the header of the next
+     * segment with each segment
+     */
+    CHECK(counter->reads == 1 + 8);
+    CHECK(counter->seeks == 0);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    lrs_file,
+    "Logical Record Segment: the underlying file is at the start on peel",
+    "[rp66][lrs][peel]") {
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* f = lfp_rp66_lrs_open(mem);
+    REQUIRE(f);
+
+    std::int64_t n;
+    auto err = lfp_size(f, &n);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* inner = nullptr;
+    std::int64_t tell;
+
+    SECTION( "peek" ) {
+        err = lfp_peek(f, &inner);
+        REQUIRE(err == LFP_OK);
+        lfp_tell(inner, &tell);
+        CHECK(tell == 0);
+        lfp_close(f);
+    }
+
+    SECTION( "peel" ) {
+        err = lfp_peel(f, &inner);
+        REQUIRE(err == LFP_OK);
+        lfp_tell(inner, &tell);
+        CHECK(tell == 0);
+        lfp_close(f);
+        lfp_close(inner);
+    }
+}
@@ -116,3 +116,119 @@ TEST_CASE_METHOD(
     "[mem]") {
     test_random_seek(this);
 }
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A borrowed mem-file reads from the caller's memory",
+    "[mem][borrow]") {
+    /* test_random_seek modifies expected, so borrow a copy */
+    auto mem = expected;
+    lfp_close(f);
+    f = lfp_memfile_borrow(mem.data(), mem.size());
+    REQUIRE(f);
+
+    SECTION( "reads see the caller's memory" ) {
+        std::int64_t nread = 0;
+        mem[0] ^= 0xFF;
+        expected[0] ^= 0xFF;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "split reads" ) {
+        test_split_read(this);
+    }
+
+    SECTION( "seeks" ) {
+        test_random_seek(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A mem-file can be read at an offset",
+    "[mem][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A mem-file can be read at many offsets",
+    "[mem][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A mem-file can be duplicated",
+    "[mem][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A mem-file can be borrowed from",
+    "[mem][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_memfile,
+    "A mem-file reports its size",
+    "[mem][size]") {
+    test_random_size(this);
+}
+
+TEST_CASE(
+    "A mem-file lends its memory without copying",
+    "[mem][borrow]") {
+    const auto mem = std::vector< unsigned char > { 1, 2, 3, 4, 5 };
+    auto* f = lfp_memfile_borrow(mem.data(), mem.size());
+    REQUIRE(f);
+
+    const void* ptr = nullptr;
+    std::int64_t avail;
+    auto err = lfp_borrow(f, 2, &ptr, &avail);
+    CHECK(err == LFP_OK);
+    CHECK(avail == 2);
+    CHECK(ptr == mem.data());
+    CHECK(lfp_release(f) == LFP_OK);
+
+    err = lfp_borrow(f, 4, &ptr, &avail);
+    CHECK(err == LFP_EOF);
+    CHECK(avail == 3);
+    CHECK(ptr == mem.data() + 2);
+    CHECK(lfp_release(f) == LFP_OK);
+
+    lfp_close(f);
+}
+
+TEST_CASE("Negative readat offset or length returns invalid args", "[mem]") {
+    auto f = memopen();
+    unsigned char x;
+    std::int64_t nread;
+    auto err = lfp_readat(f.get(), -1, &x, 1, &nread);
+    CHECK(err == LFP_INVALID_ARGS);
+    err = lfp_readat(f.get(), 0, &x, -1, &nread);
+    CHECK(err == LFP_INVALID_ARGS);
+}
+
+TEST_CASE("Negative readv_at count, offset or length returns invalid args",
+          "[mem]") {
+    auto f = memopen();
+    unsigned char x;
+    auto range = lfp_range { 0, 1, &x, 0 };
+    auto err = lfp_readv_at(f.get(), &range, -1);
+    CHECK(err == LFP_INVALID_ARGS);
+
+    range.offset = -1;
+    err = lfp_readv_at(f.get(), &range, 1);
+    CHECK(err == LFP_INVALID_ARGS);
+
+    range.offset = 0;
+    range.len = -1;
+    err = lfp_readv_at(f.get(), &range, 1);
+    CHECK(err == LFP_INVALID_ARGS);
+}
@@ -0,0 +1,304 @@
+#include <ciso646>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/lfp.h>
+#include <lfp/mmap.h>
+#include <lfp/tapeimage.h>
+
+#include "utils.hpp"
+
+
+using namespace Catch::Matchers;
+
+namespace {
+
+struct random_mmap : random_memfile {
+    random_mmap() {
+        REQUIRE(not expected.empty());
+
+        lfp_close(f);
+        f = nullptr;
+
+        const auto advice = GENERATE(
+            LFP_MMAP_NORMAL,
+            LFP_MMAP_RANDOM | LFP_MMAP_WILLNEED,
+            LFP_MMAP_SEQUENTIAL | LFP_MMAP_HUGEPAGE
+        );
+
+        f = lfp_mmap_open(tmpfd(expected.data(), expected.size()), advice);
+        REQUIRE(f);
+    }
+};
+
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be read",
+    "[mmap][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be seeked",
+    "[mmap][seek]") {
+
+    SECTION( "correct seek" ) {
+        test_random_seek(this);
+    }
+
+    SECTION( "seek beyond file end" ) {
+        auto err = lfp_seek(f, expected.size() + 10);
+        CHECK(err == LFP_OK);
+        CHECK(lfp_eof(f));
+
+        std::int64_t nread = -1;
+        err = lfp_readinto(f, out.data(), 1, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 0);
+    }
+
+    SECTION( "negative seek" ) {
+        const auto err = lfp_seek(f, -1);
+
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(f));
+        CHECK_THAT(msg, Contains(">= 0"));
+    }
+}
+
+TEST_CASE(
+    "mmap opened at an offset considers it the start",
+    "[mmap][seek]") {
+    const auto contents = std::string("Very simple file");
+    const auto fd = tmpfd(contents.data(), contents.size());
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_mmap_open(fd, LFP_MMAP_NORMAL);
+    REQUIRE(f);
+
+    std::int64_t tell = -1;
+    auto err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+
+    auto buffer = std::vector< char >(6);
+    std::int64_t nread;
+    err = lfp_readinto(f, buffer.data(), 6, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::string(buffer.begin(), buffer.end()) == "simple");
+
+    err = lfp_seek(f, 7);
+    CHECK(err == LFP_OK);
+    err = lfp_readinto(f, buffer.data(), 5, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 4);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Empty files can be mapped",
+    "[mmap]") {
+    const auto fd = tmpfd(nullptr, 0);
+    auto* f = lfp_mmap_open(fd, LFP_MMAP_NORMAL);
+    REQUIRE(f);
+    CHECK(lfp_eof(f));
+
+    unsigned char x;
+    std::int64_t nread = -1;
+    const auto err = lfp_readinto(f, &x, 1, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Pipes cannot be mapped, and are left open",
+    "[mmap][pipe]") {
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+
+    CHECK(not lfp_mmap_open(fds[0], LFP_MMAP_NORMAL));
+    CHECK(::close(fds[0]) == 0);
+    ::close(fds[1]);
+}
+
+TEST_CASE(
+    "tapeimage can be layered on mmap",
+    "[mmap][tapeimage]") {
+    const auto contents = std::vector< unsigned char > {
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x10, 0x00, 0x00, 0x00,
+
+        0x01, 0x02, 0x03, 0x04,
+
+        0x01, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x1C, 0x00, 0x00, 0x00,
+    };
+    const auto fd = tmpfd(contents.data(), contents.size());
+    auto* tif = lfp_tapeimage_open(lfp_mmap_open(fd, LFP_MMAP_RANDOM));
+    REQUIRE(tif);
+
+    auto out = std::vector< unsigned char >(5);
+    std::int64_t nread;
+    const auto err = lfp_readinto(tif, out.data(), out.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 4);
+    out.resize(nread);
+    CHECK_THAT(out, Equals(std::vector< unsigned char >{ 1, 2, 3, 4 }));
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "mmap reads at offsets from where it was opened",
+    "[mmap][readat]") {
+    const auto contents = std::string("Very simple file");
+    const auto fd = tmpfd(contents.data(), contents.size());
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_mmap_open(fd, LFP_MMAP_RANDOM);
+    REQUIRE(f);
+
+    auto buffer = std::vector< char >(8);
+    std::int64_t nread;
+    auto err = lfp_readat(f, 0, buffer.data(), 6, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 6) == "simple");
+
+    err = lfp_readat(f, 7, buffer.data(), 8, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 4);
+    CHECK(std::string(buffer.begin(), buffer.begin() + 4) == "file");
+
+    err = lfp_readat(f, 20, buffer.data(), 8, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+
+    std::int64_t tell = -1;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be read at an offset",
+    "[mmap][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be read at many offsets",
+    "[mmap][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be duplicated",
+    "[mmap][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE(
+    "mmap lends the mapping without copying",
+    "[mmap][borrow]") {
+    const auto contents = std::string("Very simple file");
+    const auto fd = tmpfd(contents.data(), contents.size());
+    ::lseek(fd, 5, SEEK_SET);
+
+    auto* f = lfp_mmap_open(fd, LFP_MMAP_SEQUENTIAL);
+    REQUIRE(f);
+
+    const void* first = nullptr;
+    std::int64_t avail;
+    auto err = lfp_borrow(f, 6, &first, &avail);
+    CHECK(err == LFP_OK);
+    REQUIRE(avail == 6);
+    const auto* p = static_cast< const char* >(first);
+    CHECK(std::string(p, p + avail) == "simple");
+    CHECK(lfp_release(f) == LFP_OK);
+
+    /* consecutive borrows are consecutive in the mapping */
+    const void* second = nullptr;
+    err = lfp_borrow(f, 10, &second, &avail);
+    CHECK(err == LFP_EOF);
+    CHECK(avail == 5);
+    CHECK(second == static_cast< const char* >(first) + 6);
+    CHECK(lfp_release(f) == LFP_OK);
+
+    std::int64_t tell = -1;
+    lfp_tell(f, &tell);
+    CHECK(tell == 11);
+    CHECK(lfp_eof(f));
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap can be borrowed from",
+    "[mmap][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE(
+    "mmap size starts where the descriptor was opened",
+    "[mmap][size]") {
+    const auto contents = std::string("Very simple file");
+    auto offset = GENERATE(0, 5, 16);
+    const auto fd = tmpfd(contents.data(), contents.size());
+    ::lseek(fd, offset, SEEK_SET);
+
+    auto* f = lfp_mmap_open(fd, LFP_MMAP_NORMAL);
+    REQUIRE(f);
+
+    std::int64_t size = -1;
+    const auto err = lfp_size(f, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 16 - offset);
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_mmap,
+    "mmap reports its size",
+    "[mmap][size]") {
+    test_random_size(this);
+}
@@ -0,0 +1,275 @@
+#include <atomic>
+#include <ciso646>
+#include <cstdint>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/lfp.h>
+#include <lfp/memfile.h>
+#include <lfp/prefetch.h>
+#include <lfp/protocol.hpp>
+
+#include "utils.hpp"
+
+using namespace Catch::Matchers;
+
+namespace {
+
+struct random_prefetch : random_memfile {
+    random_prefetch() {
+        const auto block_size = GENERATE(1, 7, 64, 0);
+        const auto max_blocks = GENERATE(1, 4);
+        f = lfp_prefetch_open(f, block_size, max_blocks);
+        REQUIRE(f);
+    }
+};
+
+}
+
+TEST_CASE(
+    "Prefetch open fails on invalid arguments",
+    "[prefetch][open]") {
+    CHECK(not lfp_prefetch_open(nullptr, 0, 0));
+
+    auto* mem = lfp_memfile_open();
+    CHECK(not lfp_prefetch_open(mem, -1, 0));
+    CHECK(not lfp_prefetch_open(mem, 0, -1));
+    lfp_close(mem);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be read",
+    "[prefetch][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be seeked",
+    "[prefetch][seek]") {
+    test_random_seek(this);
+}
+
+TEST_CASE(
+    "Prefetch reads ahead on sequential reads, and not on random reads",
+    "[prefetch]") {
+    const auto file = make_file(1000 * 1000);
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    auto* f = lfp_prefetch_open(counter, 10 * 1000, 8);
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(file.size());
+    std::int64_t nread;
+
+    SECTION( "sequential reads are served from read-ahead blocks" ) {
+        for (std::int64_t i = 0; i < 1000; ++i) {
+            const auto err = lfp_readinto(f, out.data() + i * 1000, 1000,
+                                          &nread);
+            REQUIRE(err == LFP_OK);
+        }
+        CHECK_THAT(out, Equals(file));
+        /* one read per block, and one for the EOF */
+        CHECK(counter->reads <= 100 + 1);
+    }
+
+    SECTION( "random reads shrink the window, and go straight through" ) {
+        for (std::int64_t i = 0; i < 100; ++i) {
+            const auto n = (i * 7919 * 13) % (1000 * 990);
+            auto err = lfp_seek(f, n);
+            REQUIRE(err == LFP_OK);
+
+            unsigned char buf[10];
+            err = lfp_readinto(f, buf, sizeof(buf), &nread);
+            REQUIRE(err == LFP_OK);
+            CHECK(buf[0] == file[n]);
+            CHECK(buf[9] == file[n + 9]);
+        }
+
+        /*
+         * The window drops to zero after a handful of seeks, after which
+         * every read is a single read of the underlying handle. Allow some
+         * slack for the blocks read ahead before that.
+         */
+        CHECK(counter->reads <= 100 + 16);
+    }
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Read-ahead errors are reported by the next read",
+    "[prefetch]") {
+    const auto file = make_file(1000);
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(file.data(), file.size())
+    );
+    counter->fail = true;
+    auto* f = lfp_prefetch_open(counter, 100, 4);
+    REQUIRE(f);
+
+    unsigned char buf[10];
+    std::int64_t nread;
+    auto err = lfp_readinto(f, buf, sizeof(buf), &nread);
+    CHECK(err == LFP_IOERROR);
+
+    counter->fail = false;
+    err = lfp_readinto(f, buf, sizeof(buf), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(buf[0] == file[0]);
+
+    lfp_close(f);
+}
+
+TEST_CASE(
+    "Prefetch seeks to the end of the read-ahead, and to EOF",
+    "[prefetch][seek]") {
+    const auto file = make_file(1000);
+    auto* f = lfp_prefetch_open(
+        lfp_memfile_openwith(file.data(), file.size()),
+        100,
+        4
+    );
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(file.size());
+    std::int64_t nread;
+
+    SECTION( "to EOF, after reading the whole file" ) {
+        auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+        REQUIRE(err == LFP_OK);
+        CHECK_THAT(out, Equals(file));
+
+        /* the read-ahead ends exactly at EOF */
+        err = lfp_seek(f, file.size());
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(f, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == std::int64_t(file.size()));
+
+        err = lfp_readinto(f, out.data(), 1, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 0);
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "to every block boundary, while reading ahead" ) {
+        /*
+         * The blocks start at multiples of the block size, so skipping to
+         * the next boundary regularly hits the end of the ring
+         */
+        for (std::int64_t n = 0; n < std::int64_t(file.size()); n += 100) {
+            auto err = lfp_seek(f, n);
+            REQUIRE(err == LFP_OK);
+
+            unsigned char x;
+            err = lfp_readinto(f, &x, 1, &nread);
+            REQUIRE(err == LFP_OK);
+            CHECK(x == file[n]);
+        }
+
+        /* the last boundary was at 900, and one byte of it is read */
+        const auto err = lfp_readinto(f, out.data(), 100, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 99);
+        CHECK(lfp_eof(f));
+    }
+
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be read at an offset",
+    "[prefetch][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be read at many offsets",
+    "[prefetch][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be duplicated",
+    "[prefetch][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file can be borrowed from",
+    "[prefetch][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_prefetch,
+    "Prefetched file reports its size",
+    "[prefetch][size]") {
+    test_random_size(this);
+}
+
+TEST_CASE(
+    "Prefetched file leaves the underlying file at its position on peel",
+    "[prefetch][peel]") {
+    const auto file = make_file(1000 * 1000);
+    auto* f = lfp_prefetch_open(
+        lfp_memfile_openwith(file.data(), file.size()),
+        0,
+        0
+    );
+    REQUIRE(f);
+
+    auto out = std::vector< unsigned char >(10);
+    std::int64_t nread;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    REQUIRE(err == LFP_OK);
+
+    lfp_protocol* inner;
+    err = lfp_peel(f, &inner);
+    CHECK(err == LFP_OK);
+
+    std::int64_t tell;
+    err = lfp_tell(inner, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 10);
+
+    unsigned char x;
+    err = lfp_readinto(inner, &x, 1, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(x == file[10]);
+
+    lfp_close(inner);
+    lfp_close(f);
+}
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <ciso646>
 #include <vector>
 #include <cstring>
+#include <thread>
 
 #include <catch2/catch.hpp>
 
@@ -101,10 +103,15 @@ TEST_CASE(
 
     auto out = std::vector< unsigned char >(5, 0xFF);
     std::int64_t bytes_read = -1;
-    const auto err = lfp_readinto(rp66, out.data(), 5, &bytes_read);
+    auto err = lfp_readinto(rp66, out.data(), 5, &bytes_read);
 
     CHECK(bytes_read == 0);
     CHECK(err == LFP_EOF);
+
+    std::int64_t size = -1;
+    err = lfp_size(rp66, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 0);
     lfp_close(rp66);
 }
 
@@ -301,6 +308,33 @@ TEST_CASE_METHOD(
     CHECK_THAT(out, Equals(memout));
 }
 
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: random seeks in an indexed file land in the right record",
+    "[visible envelope][rp66]") {
+    const auto real_size = size;
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    /* index the full file */
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+    REQUIRE(err == LFP_OK);
+
+    /* visit every offset once, in a scrambled order */
+    for (std::int64_t i = 0; i < real_size; ++i) {
+        const auto n = (i * 7919) % real_size;
+        err = lfp_seek(f, n);
+        REQUIRE(err == LFP_OK);
+
+        unsigned char x;
+        err = lfp_readinto(f, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == 1);
+        CHECK(x == expected[n]);
+    }
+}
+
 TEST_CASE(
     "Seek and read to record boarders",
     "[rp66]") {
@@ -629,3 +663,259 @@ TEST_CASE(
     auto err = lfp_close(outer);
     CHECK(err == LFP_OK);
 }
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: readat matches the data, and leaves the position alone",
+    "[visible envelope][rp66][readat]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: readat indexes the records it needs, and stops at EOF",
+    "[visible envelope][rp66][readat]") {
+    const auto records = GENERATE(2, 5, 13);
+    make(records);
+
+    /* nothing is read or indexed before the readat */
+    auto at = std::vector< unsigned char >(size + 10);
+    std::int64_t nread;
+    auto err = lfp_readat(f, 0, at.data(), at.size(), &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == size);
+    at.resize(nread);
+    CHECK_THAT(at, Equals(expected));
+
+    err = lfp_readat(f, size, at.data(), 1, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+
+    err = lfp_readat(f, size + 10, at.data(), 1, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == 0);
+
+    std::int64_t tell = -1;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+
+    err = lfp_readinto(f, out.data(), size, &nread);
+    CHECK(err == LFP_OK);
+    CHECK_THAT(out, Equals(expected));
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: readv_at matches the data, and leaves the position alone",
+    "[visible envelope][rp66][readv]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: readv_at merges the reads across records",
+    "[visible envelope][rp66][readv]") {
+    make(13);
+    auto* counter = new readat_counter(
+        lfp_memfile_openwith(bytes.data(), bytes.size())
+    );
+    auto* rp66 = lfp_rp66_open(counter);
+    REQUIRE(rp66);
+
+    /* index the headers first, which reads them with readat */
+    std::int64_t n;
+    auto err = lfp_size(rp66, &n);
+    REQUIRE(err == LFP_OK);
+    counter->reads = 0;
+
+    /*
+     * Three bytes out of every five, backwards, so that the ranges must be
+     * sorted, and some of them straddle records. The records are only
+     * separated by a header, so it should all be read in one go.
+     */
+    auto out = std::vector< unsigned char >(size);
+    auto ranges = std::vector< lfp_range >();
+    for (std::int64_t offset = size - 1; offset >= 0; offset -= 5) {
+        const auto len = std::min< std::int64_t >(3, size - offset);
+        ranges.push_back(lfp_range { offset, len, out.data() + offset, 0 });
+    }
+
+    err = lfp_readv_at(rp66, ranges.data(), ranges.size());
+    CHECK(err == LFP_OK);
+    CHECK(counter->reads == 1);
+
+    for (const auto& r : ranges) {
+        CHECK(r.nread == r.len);
+        const auto begin = expected.begin() + r.offset;
+        CHECK(std::equal(begin, begin + r.len, out.begin() + r.offset));
+    }
+
+    /* the position is left alone */
+    std::int64_t tell = -1;
+    err = lfp_tell(rp66, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == 0);
+
+    lfp_close(rp66);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: a duplicate reads independently of the original",
+    "[visible envelope][rp66][dup]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: bytes can be borrowed, within and across records",
+    "[visible envelope][rp66][borrow]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+    test_random_borrow(this);
+}
+
+TEST_CASE(
+    "Visible Envelope: bytes in a single record are borrowed without copying",
+    "[visible envelope][rp66][borrow]") {
+    /* three records of ten bytes, where the bytes are their logical offset */
+    const auto head = std::vector< unsigned char > { 0x00, 0x0E, 0xFF, 0x01 };
+    auto file = std::vector< unsigned char >();
+    for (int i = 0; i < 3; ++i) {
+        file.insert(file.end(), head.begin(), head.end());
+        for (int k = 0; k < 10; ++k)
+            file.push_back(static_cast< unsigned char >(i * 10 + k));
+    }
+
+    auto* rp66 = lfp_rp66_open(lfp_memfile_borrow(file.data(), file.size()));
+    REQUIRE(rp66);
+
+    const void* ptr = nullptr;
+    std::int64_t avail;
+
+    SECTION( "within a record" ) {
+        auto err = lfp_borrow(rp66, 4, &ptr, &avail);
+        CHECK(err == LFP_OK);
+        CHECK(avail == 4);
+        CHECK(ptr == file.data() + 4);
+        CHECK(lfp_release(rp66) == LFP_OK);
+
+        err = lfp_borrow(rp66, 6, &ptr, &avail);
+        CHECK(err == LFP_OK);
+        CHECK(avail == 6);
+        CHECK(ptr == file.data() + 8);
+        CHECK(lfp_release(rp66) == LFP_OK);
+
+        /* the next borrow starts in the next record */
+        err = lfp_borrow(rp66, 5, &ptr, &avail);
+        CHECK(err == LFP_OK);
+        CHECK(avail == 5);
+        CHECK(ptr == file.data() + 14 + 4);
+        CHECK(lfp_release(rp66) == LFP_OK);
+    }
+
+    SECTION( "across records" ) {
+        auto err = lfp_seek(rp66, 5);
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_borrow(rp66, 10, &ptr, &avail);
+        CHECK(err == LFP_OK);
+        REQUIRE(avail == 10);
+
+        const auto* p = static_cast< const unsigned char* >(ptr);
+        auto out = std::vector< unsigned char >(p, p + avail);
+        CHECK_THAT(out, Equals(std::vector< unsigned char > {
+            5, 6, 7, 8, 9, 10, 11, 12, 13, 14
+        }));
+        CHECK(lfp_release(rp66) == LFP_OK);
+    }
+
+    std::int64_t tell = -1;
+    lfp_tell(rp66, &tell);
+    CHECK(tell == 15);
+
+    lfp_close(rp66);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: the size is found from the headers",
+    "[visible envelope][rp66][size]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+    test_random_size(this);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: the size is found without readat on the underlying file",
+    "[visible envelope][rp66][size]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    /* read_counter does not support readat, so the headers are seeked to */
+    lfp_close(f);
+    f = lfp_rp66_open(
+        new read_counter(lfp_memfile_openwith(bytes.data(), bytes.size()))
+    );
+    REQUIRE(f);
+    test_random_size(this);
+}
+
+TEST_CASE_METHOD(
+    random_rp66,
+    "Visible Envelope: duplicates can index lazily in parallel",
+    "[visible envelope][rp66][dup]") {
+    make(13);
+    auto dups = std::vector< lfp_protocol* >(4);
+    for (auto& dup : dups) {
+        const auto err = lfp_dup(f, &dup);
+        REQUIRE(err == LFP_OK);
+    }
+
+    /*
+     * Every thread reads the file from start to end, in small reads, and all
+     * of them race to index the same headers
+     */
+    auto outs = std::vector< std::vector< unsigned char > >(dups.size());
+    auto threads = std::vector< std::thread >();
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        threads.emplace_back([this, t, &dups, &outs] {
+            auto& out = outs[t];
+            out.resize(size);
+            std::int64_t pos = 0;
+            while (pos < size) {
+                std::int64_t nread;
+                const auto len = std::min< std::int64_t >(7, size - pos);
+                lfp_readinto(dups[t], out.data() + pos, len, &nread);
+                if (nread == 0) break;
+                pos += nread;
+            }
+            out.resize(pos);
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        CHECK_THAT(outs[t], Equals(expected));
+        lfp_close(dups[t]);
+    }
+
+    /* the original seeks and reads through the shared index */
+    auto err = lfp_seek(f, size / 2);
+    CHECK(err == LFP_OK);
+    std::int64_t nread;
+    err = lfp_readinto(f, out.data(), size - size / 2, &nread);
+    CHECK(nread == size - size / 2);
+    CHECK(std::equal(out.begin(), out.begin() + nread,
+                     expected.begin() + size / 2));
+}
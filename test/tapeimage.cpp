@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <atomic>
 #include <ciso646>
 #include <cstring>
+#include <map>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include <catch2/catch.hpp>
@@ -119,10 +123,15 @@ TEST_CASE(
 
     auto out = std::vector< unsigned char >(10, 0xFF);
     std::int64_t bytes_read = -1;
-    const auto err = lfp_readinto(tif, out.data(), 10, &bytes_read);
+    auto err = lfp_readinto(tif, out.data(), 10, &bytes_read);
 
     CHECK(bytes_read == 0);
     CHECK(err == LFP_EOF);
+
+    std::int64_t size = -1;
+    err = lfp_size(tif, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 0);
     lfp_close(tif);
 }
 
@@ -166,6 +175,11 @@ TEST_CASE(
     CHECK(err == LFP_EOF);
     CHECK(lfp_eof(tif));
     CHECK_THAT(out, Equals(expected));
+
+    std::int64_t size = -1;
+    const auto size_err = lfp_size(tif, &size);
+    CHECK(size_err == LFP_OK);
+    CHECK(size == 8);
     lfp_close(tif);
 }
 
@@ -1148,19 +1162,67 @@ TEST_CASE(
     }
 }
 
+TEST_CASE(
+    "Broken TIF - next does not wrap around in small files",
+    "[tapeimage][errorcase][4GB]") {
+    /*
+     * A next that points backwards would be a wrapped offset in a file
+     * larger than 4GB, but in a small file it is just broken
+     */
+    auto contents = std::vector< unsigned char > {
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x14, 0x00, 0x00, 0x00,
+
+        0x01, 0x02, 0x03, 0x04,
+        0x05, 0x06, 0x07, 0x08,
+
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x2C, 0x00, 0x00, 0x00,
+
+        0x01, 0x02, 0x03, 0x04,
+        0x05, 0x06, 0x07, 0x08,
+        0x09, 0x0A, 0x0B, 0x0C,
+
+        0x01, 0x00, 0x00, 0x00,
+        0x14, 0x00, 0x00, 0x00,
+        0x38, 0x00, 0x00, 0x00,
+    };
+
+    SECTION( "next is zero" ) {
+        contents[8] = 0x00;
+    }
+
+    SECTION( "next points backwards" ) {
+        contents[28] = 0x0C;
+    }
+
+    auto* mem = lfp_memfile_openwith(contents.data(), contents.size());
+    auto* tif = lfp_tapeimage_open(mem);
+    REQUIRE(tif);
+
+    auto out = std::vector< unsigned char >(20);
+    std::int64_t bytes_read;
+    auto err = lfp_readinto(tif, out.data(), out.size(), &bytes_read);
+    CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+    CHECK_THAT(std::string(lfp_errormsg(tif)), Contains("head.next"));
+
+    err = lfp_tapeimage_index_build(tif);
+    CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+
+    lfp_close(tif);
+}
+
 TEST_CASE(
     "Operations on 4GB file",
     "[tapeimage][4GB][unsafe]") {
     /*
-     * Setup created to avoid dealing with actual 4GB files. Space to read the
-     * data is not created, lonely pointer is used instead. Pointer arithmetics
-     * is performed on it, but the memory under it is never read. Still, some
-     * memory-leaking tools might detect this behavior. Depending on the
-     * assigned address, pointer overflow might happen, but it doesn't matter
-     * for the test.
-     *
-     * Currently test asumes that we ignore files over 4GB and do not attempt
-     * to read overflown parts.
+     * Setup created to avoid dealing with actual 4GB files. The fake file only
+     * has contents where the headers are, and only the header bytes are ever
+     * written to the destination buffer. Data is read in chunks into a
+     * scratch buffer, which is large enough to make the reads bypass the
+     * tapeimage read buffer, but still small enough to allocate.
      */
 
     using header = std::vector< unsigned char >;
@@ -1170,33 +1232,36 @@ TEST_CASE(
       public:
         memfake()
         {
-            //assumption that it zeroes out on overflow
             //2GB + 12 header bytes
-            header h1 = {
+            this->headers[0x000000000] = {
                 0x00, 0x00, 0x00, 0x00,
                 0x00, 0x00, 0x00, 0x00,
                 0x0C, 0x00, 0x00, 0x80,
             };
 
             //1GB + 12 header bytes
-            header h2 = {
+            this->headers[0x08000000C] = {
                 0x00, 0x00, 0x00, 0x00,
                 0x00, 0x00, 0x00, 0x00,
                 0x18, 0x00, 0x00, 0xC0,
             };
 
-            //2GB + 12 header bytes - overflow header
-            header h3 = {
+            //2GB + 12 header bytes - next overflows
+            this->headers[0x0C0000018] = {
                 0x00, 0x00, 0x00, 0x00,
                 0x0C, 0x00, 0x00, 0x80,
                 0x24, 0x00, 0x00, 0x40,
             };
 
-            //5GB + 3 headers by 12 bytes
-            this->headers.push_back(h1);
-            this->headers.push_back(h2);
-            this->headers.push_back(h3);
-            this->it = this->headers.begin();
+            //end-of-file, past 4GB
+            this->headers[0x140000024] = {
+                0x01, 0x00, 0x00, 0x00,
+                0x18, 0x00, 0x00, 0xC0,
+                0x30, 0x00, 0x00, 0x40,
+            };
+
+            //5GB + 4 headers by 12 bytes
+            this->size = 0x140000030;
         }
 
         void close() noexcept(true) override {}
@@ -1205,92 +1270,1554 @@ TEST_CASE(
             std::int64_t len,
             std::int64_t *bytes_read) noexcept(true) override
         {
-            if(len == 12){
-                //pretend we are reading header
-                header hd = *this->it;
-                this->it = std::next(this->it);
-                std::memcpy(dst, hd.data(), len);
+            const auto n = std::min(len, this->size - this->pos);
+            for (const auto& head : this->headers) {
+                const auto begin = std::max(head.first, this->pos);
+                const auto end = std::min(head.first + 12, this->pos + n);
+                if (begin >= end) continue;
+                std::memcpy(
+                    static_cast< unsigned char* >(dst) + (begin - this->pos),
+                    head.second.data() + (begin - head.first),
+                    end - begin
+                );
             }
 
-            *bytes_read = len;
-            return LFP_OK;
+            this->pos += n;
+            *bytes_read = n;
+            if (n == len) return LFP_OK;
+            return LFP_EOF;
         }
 
-        int eof() const noexcept(true) override { return 0; }
+        int eof() const noexcept(true) override {
+            return this->pos == this->size;
+        }
 
-        void seek(std::int64_t n) noexcept (false) {
-            // for the purpose of this test do nothing and
-            // let readinto to handle return of the correct header
-            return;
+        void seek(std::int64_t n) noexcept (false) override {
+            this->pos = n;
+        }
+        std::int64_t tell() const noexcept (false) override {
+            return this->pos;
         }
         lfp_protocol* peel() noexcept (false) override { throw; }
         lfp_protocol* peek() const noexcept (false) override { throw; }
 
       private:
-        std::vector< header > headers;
-        std::vector< header >::const_iterator it;
+        std::map< std::int64_t, header > headers;
+        std::int64_t size;
+        std::int64_t pos = 0;
     };
 
     auto* mem = new memfake();
     auto* tif = lfp_tapeimage_open(mem);
 
-    unsigned char fake_mem = 1;
-    unsigned char* dst = &fake_mem;
-
-    const size_t GB = 1024 * 1024 * 1024;
+    const std::int64_t GB = 1024 * 1024 * 1024;
+    auto scratch = std::vector< unsigned char >(64 * 1024 * 1024);
+
+    const auto readinto = [&] (std::int64_t len, std::int64_t* nread) {
+        *nread = 0;
+        while (true) {
+            const auto chunk = std::min(len - *nread, std::int64_t(scratch.size()));
+            std::int64_t n;
+            const auto err = lfp_readinto(tif, scratch.data(), chunk, &n);
+            *nread += n;
+            if (err != LFP_OK or *nread == len)
+                return err;
+        }
+    };
 
-    SECTION( "read over 4GB data in one chunk" ) {
+    SECTION( "read over 4GB data" ) {
         std::int64_t nread = 0;
-        const auto err = lfp_readinto(tif, dst, 4*GB + 1, &nread);
-        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        auto err = readinto(4*GB + 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == 4*GB + 1);
 
-        auto msg = std::string(lfp_errormsg(tif));
-        CHECK_THAT(msg, Contains("4GB"));
+        err = readinto(2*GB, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == GB - 1);
     }
 
     SECTION( "read over 4GB data in 2 chunks" ) {
         std::int64_t nread = 0;
-        auto err = lfp_readinto(tif, dst, 3*GB, &nread);
+        auto err = readinto(3*GB, &nread);
         CHECK(err == LFP_OK);
 
-        err = lfp_readinto(tif, dst, 2*GB, &nread);
-        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        err = readinto(2*GB, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == 2*GB);
 
-        auto msg = std::string(lfp_errormsg(tif));
-        CHECK_THAT(msg, Contains("4GB"));
+        std::int64_t tell;
+        err = lfp_tell(tif, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 5*GB);
+    }
+
+    SECTION( "seek beyond 4GB" ) {
+        auto err = lfp_seek(tif, 4*GB + 1);
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(tif, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 4*GB + 1);
+
+        std::int64_t nread = 0;
+        err = readinto(2*GB, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == GB - 1);
+    }
+
+    SECTION( "seek back and forth over 4GB" ) {
+        auto err = lfp_tapeimage_index_build(tif);
+        CHECK(err == LFP_OK);
+
+        err = lfp_seek(tif, 5*GB - 1);
+        CHECK(err == LFP_OK);
+        err = lfp_seek(tif, GB);
+        CHECK(err == LFP_OK);
+        err = lfp_seek(tif, 4*GB);
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(tif, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 4*GB);
+    }
+
+    lfp_close(tif);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: a dumped index can be loaded into a new handle",
+    "[tapeimage][tif][index]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    /* seek past eof to index the full file */
+    auto err = lfp_seek(f, size + 1);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t index_size = -1;
+    err = lfp_tapeimage_index_size(f, &index_size);
+    REQUIRE(err == LFP_OK);
+    CHECK(index_size == 36 + (records + 1) * 20);
+
+    auto index = std::vector< unsigned char >(index_size);
+    err = lfp_tapeimage_index_dump(f, index.data(), index.size());
+    REQUIRE(err == LFP_OK);
+
+    /*
+     * Trash all the headers on disk. If the loaded index is used, the
+     * headers are never read, and the file can still be read correctly.
+     */
+    auto trashed = tape;
+    std::uint32_t pos = 0;
+    while (true) {
+        std::uint32_t type;
+        std::uint32_t next;
+        std::memcpy(&type, trashed.data() + pos + 0, sizeof(type));
+        std::memcpy(&next, trashed.data() + pos + 8, sizeof(next));
+        std::fill_n(trashed.begin() + pos, 12, 0xFF);
+        if (type == 1) break;
+        pos = next;
     }
 
-    SECTION( "read little less than 4GB of data in over 4GB file" ) {
-        /* We read less than 4GB, but added header size causes overflow */
+    auto* mem = lfp_memfile_openwith(trashed.data(), trashed.size());
+    auto* tif = lfp_tapeimage_open(mem);
+    err = lfp_tapeimage_index_load(tif, index.data(), index.size());
+    REQUIRE(err == LFP_OK);
+
+    SECTION( "full read" ) {
         std::int64_t nread = 0;
-        auto err = lfp_readinto(tif, dst, 4*GB - 2, &nread);
-        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
 
-        auto msg = std::string(lfp_errormsg(tif));
-        CHECK_THAT(msg, Contains("4GB"));
+    SECTION( "seek and read" ) {
+        const auto n = GENERATE_COPY(take(1, random(0, size - 1)));
+        err = lfp_seek(tif, n);
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(tif, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == n);
+
+        std::int64_t nread = 0;
+        out.resize(size - n);
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == size - n);
+
+        const auto tail = std::vector< unsigned char >(
+            expected.begin() + n,
+            expected.end()
+        );
+        CHECK_THAT(out, Equals(tail));
     }
 
-    SECTION( "seek beyond 4GB" ) {
-        auto err = lfp_seek(tif, 4*GB + 1);
+    lfp_close(tif);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: a partial index is extended when reading past it",
+    "[tapeimage][tif][index]") {
+    const auto records = GENERATE(2, 3, 5, 8, 13);
+    make(records);
+
+    const auto n = GENERATE_COPY(take(1, random(0, size - 1)));
+    auto err = lfp_seek(f, n);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t index_size = -1;
+    err = lfp_tapeimage_index_size(f, &index_size);
+    REQUIRE(err == LFP_OK);
+    auto index = std::vector< unsigned char >(index_size);
+    err = lfp_tapeimage_index_dump(f, index.data(), index.size());
+    REQUIRE(err == LFP_OK);
+
+    auto* mem = lfp_memfile_openwith(tape.data(), tape.size());
+    auto* tif = lfp_tapeimage_open(mem);
+
+    SECTION( "load before reading" ) {
+        err = lfp_tapeimage_index_load(tif, index.data(), index.size());
+        CHECK(err == LFP_OK);
+    }
+
+    SECTION( "load after reading" ) {
+        std::int64_t nread = 0;
+        err = lfp_readinto(tif, out.data(), 1, &nread);
+        CHECK(err == LFP_OK);
+
+        err = lfp_tapeimage_index_load(tif, index.data(), index.size());
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(tif, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 1);
+
+        err = lfp_seek(tif, 0);
+        CHECK(err == LFP_OK);
+    }
+
+    std::int64_t nread = 0;
+    err = lfp_readinto(tif, out.data(), out.size(), &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == expected.size());
+    CHECK_THAT(out, Equals(expected));
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Broken or mismatching index is rejected",
+    "[tapeimage][tif][index]") {
+    const auto file = std::vector< unsigned char > {
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x0C, 0x00, 0x00, 0x00,
+
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x1C, 0x00, 0x00, 0x00,
+
+        0x01, 0x02, 0x03, 0x04,
+
+        0x01, 0x00, 0x00, 0x00,
+        0x0C, 0x00, 0x00, 0x00,
+        0x28, 0x00, 0x00, 0x00,
+    };
+
+    auto* mem = lfp_memfile_openwith(file.data(), file.size());
+    auto* tif = lfp_tapeimage_open(mem);
+
+    auto err = lfp_seek(tif, 5);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t index_size = -1;
+    err = lfp_tapeimage_index_size(tif, &index_size);
+    REQUIRE(err == LFP_OK);
+    auto index = std::vector< unsigned char >(index_size);
+    err = lfp_tapeimage_index_dump(tif, index.data(), index.size());
+    REQUIRE(err == LFP_OK);
+
+    SECTION( "dump into too small buffer" ) {
+        err = lfp_tapeimage_index_dump(tif, index.data(), index.size() - 1);
         CHECK(err == LFP_INVALID_ARGS);
+    }
 
-        auto msg = std::string(lfp_errormsg(tif));
-        CHECK_THAT(msg, Contains("4GB"));
+    SECTION( "load into handle that is not a tapeimage" ) {
+        auto* other = lfp_memfile_openwith(file.data(), file.size());
+        err = lfp_tapeimage_index_load(other, index.data(), index.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(other));
+        CHECK_THAT(msg, Contains("not a tapeimage"));
+        lfp_close(other);
     }
 
-    SECTION( "seek beyond 4GB when zero is close to 4GB" ) {
-        /*
-        // TODO:
-        // would be the case of several logical files
+    SECTION( "load truncated index" ) {
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(file.data(), file.size())
+        );
+        err = lfp_tapeimage_index_load(other, index.data(), index.size() - 1);
+        CHECK(err == LFP_INVALID_ARGS);
+        lfp_close(other);
+    }
 
-        // set TIF start to be at 3GB + 24 bytes (header2)
+    SECTION( "load garbage" ) {
+        auto garbage = index;
+        garbage[0] = 'X';
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(file.data(), file.size())
+        );
+        err = lfp_tapeimage_index_load(other, garbage.data(), garbage.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        lfp_close(other);
+    }
 
-        auto err = lfp_seek(tif, 2*GB);
-        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+    SECTION( "load index into handle opened at another offset" ) {
+        auto* inner = lfp_memfile_openwith(file.data(), file.size());
+        err = lfp_seek(inner, 12);
+        REQUIRE(err == LFP_OK);
+        auto* other = lfp_tapeimage_open(inner);
+        err = lfp_tapeimage_index_load(other, index.data(), index.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(other));
+        CHECK_THAT(msg, Contains("base"));
+        lfp_close(other);
+    }
+
+    SECTION( "load index of a file that has since changed size" ) {
+        auto rewritten = file;
+        rewritten.insert(rewritten.begin() + 24, 4, 0x00);
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(rewritten.data(), rewritten.size())
+        );
+        err = lfp_tapeimage_index_load(other, index.data(), index.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(other));
+        CHECK_THAT(msg, Contains("size"));
+        lfp_close(other);
+    }
+
+    SECTION( "load index where prev does not point to the header before" ) {
+        REQUIRE(index.size() == 36 + 3 * 20);
+        auto broken = index;
+        /* prev of the third header */
+        broken[36 + 2 * 20 + 4] = 0x00;
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(file.data(), file.size())
+        );
+        err = lfp_tapeimage_index_load(other, broken.data(), broken.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(other));
+        CHECK_THAT(msg, Contains("corrupt"));
+        lfp_close(other);
+    }
+
+    SECTION( "load index where prev of the second header is not base" ) {
+        auto broken = index;
+        /* prev of the second header */
+        broken[36 + 20 + 4] = 0x04;
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(file.data(), file.size())
+        );
+        err = lfp_tapeimage_index_load(other, broken.data(), broken.size());
+        CHECK(err == LFP_INVALID_ARGS);
+        auto msg = std::string(lfp_errormsg(other));
+        CHECK_THAT(msg, Contains("header 1 is corrupt"));
+        lfp_close(other);
+    }
 
+    SECTION( "load index that disagrees with the handle" ) {
+        auto broken = index;
+        /* next of the last header */
+        broken[36 + 2 * 20 + 13] += 1;
+        err = lfp_tapeimage_index_load(tif, broken.data(), broken.size());
+        CHECK(err == LFP_INVALID_ARGS);
         auto msg = std::string(lfp_errormsg(tif));
-        CHECK_THAT(msg, Contains("4GB")); */
+        CHECK_THAT(msg, Contains("does not match"));
+    }
+
+    lfp_close(tif);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: building the index does not move the read position",
+    "[tapeimage][tif][index]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    const auto n = GENERATE_COPY(take(1, random(0, size - 1)));
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(f, out.data(), n, &nread);
+    REQUIRE(err == LFP_OK);
+
+    err = lfp_tapeimage_index_build(f);
+    CHECK(err == LFP_OK);
+
+    std::int64_t index_size = -1;
+    err = lfp_tapeimage_index_size(f, &index_size);
+    CHECK(err == LFP_OK);
+    CHECK(index_size == 36 + (records + 1) * 20);
+
+    std::int64_t tell;
+    err = lfp_tell(f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == n);
+
+    err = lfp_readinto(f, out.data() + n, size - n, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == size - n);
+    CHECK_THAT(out, Equals(expected));
+}
+
+namespace {
+
+std::vector< unsigned char > make_tape(int records, int record_size) {
+    auto tape = std::vector< unsigned char >();
+    std::uint32_t prev = 0;
+    for (int i = 0; i <= records; ++i) {
+        const std::uint32_t type = i == records ? 1 : 0;
+        const auto body = i == records ? 0 : record_size;
+        const std::uint32_t next = tape.size() + 12 + body;
+
+        auto head = std::vector< unsigned char >(12, 0);
+        std::memcpy(head.data() + 0, &type, sizeof(type));
+        std::memcpy(head.data() + 4, &prev, sizeof(prev));
+        std::memcpy(head.data() + 8, &next, sizeof(next));
+
+        prev = tape.size();
+        tape.insert(tape.end(), head.begin(), head.end());
+        tape.insert(tape.end(), body, static_cast< unsigned char >(i));
+    }
+    return tape;
+}
+
+}
+
+TEST_CASE(
+    "Tape image: index is built with few reads of the underlying file",
+    "[tapeimage][tif][index]") {
+    const auto records = 5000;
+    const auto tape = make_tape(records, 8);
+
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    auto* tif = lfp_tapeimage_open(counter);
+
+    SECTION( "index build" ) {
+        const auto err = lfp_tapeimage_index_build(tif);
+        CHECK(err == LFP_OK);
+    }
+
+    SECTION( "cold seek" ) {
+        const auto err = lfp_seek(tif, records * 8 - 1);
+        CHECK(err == LFP_OK);
+
+        unsigned char x;
+        std::int64_t nread;
+        lfp_readinto(tif, &x, 1, &nread);
+        CHECK(x == static_cast< unsigned char >(records - 1));
+    }
+
+    std::int64_t index_size = -1;
+    const auto err = lfp_tapeimage_index_size(tif, &index_size);
+    CHECK(err == LFP_OK);
+    CHECK(index_size >= 36 + records * 20);
+    CHECK(counter->reads < 20);
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: reading small records needs few reads of the underlying file",
+    "[tapeimage][tif]") {
+    const auto records = 5000;
+    const auto tape = make_tape(records, 8);
+
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    auto* tif = lfp_tapeimage_open(counter);
+
+    auto out = std::vector< unsigned char >(records * 8);
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(tif, out.data(), out.size() + 1, &nread);
+    CHECK(err == LFP_EOF);
+    CHECK(nread == records * 8);
+    CHECK(out[0] == 0);
+    CHECK(out.back() == static_cast< unsigned char >(records - 1));
+
+    /* the file is ~100k, and should be read in a handful of blocks */
+    CHECK(counter->reads < 10);
+
+    SECTION( "the underlying file is positioned after the last byte read" ) {
+        err = lfp_seek(tif, 8);
+        CHECK(err == LFP_OK);
+
+        lfp_protocol* inner;
+        err = lfp_peek(tif, &inner);
+        CHECK(err == LFP_OK);
+
+        std::int64_t tell;
+        err = lfp_tell(inner, &tell);
+        CHECK(err == LFP_OK);
+        CHECK(tell == 12 + 8 + 12);
     }
 
     lfp_close(tif);
 }
+
+namespace {
+
+/*
+ * A file that is still being written. Only the first visible bytes of data
+ * can be read, and reads past them report EOF, like a regular file would.
+ */
+class growing : public lfp_protocol {
+public:
+    explicit growing(const std::vector< unsigned char >& d) : data(d) {}
+
+    void close() noexcept (false) override {}
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* nread)
+    noexcept (false) override {
+        const auto n = std::max(
+            std::int64_t(0),
+            std::min(len, this->visible - this->pos)
+        );
+        std::memcpy(dst, this->data.data() + this->pos, n);
+        this->pos += n;
+        *nread = n;
+        return n == len ? LFP_OK : LFP_EOF;
+    }
+
+    int eof() const noexcept (false) override {
+        return this->pos >= this->visible;
+    }
+    void seek(std::int64_t n) noexcept (false) override { this->pos = n; }
+    std::int64_t tell() const noexcept (false) override { return this->pos; }
+
+    lfp_protocol* peel() noexcept (false) override { return nullptr; }
+    lfp_protocol* peek() const noexcept (false) override { return nullptr; }
+
+    std::int64_t visible = 0;
+
+private:
+    const std::vector< unsigned char >& data;
+    std::int64_t pos = 0;
+};
+
+}
+
+TEST_CASE(
+    "Tape image: a file that is still being written is read again at EOF",
+    "[tapeimage][tif]") {
+    const auto records = 3;
+    const auto size = 100;
+    const auto tape = make_tape(records, size);
+
+    auto* file = new growing(tape);
+    file->visible = 12 + size / 2;
+    auto* tif = lfp_tapeimage_open(file);
+
+    auto out = std::vector< unsigned char >(records * size);
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(tif, out.data(), out.size(), &nread);
+    CHECK(err == LFP_UNEXPECTED_EOF);
+
+    std::int64_t tell;
+    err = lfp_tell(tif, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == size / 2);
+
+    file->visible = tape.size();
+    const auto remaining = std::int64_t(out.size()) - tell;
+    err = lfp_readinto(tif, out.data() + tell, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+
+    auto expected = std::vector< unsigned char >();
+    for (int i = 0; i < records; ++i)
+        expected.insert(expected.end(), size, static_cast< unsigned char >(i));
+    CHECK_THAT(out, Equals(expected));
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: random seeks in an indexed file land in the right record",
+    "[tapeimage][tif][index]") {
+    const auto records = 5000;
+    const auto tape = make_tape(records, 8);
+
+    auto* tif = lfp_tapeimage_open(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    auto err = lfp_tapeimage_index_build(tif);
+    REQUIRE(err == LFP_OK);
+
+    /* visit every logical offset once, in a scrambled order */
+    const auto size = records * 8;
+    for (std::int64_t i = 0; i < size; ++i) {
+        const auto n = (i * 7919) % size;
+        err = lfp_seek(tif, n);
+        REQUIRE(err == LFP_OK);
+
+        unsigned char x;
+        std::int64_t nread;
+        err = lfp_readinto(tif, &x, 1, &nread);
+        CHECK(err == LFP_OK);
+        CHECK(nread == 1);
+        CHECK(x == static_cast< unsigned char >(n / 8));
+    }
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: records can be iterated over",
+    "[tapeimage][tif]") {
+    const auto records = 10;
+    const auto tape = make_tape(records, 8);
+
+    auto* tif = lfp_tapeimage_open(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+
+    int type = -1;
+    std::int64_t offset = -1;
+    std::int64_t length = -1;
+
+    SECTION( "all records are visited without reading them" ) {
+        for (int i = 0; i < records; ++i) {
+            const auto err = lfp_tapeimage_next_record(
+                tif, &type, &offset, &length
+            );
+            CHECK(err == LFP_OK);
+            CHECK(type == 0);
+            CHECK(offset == i * 8);
+            CHECK(length == 8);
+        }
+
+        auto err = lfp_tapeimage_next_record(tif, &type, &offset, &length);
+        CHECK(err == LFP_EOF);
+        CHECK(type == 1);
+        CHECK(offset == records * 8);
+        CHECK(length == 0);
+
+        err = lfp_tapeimage_next_record(tif, nullptr, nullptr, nullptr);
+        CHECK(err == LFP_EOF);
+    }
+
+    SECTION( "the length is enough to read the full record" ) {
+        for (int i = 0; i < records; ++i) {
+            auto err = lfp_tapeimage_next_record(
+                tif, &type, &offset, &length
+            );
+            REQUIRE(err == LFP_OK);
+
+            std::int64_t tell;
+            lfp_tell(tif, &tell);
+            CHECK(tell == offset);
+
+            auto out = std::vector< unsigned char >(length);
+            std::int64_t nread;
+            err = lfp_readinto(tif, out.data(), length, &nread);
+            CHECK(err == LFP_OK);
+            CHECK(nread == length);
+
+            const auto expected = std::vector< unsigned char >(length, i);
+            CHECK_THAT(out, Equals(expected));
+        }
+    }
+
+    SECTION( "next record after a seek is the one after the seeked record" ) {
+        auto err = lfp_seek(tif, 8 * 3 + 4);
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_tapeimage_next_record(tif, &type, &offset, &length);
+        CHECK(err == LFP_OK);
+        CHECK(offset == 8 * 4);
+
+        unsigned char x;
+        err = lfp_readinto(tif, &x, 1, nullptr);
+        CHECK(err == LFP_OK);
+        CHECK(x == 4);
+    }
+
+    SECTION( "seek back to an iterated record" ) {
+        for (int i = 0; i < records; ++i)
+            lfp_tapeimage_next_record(tif, nullptr, nullptr, nullptr);
+
+        auto err = lfp_seek(tif, 8 * 2 + 1);
+        CHECK(err == LFP_OK);
+
+        unsigned char x;
+        err = lfp_readinto(tif, &x, 1, nullptr);
+        CHECK(err == LFP_OK);
+        CHECK(x == 2);
+    }
+
+    lfp_close(tif);
+}
+
+namespace {
+
+std::vector< unsigned char > dump_index(lfp_protocol* tif) {
+    std::int64_t size;
+    auto err = lfp_tapeimage_index_size(tif, &size);
+    REQUIRE(err == LFP_OK);
+
+    auto index = std::vector< unsigned char >(size);
+    err = lfp_tapeimage_index_dump(tif, index.data(), size);
+    REQUIRE(err == LFP_OK);
+    return index;
+}
+
+}
+
+TEST_CASE(
+    "Tape image: parallel index build gives the sequential index",
+    "[tapeimage][tif][index]") {
+    /*
+     * The files span several stripes, so the threads have to find the first
+     * record in their stripes on their own. Every 256th record is all zeros,
+     * which looks a lot like a header.
+     *
+     * The workers read with readat when the underlying file supports it, and
+     * share its position otherwise. The readat of the counter is not safe to
+     * call from multiple threads, so the workers take turns.
+     */
+    const auto positional = GENERATE(true, false);
+
+    std::vector< unsigned char > tape;
+    SECTION( "small records" ) {
+        tape = make_tape(100000, 200);
+    }
+    SECTION( "large records" ) {
+        tape = make_tape(10, 2 * 1024 * 1024 + 3);
+    }
+    SECTION( "fewer records than threads" ) {
+        tape = make_tape(2, 10);
+    }
+
+    /*
+     * The counters do not know the size of the file, so neither does the
+     * index of the sequential build, for the dumps to be equal
+     */
+    auto* seq = lfp_tapeimage_open(
+        new read_counter(lfp_memfile_openwith(tape.data(), tape.size()))
+    );
+    auto err = lfp_tapeimage_index_build(seq);
+    REQUIRE(err == LFP_OK);
+    const auto expected = dump_index(seq);
+    lfp_close(seq);
+
+    auto* mem = lfp_memfile_openwith(tape.data(), tape.size());
+    readat_counter* counter = nullptr;
+    lfp_protocol* inner = nullptr;
+    if (positional)
+        inner = counter = new readat_counter(mem);
+    else
+        inner = new read_counter(mem);
+
+    auto* tif = lfp_tapeimage_open(inner);
+
+    unsigned char x;
+    err = lfp_readinto(tif, &x, 1, nullptr);
+    REQUIRE(err == LFP_OK);
+
+    err = lfp_tapeimage_index_build_parallel(tif, 4);
+    CHECK(err == LFP_OK);
+    CHECK(dump_index(tif) == expected);
+    if (counter) {
+        CHECK(counter->reads > 0);
+        CHECK(not counter->overlapped);
+    }
+
+    std::int64_t tell;
+    lfp_tell(tif, &tell);
+    CHECK(tell == 1);
+
+    err = lfp_readinto(tif, &x, 1, nullptr);
+    CHECK(err == LFP_OK);
+    CHECK(x == tape[12 + 1]);
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: parallel index build reports broken files",
+    "[tapeimage][tif][index]") {
+    auto tape = make_tape(100000, 200);
+    /* break the next pointer of a record in the middle of the file */
+    const auto broken = (12 + 200) * 50000 + 8;
+    std::memset(tape.data() + broken, 0, 4);
+
+    auto* seq = lfp_tapeimage_open(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    const auto expected = lfp_tapeimage_index_build(seq);
+    REQUIRE(expected != LFP_OK);
+    lfp_close(seq);
+
+    auto* tif = lfp_tapeimage_open(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    const auto err = lfp_tapeimage_index_build_parallel(tif, 4);
+    CHECK(err == expected);
+
+    lfp_close(tif);
+}
+
+namespace {
+
+/*
+ * Make a tape image from a list of record sizes, where a negative size is an
+ * end-of-file mark. The bytes of record i are all i.
+ */
+std::vector< unsigned char > make_archive(const std::vector< int >& sizes) {
+    auto tape = std::vector< unsigned char >();
+    std::uint32_t prev = 0;
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        const std::uint32_t type = sizes[i] < 0 ? 1 : 0;
+        const auto body = std::max(sizes[i], 0);
+        const std::uint32_t next = tape.size() + 12 + body;
+
+        auto head = std::vector< unsigned char >(12, 0);
+        std::memcpy(head.data() + 0, &type, sizeof(type));
+        std::memcpy(head.data() + 4, &prev, sizeof(prev));
+        std::memcpy(head.data() + 8, &next, sizeof(next));
+
+        prev = tape.size();
+        tape.insert(tape.end(), head.begin(), head.end());
+        tape.insert(tape.end(), body, static_cast< unsigned char >(i));
+    }
+    return tape;
+}
+
+}
+
+TEST_CASE(
+    "Tape image: open at one of the last logical files",
+    "[tapeimage][tif]") {
+    const auto tape = make_archive({
+        5, 7, -1,
+        3, -1,
+        4, 0, 2, -1,
+        -1,
+    });
+
+    auto* counter = new read_counter(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+
+    SECTION( "the last file" ) {
+        auto* tif = lfp_tapeimage_open_tail(counter, 1);
+        REQUIRE(tif);
+
+        std::int64_t size;
+        auto err = lfp_tapeimage_index_size(tif, &size);
+        CHECK(err == LFP_OK);
+        CHECK(size == 36 + 4 * 20);
+
+        const auto reads = counter->reads.load();
+
+        std::int64_t tell;
+        lfp_tell(tif, &tell);
+        CHECK(tell == 0);
+
+        auto out = std::vector< unsigned char >(10);
+        std::int64_t nread;
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 6);
+
+        const auto expected = std::vector< unsigned char >{
+            5, 5, 5, 5, 7, 7,
+        };
+        out.resize(nread);
+        CHECK_THAT(out, Equals(expected));
+
+        /* everything was served from the index and the read buffer */
+        CHECK(counter->reads - reads <= 1);
+
+        lfp_close(tif);
+    }
+
+    SECTION( "the second to last file" ) {
+        auto* tif = lfp_tapeimage_open_tail(counter, 2);
+        REQUIRE(tif);
+
+        auto out = std::vector< unsigned char >(10);
+        std::int64_t nread;
+        const auto err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 3);
+        CHECK(out[0] == 3);
+        CHECK(out[2] == 3);
+
+        lfp_close(tif);
+    }
+
+    SECTION( "the first file" ) {
+        auto* tif = lfp_tapeimage_open_tail(counter, 3);
+        REQUIRE(tif);
+
+        auto err = lfp_seek(tif, 6);
+        CHECK(err == LFP_OK);
+
+        unsigned char x;
+        err = lfp_readinto(tif, &x, 1, nullptr);
+        CHECK(err == LFP_OK);
+        CHECK(x == 1);
+
+        lfp_close(tif);
+    }
+
+    SECTION( "the end is found from the size, without probing" ) {
+        counter->sized = true;
+        auto* tif = lfp_tapeimage_open_tail(counter, 1);
+        REQUIRE(tif);
+
+        /* a single block covers the whole file */
+        CHECK(counter->reads == 1);
+        lfp_close(tif);
+    }
+
+    SECTION( "the end is found by probing when the size is unknown" ) {
+        auto* tif = lfp_tapeimage_open_tail(counter, 1);
+        REQUIRE(tif);
+        CHECK(counter->reads > 1);
+        lfp_close(tif);
+    }
+
+    SECTION( "too few files" ) {
+        auto* tif = lfp_tapeimage_open_tail(counter, 4);
+        CHECK(not tif);
+        lfp_close(counter);
+    }
+
+    SECTION( "broken prev pointer" ) {
+        auto broken = tape;
+        /* the prev of the header of the record with 2 bytes */
+        const auto pos = 12 + 5 + 12 + 7 + 12 + 12 + 3 + 12 + 12 + 4 + 12;
+        broken[pos + 4] += 1;
+
+        lfp_close(counter);
+        auto* mem = lfp_memfile_openwith(broken.data(), broken.size());
+        auto* tif = lfp_tapeimage_open_tail(mem, 1);
+        CHECK(not tif);
+        lfp_close(mem);
+    }
+}
+
+TEST_CASE(
+    "Tape image: resynchronise on broken headers",
+    "[tapeimage][tif]") {
+    const auto records = 1000;
+    const auto size = 100;
+    auto tape = make_tape(records, size);
+    const auto header_of = [] (int i) { return (12 + size) * i; };
+
+    auto expected = std::vector< unsigned char >();
+    for (int i = 0; i < records; ++i)
+        expected.insert(expected.end(), size, static_cast< unsigned char >(i));
+
+    auto out = std::vector< unsigned char >(records * size + 100);
+    std::int64_t nread;
+
+    SECTION( "a broken header is fatal without resync" ) {
+        std::memset(tape.data() + header_of(500), 0xFF, 12);
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+
+        const auto err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+        lfp_close(tif);
+    }
+
+    SECTION( "a single broken header" ) {
+        std::memset(tape.data() + header_of(500), 0xFF, 12);
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        auto err = lfp_tapeimage_set_resync(tif, 1);
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        CHECK(nread == records * size);
+
+        out.resize(nread);
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(tif));
+        lfp_close(tif);
+    }
+
+    SECTION( "a single broken header, recovered index dumped and loaded" ) {
+        std::memset(tape.data() + header_of(500), 0xFF, 12);
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        auto err = lfp_tapeimage_set_resync(tif, 1);
+        REQUIRE(err == LFP_OK);
+        err = lfp_tapeimage_index_build(tif);
+        REQUIRE(err == LFP_OK);
+
+        std::int64_t index_size;
+        err = lfp_tapeimage_index_size(tif, &index_size);
+        REQUIRE(err == LFP_OK);
+        auto index = std::vector< unsigned char >(index_size);
+        err = lfp_tapeimage_index_dump(tif, index.data(), index.size());
+        REQUIRE(err == LFP_OK);
+        lfp_close(tif);
+
+        /*
+         * The loaded index covers the broken header, which is never read,
+         * and reads still report the recovery
+         */
+        auto* other = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        err = lfp_tapeimage_index_load(other, index.data(), index.size());
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_readinto(other, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        CHECK(nread == records * size);
+
+        out.resize(nread);
+        CHECK_THAT(out, Equals(expected));
+        lfp_close(other);
+    }
+
+    SECTION( "a single broken header, read at an offset" ) {
+        std::memset(tape.data() + header_of(500), 0xFF, 12);
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        auto err = lfp_tapeimage_set_resync(tif, 1);
+        REQUIRE(err == LFP_OK);
+
+        /* before the broken header, nothing is recovered yet */
+        err = lfp_readat(tif, 0, out.data(), size, &nread);
+        CHECK(err == LFP_OK);
+
+        const auto offset = 400 * size;
+        const auto len = 200 * size;
+        err = lfp_readat(tif, offset, out.data(), len, &nread);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        CHECK(nread == len);
+        CHECK(std::equal(
+            out.begin(),
+            out.begin() + len,
+            expected.begin() + offset
+        ));
+
+        lfp_range range { offset, len, out.data(), 0 };
+        err = lfp_readv_at(tif, &range, 1);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        CHECK(range.nread == len);
+
+        /* the read head shares the recovery state */
+        err = lfp_readinto(tif, out.data(), size, &nread);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        lfp_close(tif);
+    }
+
+    SECTION( "consecutive broken headers" ) {
+        std::memset(tape.data() + header_of(500), 0xFF, 12);
+        std::memset(tape.data() + header_of(501), 0x00, 12);
+        std::memset(tape.data() + header_of(700), 0xAB, 12);
+
+        /* the broken header of 501 is presented as data */
+        const auto at = expected.begin() + 501 * size;
+        expected.insert(at, 12, 0x00);
+
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        auto err = lfp_tapeimage_set_resync(tif, 1);
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_tapeimage_index_build(tif);
+        CHECK(err == LFP_OK);
+
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_TRYRECOVERY);
+        CHECK(nread == std::int64_t(expected.size()));
+
+        out.resize(nread);
+        CHECK_THAT(out, Equals(expected));
+        lfp_close(tif);
+    }
+
+    SECTION( "no header after the broken one" ) {
+        tape.resize(header_of(records - 1) + 12 + size);
+        std::memset(tape.data() + header_of(records - 1), 0xFF, 12);
+
+        auto* tif = lfp_tapeimage_open(
+            lfp_memfile_openwith(tape.data(), tape.size())
+        );
+        auto err = lfp_tapeimage_set_resync(tif, 1);
+        REQUIRE(err == LFP_OK);
+
+        err = lfp_readinto(tif, out.data(), out.size(), &nread);
+        CHECK(err == LFP_PROTOCOL_FAILEDRECOVERY);
+        lfp_close(tif);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: readat matches the data, and leaves the position alone",
+    "[tapeimage][tif][readat]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    SECTION( "lazily indexed" ) {
+        test_random_readat(this);
+    }
+
+    SECTION( "fully indexed" ) {
+        const auto err = lfp_tapeimage_index_build(f);
+        REQUIRE(err == LFP_OK);
+        test_random_readat(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: readv_at matches the data, and leaves the position alone",
+    "[tapeimage][tif][readv]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    SECTION( "lazily indexed" ) {
+        test_random_readv_at(this);
+    }
+
+    SECTION( "fully indexed" ) {
+        const auto err = lfp_tapeimage_index_build(f);
+        REQUIRE(err == LFP_OK);
+        test_random_readv_at(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: a duplicate reads independently of the original",
+    "[tapeimage][tif][dup]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    SECTION( "lazily indexed" ) {
+        test_random_dup(this);
+    }
+
+    SECTION( "fully indexed" ) {
+        const auto err = lfp_tapeimage_index_build(f);
+        REQUIRE(err == LFP_OK);
+        test_random_dup(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: bytes can be borrowed, within and across records",
+    "[tapeimage][tif][borrow]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    SECTION( "lazily indexed" ) {
+        test_random_borrow(this);
+    }
+
+    SECTION( "fully indexed" ) {
+        const auto err = lfp_tapeimage_index_build(f);
+        REQUIRE(err == LFP_OK);
+        test_random_borrow(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: the size is found from the headers",
+    "[tapeimage][tif][size]") {
+    const auto records = GENERATE(1, 2, 3, 5, 8, 13);
+    make(records);
+
+    SECTION( "lazily indexed" ) {
+        test_random_size(this);
+    }
+
+    SECTION( "fully indexed" ) {
+        const auto err = lfp_tapeimage_index_build(f);
+        REQUIRE(err == LFP_OK);
+        test_random_size(this);
+    }
+}
+
+TEST_CASE(
+    "Tape image: the size ends at the first file mark",
+    "[tapeimage][tif][size]") {
+    auto tape = make_archive({ 10, 0, 20, -1, 5, -1 });
+    auto* tif = lfp_tapeimage_open(memopen(tape).release());
+    REQUIRE(tif);
+
+    unsigned char x;
+    auto err = lfp_readinto(tif, &x, 1, nullptr);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t size = -1;
+    err = lfp_size(tif, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == 30);
+
+    /* the whole logical file was indexed to find the size */
+    std::int64_t index_size;
+    err = lfp_tapeimage_index_size(tif, &index_size);
+    CHECK(err == LFP_OK);
+    CHECK(index_size == 36 + 4 * 20);
+
+    std::int64_t tell = -1;
+    lfp_tell(tif, &tell);
+    CHECK(tell == 1);
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: the size of a broken file is an error",
+    "[tapeimage][tif][size][errorcase]") {
+    auto tape = make_archive({ 10, 20, -1 });
+    /* point the second record's next backwards */
+    tape[22 + 8] = 0;
+
+    auto* tif = lfp_tapeimage_open(memopen(tape).release());
+    REQUIRE(tif);
+
+    std::int64_t size = -1;
+    const auto err = lfp_size(tif, &size);
+    CHECK(err == LFP_PROTOCOL_FATAL_ERROR);
+    CHECK(size == -1);
+
+    lfp_close(tif);
+}
+
+TEST_CASE(
+    "Tape image: bytes in a single record are borrowed without copying",
+    "[tapeimage][tif][borrow]") {
+    /*
+     * The record is larger than the read buffer, so it is lent straight from
+     * the underlying mem-file
+     */
+    const std::uint32_t record = 0;
+    const std::uint32_t mark = 1;
+    const std::uint32_t size = 100000;
+    const std::uint32_t zero = 0;
+    const std::uint32_t next = 12 + size;
+    const std::uint32_t eof = next + 12;
+
+    auto tape = std::vector< unsigned char >(eof, 0);
+    std::memcpy(tape.data() + 0, &record, sizeof(record));
+    std::memcpy(tape.data() + 4, &zero,   sizeof(zero));
+    std::memcpy(tape.data() + 8, &next,   sizeof(next));
+    for (std::uint32_t i = 0; i < size; ++i)
+        tape[12 + i] = static_cast< unsigned char >(i);
+    std::memcpy(tape.data() + next + 0, &mark, sizeof(mark));
+    std::memcpy(tape.data() + next + 4, &zero, sizeof(zero));
+    std::memcpy(tape.data() + next + 8, &eof,  sizeof(eof));
+
+    auto* tif = lfp_tapeimage_open(lfp_memfile_borrow(tape.data(), eof));
+    REQUIRE(tif);
+
+    const void* ptr = nullptr;
+    std::int64_t avail;
+    auto err = lfp_borrow(tif, size, &ptr, &avail);
+    CHECK(err == LFP_OK);
+    CHECK(avail == size);
+    CHECK(ptr == tape.data() + 12);
+    CHECK(lfp_release(tif) == LFP_OK);
+
+    err = lfp_borrow(tif, 1, &ptr, &avail);
+    CHECK(err == LFP_EOF);
+    CHECK(avail == 0);
+    CHECK(lfp_release(tif) == LFP_OK);
+
+    lfp_close(tif);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: duplicates share the index, and can be read in parallel",
+    "[tapeimage][tif][dup]") {
+    make(13);
+    auto err = lfp_tapeimage_index_build(f);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t expected_size;
+    err = lfp_tapeimage_index_size(f, &expected_size);
+    REQUIRE(err == LFP_OK);
+
+    auto dups = std::vector< lfp_protocol* >(4);
+    for (auto& dup : dups) {
+        err = lfp_dup(f, &dup);
+        REQUIRE(err == LFP_OK);
+
+        std::int64_t size;
+        err = lfp_tapeimage_index_size(dup, &size);
+        CHECK(err == LFP_OK);
+        CHECK(size == expected_size);
+    }
+
+    auto outs = std::vector< std::vector< unsigned char > >(dups.size());
+    auto threads = std::vector< std::thread >();
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        threads.emplace_back([this, t, &dups, &outs] {
+            auto& out = outs[t];
+            out.resize(size);
+            std::int64_t nread;
+            lfp_readinto(dups[t], out.data(), size, &nread);
+            out.resize(nread);
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        CHECK_THAT(outs[t], Equals(expected));
+        lfp_close(dups[t]);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: headers found by a duplicate are indexed for the original",
+    "[tapeimage][tif][dup]") {
+    make(13);
+    lfp_protocol* dup;
+    auto err = lfp_dup(f, &dup);
+    REQUIRE(err == LFP_OK);
+
+    std::int64_t before;
+    err = lfp_tapeimage_index_size(f, &before);
+    CHECK(err == LFP_OK);
+
+    std::int64_t nread;
+    err = lfp_readinto(dup, out.data(), size, &nread);
+    CHECK(nread == size);
+    CHECK_THAT(out, Equals(expected));
+
+    std::int64_t from_dup;
+    err = lfp_tapeimage_index_size(dup, &from_dup);
+    CHECK(err == LFP_OK);
+    CHECK(from_dup > before);
+
+    std::int64_t from_original;
+    err = lfp_tapeimage_index_size(f, &from_original);
+    CHECK(err == LFP_OK);
+    CHECK(from_original == from_dup);
+
+    /* the original reads through the headers the duplicate found */
+    std::fill(out.begin(), out.end(), 0);
+    err = lfp_readinto(f, out.data(), size, &nread);
+    CHECK(nread == size);
+    CHECK_THAT(out, Equals(expected));
+
+    lfp_close(dup);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: duplicates can index lazily in parallel",
+    "[tapeimage][tif][dup]") {
+    make(13);
+    auto dups = std::vector< lfp_protocol* >(4);
+    for (auto& dup : dups) {
+        const auto err = lfp_dup(f, &dup);
+        REQUIRE(err == LFP_OK);
+    }
+
+    /*
+     * Every thread reads the file from start to end, in small reads, and all
+     * of them race to index the same headers
+     */
+    auto outs = std::vector< std::vector< unsigned char > >(dups.size());
+    auto threads = std::vector< std::thread >();
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        threads.emplace_back([this, t, &dups, &outs] {
+            auto& out = outs[t];
+            out.resize(size);
+            std::int64_t pos = 0;
+            while (pos < size) {
+                std::int64_t nread;
+                const auto len = std::min< std::int64_t >(7, size - pos);
+                lfp_readinto(dups[t], out.data() + pos, len, &nread);
+                if (nread == 0) break;
+                pos += nread;
+            }
+            out.resize(pos);
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (std::size_t t = 0; t < dups.size(); ++t) {
+        CHECK_THAT(outs[t], Equals(expected));
+        lfp_close(dups[t]);
+    }
+
+    /*
+     * No header was indexed twice - the index is the preamble, and the 13
+     * records and the file mark
+     */
+    auto err = lfp_tapeimage_index_build(f);
+    CHECK(err == LFP_OK);
+    std::int64_t built;
+    err = lfp_tapeimage_index_size(f, &built);
+    CHECK(err == LFP_OK);
+    CHECK(built == 36 + (13 + 1) * 20);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: readv_at merges the reads across records",
+    "[tapeimage][tif][readv]") {
+    make(13);
+    auto* counter = new readat_counter(memopen(tape).release());
+    auto* tif = lfp_tapeimage_open(counter);
+    REQUIRE(tif);
+    auto err = lfp_tapeimage_index_build(tif);
+    REQUIRE(err == LFP_OK);
+
+    /*
+     * Every other byte, backwards, so that the ranges must be sorted, and
+     * cover every record. The records are only separated by a header, so it
+     * should all be read in one go.
+     */
+    auto out = std::vector< unsigned char >(size);
+    auto ranges = std::vector< lfp_range >();
+    for (auto offset = size - 1; offset >= 0; offset -= 2)
+        ranges.push_back(lfp_range { offset, 1, out.data() + offset, 0 });
+
+    err = lfp_readv_at(tif, ranges.data(), ranges.size());
+    CHECK(err == LFP_OK);
+    CHECK(counter->reads == 1);
+
+    for (const auto& r : ranges) {
+        CHECK(r.nread == 1);
+        CHECK(out[r.offset] == expected[r.offset]);
+    }
+
+    lfp_close(tif);
+}
+
+TEST_CASE_METHOD(
+    random_tapeimage,
+    "Tape image: indexed file can be read at offsets from multiple threads",
+    "[tapeimage][tif][readat]") {
+    make(13);
+    const auto err = lfp_tapeimage_index_build(f);
+    REQUIRE(err == LFP_OK);
+
+    const auto offsets = GENERATE_COPY(
+        take(1, chunk(64, random(0, size - 1)))
+    );
+
+    auto ok = std::vector< int >(4, 1);
+    auto threads = std::vector< std::thread >();
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([this, t, &offsets, &ok] {
+            for (auto i = std::size_t(t); i < offsets.size(); i += 4) {
+                const auto offset = offsets[i];
+                const auto len = std::min(100, size - offset);
+                auto out = std::vector< unsigned char >(len);
+                std::int64_t nread;
+                const auto err = lfp_readat(f, offset, out.data(), len, &nread);
+                const auto* first = expected.data() + offset;
+                ok[t] = ok[t]
+                    and err == LFP_OK
+                    and nread == len
+                    and std::equal(out.begin(), out.end(), first);
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_THAT(ok, Equals(std::vector< int >(4, 1)));
+}
+
+TEST_CASE(
+    "Tape image: unindexed file can be read at offsets from multiple threads",
+    "[tapeimage][tif][readat]") {
+    const auto records = 20000;
+    const auto size = 50;
+    const auto tape = make_tape(records, size);
+    auto* tif = lfp_tapeimage_open(
+        lfp_memfile_openwith(tape.data(), tape.size())
+    );
+    REQUIRE(tif);
+
+    /*
+     * Every thread reads from the end towards the start, so they all race to
+     * index the file, while the read head is moved through it with readinto
+     */
+    auto ok = std::vector< int >(4, 1);
+    auto threads = std::vector< std::thread >();
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([tif, t, &ok] {
+            for (int i = records - 1 - t; i >= 0; i -= 997) {
+                auto out = std::vector< unsigned char >(size + 1);
+                const auto offset = std::int64_t(i) * size;
+                const auto len = i == records - 1 ? size : size + 1;
+                std::int64_t nread;
+                const auto err = lfp_readat(
+                    tif, offset, out.data(), len, &nread
+                );
+                const auto x = static_cast< unsigned char >(i);
+                ok[t] = ok[t]
+                    and err == LFP_OK
+                    and nread == len
+                    and out[0] == x
+                    and out[size - 1] == x;
+            }
+        });
+    }
+
+    auto out = std::vector< unsigned char >(records * size);
+    std::int64_t nread = 0;
+    std::int64_t pos = 0;
+    while (pos < std::int64_t(out.size())) {
+        const auto err = lfp_readinto(tif, out.data() + pos, 1000, &nread);
+        REQUIRE(err == LFP_OK);
+        pos += nread;
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_THAT(ok, Equals(std::vector< int >(4, 1)));
+    CHECK(out[0] == 0);
+    CHECK(out.back() == static_cast< unsigned char >(records - 1));
+
+    std::int64_t tell;
+    const auto err = lfp_tell(tif, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == std::int64_t(out.size()));
+
+    lfp_close(tif);
+}
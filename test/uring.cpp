@@ -0,0 +1,257 @@
+#include <ciso646>
+#include <cstdio>
+#include <numeric>
+
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+
+#include <lfp/lfp.h>
+#include <lfp/rp66.h>
+#include <lfp/uring.h>
+
+#include "utils.hpp"
+
+
+using namespace Catch::Matchers;
+
+namespace {
+
+/*
+ * Depth 0 is the pread fallback, so every test runs both with and without
+ * io_uring.
+ */
+struct random_uring : random_memfile {
+    random_uring() {
+        REQUIRE(not expected.empty());
+
+        lfp_close(f);
+        f = nullptr;
+
+        const auto depth = GENERATE(0, 1, 4);
+        f = lfp_uring_open(tmpfd(expected.data(), expected.size()), depth);
+        REQUIRE(f);
+    }
+};
+
+/*
+ * A file that spans several io_uring blocks
+ */
+struct large_uring {
+    large_uring() {
+        expected.resize(1000 * 1000);
+        std::iota(expected.begin(), expected.end(), 0);
+
+        depth = GENERATE(0, 1, 4, 16);
+        f = lfp_uring_open(tmpfd(expected.data(), expected.size()), depth);
+        REQUIRE(f);
+    }
+
+    ~large_uring() {
+        lfp_close(f);
+    }
+
+    int depth;
+    lfp_protocol* f = nullptr;
+    std::vector< unsigned char > expected;
+};
+
+}
+
+TEST_CASE(
+    "Opening a negative descriptor or depth fails",
+    "[uring][open]") {
+    CHECK(not lfp_uring_open(-1, 4));
+
+    unsigned char x = 0;
+    const auto fd = tmpfd(&x, 1);
+    CHECK(not lfp_uring_open(fd, -1));
+    ::close(fd);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be read",
+    "[uring][read]") {
+
+    SECTION( "full read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        CHECK(err == LFP_OK);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+    }
+
+    SECTION( "incomplete read" ) {
+        std::int64_t nread = -1;
+        const auto err = lfp_readinto(f, out.data(), 2*out.size(), &nread);
+
+        CHECK(err == LFP_EOF);
+        CHECK(nread == expected.size());
+        CHECK_THAT(out, Equals(expected));
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "A file can be read in multiple, smaller reads" ) {
+        test_split_read(this);
+    }
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be seeked",
+    "[uring][seek]") {
+
+    SECTION( "correct seek" ) {
+        test_random_seek(this);
+    }
+
+    SECTION( "seek beyond file end" ) {
+        auto err = lfp_seek(f, expected.size() + 10);
+        CHECK(err == LFP_OK);
+
+        std::int64_t nread = -1;
+        err = lfp_readinto(f, out.data(), 1, &nread);
+        CHECK(err == LFP_EOF);
+        CHECK(nread == 0);
+        CHECK(lfp_eof(f));
+    }
+
+    SECTION( "negative seek" ) {
+        const auto err = lfp_seek(f, -1);
+        CHECK(err == LFP_INVALID_ARGS);
+    }
+}
+
+TEST_CASE_METHOD(
+    large_uring,
+    "uring reads across blocks, in small and large reads",
+    "[uring][read]") {
+    const auto size = std::int64_t(expected.size());
+    const auto chunk = GENERATE(1000, 64 * 1024, 300 * 1024);
+
+    auto out = std::vector< unsigned char >(expected.size());
+    std::int64_t total = 0;
+    while (true) {
+        std::int64_t nread;
+        const auto len = std::min(std::int64_t(chunk), size - total + 1);
+        const auto err = lfp_readinto(f, out.data() + total, len, &nread);
+        total += nread;
+        if (err == LFP_EOF) break;
+        REQUIRE(err == LFP_OK);
+    }
+
+    CHECK(total == size);
+    CHECK_THAT(out, Equals(expected));
+}
+
+TEST_CASE_METHOD(
+    large_uring,
+    "uring random reads land in the right place",
+    "[uring][seek]") {
+    const auto size = std::int64_t(expected.size());
+
+    /* visit offsets in a scrambled order, with reads that cross blocks */
+    for (std::int64_t i = 0; i < 500; ++i) {
+        const auto n = (i * 7919 * 131) % size;
+        auto err = lfp_seek(f, n);
+        REQUIRE(err == LFP_OK);
+
+        auto out = std::vector< unsigned char >(1000);
+        std::int64_t nread;
+        err = lfp_readinto(f, out.data(), out.size(), &nread);
+
+        const auto remaining = std::min(size - n, std::int64_t(out.size()));
+        CHECK(nread == remaining);
+        out.resize(nread);
+        const auto begin = expected.begin() + n;
+        const auto sub = std::vector< unsigned char >(begin, begin + nread);
+        CHECK_THAT(out, Equals(sub));
+    }
+}
+
+TEST_CASE_METHOD(
+    large_uring,
+    "uring prefetched regions can be read",
+    "[uring][prefetch]") {
+    const std::int64_t offsets[] = { 900 * 1000, 10, 500 * 1000 };
+    const std::int64_t lengths[] = {  50 * 1000, 20, 200 * 1000 };
+
+    auto err = lfp_uring_prefetch(f, offsets, lengths, 3);
+    CHECK(err == LFP_OK);
+
+    for (int i = 0; i < 3; ++i) {
+        err = lfp_seek(f, offsets[i]);
+        REQUIRE(err == LFP_OK);
+
+        auto out = std::vector< unsigned char >(lengths[i]);
+        std::int64_t nread;
+        err = lfp_readinto(f, out.data(), out.size(), &nread);
+        CHECK(err == LFP_OK);
+
+        const auto begin = expected.begin() + offsets[i];
+        const auto sub = std::vector< unsigned char >(begin, begin + nread);
+        CHECK_THAT(out, Equals(sub));
+    }
+
+    SECTION( "negative lengths are invalid" ) {
+        const std::int64_t off = 0;
+        const std::int64_t len = -1;
+        err = lfp_uring_prefetch(f, &off, &len, 1);
+        CHECK(err == LFP_INVALID_ARGS);
+    }
+
+    SECTION( "closing with reads in flight" ) {
+        err = lfp_uring_prefetch(f, offsets, lengths, 3);
+        CHECK(err == LFP_OK);
+    }
+}
+
+TEST_CASE(
+    "Prefetch on another protocol is invalid",
+    "[uring][prefetch]") {
+    std::FILE* fp = std::tmpfile();
+    auto* f = lfp_cfile(fp);
+
+    const std::int64_t off = 0;
+    const std::int64_t len = 1;
+    const auto err = lfp_uring_prefetch(f, &off, &len, 1);
+    CHECK(err == LFP_INVALID_ARGS);
+    lfp_close(f);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be read at an offset",
+    "[uring][readat]") {
+    test_random_readat(this);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be read at many offsets",
+    "[uring][readv]") {
+    test_random_readv_at(this);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be duplicated",
+    "[uring][dup]") {
+    test_random_dup(this);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring can be borrowed from",
+    "[uring][borrow]") {
+    test_random_borrow(this);
+}
+
+TEST_CASE_METHOD(
+    random_uring,
+    "uring reports its size",
+    "[uring][size]") {
+    test_random_size(this);
+}
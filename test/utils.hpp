@@ -1,12 +1,23 @@
 #ifndef LFP_TEST_UTILS_HPP
 #define LFP_TEST_UTILS_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <memory>
+#include <random>
+#include <vector>
+
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
 
 #include <catch2/catch.hpp>
 
 #include <lfp/lfp.h>
 #include <lfp/memfile.h>
+#include <lfp/protocol.hpp>
 
 namespace {
 
@@ -16,19 +27,19 @@ struct memfile_closer {
 
 using uniquemem = std::unique_ptr< lfp_protocol, memfile_closer >;
 
-uniquemem memopen() {
+inline uniquemem memopen() {
     auto f = uniquemem{ lfp_memfile_open() };
     REQUIRE(f);
     return f;
 }
 
-uniquemem memopen(const unsigned char* p, std::size_t len) {
+inline uniquemem memopen(const unsigned char* p, std::size_t len) {
     auto f = uniquemem{ lfp_memfile_openwith(p, len) };
     REQUIRE(f);
     return f;
 }
 
-uniquemem memopen(const std::vector< unsigned char >& v) {
+inline uniquemem memopen(const std::vector< unsigned char >& v) {
     return memopen(v.data(), v.size());
 }
 
@@ -36,7 +47,7 @@ uniquemem memopen(const std::vector< unsigned char >& v) {
 
 namespace {
 
-std::vector< unsigned char > make_tempfile(std::size_t size) {
+inline std::vector< unsigned char > make_tempfile(std::size_t size) {
     return GENERATE_COPY(take(1, chunk(size, random< unsigned char >(0, 255))));
 }
 
@@ -76,7 +87,138 @@ struct random_memfile {
 
 namespace {
 
-void test_split_read(random_memfile* file) {
+/*
+ * Forwarding protocol that counts the calls to readinto and seek, for
+ * checking that layers issue few reads to the underlying file. readat is not
+ * forwarded, so layers fall back to seek and read, and neither is size,
+ * unless sized is set. Reads can be made to fail with fail.
+ *
+ * The counters are atomic, as some layers read in background threads.
+ */
+class read_counter : public lfp_protocol {
+public:
+    explicit read_counter(lfp_protocol* f) : inner(f) {}
+
+    void close() noexcept (false) override {
+        if (this->inner) this->inner.close();
+    }
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* nread)
+    noexcept (false) override {
+        ++this->reads;
+        if (this->fail) throw lfp::io_error("read_counter: failed read");
+        return this->inner->readinto(dst, len, nread);
+    }
+
+    int eof() const noexcept (false) override { return this->inner->eof(); }
+    void seek(std::int64_t n) noexcept (false) override {
+        ++this->seeks;
+        this->inner->seek(n);
+    }
+    std::int64_t tell() const noexcept (false) override {
+        return this->inner->tell();
+    }
+    std::int64_t size() noexcept (false) override {
+        if (not this->sized)
+            return lfp_protocol::size();
+        return this->inner->size();
+    }
+
+    lfp_protocol* peel() noexcept (false) override { return nullptr; }
+    lfp_protocol* peek() const noexcept (false) override { return nullptr; }
+
+    std::atomic< int > reads { 0 };
+    std::atomic< int > seeks { 0 };
+    std::atomic< bool > fail { false };
+    bool sized = false;
+
+private:
+    lfp::unique_lfp inner;
+};
+
+/*
+ * Forwarding protocol that counts the calls to readat, for checking that
+ * layers batch their reads, or read with readat at all. It does not say its
+ * readat is safe to call from multiple threads, and records if it is called
+ * from more than one at the same time anyway.
+ */
+class readat_counter : public lfp_protocol {
+public:
+    explicit readat_counter(lfp_protocol* f) : inner(f) {}
+
+    void close() noexcept (false) override {
+        if (this->inner) this->inner.close();
+    }
+    lfp_status readinto(void* dst, std::int64_t len, std::int64_t* nread)
+    noexcept (false) override {
+        return this->inner->readinto(dst, len, nread);
+    }
+    lfp_status readat(
+            std::int64_t offset,
+            void* dst,
+            std::int64_t len,
+            std::int64_t* nread)
+    noexcept (false) override {
+        ++this->reads;
+        if (++this->active > 1)
+            this->overlapped = true;
+
+        try {
+            const auto err = this->inner->readat(offset, dst, len, nread);
+            --this->active;
+            return err;
+        } catch (...) {
+            --this->active;
+            throw;
+        }
+    }
+
+    int eof() const noexcept (false) override { return this->inner->eof(); }
+    void seek(std::int64_t n) noexcept (false) override {
+        this->inner->seek(n);
+    }
+    std::int64_t tell() const noexcept (false) override {
+        return this->inner->tell();
+    }
+
+    lfp_protocol* peel() noexcept (false) override { return nullptr; }
+    lfp_protocol* peek() const noexcept (false) override { return nullptr; }
+
+    std::atomic< int > reads { 0 };
+    std::atomic< int > active { 0 };
+    std::atomic< bool > overlapped { false };
+
+private:
+    lfp::unique_lfp inner;
+};
+
+/*
+ * A file of size bytes where byte i is i * 7, so that misplaced blocks are
+ * easy to spot
+ */
+inline std::vector< unsigned char > make_file(std::size_t size) {
+    auto file = std::vector< unsigned char >(size);
+    for (std::size_t i = 0; i < file.size(); ++i)
+        file[i] = static_cast< unsigned char >(i * 7);
+    return file;
+}
+
+#ifndef _WIN32
+/*
+ * A descriptor of a temporary file with the contents data, positioned at the
+ * start of the file
+ */
+inline int tmpfd(const void* data, std::size_t size) {
+    std::FILE* fp = std::tmpfile();
+    std::fwrite(data, 1, size, fp);
+    std::fflush(fp);
+    const auto fd = ::dup(fileno(fp));
+    std::fclose(fp);
+    ::lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+#endif
+
+inline void test_split_read(random_memfile* file) {
     // +1 so that if size is 1, max is still >= min
     const auto readsize = GENERATE_COPY(
                           take(1, random(1, (file->size + 1) / 2)));
@@ -99,7 +241,7 @@ void test_split_read(random_memfile* file) {
     CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
 }
 
-void test_random_seek(random_memfile* file) {
+inline void test_random_seek(random_memfile* file) {
     const auto n = GENERATE_COPY(take(1, random(0, file->size - 1)));
     auto err = lfp_seek(file->f, n);
     REQUIRE(err == LFP_OK);
@@ -122,6 +264,219 @@ void test_random_seek(random_memfile* file) {
     CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
 }
 
+inline void test_random_readat(random_memfile* file) {
+    /*
+     * Read the first half with readinto, so that the handle has a position
+     * which readat must leave alone
+     */
+    const auto half = file->size / 2;
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(file->f, file->out.data(), half, &nread);
+    REQUIRE(err == LFP_OK);
+    REQUIRE(nread == half);
+
+    const auto offset = GENERATE_COPY(take(1, random(0, file->size - 1)));
+    const auto len = GENERATE_COPY(take(1, random(1, file->size)));
+    const auto end = std::min(offset + len, file->size);
+
+    auto at = std::vector< unsigned char >(len);
+    err = lfp_readat(file->f, offset, at.data(), len, &nread);
+    CHECK(err == (offset + len <= file->size ? LFP_OK : LFP_EOF));
+    CHECK(nread == end - offset);
+    at.resize(nread);
+    CHECK_THAT(at, Catch::Matchers::Equals(std::vector< unsigned char >(
+        file->expected.begin() + offset,
+        file->expected.begin() + end
+    )));
+
+    std::int64_t tell;
+    err = lfp_tell(file->f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == half);
+
+    const auto remaining = file->size - half;
+    err = lfp_readinto(file->f, file->out.data() + half, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+    CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
+}
+
+inline void test_random_readv_at(random_memfile* file) {
+    const auto size = std::int64_t(file->size);
+    const auto half = file->size / 2;
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(file->f, file->out.data(), half, &nread);
+    REQUIRE(err == LFP_OK);
+    REQUIRE(nread == half);
+
+    /*
+     * A bunch of ranges in random order, which may overlap, be empty, or go
+     * past the end of the file
+     */
+    const auto seed = GENERATE(take(1, random(0, 1 << 30)));
+    auto rng = std::mt19937(seed);
+    auto count = std::uniform_int_distribution< int >(1, 32);
+    auto offset = std::uniform_int_distribution< std::int64_t >(0, size);
+    auto length = std::uniform_int_distribution< std::int64_t >(
+        0, size / 4 + 1
+    );
+
+    auto ranges = std::vector< lfp_range >(count(rng));
+    auto buffers = std::vector< std::vector< unsigned char > >();
+    auto expected_status = LFP_OK;
+    for (auto& r : ranges) {
+        r.offset = offset(rng);
+        r.len = length(rng);
+        r.nread = -1;
+        buffers.emplace_back(r.len);
+        r.dst = buffers.back().data();
+        if (r.len > 0 and r.offset + r.len > size)
+            expected_status = LFP_EOF;
+    }
+
+    err = lfp_readv_at(file->f, ranges.data(), ranges.size());
+    CHECK(err == expected_status);
+
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        const auto& r = ranges[i];
+        const auto end = std::min(r.offset + r.len, size);
+        CHECK(r.nread == end - r.offset);
+
+        auto& buffer = buffers[i];
+        buffer.resize(r.nread);
+        CHECK_THAT(buffer, Catch::Matchers::Equals(std::vector< unsigned char >(
+            file->expected.begin() + r.offset,
+            file->expected.begin() + end
+        )));
+    }
+
+    std::int64_t tell;
+    err = lfp_tell(file->f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == half);
+
+    const auto remaining = file->size - half;
+    err = lfp_readinto(file->f, file->out.data() + half, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+    CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
+}
+
+inline void test_random_dup(random_memfile* file) {
+    const auto half = file->size / 2;
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(file->f, file->out.data(), half, &nread);
+    REQUIRE(err == LFP_OK);
+    REQUIRE(nread == half);
+
+    lfp_protocol* dup = nullptr;
+    err = lfp_dup(file->f, &dup);
+    REQUIRE(err == LFP_OK);
+    REQUIRE(dup);
+
+    std::int64_t tell;
+    err = lfp_tell(dup, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == half);
+
+    /*
+     * Read the rest of the file from the duplicate, and then from the
+     * original, which must not have moved. Then read the whole file again
+     * from the duplicate, after the original is closed.
+     */
+    const auto remaining = file->size - half;
+    auto out = file->out;
+    err = lfp_readinto(dup, out.data() + half, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+    std::copy_n(file->expected.begin(), half, out.begin());
+    CHECK_THAT(out, Catch::Matchers::Equals(file->expected));
+
+    err = lfp_tell(file->f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == half);
+
+    err = lfp_readinto(file->f, file->out.data() + half, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+    CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
+
+    err = lfp_close(file->f);
+    file->f = nullptr;
+    CHECK(err == LFP_OK);
+
+    err = lfp_seek(dup, 0);
+    CHECK(err == LFP_OK);
+    out.assign(file->size, 0);
+    err = lfp_readinto(dup, out.data(), file->size, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == file->size);
+    CHECK_THAT(out, Catch::Matchers::Equals(file->expected));
+
+    err = lfp_close(dup);
+    CHECK(err == LFP_OK);
+}
+
+inline void test_random_borrow(random_memfile* file) {
+    const auto size = std::int64_t(file->size);
+    const auto chunk = GENERATE_COPY(take(1, random(1, file->size)));
+
+    /*
+     * Borrow the whole file, chunk by chunk, and release every chunk before
+     * borrowing the next
+     */
+    auto out = std::vector< unsigned char >();
+    while (std::int64_t(out.size()) < size) {
+        const auto remaining = size - std::int64_t(out.size());
+        const void* ptr = nullptr;
+        std::int64_t avail = 0;
+        auto err = lfp_borrow(file->f, chunk, &ptr, &avail);
+        CHECK(err == (chunk <= remaining ? LFP_OK : LFP_EOF));
+        REQUIRE(avail == std::min(std::int64_t(chunk), remaining));
+
+        const auto* p = static_cast< const unsigned char* >(ptr);
+        out.insert(out.end(), p, p + avail);
+        err = lfp_release(file->f);
+        CHECK(err == LFP_OK);
+    }
+    CHECK_THAT(out, Catch::Matchers::Equals(file->expected));
+
+    std::int64_t tell;
+    auto err = lfp_tell(file->f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == size);
+}
+
+inline void test_random_size(random_memfile* file) {
+    const auto n = GENERATE_COPY(take(1, random(0, file->size - 1)));
+
+    /*
+     * Read a little first, so that the size is asked for in the middle of
+     * the file, and check that the handle is not moved by it
+     */
+    file->out.resize(file->size);
+    std::int64_t nread = 0;
+    auto err = lfp_readinto(file->f, file->out.data(), n, &nread);
+    REQUIRE(err == LFP_OK);
+    REQUIRE(nread == n);
+
+    std::int64_t size;
+    err = lfp_size(file->f, &size);
+    CHECK(err == LFP_OK);
+    CHECK(size == file->size);
+
+    std::int64_t tell;
+    err = lfp_tell(file->f, &tell);
+    CHECK(err == LFP_OK);
+    CHECK(tell == n);
+
+    const auto remaining = file->size - n;
+    err = lfp_readinto(file->f, file->out.data() + n, remaining, &nread);
+    CHECK(err == LFP_OK);
+    CHECK(nread == remaining);
+    CHECK_THAT(file->out, Catch::Matchers::Equals(file->expected));
+}
+
 }
 
 